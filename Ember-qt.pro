@@ -263,9 +263,12 @@ HEADERS += src/qt/bitcoingui.h \
     src/serialize.h \
     src/core.h \
     src/main.h \
+    src/blockstore.h \
     src/miner.h \
     src/net.h \
+    src/bloom.h \
     src/key.h \
+    src/ecverify.h \
     src/db.h \
     src/txdb.h \
     src/txmempool.h \
@@ -273,6 +276,7 @@ HEADERS += src/qt/bitcoingui.h \
     src/script.h \
     src/init.h \
     src/mruset.h \
+    src/checkqueue.h \
     src/json/json_spirit_writer_template.h \
     src/json/json_spirit_writer.h \
     src/json/json_spirit_value.h \
@@ -340,14 +344,19 @@ SOURCES += src/qt/bitcoin.cpp src/qt/bitcoingui.cpp \
     src/txmempool.cpp \
     src/util.cpp \
     src/hash.cpp \
+    src/hashblock.cpp \
+    src/sha256d64.cpp \
     src/netbase.cpp \
     src/key.cpp \
+    src/ecverify.cpp \
     src/script.cpp \
     src/core.cpp \
     src/main.cpp \
+    src/blockstore.cpp \
     src/miner.cpp \
     src/init.cpp \
     src/net.cpp \
+    src/bloom.cpp \
     src/checkpoints.cpp \
     src/addrman.cpp \
     src/db.cpp \
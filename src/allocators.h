@@ -9,6 +9,8 @@
 #include <string>
 #include <boost/thread/mutex.hpp>
 #include <map>
+#include <type_traits>
+#include <vector>
 #include <openssl/crypto.h> // for OPENSSL_cleanse()
 
 #ifdef WIN32
@@ -234,8 +236,84 @@ struct secure_allocator : public std::allocator<T>
 };
 
 
+/**
+ * Pool of freed serialization buffers, kept in power of two size classes so
+ * network messages can reuse them instead of going back to the heap each time.
+ * Buffers larger than the biggest class are not pooled.
+ */
+class CBufferPool
+{
+public:
+    static const size_t MIN_CLASS_SIZE = 256;
+    static const int NUM_CLASSES = 14; // 256 bytes to 2MB, enough for a whole block message
+    static const size_t MAX_POOLED_BYTES = 32 * 1024 * 1024;
+
+    // Never destroyed, since buffers may be freed by static destructors
+    static CBufferPool& instance()
+    {
+        static CBufferPool* pool = new CBufferPool();
+        return *pool;
+    }
+
+    void* Allocate(size_t nSize)
+    {
+        int nClass = SizeClass(nSize);
+        if (nClass < 0)
+            return ::operator new(nSize);
+        {
+            boost::mutex::scoped_lock lock(mutex);
+            std::vector<void*>& vFree = vvFree[nClass];
+            if (!vFree.empty())
+            {
+                void* p = vFree.back();
+                vFree.pop_back();
+                nPooledBytes -= ClassSize(nClass);
+                return p;
+            }
+        }
+        return ::operator new(ClassSize(nClass));
+    }
+
+    void Free(void* p, size_t nSize)
+    {
+        int nClass = SizeClass(nSize);
+        if (nClass >= 0)
+        {
+            boost::mutex::scoped_lock lock(mutex);
+            if (nPooledBytes + ClassSize(nClass) <= MAX_POOLED_BYTES)
+            {
+                vvFree[nClass].push_back(p);
+                nPooledBytes += ClassSize(nClass);
+                return;
+            }
+        }
+        ::operator delete(p);
+    }
+
+private:
+    boost::mutex mutex;
+    std::vector<void*> vvFree[NUM_CLASSES];
+    size_t nPooledBytes;
+
+    CBufferPool() : nPooledBytes(0) {}
+
+    static size_t ClassSize(int nClass) { return MIN_CLASS_SIZE << nClass; }
+
+    static int SizeClass(size_t nSize)
+    {
+        int nClass = 0;
+        while (ClassSize(nClass) < nSize)
+            if (++nClass == NUM_CLASSES)
+                return -1;
+        return nClass;
+    }
+};
+
 //
-// Allocator that clears its contents before deletion.
+// Allocator that clears its contents before deletion, unless constructed
+// with fCleanse false for buffers that never hold secrets, such as network
+// messages. Memory comes from CBufferPool. The allocator travels with the
+// buffer on swap and move, so a buffer is always freed the way it was meant to be.
 //
 template<typename T>
 struct zero_after_free_allocator : public std::allocator<T>
@@ -249,22 +327,38 @@ struct zero_after_free_allocator : public std::allocator<T>
     typedef typename base::reference reference;
     typedef typename base::const_reference const_reference;
     typedef typename base::value_type value_type;
-    zero_after_free_allocator() throw() {}
-    zero_after_free_allocator(const zero_after_free_allocator& a) throw() : base(a) {}
+    typedef std::true_type propagate_on_container_move_assignment;
+    typedef std::true_type propagate_on_container_swap;
+    bool fCleanse;
+    explicit zero_after_free_allocator(bool fCleanseIn = true) throw() : fCleanse(fCleanseIn) {}
+    zero_after_free_allocator(const zero_after_free_allocator& a) throw() : base(a), fCleanse(a.fCleanse) {}
     template <typename U>
-    zero_after_free_allocator(const zero_after_free_allocator<U>& a) throw() : base(a) {}
+    zero_after_free_allocator(const zero_after_free_allocator<U>& a) throw() : base(a), fCleanse(a.fCleanse) {}
     ~zero_after_free_allocator() throw() {}
     template<typename _Other> struct rebind
     { typedef zero_after_free_allocator<_Other> other; };
 
+    T* allocate(std::size_t n, const void *hint = 0)
+    {
+        return static_cast<T*>(CBufferPool::instance().Allocate(sizeof(T) * n));
+    }
+
     void deallocate(T* p, std::size_t n)
     {
-        if (p != NULL)
+        if (p == NULL)
+            return;
+        if (fCleanse)
             OPENSSL_cleanse(p, sizeof(T) * n);
-        std::allocator<T>::deallocate(p, n);
+        CBufferPool::instance().Free(p, sizeof(T) * n);
     }
 };
 
+// All instances share the pool, so memory from one can be freed by another
+template<typename T, typename U>
+bool operator==(const zero_after_free_allocator<T>&, const zero_after_free_allocator<U>&) { return true; }
+template<typename T, typename U>
+bool operator!=(const zero_after_free_allocator<T>&, const zero_after_free_allocator<U>&) { return false; }
+
 // This is exactly like std::string, but with a custom allocator.
 typedef std::basic_string<char, std::char_traits<char>, secure_allocator<char> > SecureString;
 
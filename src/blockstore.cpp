@@ -0,0 +1,389 @@
+// Copyright (c) 2016 The Ember developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockstore.h"
+
+#include "chainparams.h"
+#include "main.h"
+#include "sync.h"
+#include "util.h"
+
+#include <algorithm>
+#include <list>
+#include <map>
+
+#ifndef WIN32
+#include <fcntl.h>
+#endif
+
+using namespace std;
+
+// Blocks are stored as <message start><size><serialized block>, appended to
+// blk%04u.dat files and addressed by file number and the offset of the
+// serialized block. The file being appended to stays open, and grows on disk
+// a chunk at a time. Reads go through a small pool of open handles, and the
+// most recently used blocks are kept deserialized in an LRU cache.
+
+typedef pair<unsigned int, unsigned int> BlockPos;
+
+// The block file being appended to
+static CCriticalSection cs_blockAppend;
+static unsigned int nCurrentBlockFile = 1;
+static FILE* fileAppend = NULL;
+static long nAppendAllocated = 0;
+
+// Idle read handles, by file number
+static CCriticalSection cs_blockFiles;
+static multimap<unsigned int, FILE*> mapReadHandles;
+
+struct CBlockCacheEntry
+{
+    BlockPos pos;
+    CBlock block;
+    // Offsets of the transactions from the start of the block
+    vector<unsigned int> vTxOffset;
+    size_t nSize;
+};
+
+static CCriticalSection cs_blockCache;
+static list<CBlockCacheEntry> listBlockCache; // most recently used first
+static map<BlockPos, list<CBlockCacheEntry>::iterator> mapBlockCache;
+static size_t nBlockCacheUsage = 0;
+static size_t nBlockCacheLimit = DEFAULT_BLOCK_CACHE_SIZE * 1048576;
+
+// Reserve disk space for the file without changing its size, so that
+// appending to the end still works
+static void PreallocateBlockFile(FILE* file, long nOffset, long nLength)
+{
+#if defined(FALLOC_FL_KEEP_SIZE)
+    fallocate(fileno(file), FALLOC_FL_KEEP_SIZE, nOffset, nLength);
+#elif defined(MAC_OSX) && defined(F_PREALLOCATE)
+    fstore_t fst;
+    fst.fst_flags = F_ALLOCATECONTIG;
+    fst.fst_posmode = F_PEOFPOSMODE;
+    fst.fst_offset = 0;
+    fst.fst_length = nOffset + nLength;
+    fst.fst_bytesalloc = 0;
+    if (fcntl(fileno(file), F_PREALLOCATE, &fst) == -1)
+    {
+        fst.fst_flags = F_ALLOCATEALL;
+        fcntl(fileno(file), F_PREALLOCATE, &fst);
+    }
+#endif
+}
+
+// Return the append handle, moving on to the next file when the current one
+// is full. Caller holds cs_blockAppend.
+static FILE* GetAppendFile(unsigned int& nFileRet)
+{
+    nFileRet = 0;
+    while (true)
+    {
+        if (!fileAppend)
+        {
+            fileAppend = OpenBlockFile(nCurrentBlockFile, 0, "ab");
+            if (!fileAppend)
+                return NULL;
+            nAppendAllocated = 0;
+        }
+        if (fseek(fileAppend, 0, SEEK_END) != 0)
+            return NULL;
+        // FAT32 file size max 4GB, fseek and ftell max 2GB, so we must stay under 2GB
+        long nPos = ftell(fileAppend);
+        if (nPos >= 0 && nPos < (long)(0x7F000000 - MAX_SIZE))
+        {
+            if (nPos + (long)MAX_BLOCK_SIZE > nAppendAllocated)
+            {
+                nAppendAllocated = (nPos / BLOCKFILE_CHUNK_SIZE + 1) * BLOCKFILE_CHUNK_SIZE;
+                PreallocateBlockFile(fileAppend, nPos, nAppendAllocated - nPos);
+            }
+            nFileRet = nCurrentBlockFile;
+            return fileAppend;
+        }
+        FileCommit(fileAppend);
+        fclose(fileAppend);
+        fileAppend = NULL;
+        nCurrentBlockFile++;
+    }
+}
+
+static FILE* TakeReadHandle(unsigned int nFile)
+{
+    {
+        LOCK(cs_blockFiles);
+        multimap<unsigned int, FILE*>::iterator it = mapReadHandles.find(nFile);
+        if (it != mapReadHandles.end())
+        {
+            FILE* file = it->second;
+            mapReadHandles.erase(it);
+            return file;
+        }
+    }
+    return OpenBlockFile(nFile, 0, "rb");
+}
+
+static void ReturnReadHandle(unsigned int nFile, FILE* file)
+{
+    {
+        LOCK(cs_blockFiles);
+        if (mapReadHandles.size() < MAX_BLOCKFILE_READ_HANDLES)
+        {
+            mapReadHandles.insert(make_pair(nFile, file));
+            return;
+        }
+    }
+    fclose(file);
+}
+
+// Read nSize bytes at nPos of a block file through a pooled handle
+static bool ReadBlockFileRange(unsigned int nFile, unsigned int nPos, char* pch, size_t nSize)
+{
+    FILE* file = TakeReadHandle(nFile);
+    if (!file)
+        return error("ReadBlockFileRange() : OpenBlockFile failed");
+    if (fseek(file, nPos, SEEK_SET) != 0 || fread(pch, 1, nSize, file) != nSize)
+    {
+        fclose(file);
+        return error("ReadBlockFileRange() : read failed at %u:%u", nFile, nPos);
+    }
+    ReturnReadHandle(nFile, file);
+    return true;
+}
+
+static void AddToBlockCache(const BlockPos& pos, const CBlock& block)
+{
+    if (nBlockCacheLimit == 0)
+        return;
+
+    // Build the entry outside the lock, then splice it in
+    list<CBlockCacheEntry> listNew(1);
+    CBlockCacheEntry& entry = listNew.front();
+    entry.pos = pos;
+    entry.block = block;
+    unsigned int nOffset = ::GetSerializeSize(CBlock(), SER_DISK, CLIENT_VERSION) - (2 * GetSizeOfCompactSize(0)) + GetSizeOfCompactSize(block.vtx.size());
+    entry.vTxOffset.reserve(block.vtx.size());
+    BOOST_FOREACH(const CTransaction& tx, block.vtx)
+    {
+        entry.vTxOffset.push_back(nOffset);
+        nOffset += ::GetSerializeSize(tx, SER_DISK, CLIENT_VERSION);
+    }
+    // rough in-memory cost of the deserialized block
+    entry.nSize = 2 * nOffset + sizeof(CBlockCacheEntry);
+
+    LOCK(cs_blockCache);
+    if (mapBlockCache.count(pos))
+        return;
+    listBlockCache.splice(listBlockCache.begin(), listNew);
+    mapBlockCache[pos] = listBlockCache.begin();
+    nBlockCacheUsage += entry.nSize;
+    while (nBlockCacheUsage > nBlockCacheLimit && listBlockCache.size() > 1)
+    {
+        nBlockCacheUsage -= listBlockCache.back().nSize;
+        mapBlockCache.erase(listBlockCache.back().pos);
+        listBlockCache.pop_back();
+    }
+}
+
+// Find a cached block and mark it most recently used. Caller holds cs_blockCache.
+static const CBlockCacheEntry* LookupBlockCache(const BlockPos& pos)
+{
+    map<BlockPos, list<CBlockCacheEntry>::iterator>::iterator mi = mapBlockCache.find(pos);
+    if (mi == mapBlockCache.end())
+        return NULL;
+    listBlockCache.splice(listBlockCache.begin(), listBlockCache, mi->second);
+    return &*mi->second;
+}
+
+static void CopyBlockHeader(CBlock& block, const CBlock& from)
+{
+    block.SetNull();
+    block.nVersion       = from.nVersion;
+    block.hashPrevBlock  = from.hashPrevBlock;
+    block.hashMerkleRoot = from.hashMerkleRoot;
+    block.nTime          = from.nTime;
+    block.nBits          = from.nBits;
+    block.nNonce         = from.nNonce;
+}
+
+bool WriteBlockToDisk(const CBlock& block, unsigned int& nFileRet, unsigned int& nBlockPosRet, bool fCommit)
+{
+    {
+        LOCK(cs_blockAppend);
+        FILE* file = GetAppendFile(nFileRet);
+        if (!file)
+            return error("WriteBlockToDisk() : cannot open block file for appending");
+        CAutoFile fileout = CAutoFile(file, SER_DISK, CLIENT_VERSION);
+        try {
+            // Write index header
+            unsigned int nSize = fileout.GetSerializeSize(block);
+            fileout << FLATDATA(Params().MessageStart()) << nSize;
+
+            // Write block
+            long fileOutPos = ftell(fileout);
+            if (fileOutPos < 0)
+            {
+                fileout.release();
+                return error("WriteBlockToDisk() : ftell failed");
+            }
+            nBlockPosRet = fileOutPos;
+            fileout << block;
+        }
+        catch (std::exception &e) {
+            fileout.release();
+            return error("WriteBlockToDisk() : I/O error");
+        }
+        fileout.release();
+
+        // Flush stdio buffers and commit to disk before returning
+        fflush(file);
+        if (fCommit)
+            FileCommit(file);
+    }
+
+    AddToBlockCache(make_pair(nFileRet, nBlockPosRet), block);
+    return true;
+}
+
+template<typename T>
+static bool ReadRawBlock(T& vchBlock, unsigned int nFile, unsigned int nBlockPos)
+{
+    if (nBlockPos < 8)
+        return error("ReadRawBlockFromDisk() : bad block position %u:%u", nFile, nBlockPos);
+
+    // The message start and size precede the block
+    unsigned char pchHeader[8];
+    if (!ReadBlockFileRange(nFile, nBlockPos - 8, (char*)pchHeader, sizeof(pchHeader)))
+        return false;
+    unsigned int nSize = pchHeader[4] | (pchHeader[5] << 8) | (pchHeader[6] << 16) | ((unsigned int)pchHeader[7] << 24);
+    if (memcmp(pchHeader, Params().MessageStart(), MESSAGE_START_SIZE) != 0 || nSize > MAX_BLOCK_SIZE)
+        return error("ReadRawBlockFromDisk() : no block at %u:%u", nFile, nBlockPos);
+
+    vchBlock.resize(nSize);
+    if (nSize == 0)
+        return true;
+    return ReadBlockFileRange(nFile, nBlockPos, &vchBlock[0], nSize);
+}
+
+bool ReadRawBlockFromDisk(vector<char>& vchBlock, unsigned int nFile, unsigned int nBlockPos)
+{
+    return ReadRawBlock(vchBlock, nFile, nBlockPos);
+}
+
+bool ReadRawBlockFromDisk(CSerializeData& vchBlock, unsigned int nFile, unsigned int nBlockPos)
+{
+    return ReadRawBlock(vchBlock, nFile, nBlockPos);
+}
+
+bool ReadBlockFromDisk(CBlock& block, unsigned int nFile, unsigned int nBlockPos)
+{
+    BlockPos pos = make_pair(nFile, nBlockPos);
+    {
+        LOCK(cs_blockCache);
+        const CBlockCacheEntry* pentry = LookupBlockCache(pos);
+        if (pentry)
+        {
+            block = pentry->block;
+            return true;
+        }
+    }
+
+    vector<char> vchBlock;
+    if (!ReadRawBlockFromDisk(vchBlock, nFile, nBlockPos))
+        return false;
+    try {
+        CDataStream ssBlock(vchBlock, SER_DISK, CLIENT_VERSION);
+        ssBlock >> block;
+    }
+    catch (std::exception &e) {
+        return error("%s() : deserialize or I/O error", __PRETTY_FUNCTION__);
+    }
+    AddToBlockCache(pos, block);
+    return true;
+}
+
+bool ReadBlockHeaderFromDisk(CBlock& block, unsigned int nFile, unsigned int nBlockPos)
+{
+    {
+        LOCK(cs_blockCache);
+        const CBlockCacheEntry* pentry = LookupBlockCache(make_pair(nFile, nBlockPos));
+        if (pentry)
+        {
+            CopyBlockHeader(block, pentry->block);
+            return true;
+        }
+    }
+
+    char pchHeader[BLOCK_HEADER_SIZE];
+    if (!ReadBlockFileRange(nFile, nBlockPos, pchHeader, sizeof(pchHeader)))
+        return false;
+    try {
+        CDataStream ssHeader(pchHeader, pchHeader + sizeof(pchHeader), SER_DISK | SER_BLOCKHEADERONLY, CLIENT_VERSION);
+        ssHeader >> block;
+    }
+    catch (std::exception &e) {
+        return error("%s() : deserialize or I/O error", __PRETTY_FUNCTION__);
+    }
+    return true;
+}
+
+bool ReadTransactionFromDisk(CTransaction& tx, unsigned int nFile, unsigned int nBlockPos, unsigned int nTxPos)
+{
+    {
+        LOCK(cs_blockCache);
+        const CBlockCacheEntry* pentry = LookupBlockCache(make_pair(nFile, nBlockPos));
+        if (pentry && nTxPos >= nBlockPos)
+        {
+            vector<unsigned int>::const_iterator it = lower_bound(pentry->vTxOffset.begin(), pentry->vTxOffset.end(), nTxPos - nBlockPos);
+            if (it != pentry->vTxOffset.end() && *it == nTxPos - nBlockPos)
+            {
+                tx = pentry->block.vtx[it - pentry->vTxOffset.begin()];
+                return true;
+            }
+        }
+    }
+
+    FILE* file = TakeReadHandle(nFile);
+    if (!file)
+        return error("ReadTransactionFromDisk() : OpenBlockFile failed");
+    CAutoFile filein = CAutoFile(file, SER_DISK, CLIENT_VERSION);
+    if (fseek(filein, nTxPos, SEEK_SET) != 0)
+        return error("ReadTransactionFromDisk() : fseek failed");
+    try {
+        filein >> tx;
+    }
+    catch (std::exception &e) {
+        return error("%s() : deserialize or I/O error", __PRETTY_FUNCTION__);
+    }
+    ReturnReadHandle(nFile, filein.release());
+    return true;
+}
+
+void SetBlockCacheSize(size_t nBytes)
+{
+    LOCK(cs_blockCache);
+    nBlockCacheLimit = nBytes;
+    while (nBlockCacheUsage > nBlockCacheLimit && !listBlockCache.empty())
+    {
+        nBlockCacheUsage -= listBlockCache.back().nSize;
+        mapBlockCache.erase(listBlockCache.back().pos);
+        listBlockCache.pop_back();
+    }
+}
+
+void CloseBlockFiles()
+{
+    {
+        LOCK(cs_blockAppend);
+        if (fileAppend)
+        {
+            FileCommit(fileAppend);
+            fclose(fileAppend);
+            fileAppend = NULL;
+        }
+    }
+    LOCK(cs_blockFiles);
+    for (multimap<unsigned int, FILE*>::iterator it = mapReadHandles.begin(); it != mapReadHandles.end(); ++it)
+        fclose(it->second);
+    mapReadHandles.clear();
+}
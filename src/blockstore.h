@@ -0,0 +1,38 @@
+// Copyright (c) 2016 The Ember developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_BLOCKSTORE_H
+#define BITCOIN_BLOCKSTORE_H
+
+#include "serialize.h"
+
+#include <stddef.h>
+#include <vector>
+
+class CBlock;
+class CTransaction;
+
+/** Block files grow on disk in chunks of this size, to limit fragmentation */
+static const unsigned int BLOCKFILE_CHUNK_SIZE = 16 * 1024 * 1024;
+/** Number of idle block file read handles kept open */
+static const unsigned int MAX_BLOCKFILE_READ_HANDLES = 16;
+/** Default for -blockcache, the size of the recent block cache in megabytes */
+static const unsigned int DEFAULT_BLOCK_CACHE_SIZE = 16;
+
+/** Append a block to the current block file, committing it to disk if fCommit */
+bool WriteBlockToDisk(const CBlock& block, unsigned int& nFileRet, unsigned int& nBlockPosRet, bool fCommit);
+/** Read the block stored at nBlockPos, from the cache if it's there */
+bool ReadBlockFromDisk(CBlock& block, unsigned int nFile, unsigned int nBlockPos);
+/** Read only the header of the block stored at nBlockPos */
+bool ReadBlockHeaderFromDisk(CBlock& block, unsigned int nFile, unsigned int nBlockPos);
+/** Read the serialized block stored at nBlockPos, without parsing it */
+bool ReadRawBlockFromDisk(std::vector<char>& vchBlock, unsigned int nFile, unsigned int nBlockPos);
+bool ReadRawBlockFromDisk(CSerializeData& vchBlock, unsigned int nFile, unsigned int nBlockPos);
+/** Read the transaction stored at nTxPos in the block at nBlockPos */
+bool ReadTransactionFromDisk(CTransaction& tx, unsigned int nFile, unsigned int nBlockPos, unsigned int nTxPos);
+
+void SetBlockCacheSize(size_t nBytes);
+/** Close the append and read handles, flushing outstanding writes */
+void CloseBlockFiles();
+
+#endif // BITCOIN_BLOCKSTORE_H
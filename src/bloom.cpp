@@ -0,0 +1,106 @@
+// Copyright (c) 2016 The Ember developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bloom.h"
+
+#include "uint256.h"
+
+#include <algorithm>
+#include <math.h>
+#include <string.h>
+
+#include <openssl/rand.h>
+
+using namespace std;
+
+// Finalizer of MurmurHash3's 64 bit variant, spreads every input bit over the output
+static inline uint64_t Mix64(uint64_t k)
+{
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+}
+
+CRollingBloomFilter::CRollingBloomFilter(unsigned int nElements, double nFPRate)
+{
+    nEntriesPerGeneration = (nElements + 1) / 2;
+    unsigned int nMaxElements = nEntriesPerGeneration * 3;
+    // The usual sizing for nMaxElements at nFPRate, with the number of hash
+    // functions rounded to an integer first
+    nHashFuncs = max(1, min((int)round(log(nFPRate) / log(0.5)), 50));
+    nFilterBits = (unsigned int)ceil(-1.0 * nHashFuncs * nMaxElements / log(1.0 - exp(log(nFPRate) / nHashFuncs)));
+    data.resize(((nFilterBits + 63) / 64) << 1);
+    reset();
+}
+
+void CRollingBloomFilter::GetPositions(const uint256& hash, uint64_t& h1, uint64_t& h2) const
+{
+    // Inventory hashes are already uniformly distributed, they only need keying
+    uint64_t pn[4];
+    memcpy(pn, hash.begin(), sizeof(pn));
+    h1 = Mix64(pn[0] ^ nKey) ^ Mix64(pn[2] + nKey);
+    h2 = Mix64(pn[1] ^ h1) ^ Mix64(pn[3] + (nKey >> 1));
+    // an even step could cycle through only part of the table
+    h2 |= 1;
+}
+
+void CRollingBloomFilter::insert(const uint256& hash)
+{
+    if (nEntriesThisGeneration == nEntriesPerGeneration)
+    {
+        nEntriesThisGeneration = 0;
+        nGeneration++;
+        if (nGeneration == 4)
+            nGeneration = 1;
+        uint64_t nGenerationMask1 = 0 - (uint64_t)(nGeneration & 1);
+        uint64_t nGenerationMask2 = 0 - (uint64_t)(nGeneration >> 1);
+        // Wipe every position that belongs to the generation being reused
+        for (unsigned int p = 0; p < data.size(); p += 2)
+        {
+            uint64_t p1 = data[p], p2 = data[p + 1];
+            uint64_t mask = (p1 ^ nGenerationMask1) | (p2 ^ nGenerationMask2);
+            data[p] = p1 & mask;
+            data[p + 1] = p2 & mask;
+        }
+    }
+    nEntriesThisGeneration++;
+
+    uint64_t h1, h2;
+    GetPositions(hash, h1, h2);
+    for (unsigned int n = 0; n < nHashFuncs; n++)
+    {
+        unsigned int nPos = (h1 + n * h2) % nFilterBits;
+        unsigned int nWord = nPos >> 6;
+        unsigned int nBit = nPos & 63;
+        data[nWord * 2] = (data[nWord * 2] & ~(1ULL << nBit)) | ((uint64_t)(nGeneration & 1)) << nBit;
+        data[nWord * 2 + 1] = (data[nWord * 2 + 1] & ~(1ULL << nBit)) | ((uint64_t)(nGeneration >> 1)) << nBit;
+    }
+}
+
+bool CRollingBloomFilter::contains(const uint256& hash) const
+{
+    uint64_t h1, h2;
+    GetPositions(hash, h1, h2);
+    for (unsigned int n = 0; n < nHashFuncs; n++)
+    {
+        unsigned int nPos = (h1 + n * h2) % nFilterBits;
+        unsigned int nWord = nPos >> 6;
+        unsigned int nBit = nPos & 63;
+        // a zero generation number means the position isn't set
+        if (!(((data[nWord * 2] | data[nWord * 2 + 1]) >> nBit) & 1))
+            return false;
+    }
+    return true;
+}
+
+void CRollingBloomFilter::reset()
+{
+    RAND_bytes((unsigned char*)&nKey, sizeof(nKey));
+    nEntriesThisGeneration = 0;
+    nGeneration = 1;
+    std::fill(data.begin(), data.end(), 0);
+}
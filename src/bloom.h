@@ -0,0 +1,45 @@
+// Copyright (c) 2016 The Ember developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_BLOOM_H
+#define BITCOIN_BLOOM_H
+
+#include <stdint.h>
+#include <vector>
+
+class uint256;
+
+/** Bloom filter over hashes that remembers roughly the last nElements
+ * inserted, forgetting older ones a generation at a time.
+ *
+ * Each bit position holds a two bit generation number instead of a single
+ * bit. Once a generation has taken nElements / 2 entries, the oldest of the
+ * three generations is wiped, so the filter always covers at least the last
+ * nElements / 2 and at most the last 3 * nElements / 2 entries, in fixed memory.
+ *
+ * Positions are derived from the inserted hash with a random per-filter key,
+ * so peers can't grind hashes that collide in our filter.
+ */
+class CRollingBloomFilter
+{
+public:
+    CRollingBloomFilter(unsigned int nElements, double nFPRate);
+
+    void insert(const uint256& hash);
+    bool contains(const uint256& hash) const;
+    void reset();
+
+private:
+    int nEntriesPerGeneration;
+    int nEntriesThisGeneration;
+    int nGeneration;
+    unsigned int nHashFuncs;
+    unsigned int nFilterBits;
+    uint64_t nKey;
+    // bit i of the generation number of position n lives in data[2*(n/64)+i], bit n%64
+    std::vector<uint64_t> data;
+
+    void GetPositions(const uint256& hash, uint64_t& h1, uint64_t& h2) const;
+};
+
+#endif // BITCOIN_BLOOM_H
@@ -51,6 +51,13 @@ namespace Checkpoints
         return hash == i->second;
     }
 
+    bool IsHardenedHeight(int nHeight)
+    {
+        MapCheckpoints& checkpoints = (TestNet() ? mapCheckpointsTestnet : mapCheckpoints);
+
+        return checkpoints.count(nHeight);
+    }
+
     int GetTotalBlocksEstimate()
     {
         MapCheckpoints& checkpoints = (TestNet() ? mapCheckpointsTestnet : mapCheckpoints);
@@ -37,6 +37,9 @@ namespace Checkpoints
     // Returns true if block passes checkpoint checks
     bool CheckHardened(int nHeight, const uint256& hash);
 
+    // Returns true if there is a hardened checkpoint at nHeight
+    bool IsHardenedHeight(int nHeight);
+
     // Return conservative estimate of total number of blocks, 0 if unknown
     int GetTotalBlocksEstimate();
 
@@ -0,0 +1,925 @@
+// Copyright (c) 2016 The Ember developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "ecverify.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+
+#ifdef __SIZEOF_INT128__
+
+// Verification only handles public data, so none of this needs to run in
+// constant time. Signing stays with OpenSSL.
+
+typedef unsigned __int128 uint128_t;
+
+namespace {
+
+// Field elements mod p = 2^256 - 2^32 - 977, as four little endian 64 bit
+// limbs, always fully reduced.
+struct fe
+{
+    uint64_t n[4];
+};
+
+// 2^256 - p
+static const uint64_t FE_C = 0x1000003D1ULL;
+static const fe FE_P = {{0xFFFFFFFEFFFFFC2FULL, 0xFFFFFFFFFFFFFFFFULL, 0xFFFFFFFFFFFFFFFFULL, 0xFFFFFFFFFFFFFFFFULL}};
+
+// Scalars mod the group order n, same layout
+struct sc
+{
+    uint64_t n[4];
+};
+
+static const sc SC_N = {{0xBFD25E8CD0364141ULL, 0xBAAEDCE6AF48A03BULL, 0xFFFFFFFFFFFFFFFEULL, 0xFFFFFFFFFFFFFFFFULL}};
+// 2^256 - n
+static const uint64_t SC_C[3] = {0x402DA1732FC9BEBFULL, 0x4551231950B75FC4ULL, 1};
+
+static inline bool Ge256(const uint64_t* a, const uint64_t* b)
+{
+    for (int i = 3; i >= 0; i--)
+    {
+        if (a[i] != b[i])
+            return a[i] > b[i];
+    }
+    return true;
+}
+
+static inline bool IsZero256(const uint64_t* a)
+{
+    return (a[0] | a[1] | a[2] | a[3]) == 0;
+}
+
+// r = a - b, returning the borrow
+static inline uint64_t Sub256(uint64_t* r, const uint64_t* a, const uint64_t* b)
+{
+    uint64_t borrow = 0;
+    for (int i = 0; i < 4; i++)
+    {
+        uint128_t t = (uint128_t)a[i] - b[i] - borrow;
+        r[i] = (uint64_t)t;
+        borrow = (uint64_t)(t >> 64) & 1;
+    }
+    return borrow;
+}
+
+static void Read256(uint64_t* r, const unsigned char* p)
+{
+    for (int i = 0; i < 4; i++)
+    {
+        uint64_t x = 0;
+        for (int j = 0; j < 8; j++)
+            x = (x << 8) | p[(3 - i) * 8 + j];
+        r[i] = x;
+    }
+}
+
+// Add a * b into the three word accumulator (c0, c1, c2)
+#define MULADD(a, b) do {                                   \
+        uint128_t t = (uint128_t)(a) * (b);                 \
+        uint64_t tl = (uint64_t)t, th = (uint64_t)(t >> 64); \
+        c0 += tl; th += (c0 < tl);                          \
+        c1 += th; c2 += (c1 < th);                          \
+    } while (0)
+#define EXTRACT(r) do { r = c0; c0 = c1; c1 = c2; c2 = 0; } while (0)
+
+// 512 bit product, column by column
+static inline void Mul256(uint64_t* r, const uint64_t* a, const uint64_t* b)
+{
+    uint64_t c0 = 0, c1 = 0, c2 = 0;
+    MULADD(a[0], b[0]);
+    EXTRACT(r[0]);
+    MULADD(a[0], b[1]); MULADD(a[1], b[0]);
+    EXTRACT(r[1]);
+    MULADD(a[0], b[2]); MULADD(a[1], b[1]); MULADD(a[2], b[0]);
+    EXTRACT(r[2]);
+    MULADD(a[0], b[3]); MULADD(a[1], b[2]); MULADD(a[2], b[1]); MULADD(a[3], b[0]);
+    EXTRACT(r[3]);
+    MULADD(a[1], b[3]); MULADD(a[2], b[2]); MULADD(a[3], b[1]);
+    EXTRACT(r[4]);
+    MULADD(a[2], b[3]); MULADD(a[3], b[2]);
+    EXTRACT(r[5]);
+    MULADD(a[3], b[3]);
+    EXTRACT(r[6]);
+    r[7] = c0;
+}
+
+#undef MULADD
+#undef EXTRACT
+
+//
+// Field arithmetic
+//
+
+static inline bool fe_is_zero(const fe& a)
+{
+    return IsZero256(a.n);
+}
+
+static inline bool fe_equal(const fe& a, const fe& b)
+{
+    return memcmp(a.n, b.n, sizeof(a.n)) == 0;
+}
+
+static inline void fe_set_int(fe& r, uint64_t x)
+{
+    r.n[0] = x;
+    r.n[1] = r.n[2] = r.n[3] = 0;
+}
+
+// Fails if the value isn't below p
+static bool fe_set_b32(fe& r, const unsigned char* p)
+{
+    Read256(r.n, p);
+    return !Ge256(r.n, FE_P.n);
+}
+
+static void fe_add(fe& r, const fe& a, const fe& b)
+{
+    uint64_t t[4];
+    uint64_t carry = 0;
+    for (int i = 0; i < 4; i++)
+    {
+        uint128_t x = (uint128_t)a.n[i] + b.n[i] + carry;
+        t[i] = (uint64_t)x;
+        carry = (uint64_t)(x >> 64);
+    }
+    // t >= p exactly when t + (2^256 - p) overflows 256 bits
+    uint64_t u[4];
+    uint64_t c = FE_C;
+    for (int i = 0; i < 4; i++)
+    {
+        uint128_t x = (uint128_t)t[i] + c;
+        u[i] = (uint64_t)x;
+        c = (uint64_t)(x >> 64);
+    }
+    memcpy(r.n, (carry | c) ? u : t, sizeof(r.n));
+}
+
+static void fe_sub(fe& r, const fe& a, const fe& b)
+{
+    if (Sub256(r.n, a.n, b.n))
+    {
+        // wrapped around 2^256; adding p is subtracting 2^256 - p
+        uint64_t borrow = FE_C;
+        for (int i = 0; i < 4; i++)
+        {
+            uint128_t x = (uint128_t)r.n[i] - borrow;
+            r.n[i] = (uint64_t)x;
+            borrow = (uint64_t)(x >> 64) & 1;
+        }
+    }
+}
+
+static inline void fe_negate(fe& r, const fe& a)
+{
+    fe zero;
+    fe_set_int(zero, 0);
+    fe_sub(r, zero, a);
+}
+
+static void fe_mul(fe& r, const fe& a, const fe& b)
+{
+    uint64_t t[8];
+    Mul256(t, a.n, b.n);
+
+    // 2^256 = 2^256 - p (mod p), so fold the high half in, then the few
+    // bits that carry out of that
+    uint128_t x = (uint128_t)t[4] * FE_C + t[0];
+    uint64_t l0 = (uint64_t)x;
+    x = (x >> 64) + (uint128_t)t[5] * FE_C + t[1];
+    uint64_t l1 = (uint64_t)x;
+    x = (x >> 64) + (uint128_t)t[6] * FE_C + t[2];
+    uint64_t l2 = (uint64_t)x;
+    x = (x >> 64) + (uint128_t)t[7] * FE_C + t[3];
+    uint64_t l3 = (uint64_t)x;
+
+    x = (x >> 64) * FE_C + l0;
+    l0 = (uint64_t)x;
+    x = (x >> 64) + l1;
+    l1 = (uint64_t)x;
+    x = (x >> 64) + l2;
+    l2 = (uint64_t)x;
+    x = (x >> 64) + l3;
+    l3 = (uint64_t)x;
+    if (x >> 64)
+    {
+        // what wrapped around is tiny, so adding 2^256 - p again can't carry out
+        x = (uint128_t)l0 + FE_C;
+        l0 = (uint64_t)x;
+        x = (x >> 64) + l1;
+        l1 = (uint64_t)x;
+        x = (x >> 64) + l2;
+        l2 = (uint64_t)x;
+        l3 += (uint64_t)(x >> 64);
+    }
+    r.n[0] = l0;
+    r.n[1] = l1;
+    r.n[2] = l2;
+    r.n[3] = l3;
+    if (Ge256(r.n, FE_P.n))
+        Sub256(r.n, r.n, FE_P.n);
+}
+
+static inline void fe_sqr(fe& r, const fe& a)
+{
+    fe_mul(r, a, a);
+}
+
+static void fe_pow(fe& r, const fe& a, const uint64_t* e)
+{
+    fe x;
+    fe_set_int(x, 1);
+    for (int i = 255; i >= 0; i--)
+    {
+        fe_sqr(x, x);
+        if ((e[i / 64] >> (i % 64)) & 1)
+            fe_mul(x, x, a);
+    }
+    r = x;
+}
+
+static void fe_inv(fe& r, const fe& a)
+{
+    // a^(p-2)
+    static const uint64_t e[4] = {0xFFFFFFFEFFFFFC2DULL, 0xFFFFFFFFFFFFFFFFULL, 0xFFFFFFFFFFFFFFFFULL, 0xFFFFFFFFFFFFFFFFULL};
+    fe_pow(r, a, e);
+}
+
+// Fails if a isn't a square
+static bool fe_sqrt(fe& r, const fe& a)
+{
+    // p = 3 mod 4, so a^((p+1)/4) is a root if there is one
+    static const uint64_t e[4] = {0xFFFFFFFFBFFFFF0CULL, 0xFFFFFFFFFFFFFFFFULL, 0xFFFFFFFFFFFFFFFFULL, 0x3FFFFFFFFFFFFFFFULL};
+    fe root, check;
+    fe_pow(root, a, e);
+    fe_sqr(check, root);
+    if (!fe_equal(check, a))
+        return false;
+    r = root;
+    return true;
+}
+
+//
+// Scalar arithmetic
+//
+
+static inline bool sc_is_zero(const sc& a)
+{
+    return IsZero256(a.n);
+}
+
+static void sc_mul(sc& r, const sc& a, const sc& b)
+{
+    uint64_t t[8];
+    Mul256(t, a.n, b.n);
+
+    // Fold the part above 2^256 back in as hi * (2^256 - n) until it's gone
+    while (t[4] | t[5] | t[6] | t[7])
+    {
+        uint64_t u[8] = {t[0], t[1], t[2], t[3], 0, 0, 0, 0};
+        for (int i = 0; i < 4; i++)
+        {
+            uint64_t carry = 0;
+            for (int j = 0; j < 3; j++)
+            {
+                uint128_t x = (uint128_t)t[i + 4] * SC_C[j] + u[i + j] + carry;
+                u[i + j] = (uint64_t)x;
+                carry = (uint64_t)(x >> 64);
+            }
+            for (int k = i + 3; k < 8 && carry; k++)
+            {
+                uint128_t x = (uint128_t)u[k] + carry;
+                u[k] = (uint64_t)x;
+                carry = (uint64_t)(x >> 64);
+            }
+        }
+        memcpy(t, u, sizeof(t));
+    }
+    if (Ge256(t, SC_N.n))
+        Sub256(t, t, SC_N.n);
+    memcpy(r.n, t, sizeof(r.n));
+}
+
+static inline bool IsOne256(const uint64_t* a)
+{
+    return a[0] == 1 && (a[1] | a[2] | a[3]) == 0;
+}
+
+// a / 2 mod n
+static void sc_half(uint64_t* a)
+{
+    uint64_t top = 0;
+    if (a[0] & 1)
+    {
+        // make it even by adding n, keeping the carry as bit 256
+        uint64_t carry = 0;
+        for (int i = 0; i < 4; i++)
+        {
+            uint128_t x = (uint128_t)a[i] + SC_N.n[i] + carry;
+            a[i] = (uint64_t)x;
+            carry = (uint64_t)(x >> 64);
+        }
+        top = carry;
+    }
+    for (int i = 0; i < 3; i++)
+        a[i] = (a[i] >> 1) | (a[i + 1] << 63);
+    a[3] = (a[3] >> 1) | (top << 63);
+}
+
+// a - b mod n, for a and b below n
+static void sc_sub(uint64_t* r, const uint64_t* a, const uint64_t* b)
+{
+    if (Sub256(r, a, b))
+    {
+        uint64_t carry = 0;
+        for (int i = 0; i < 4; i++)
+        {
+            uint128_t x = (uint128_t)r[i] + SC_N.n[i] + carry;
+            r[i] = (uint64_t)x;
+            carry = (uint64_t)(x >> 64);
+        }
+    }
+}
+
+// Binary extended Euclid, which keeps u = x1 * a and v = x2 * a (mod n).
+// It's variable time, but so is everything else here.
+static void sc_inv(sc& r, const sc& a)
+{
+    uint64_t u[4], v[4], x1[4] = {1, 0, 0, 0}, x2[4] = {0, 0, 0, 0};
+    memcpy(u, a.n, sizeof(u));
+    memcpy(v, SC_N.n, sizeof(v));
+    while (!IsOne256(u) && !IsOne256(v))
+    {
+        while (!(u[0] & 1))
+        {
+            for (int i = 0; i < 3; i++)
+                u[i] = (u[i] >> 1) | (u[i + 1] << 63);
+            u[3] >>= 1;
+            sc_half(x1);
+        }
+        while (!(v[0] & 1))
+        {
+            for (int i = 0; i < 3; i++)
+                v[i] = (v[i] >> 1) | (v[i + 1] << 63);
+            v[3] >>= 1;
+            sc_half(x2);
+        }
+        if (Ge256(u, v))
+        {
+            Sub256(u, u, v);
+            sc_sub(x1, x1, x2);
+        }
+        else
+        {
+            Sub256(v, v, u);
+            sc_sub(x2, x2, x1);
+        }
+    }
+    memcpy(r.n, IsOne256(u) ? x1 : x2, sizeof(r.n));
+}
+
+//
+// Group arithmetic on y^2 = x^3 + 7
+//
+
+struct ge
+{
+    fe x, y;
+};
+
+// Jacobian coordinates: (x / z^2, y / z^3)
+struct gej
+{
+    fe x, y, z;
+    bool fInfinity;
+};
+
+static void gej_set_ge(gej& r, const ge& a)
+{
+    r.x = a.x;
+    r.y = a.y;
+    fe_set_int(r.z, 1);
+    r.fInfinity = false;
+}
+
+static void gej_double(gej& r, const gej& a)
+{
+    if (a.fInfinity || fe_is_zero(a.y))
+    {
+        r.fInfinity = true;
+        return;
+    }
+    fe yy, s, m, t, yyyy;
+    fe_sqr(yy, a.y);
+    fe_mul(s, a.x, yy);
+    fe_add(s, s, s);
+    fe_add(s, s, s);             // s = 4 x y^2
+    fe_sqr(m, a.x);
+    fe_add(t, m, m);
+    fe_add(m, t, m);             // m = 3 x^2
+    fe_mul(r.z, a.y, a.z);
+    fe_add(r.z, r.z, r.z);       // z3 = 2 y z
+    fe_sqr(r.x, m);
+    fe_add(t, s, s);
+    fe_sub(r.x, r.x, t);         // x3 = m^2 - 2 s
+    fe_sqr(yyyy, yy);
+    fe_add(yyyy, yyyy, yyyy);
+    fe_add(yyyy, yyyy, yyyy);
+    fe_add(yyyy, yyyy, yyyy);    // 8 y^4
+    fe_sub(t, s, r.x);
+    fe_mul(r.y, m, t);
+    fe_sub(r.y, r.y, yyyy);      // y3 = m (s - x3) - 8 y^4
+    r.fInfinity = false;
+}
+
+// r = a + (u2 / zz, s2 / zzz), with u1 and s1 being a's x and y scaled to
+// the common denominator. Shared tail of the two additions below.
+static void gej_add_common(gej& r, const gej& a, const fe& u1, const fe& s1, const fe& u2, const fe& s2, const fe& zProduct)
+{
+    fe h, rr;
+    fe_sub(h, u2, u1);
+    fe_sub(rr, s2, s1);
+    if (fe_is_zero(h))
+    {
+        if (fe_is_zero(rr))
+            gej_double(r, a);
+        else
+            r.fInfinity = true;
+        return;
+    }
+    fe hh, hhh, v, t;
+    fe_sqr(hh, h);
+    fe_mul(hhh, hh, h);
+    fe_mul(v, u1, hh);
+    fe_mul(r.z, zProduct, h);
+    fe_sqr(r.x, rr);
+    fe_sub(r.x, r.x, hhh);
+    fe_add(t, v, v);
+    fe_sub(r.x, r.x, t);         // x3 = r^2 - h^3 - 2 u1 h^2
+    fe_mul(hhh, s1, hhh);
+    fe_sub(t, v, r.x);
+    fe_mul(r.y, rr, t);
+    fe_sub(r.y, r.y, hhh);       // y3 = r (u1 h^2 - x3) - s1 h^3
+    r.fInfinity = false;
+}
+
+static void gej_add_ge(gej& r, const gej& a, const ge& b)
+{
+    if (a.fInfinity)
+    {
+        gej_set_ge(r, b);
+        return;
+    }
+    fe zz, zzz, u2, s2;
+    fe_sqr(zz, a.z);
+    fe_mul(zzz, zz, a.z);
+    fe_mul(u2, b.x, zz);
+    fe_mul(s2, b.y, zzz);
+    fe z = a.z;
+    gej_add_common(r, a, a.x, a.y, u2, s2, z);
+}
+
+static void gej_add(gej& r, const gej& a, const gej& b)
+{
+    if (a.fInfinity)
+    {
+        r = b;
+        return;
+    }
+    if (b.fInfinity)
+    {
+        r = a;
+        return;
+    }
+    fe z1z1, z2z2, u1, u2, s1, s2, t, zProduct;
+    fe_sqr(z1z1, a.z);
+    fe_sqr(z2z2, b.z);
+    fe_mul(u1, a.x, z2z2);
+    fe_mul(u2, b.x, z1z1);
+    fe_mul(t, z2z2, b.z);
+    fe_mul(s1, a.y, t);
+    fe_mul(t, z1z1, a.z);
+    fe_mul(s2, b.y, t);
+    fe_mul(zProduct, a.z, b.z);
+    gej_add_common(r, a, u1, s1, u2, s2, zProduct);
+}
+
+static void gej_negate(gej& r, const gej& a)
+{
+    r = a;
+    fe_negate(r.y, a.y);
+}
+
+static void ge_set_gej(ge& r, const gej& a)
+{
+    fe zi, zi2, zi3;
+    fe_inv(zi, a.z);
+    fe_sqr(zi2, zi);
+    fe_mul(zi3, zi2, zi);
+    fe_mul(r.x, a.x, zi2);
+    fe_mul(r.y, a.y, zi3);
+}
+
+// Window sizes of the wNAF multiplications. The generator's odd multiples
+// are computed once; the public key's for every verification.
+static const int WINDOW_G = 8;
+static const int WINDOW_A = 5;
+static const int TABLE_SIZE_G = 1 << (WINDOW_G - 2);
+static const int TABLE_SIZE_A = 1 << (WINDOW_A - 2);
+
+// G, 3G, 5G, ... and the same for 2^128 G, in affine coordinates
+static ge tableG[TABLE_SIZE_G];
+static ge tableG128[TABLE_SIZE_G];
+static bool fTableGReady = false;
+
+// The curve has an efficient endomorphism: lambda * (x, y) = (beta * x, y)
+static const fe FE_BETA = {{0xC1396C28719501EEULL, 0x9CF0497512F58995ULL, 0x6E64479EAC3434E9ULL, 0x7AE96A2B657C0710ULL}};
+static const sc SC_LAMBDA = {{0xDF02967C1B23BD72ULL, 0x122E22EA20816678ULL, 0xA5261C028812645AULL, 0x5363AD4CC05C30E0ULL}};
+
+// Width-w non-adjacent form of a scalar: every nonzero digit is odd, below
+// 2^(w-1) in absolute value, and followed by at least w-1 zeros. Returns the
+// number of digits.
+static int sc_wnaf(int* wnaf, const sc& a, int w)
+{
+    uint64_t k[5] = {a.n[0], a.n[1], a.n[2], a.n[3], 0};
+    int nDigits = 0;
+    while (k[0] | k[1] | k[2] | k[3] | k[4])
+    {
+        int digit = 0;
+        if (k[0] & 1)
+        {
+            digit = (int)(k[0] & ((1 << w) - 1));
+            if (digit >= (1 << (w - 1)))
+                digit -= (1 << w);
+            // k -= digit, which leaves the low w bits zero
+            if (digit > 0)
+            {
+                uint64_t borrow = digit;
+                for (int i = 0; i < 5 && borrow; i++)
+                {
+                    uint64_t old = k[i];
+                    k[i] -= borrow;
+                    borrow = old < borrow;
+                }
+            }
+            else
+            {
+                uint64_t carry = -digit;
+                for (int i = 0; i < 5 && carry; i++)
+                {
+                    k[i] += carry;
+                    carry = k[i] < carry;
+                }
+            }
+        }
+        wnaf[nDigits++] = digit;
+        for (int i = 0; i < 4; i++)
+            k[i] = (k[i] >> 1) | (k[i + 1] << 63);
+        k[4] >>= 1;
+    }
+    return nDigits;
+}
+
+// Replace a by its negation if that's smaller, i.e. a above n / 2
+static bool sc_abs(sc& a)
+{
+    static const uint64_t nHalf[4] = {0xDFE92F46681B20A0ULL, 0x5D576E7357A4501DULL, 0xFFFFFFFFFFFFFFFFULL, 0x7FFFFFFFFFFFFFFFULL};
+    if (!Ge256(a.n, nHalf) || (memcmp(a.n, nHalf, sizeof(nHalf)) == 0))
+        return false;
+    Sub256(a.n, SC_N.n, a.n);
+    return true;
+}
+
+// Split k into k1 + k2 * lambda (mod n) with k1 and k2 around 128 bits,
+// returned as magnitude and sign
+static void sc_split_lambda(sc& k1, bool& fNeg1, sc& k2, bool& fNeg2, const sc& k)
+{
+    // c1 = round(k * b2 / n), c2 = round(k * -b1 / n) from the short basis
+    // (a1, b1), (a2, b2) of the lattice of (x, y) with x + y * lambda = 0,
+    // with g1 = round(2^384 * b2 / n) and g2 = round(2^384 * -b1 / n)
+    static const uint64_t g1[4] = {0xE893209A45DBB031ULL, 0x3DAA8A1471E8CA7FULL, 0xE86C90E49284EB15ULL, 0x3086D221A7D46BCDULL};
+    static const uint64_t g2[4] = {0x1571B4AE8AC47F71ULL, 0x221208AC9DF506C6ULL, 0x6F547FA90ABFE4C4ULL, 0xE4437ED6010E8828ULL};
+    static const sc minusB1 = {{0x6F547FA90ABFE4C3ULL, 0xE4437ED6010E8828ULL, 0, 0}};
+    static const sc b2 = {{0xE86C90E49284EB15ULL, 0x3086D221A7D46BCDULL, 0, 0}};
+
+    sc c1, c2;
+    const uint64_t* g[2] = {g1, g2};
+    sc* c[2] = {&c1, &c2};
+    for (int i = 0; i < 2; i++)
+    {
+        uint64_t t[8];
+        Mul256(t, k.n, g[i]);
+        // >> 384, rounding on bit 383
+        uint64_t round = t[5] >> 63;
+        c[i]->n[0] = t[6] + round;
+        c[i]->n[1] = t[7] + (c[i]->n[0] < round);
+        c[i]->n[2] = c[i]->n[3] = 0;
+    }
+
+    // k2 = -c1 * b1 - c2 * b2, k1 = k - k2 * lambda
+    sc t1, t2;
+    sc_mul(t1, c1, minusB1);
+    sc_mul(t2, c2, b2);
+    sc_sub(k2.n, t1.n, t2.n);
+    sc_mul(t1, k2, SC_LAMBDA);
+    sc_sub(k1.n, k.n, t1.n);
+    fNeg1 = sc_abs(k1);
+    fNeg2 = sc_abs(k2);
+}
+
+static void gej_add_wnaf(gej& r, const gej* table, int n, bool fNeg)
+{
+    if (n == 0)
+        return;
+    if ((n < 0) == fNeg)
+        gej_add(r, r, table[(abs(n) - 1) / 2]);
+    else
+    {
+        gej neg;
+        gej_negate(neg, table[(abs(n) - 1) / 2]);
+        gej_add(r, r, neg);
+    }
+}
+
+static void gej_add_ge_wnaf(gej& r, const ge* table, int n)
+{
+    if (n > 0)
+        gej_add_ge(r, r, table[(n - 1) / 2]);
+    else if (n < 0)
+    {
+        ge neg = table[(-n - 1) / 2];
+        fe_negate(neg.y, neg.y);
+        gej_add_ge(r, r, neg);
+    }
+}
+
+// r = na * a + ng * G, as four half length multiplications sharing the
+// doublings: na is split with the endomorphism, ng into its 128 bit halves
+static void ecmult(gej& r, const gej& a, const sc& na, const sc& ng)
+{
+    // odd multiples of a and lambda * a
+    gej tableA[TABLE_SIZE_A], tableLamA[TABLE_SIZE_A];
+    gej a2;
+    tableA[0] = a;
+    gej_double(a2, a);
+    for (int i = 1; i < TABLE_SIZE_A; i++)
+        gej_add(tableA[i], tableA[i - 1], a2);
+    for (int i = 0; i < TABLE_SIZE_A; i++)
+    {
+        tableLamA[i] = tableA[i];
+        fe_mul(tableLamA[i].x, tableA[i].x, FE_BETA);
+    }
+
+    sc na1, na2, ngLow, ngHigh;
+    bool fNeg1, fNeg2;
+    sc_split_lambda(na1, fNeg1, na2, fNeg2, na);
+    memset(&ngLow, 0, sizeof(ngLow));
+    memset(&ngHigh, 0, sizeof(ngHigh));
+    ngLow.n[0] = ng.n[0];
+    ngLow.n[1] = ng.n[1];
+    ngHigh.n[0] = ng.n[2];
+    ngHigh.n[1] = ng.n[3];
+
+    int wnafA1[257], wnafA2[257], wnafGLow[257], wnafGHigh[257];
+    int nBitsA1 = sc_wnaf(wnafA1, na1, WINDOW_A);
+    int nBitsA2 = sc_wnaf(wnafA2, na2, WINDOW_A);
+    int nBitsGLow = sc_wnaf(wnafGLow, ngLow, WINDOW_G);
+    int nBitsGHigh = sc_wnaf(wnafGHigh, ngHigh, WINDOW_G);
+    int nBits = std::max(std::max(nBitsA1, nBitsA2), std::max(nBitsGLow, nBitsGHigh));
+
+    r.fInfinity = true;
+    for (int i = nBits - 1; i >= 0; i--)
+    {
+        gej_double(r, r);
+        if (i < nBitsA1)
+            gej_add_wnaf(r, tableA, wnafA1[i], fNeg1);
+        if (i < nBitsA2)
+            gej_add_wnaf(r, tableLamA, wnafA2[i], fNeg2);
+        if (i < nBitsGLow)
+            gej_add_ge_wnaf(r, tableG, wnafGLow[i]);
+        if (i < nBitsGHigh)
+            gej_add_ge_wnaf(r, tableG128, wnafGHigh[i]);
+    }
+}
+
+static void BuildTable(ge* table, const gej& p)
+{
+    gej p2, multiple = p;
+    gej_double(p2, p);
+    ge_set_gej(table[0], p);
+    for (int i = 1; i < TABLE_SIZE_G; i++)
+    {
+        gej_add(multiple, multiple, p2);
+        ge_set_gej(table[i], multiple);
+    }
+}
+
+static void BuildTableG()
+{
+    static const unsigned char pchGx[32] = {
+        0x79, 0xBE, 0x66, 0x7E, 0xF9, 0xDC, 0xBB, 0xAC, 0x55, 0xA0, 0x62, 0x95, 0xCE, 0x87, 0x0B, 0x07,
+        0x02, 0x9B, 0xFC, 0xDB, 0x2D, 0xCE, 0x28, 0xD9, 0x59, 0xF2, 0x81, 0x5B, 0x16, 0xF8, 0x17, 0x98
+    };
+    static const unsigned char pchGy[32] = {
+        0x48, 0x3A, 0xDA, 0x77, 0x26, 0xA3, 0xC4, 0x65, 0x5D, 0xA4, 0xFB, 0xFC, 0x0E, 0x11, 0x08, 0xA8,
+        0xFD, 0x17, 0xB4, 0x48, 0xA6, 0x85, 0x54, 0x19, 0x9C, 0x47, 0xD0, 0x8F, 0xFB, 0x10, 0xD4, 0xB8
+    };
+    ge g;
+    fe_set_b32(g.x, pchGx);
+    fe_set_b32(g.y, pchGy);
+    gej gj;
+    gej_set_ge(gj, g);
+    BuildTable(tableG, gj);
+    for (int i = 0; i < 128; i++)
+        gej_double(gj, gj);
+    BuildTable(tableG128, gj);
+    fTableGReady = true;
+}
+
+// Public key as serialized by CPubKey: 33 byte compressed or 65 byte
+// uncompressed. Hybrid encodings are left to OpenSSL.
+static bool ParsePubKey(ge& r, const unsigned char* p, size_t nLen)
+{
+    if (nLen == 33 && (p[0] == 0x02 || p[0] == 0x03))
+    {
+        if (!fe_set_b32(r.x, p + 1))
+            return false;
+        fe x3, seven;
+        fe_sqr(x3, r.x);
+        fe_mul(x3, x3, r.x);
+        fe_set_int(seven, 7);
+        fe_add(x3, x3, seven);
+        if (!fe_sqrt(r.y, x3) || fe_is_zero(r.y))
+            return false;
+        if ((r.y.n[0] & 1) != (uint64_t)(p[0] & 1))
+            fe_negate(r.y, r.y);
+        return true;
+    }
+    if (nLen == 65 && p[0] == 0x04)
+    {
+        if (!fe_set_b32(r.x, p + 1) || !fe_set_b32(r.y, p + 33))
+            return false;
+        fe lhs, rhs, seven;
+        fe_sqr(lhs, r.y);
+        fe_sqr(rhs, r.x);
+        fe_mul(rhs, rhs, r.x);
+        fe_set_int(seven, 7);
+        fe_add(rhs, rhs, seven);
+        return fe_equal(lhs, rhs);
+    }
+    return false;
+}
+
+// One INTEGER of a strict DER signature, at most 32 bytes after dropping a
+// single zero byte that keeps it positive
+static bool ParseDERInteger(unsigned char* pch32, const unsigned char*& p, const unsigned char* pend)
+{
+    if (pend - p < 2 || p[0] != 0x02)
+        return false;
+    size_t nLen = p[1];
+    p += 2;
+    if (nLen == 0 || nLen > (size_t)(pend - p))
+        return false;
+    // negative, or not minimally encoded
+    if (p[0] & 0x80)
+        return false;
+    if (nLen > 1 && p[0] == 0 && !(p[1] & 0x80))
+        return false;
+    const unsigned char* pint = p;
+    size_t nIntLen = nLen;
+    if (pint[0] == 0)
+    {
+        pint++;
+        nIntLen--;
+    }
+    if (nIntLen > 32)
+        return false;
+    memset(pch32, 0, 32);
+    memcpy(pch32 + 32 - nIntLen, pint, nIntLen);
+    p += nLen;
+    return true;
+}
+
+static bool ParseDERSignature(unsigned char* pchR, unsigned char* pchS, const unsigned char* p, size_t nLen)
+{
+    // SEQUENCE with a short form length covering exactly the rest
+    if (nLen < 8 || nLen > 72 || p[0] != 0x30 || p[1] != nLen - 2)
+        return false;
+    const unsigned char* pend = p + nLen;
+    p += 2;
+    if (!ParseDERInteger(pchR, p, pend) || !ParseDERInteger(pchS, p, pend))
+        return false;
+    return p == pend;
+}
+
+}
+
+int ECVerify(const unsigned char* pchPubKey, size_t nPubKeyLen, const unsigned char* pchHash,
+             const unsigned char* pchSig, size_t nSigLen)
+{
+    if (!fTableGReady)
+        return -1;
+
+    unsigned char pchR[32], pchS[32];
+    if (pchSig == NULL || !ParseDERSignature(pchR, pchS, pchSig, nSigLen))
+        return -1;
+    ge pubkey;
+    if (!ParsePubKey(pubkey, pchPubKey, nPubKeyLen))
+        return -1;
+
+    // r and s must be in [1, n-1]
+    sc r, s, e;
+    Read256(r.n, pchR);
+    Read256(s.n, pchS);
+    if (sc_is_zero(r) || sc_is_zero(s) || Ge256(r.n, SC_N.n) || Ge256(s.n, SC_N.n))
+        return 0;
+    Read256(e.n, pchHash);
+    if (Ge256(e.n, SC_N.n))
+        Sub256(e.n, e.n, SC_N.n);
+
+    sc w, u1, u2;
+    sc_inv(w, s);
+    sc_mul(u1, e, w);
+    sc_mul(u2, r, w);
+
+    gej a, R;
+    gej_set_ge(a, pubkey);
+    ecmult(R, a, u2, u1);
+    if (R.fInfinity)
+        return 0;
+
+    // Compare without leaving Jacobian coordinates: x / z^2 mod n == r,
+    // where x / z^2 may also be r + n since p > n
+    fe xr, zz, t;
+    fe_sqr(zz, R.z);
+    fe_set_b32(xr, pchR);
+    fe_mul(t, xr, zz);
+    if (fe_equal(t, R.x))
+        return 1;
+    uint64_t rn[4];
+    uint64_t carry = 0;
+    for (int i = 0; i < 4; i++)
+    {
+        uint128_t x = (uint128_t)r.n[i] + SC_N.n[i] + carry;
+        rn[i] = (uint64_t)x;
+        carry = (uint64_t)(x >> 64);
+    }
+    if (carry || Ge256(rn, FE_P.n))
+        return 0;
+    memcpy(xr.n, rn, sizeof(rn));
+    fe_mul(t, xr, zz);
+    return fe_equal(t, R.x) ? 1 : 0;
+}
+
+bool ECVerifyInit()
+{
+    if (!fTableGReady)
+        BuildTableG();
+
+    // A signature made with OpenSSL
+    static const unsigned char pchPubKey[65] = {
+        0x04, 0x14, 0xb6, 0xa6, 0x67, 0x47, 0x4a, 0x6d, 0x9a, 0x6a, 0x5b, 0xab, 0x36, 0x56, 0x87, 0x54,
+        0x7a, 0x12, 0xcd, 0x62, 0x5d, 0xbc, 0xc4, 0xcc, 0x77, 0xee, 0xba, 0x84, 0x49, 0x60, 0xfb, 0xe2,
+        0x0e, 0x50, 0x1f, 0xab, 0x93, 0x33, 0x77, 0x18, 0xff, 0x6f, 0x94, 0x25, 0x24, 0x48, 0x58, 0x71,
+        0x20, 0x18, 0xf3, 0x44, 0x92, 0xf1, 0xb4, 0xf1, 0x4a, 0x71, 0x36, 0x89, 0x19, 0xf9, 0x51, 0xa0,
+        0xd7
+    };
+    static const unsigned char pchHash[32] = {
+        0x85, 0xb4, 0xb5, 0x75, 0x05, 0xd4, 0x05, 0xde, 0x55, 0x5c, 0x52, 0x82, 0x9c, 0xe3, 0x01, 0x67,
+        0xcc, 0xec, 0x0d, 0xfe, 0xd6, 0xe9, 0x54, 0x29, 0x0a, 0x46, 0x0a, 0xad, 0x0f, 0x12, 0x94, 0x7e
+    };
+    static const unsigned char pchSig[] = {
+        0x30, 0x44, 0x02, 0x20, 0x30, 0x0a, 0xa4, 0x47, 0xc1, 0x66, 0xba, 0xe5, 0x45, 0xbb, 0x62, 0x02,
+        0x57, 0xc3, 0x6a, 0x57, 0xf7, 0x0f, 0x79, 0xbd, 0x59, 0x7d, 0x22, 0x51, 0xdc, 0x16, 0x95, 0x4f,
+        0xa6, 0x4f, 0xb6, 0x58, 0x02, 0x20, 0x1a, 0x31, 0x7d, 0x44, 0xcf, 0xce, 0x3c, 0xca, 0x3a, 0x9e,
+        0x5a, 0x8b, 0xeb, 0xe3, 0xdb, 0x86, 0xcf, 0x28, 0x30, 0xb7, 0xfe, 0xba, 0x38, 0x80, 0x3e, 0x7a,
+        0x19, 0x83, 0xa7, 0xd4, 0xba, 0x3e
+    };
+    if (ECVerify(pchPubKey, sizeof(pchPubKey), pchHash, pchSig, sizeof(pchSig)) != 1)
+        return false;
+    unsigned char pchBadHash[32];
+    memcpy(pchBadHash, pchHash, sizeof(pchBadHash));
+    pchBadHash[31] ^= 1;
+    return ECVerify(pchPubKey, sizeof(pchPubKey), pchBadHash, pchSig, sizeof(pchSig)) == 0;
+}
+
+#else // __SIZEOF_INT128__
+
+int ECVerify(const unsigned char* pchPubKey, size_t nPubKeyLen, const unsigned char* pchHash,
+             const unsigned char* pchSig, size_t nSigLen)
+{
+    return -1;
+}
+
+bool ECVerifyInit()
+{
+    return true;
+}
+
+#endif // __SIZEOF_INT128__
@@ -0,0 +1,24 @@
+// Copyright (c) 2016 The Ember developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_ECVERIFY_H
+#define BITCOIN_ECVERIFY_H
+
+#include <stddef.h>
+
+/** Verify a DER encoded ECDSA signature of the 32 byte hash with a serialized
+ * secp256k1 public key, using dedicated curve arithmetic instead of OpenSSL.
+ *
+ * Returns 1 for a valid signature and 0 for an invalid one. Returns -1 when
+ * the signature isn't strict DER or the public key isn't a plain compressed or
+ * uncompressed point, and on builds without 128 bit integer support; the
+ * caller then has to decide with OpenSSL, so that odd encodings are treated
+ * exactly as before.
+ */
+int ECVerify(const unsigned char* pchPubKey, size_t nPubKeyLen, const unsigned char* pchHash,
+             const unsigned char* pchSig, size_t nSigLen);
+
+/** Build the precomputed multiples of the generator, and check a known signature */
+bool ECVerifyInit();
+
+#endif // BITCOIN_ECVERIFY_H
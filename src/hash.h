@@ -96,6 +96,17 @@ inline uint256 Hash(const T1 p1begin, const T1 p1end,
     return hash2;
 }
 
+/** Double SHA-256 of nBlocks consecutive 64-byte inputs, such as pairs of
+ * merkle tree nodes, into nBlocks consecutive 32-byte outputs. Several inputs
+ * are hashed at once with SSE4.1, AVX2 or the SHA extensions where the CPU
+ * has them. */
+void SHA256D64(unsigned char* pout, const unsigned char* pin, size_t nBlocks);
+/** Name of the SHA256D64 implementation picked for this CPU */
+const char* SHA256D64Implementation();
+/** Run the named SHA256D64 implementation ("generic", "sse4.1", "avx2" or
+ * "shani"), for tests. Returns false if this build or CPU doesn't have it. */
+bool SHA256D64With(const char* pszName, unsigned char* pout, const unsigned char* pin, size_t nBlocks);
+
 template<typename T>
 uint256 SerializeHash(const T& obj, int nType=SER_GETHASH, int nVersion=PROTOCOL_VERSION)
 {
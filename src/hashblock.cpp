@@ -0,0 +1,478 @@
+// Copyright (c) 2016 The Ember developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "hashblock.h"
+
+#include <algorithm>
+#include <string.h>
+
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+
+// Like the SHA256D64 kernels, the vector code is built with per-function
+// target attributes and picked from cpuid at the first call.
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define USE_HASH9_X86
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+// Batches smaller than this are hashed on the calling thread
+static const size_t HASH9_BATCH_PARALLEL_MIN = 256;
+
+typedef void (*Hash9BatchFunc)(const unsigned char* pheaders, size_t nCount, uint256* phashes);
+
+static void Hash9BatchGeneric(const unsigned char* pheaders, size_t nCount, uint256* phashes)
+{
+    for (size_t i = 0; i < nCount; i++)
+    {
+        const unsigned char* pheader = pheaders + i * BLOCK_HEADER_SIZE;
+        phashes[i] = Hash9(pheader, pheader + BLOCK_HEADER_SIZE);
+    }
+}
+
+#ifdef USE_HASH9_X86
+
+// The AVX2 kernel hashes eight headers at a time. The stages built from
+// adds, rotates and logic run on several headers at once, one header per
+// vector lane: blake512 and keccak512 four at a time on 64-bit words, and
+// cubehash512, the most expensive stage, eight at a time on 32-bit words.
+// The other ten stages run one header at a time in between, with the same
+// sph code Hash9 uses.
+
+static const uint64_t BLAKE512_IV[8] = {
+    0x6A09E667F3BCC908ULL, 0xBB67AE8584CAA73BULL, 0x3C6EF372FE94F82BULL, 0xA54FF53A5F1D36F1ULL,
+    0x510E527FADE682D1ULL, 0x9B05688C2B3E6C1FULL, 0x1F83D9ABFB41BD6BULL, 0x5BE0CD19137E2179ULL
+};
+
+static const uint64_t BLAKE512_C[16] = {
+    0x243F6A8885A308D3ULL, 0x13198A2E03707344ULL, 0xA4093822299F31D0ULL, 0x082EFA98EC4E6C89ULL,
+    0x452821E638D01377ULL, 0xBE5466CF34E90C6CULL, 0xC0AC29B7C97C50DDULL, 0x3F84D5B5B5470917ULL,
+    0x9216D5D98979FB1BULL, 0xD1310BA698DFB5ACULL, 0x2FFD72DBD01ADFB7ULL, 0xB8E1AFED6A267E96ULL,
+    0xBA7C9045F12C7F99ULL, 0x24A19947B3916CF7ULL, 0x0801F2E2858EFC16ULL, 0x636920D871574E69ULL
+};
+
+static const unsigned char BLAKE_SIGMA[10][16] = {
+    { 0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15},
+    {14, 10,  4,  8,  9, 15, 13,  6,  1, 12,  0,  2, 11,  7,  5,  3},
+    {11,  8, 12,  0,  5,  2, 15, 13, 10, 14,  3,  6,  7,  1,  9,  4},
+    { 7,  9,  3,  1, 13, 12, 11, 14,  2,  6,  5, 10,  4,  0, 15,  8},
+    { 9,  0,  5,  7,  2,  4, 10, 15, 14,  1, 11, 12,  6,  8,  3, 13},
+    { 2, 12,  6, 10,  0, 11,  8,  3,  4, 13,  7,  5, 15, 14,  1,  9},
+    {12,  5,  1, 15, 14, 13,  4, 10,  0,  7,  6,  3,  9,  2,  8, 11},
+    {13, 11,  7, 14, 12,  1,  3,  9,  5,  0, 15,  4,  8,  6,  2, 10},
+    { 6, 15, 14,  9, 11,  3,  0,  8, 12,  2, 13,  7,  1,  4, 10,  5},
+    {10,  2,  8,  4,  7,  6,  1,  5, 15, 11,  9, 14,  3, 12, 13,  0}
+};
+
+static const uint32_t CUBEHASH512_IV[32] = {
+    0x2AEA2A61, 0x50F494D4, 0x2D538B8B, 0x4167D83E, 0x3FEE2313, 0xC701CF8C, 0xCC39968E, 0x50AC5695,
+    0x4D42C787, 0xA647A8B3, 0x97CF0BEF, 0x825B4537, 0xEEF864D2, 0xF22090C4, 0xD0E5CD33, 0xA23911AE,
+    0xFCD398D9, 0x148FE485, 0x1B017BEF, 0xB6444532, 0x6A536159, 0x2FF5781C, 0x91FA7934, 0x0DBADEA9,
+    0xD65C8A2B, 0xA5A70E75, 0xB1C62456, 0xBC796576, 0x1921C8F7, 0xE7989AF1, 0x7795D246, 0xD43E3B44
+};
+
+static const uint64_t KECCAK_RC[24] = {
+    0x0000000000000001ULL, 0x0000000000008082ULL, 0x800000000000808AULL, 0x8000000080008000ULL,
+    0x000000000000808BULL, 0x0000000080000001ULL, 0x8000000080008081ULL, 0x8000000000008009ULL,
+    0x000000000000008AULL, 0x0000000000000088ULL, 0x0000000080008009ULL, 0x000000008000000AULL,
+    0x000000008000808BULL, 0x800000000000008BULL, 0x8000000000008089ULL, 0x8000000000008003ULL,
+    0x8000000000008002ULL, 0x8000000000000080ULL, 0x000000000000800AULL, 0x800000008000000AULL,
+    0x8000000080008081ULL, 0x8000000000008080ULL, 0x0000000080000001ULL, 0x8000000080008008ULL
+};
+
+// Rotation of lane x + 5 * y, and where the pi step moves it
+static const int KECCAK_ROTC[25] = {
+     0,  1, 62, 28, 27,
+    36, 44,  6, 55, 20,
+     3, 10, 43, 25, 39,
+    41, 45, 15, 21,  8,
+    18,  2, 61, 56, 14
+};
+static const int KECCAK_PI[25] = {
+     0, 10, 20,  5, 15,
+    16,  1, 11, 21,  6,
+     7, 17,  2, 12, 22,
+    23,  8, 18,  3, 13,
+    14, 24,  9, 19,  4
+};
+
+static inline uint32_t ReadLE32(const unsigned char* p)
+{
+    uint32_t x;
+    memcpy(&x, p, 4);
+    return x;
+}
+
+static inline uint64_t ReadLE64(const unsigned char* p)
+{
+    uint64_t x;
+    memcpy(&x, p, 8);
+    return x;
+}
+
+static inline uint64_t ReadBE64(const unsigned char* p)
+{
+    return __builtin_bswap64(ReadLE64(p));
+}
+
+static inline void WriteBE64(unsigned char* p, uint64_t x)
+{
+    x = __builtin_bswap64(x);
+    memcpy(p, &x, 8);
+}
+
+// bmw512, groestl512, skein512 and jh512
+static void HashBmwToJh(const unsigned char* pin, unsigned char* pout)
+{
+    sph_bmw512_context ctx_bmw;
+    sph_groestl512_context ctx_groestl;
+    sph_skein512_context ctx_skein;
+    sph_jh512_context ctx_jh;
+    unsigned char hash[64];
+
+    sph_bmw512_init(&ctx_bmw);
+    sph_bmw512(&ctx_bmw, pin, 64);
+    sph_bmw512_close(&ctx_bmw, hash);
+
+    sph_groestl512_init(&ctx_groestl);
+    sph_groestl512(&ctx_groestl, hash, 64);
+    sph_groestl512_close(&ctx_groestl, hash);
+
+    sph_skein512_init(&ctx_skein);
+    sph_skein512(&ctx_skein, hash, 64);
+    sph_skein512_close(&ctx_skein, hash);
+
+    sph_jh512_init(&ctx_jh);
+    sph_jh512(&ctx_jh, hash, 64);
+    sph_jh512_close(&ctx_jh, pout);
+}
+
+static void HashLuffa(const unsigned char* pin, unsigned char* pout)
+{
+    sph_luffa512_context ctx_luffa;
+
+    sph_luffa512_init(&ctx_luffa);
+    sph_luffa512(&ctx_luffa, pin, 64);
+    sph_luffa512_close(&ctx_luffa, pout);
+}
+
+// shavite512 through fugue512
+static uint256 HashShaviteToFugue(const unsigned char* pin)
+{
+    sph_shavite512_context ctx_shavite;
+    sph_simd512_context ctx_simd;
+    sph_echo512_context ctx_echo;
+    sph_hamsi512_context ctx_hamsi;
+    sph_fugue512_context ctx_fugue;
+    uint512 hash[2];
+
+    sph_shavite512_init(&ctx_shavite);
+    sph_shavite512(&ctx_shavite, pin, 64);
+    sph_shavite512_close(&ctx_shavite, &hash[0]);
+
+    sph_simd512_init(&ctx_simd);
+    sph_simd512(&ctx_simd, &hash[0], 64);
+    sph_simd512_close(&ctx_simd, &hash[1]);
+
+    sph_echo512_init(&ctx_echo);
+    sph_echo512(&ctx_echo, &hash[1], 64);
+    sph_echo512_close(&ctx_echo, &hash[0]);
+
+    sph_hamsi512_init(&ctx_hamsi);
+    sph_hamsi512(&ctx_hamsi, &hash[0], 64);
+    sph_hamsi512_close(&ctx_hamsi, &hash[1]);
+
+    sph_fugue512_init(&ctx_fugue);
+    sph_fugue512(&ctx_fugue, &hash[1], 64);
+    sph_fugue512_close(&ctx_fugue, &hash[0]);
+
+    return hash[0].trim256();
+}
+
+namespace avx2 {
+
+#define AVX2_TARGET __attribute__((target("avx2")))
+
+AVX2_TARGET static inline __m256i K(uint64_t x) { return _mm256_set1_epi64x((long long)x); }
+AVX2_TARGET static inline __m256i Xor(__m256i a, __m256i b) { return _mm256_xor_si256(a, b); }
+AVX2_TARGET static inline __m256i Add(__m256i a, __m256i b) { return _mm256_add_epi64(a, b); }
+AVX2_TARGET static inline __m256i Ror(__m256i x, int n) { return _mm256_or_si256(_mm256_srli_epi64(x, n), _mm256_slli_epi64(x, 64 - n)); }
+AVX2_TARGET static inline __m256i Rol(__m256i x, int n) { return _mm256_or_si256(_mm256_slli_epi64(x, n), _mm256_srli_epi64(x, 64 - n)); }
+
+AVX2_TARGET static inline void Swap(__m256i& a, __m256i& b) { __m256i t = a; a = b; b = t; }
+AVX2_TARGET static inline __m256i Rol32(__m256i x, int n) { return _mm256_or_si256(_mm256_slli_epi32(x, n), _mm256_srli_epi32(x, 32 - n)); }
+
+AVX2_TARGET static inline __m256i Lanes(uint64_t x0, uint64_t x1, uint64_t x2, uint64_t x3)
+{
+    return _mm256_set_epi64x((long long)x3, (long long)x2, (long long)x1, (long long)x0);
+}
+
+AVX2_TARGET static inline void BlakeG(__m256i v[16], const __m256i m[16], int a, int b, int c, int d, int x, int y)
+{
+    v[a] = Add(Add(v[a], v[b]), Xor(m[x], K(BLAKE512_C[y])));
+    v[d] = Ror(Xor(v[d], v[a]), 32);
+    v[c] = Add(v[c], v[d]);
+    v[b] = Ror(Xor(v[b], v[c]), 25);
+    v[a] = Add(Add(v[a], v[b]), Xor(m[y], K(BLAKE512_C[x])));
+    v[d] = Ror(Xor(v[d], v[a]), 16);
+    v[c] = Add(v[c], v[d]);
+    v[b] = Ror(Xor(v[b], v[c]), 11);
+}
+
+// blake512 of four BLOCK_HEADER_SIZE-byte headers. An 80-byte message and
+// its padding fill exactly one compression, with a bit counter of 640.
+AVX2_TARGET static void Blake512(const unsigned char* pin, unsigned char pout[4][64])
+{
+    __m256i m[16];
+    for (int i = 0; i < 10; i++)
+        m[i] = Lanes(ReadBE64(pin + 8 * i), ReadBE64(pin + BLOCK_HEADER_SIZE + 8 * i),
+                     ReadBE64(pin + 2 * BLOCK_HEADER_SIZE + 8 * i), ReadBE64(pin + 3 * BLOCK_HEADER_SIZE + 8 * i));
+    m[10] = K(0x8000000000000000ULL);
+    m[11] = m[12] = m[14] = _mm256_setzero_si256();
+    m[13] = K(1);
+    m[15] = K(BLOCK_HEADER_SIZE * 8);
+
+    __m256i v[16];
+    for (int i = 0; i < 8; i++)
+        v[i] = K(BLAKE512_IV[i]);
+    for (int i = 0; i < 4; i++)
+        v[8 + i] = K(BLAKE512_C[i]);
+    v[12] = K(BLAKE512_C[4] ^ (BLOCK_HEADER_SIZE * 8));
+    v[13] = K(BLAKE512_C[5] ^ (BLOCK_HEADER_SIZE * 8));
+    v[14] = K(BLAKE512_C[6]);
+    v[15] = K(BLAKE512_C[7]);
+
+    for (int r = 0; r < 16; r++)
+    {
+        const unsigned char* s = BLAKE_SIGMA[r % 10];
+        BlakeG(v, m, 0, 4,  8, 12, s[ 0], s[ 1]);
+        BlakeG(v, m, 1, 5,  9, 13, s[ 2], s[ 3]);
+        BlakeG(v, m, 2, 6, 10, 14, s[ 4], s[ 5]);
+        BlakeG(v, m, 3, 7, 11, 15, s[ 6], s[ 7]);
+        BlakeG(v, m, 0, 5, 10, 15, s[ 8], s[ 9]);
+        BlakeG(v, m, 1, 6, 11, 12, s[10], s[11]);
+        BlakeG(v, m, 2, 7,  8, 13, s[12], s[13]);
+        BlakeG(v, m, 3, 4,  9, 14, s[14], s[15]);
+    }
+
+    for (int i = 0; i < 8; i++)
+    {
+        uint64_t h[4];
+        _mm256_storeu_si256((__m256i*)h, Xor(K(BLAKE512_IV[i]), Xor(v[i], v[8 + i])));
+        for (int j = 0; j < 4; j++)
+            WriteBE64(pout[j] + 8 * i, h[j]);
+    }
+}
+
+// keccak512 of four 64-byte inputs. The input and its padding fit in the
+// 72-byte rate, so it takes a single permutation.
+AVX2_TARGET static void Keccak512(unsigned char pin[4][64], unsigned char pout[4][64])
+{
+    __m256i a[25], b[25], c[5];
+    for (int i = 0; i < 8; i++)
+        a[i] = Lanes(ReadLE64(pin[0] + 8 * i), ReadLE64(pin[1] + 8 * i), ReadLE64(pin[2] + 8 * i), ReadLE64(pin[3] + 8 * i));
+    a[8] = K(0x8000000000000001ULL);
+    for (int i = 9; i < 25; i++)
+        a[i] = _mm256_setzero_si256();
+
+    for (int r = 0; r < 24; r++)
+    {
+        for (int x = 0; x < 5; x++)
+            c[x] = Xor(Xor(Xor(a[x], a[x + 5]), Xor(a[x + 10], a[x + 15])), a[x + 20]);
+        for (int x = 0; x < 5; x++)
+        {
+            __m256i d = Xor(c[(x + 4) % 5], Rol(c[(x + 1) % 5], 1));
+            for (int y = 0; y < 25; y += 5)
+                a[x + y] = Xor(a[x + y], d);
+        }
+        for (int i = 0; i < 25; i++)
+            b[KECCAK_PI[i]] = KECCAK_ROTC[i] ? Rol(a[i], KECCAK_ROTC[i]) : a[i];
+        for (int y = 0; y < 25; y += 5)
+            for (int x = 0; x < 5; x++)
+                a[x + y] = Xor(b[x + y], _mm256_andnot_si256(b[(x + 1) % 5 + y], b[(x + 2) % 5 + y]));
+        a[0] = Xor(a[0], K(KECCAK_RC[r]));
+    }
+
+    for (int i = 0; i < 8; i++)
+    {
+        uint64_t h[4];
+        _mm256_storeu_si256((__m256i*)h, a[i]);
+        for (int j = 0; j < 4; j++)
+            memcpy(pout[j] + 8 * i, &h[j], 8);
+    }
+}
+
+AVX2_TARGET static void CubeHashRounds(__m256i x[32], int nRounds)
+{
+    for (int r = 0; r < nRounds; r++)
+    {
+        for (int i = 0; i < 16; i++)
+            x[i + 16] = _mm256_add_epi32(x[i + 16], x[i]);
+        for (int i = 0; i < 16; i++)
+            x[i] = Rol32(x[i], 7);
+        for (int i = 0; i < 8; i++)
+            Swap(x[i], x[i + 8]);
+        for (int i = 0; i < 16; i++)
+            x[i] = Xor(x[i], x[i + 16]);
+        for (int i = 16; i < 32; i += 4)
+        {
+            Swap(x[i], x[i + 2]);
+            Swap(x[i + 1], x[i + 3]);
+        }
+        for (int i = 0; i < 16; i++)
+            x[i + 16] = _mm256_add_epi32(x[i + 16], x[i]);
+        for (int i = 0; i < 16; i++)
+            x[i] = Rol32(x[i], 11);
+        for (int i = 0; i < 16; i += 8)
+            for (int j = 0; j < 4; j++)
+                Swap(x[i + j], x[i + j + 4]);
+        for (int i = 0; i < 16; i++)
+            x[i] = Xor(x[i], x[i + 16]);
+        for (int i = 16; i < 32; i += 2)
+            Swap(x[i], x[i + 1]);
+    }
+}
+
+// cubehash512 (16 rounds per 32-byte block) of eight 64-byte inputs: two
+// message blocks, the padding block, then the 160 finalization rounds
+AVX2_TARGET static void CubeHash512(unsigned char pin[8][64], unsigned char pout[8][64])
+{
+    __m256i x[32];
+    for (int i = 0; i < 32; i++)
+        x[i] = _mm256_set1_epi32((int)CUBEHASH512_IV[i]);
+    for (int nBlock = 0; nBlock < 2; nBlock++)
+    {
+        for (int i = 0; i < 8; i++)
+        {
+            int nPos = 32 * nBlock + 4 * i;
+            x[i] = Xor(x[i], _mm256_set_epi32((int)ReadLE32(pin[7] + nPos), (int)ReadLE32(pin[6] + nPos),
+                                              (int)ReadLE32(pin[5] + nPos), (int)ReadLE32(pin[4] + nPos),
+                                              (int)ReadLE32(pin[3] + nPos), (int)ReadLE32(pin[2] + nPos),
+                                              (int)ReadLE32(pin[1] + nPos), (int)ReadLE32(pin[0] + nPos)));
+        }
+        CubeHashRounds(x, 16);
+    }
+    x[0] = Xor(x[0], _mm256_set1_epi32(0x80));
+    CubeHashRounds(x, 16);
+    x[31] = Xor(x[31], _mm256_set1_epi32(1));
+    CubeHashRounds(x, 160);
+
+    for (int i = 0; i < 16; i++)
+    {
+        uint32_t h[8];
+        _mm256_storeu_si256((__m256i*)h, x[i]);
+        for (int j = 0; j < 8; j++)
+            memcpy(pout[j] + 4 * i, &h[j], 4);
+    }
+}
+
+}
+
+static void Hash9BatchAVX2(const unsigned char* pheaders, size_t nCount, uint256* phashes)
+{
+    size_t i = 0;
+    for (; i + 8 <= nCount; i += 8)
+    {
+        unsigned char hash1[8][64], hash2[8][64];
+        avx2::Blake512(pheaders + i * BLOCK_HEADER_SIZE, hash1);
+        avx2::Blake512(pheaders + (i + 4) * BLOCK_HEADER_SIZE, hash1 + 4);
+        for (int j = 0; j < 8; j++)
+            HashBmwToJh(hash1[j], hash2[j]);
+        avx2::Keccak512(hash2, hash1);
+        avx2::Keccak512(hash2 + 4, hash1 + 4);
+        for (int j = 0; j < 8; j++)
+            HashLuffa(hash1[j], hash2[j]);
+        avx2::CubeHash512(hash2, hash1);
+        for (int j = 0; j < 8; j++)
+            phashes[i + j] = HashShaviteToFugue(hash1[j]);
+    }
+    Hash9BatchGeneric(pheaders + i * BLOCK_HEADER_SIZE, nCount - i, phashes + i);
+}
+
+static uint64_t ReadXCR0()
+{
+    uint32_t a, d;
+    __asm__ ("xgetbv" : "=a"(a), "=d"(d) : "c"(0));
+    return ((uint64_t)d << 32) | a;
+}
+
+#endif // USE_HASH9_X86
+
+struct CHash9BatchImpl
+{
+    Hash9BatchFunc pfn;
+    const char* pszName;
+    bool fAVX2;
+
+    CHash9BatchImpl() : pfn(Hash9BatchGeneric), pszName("generic"), fAVX2(false)
+    {
+#ifdef USE_HASH9_X86
+        unsigned int eax, ebx, ecx, edx;
+        if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+            return;
+        // AVX registers also need saving by the OS
+        bool fAVX = ((ecx >> 27) & 1) && ((ecx >> 28) & 1) && (ReadXCR0() & 6) == 6;
+        if (__get_cpuid_max(0, NULL) >= 7)
+        {
+            __cpuid_count(7, 0, eax, ebx, ecx, edx);
+            fAVX2 = fAVX && ((ebx >> 5) & 1);
+        }
+        if (fAVX2)
+        {
+            pfn = Hash9BatchAVX2;
+            pszName = "avx2";
+        }
+#endif
+    }
+};
+
+static const CHash9BatchImpl& GetHash9BatchImpl()
+{
+    static const CHash9BatchImpl impl;
+    return impl;
+}
+
+static void Hash9BatchRange(const unsigned char* pheaders, size_t nBegin, size_t nEnd, uint256* phashes)
+{
+    GetHash9BatchImpl().pfn(pheaders + nBegin * BLOCK_HEADER_SIZE, nEnd - nBegin, phashes + nBegin);
+}
+
+void Hash9Batch(const unsigned char* pheaders, size_t nCount, uint256* phashes, bool fParallel)
+{
+    size_t nThreads = fParallel ? boost::thread::hardware_concurrency() : 1;
+    if (nThreads <= 1 || nCount < HASH9_BATCH_PARALLEL_MIN)
+    {
+        Hash9BatchRange(pheaders, 0, nCount, phashes);
+        return;
+    }
+    nThreads = std::min(nThreads, nCount / (HASH9_BATCH_PARALLEL_MIN / 2));
+
+    size_t nChunk = (nCount + nThreads - 1) / nThreads;
+    boost::thread_group threadGroup;
+    for (size_t nBegin = nChunk; nBegin < nCount; nBegin += nChunk)
+        threadGroup.create_thread(boost::bind(&Hash9BatchRange, pheaders, nBegin, std::min(nCount, nBegin + nChunk), phashes));
+    Hash9BatchRange(pheaders, 0, std::min(nCount, nChunk), phashes);
+    threadGroup.join_all();
+}
+
+const char* Hash9BatchImplementation()
+{
+    return GetHash9BatchImpl().pszName;
+}
+
+bool Hash9BatchWith(const char* pszName, const unsigned char* pheaders, size_t nCount, uint256* phashes)
+{
+    Hash9BatchFunc pfn = NULL;
+    if (strcmp(pszName, "generic") == 0)
+        pfn = Hash9BatchGeneric;
+#ifdef USE_HASH9_X86
+    else if (strcmp(pszName, "avx2") == 0 && GetHash9BatchImpl().fAVX2)
+        pfn = Hash9BatchAVX2;
+#endif
+    if (!pfn)
+        return false;
+    pfn(pheaders, nCount, phashes);
+    return true;
+}
@@ -148,4 +148,20 @@ inline uint256 Hash9(const T1 pbegin, const T1 pend)
     return hash[12].trim256();
 }
 
+/** Size of the serialized block header (nVersion .. nNonce) that Hash9 is computed over */
+static const size_t BLOCK_HEADER_SIZE = 80;
+
+/** Hash nCount consecutive BLOCK_HEADER_SIZE-byte headers into phashes. With
+ * AVX2, the blake512, keccak512 and cubehash512 stages run on several headers
+ * at once. With fParallel, large batches are split over all cores on threads
+ * started for the call, which is meant for startup work like loading the
+ * block index.
+ */
+void Hash9Batch(const unsigned char* pheaders, size_t nCount, uint256* phashes, bool fParallel = false);
+/** Name of the Hash9Batch implementation picked for this CPU */
+const char* Hash9BatchImplementation();
+/** Run the named Hash9Batch implementation ("generic" or "avx2"), for tests.
+ * Returns false if this build or CPU doesn't have it. */
+bool Hash9BatchWith(const char* pszName, const unsigned char* pheaders, size_t nCount, uint256* phashes);
+
 #endif // HASHBLOCK_H
\ No newline at end of file
@@ -101,12 +101,22 @@ void Shutdown()
         bitdb.Flush(false);
 #endif
     StopNode();
+    // Only once it was read back, or the saved pool would be lost
+    if (mempool.IsLoaded() && GetBoolArg("-persistmempool", DEFAULT_PERSIST_MEMPOOL))
+        DumpMempool();
     {
         LOCK(cs_main);
 #ifdef ENABLE_WALLET
         if (pwalletMain)
             pwalletMain->SetBestChain(CBlockLocator(pindexBest));
 #endif
+        if (pindexBest)
+        {
+            CTxDB txdb;
+            txdb.FlushUnspent();
+            txdb.WriteBlockIndexSnapshot();
+        }
+        CloseBlockFiles();
     }
 #ifdef ENABLE_WALLET
     if (pwalletMain)
@@ -168,7 +178,13 @@ std::string HelpMessage()
     strUsage += "  -datadir=<dir>         " + _("Specify data directory") + "\n";
     strUsage += "  -wallet=<dir>          " + _("Specify wallet file (within data directory)") + "\n";
     strUsage += "  -dbcache=<n>           " + _("Set database cache size in megabytes (default: 25)") + "\n";
+    strUsage += "  -blockcache=<n>        " + strprintf(_("Keep up to <n> megabytes of recently used blocks in memory (default: %u)"), DEFAULT_BLOCK_CACHE_SIZE) + "\n";
     strUsage += "  -dblogsize=<n>         " + _("Set database disk log size in megabytes (default: 100)") + "\n";
+    strUsage += "  -maxmempool=<n>        " + strprintf(_("Keep the transaction memory pool below <n> megabytes (default: %u)"), DEFAULT_MAX_MEMPOOL_SIZE) + "\n";
+    strUsage += "  -persistmempool        " + strprintf(_("Save the transaction memory pool on shutdown and load it on startup (default: %u)"), DEFAULT_PERSIST_MEMPOOL) + "\n";
+    strUsage += "  -sigcachemb=<n>        " + strprintf(_("Keep up to <n> megabytes of verified signatures in memory (default: %u)"), DEFAULT_SIG_CACHE_MB) + "\n";
+    strUsage += "  -maxsigcachesize=<n>   " + _("Size the signature cache for <n> signatures instead, unless -sigcachemb is given") + "\n";
+    strUsage += "  -par=<n>               " + strprintf(_("Set the number of script verification threads (up to %d, 0 = auto, <0 = leave that many cores free, default: %d)"), MAX_SCRIPTCHECK_THREADS, DEFAULT_SCRIPTCHECK_THREADS) + "\n";
     strUsage += "  -timeout=<n>           " + _("Specify connection timeout in milliseconds (default: 5000)") + "\n";
     strUsage += "  -proxy=<ip:port>       " + _("Connect through SOCKS5 proxy") + "\n";
     strUsage += "  -tor=<ip:port>         " + _("Use proxy to reach tor hidden services (default: same as -proxy)") + "\n";
@@ -191,6 +207,7 @@ std::string HelpMessage()
     strUsage += "  -bantime=<n>           " + _("Number of seconds to keep misbehaving peers from reconnecting (default: 86400)") + "\n";
     strUsage += "  -maxreceivebuffer=<n>  " + _("Maximum per-connection receive buffer, <n>*1000 bytes (default: 5000)") + "\n";
     strUsage += "  -maxsendbuffer=<n>     " + _("Maximum per-connection send buffer, <n>*1000 bytes (default: 1000)") + "\n";
+    strUsage += "  -msghandlers=<n>       " + strprintf(_("Number of threads processing peer messages (1-%d, default: %d)"), MAX_MESSAGE_HANDLERS, DEFAULT_MESSAGE_HANDLERS) + "\n";
 #ifdef USE_UPNP
 #if USE_UPNP
     strUsage += "  -upnp                  " + _("Use UPnP to map the listening port (default: 1 when listening)") + "\n";
@@ -245,9 +262,11 @@ std::string HelpMessage()
     strUsage += "  -rescan                " + _("Rescan the block chain for missing wallet transactions") + "\n";
     strUsage += "  -salvagewallet         " + _("Attempt to recover private keys from a corrupt wallet.dat") + "\n";
     strUsage += "  -checkblocks=<n>       " + _("How many blocks to check at startup (default: 500, 0 = all)") + "\n";
-    strUsage += "  -checklevel=<n>        " + _("How thorough the block verification is (0-6, default: 1)") + "\n";
+    strUsage += "  -checklevel=<n>        " + _("How thorough the block verification is (0-6, default: 1, levels above 1 finish in the background)") + "\n";
     strUsage += "  -loadblock=<file>      " + _("Imports blocks from external blk000?.dat file") + "\n";
     strUsage += "  -maxorphanblocks=<n>   " + strprintf(_("Keep at most <n> unconnectable blocks in memory (default: %u)"), DEFAULT_MAX_ORPHAN_BLOCKS) + "\n";
+    strUsage += "  -headersfirst          " + _("Download and check block headers up to the last checkpoint first, then fetch those blocks from several peers (default: 1)") + "\n";
+    strUsage += "  -compactblocks         " + _("Relay new blocks to peers that support it as compact blocks, rebuilt from their memory pool (default: 1)") + "\n";
 
     strUsage += "\n" + _("Block creation options:") + "\n";
     strUsage += "  -blockminsize=<n>      "   + _("Set minimum block size in bytes (default: 0)") + "\n";
@@ -443,6 +462,19 @@ bool AppInit2(boost::thread_group& threadGroup)
     }
 #endif
 
+    SetBlockCacheSize(std::max((int64_t)0, GetArg("-blockcache", DEFAULT_BLOCK_CACHE_SIZE)) * 1048576);
+
+    // -par=0 means autodetect, but nScriptCheckThreads==0 means no concurrency
+    nScriptCheckThreads = GetArg("-par", DEFAULT_SCRIPTCHECK_THREADS);
+    if (nScriptCheckThreads <= 0)
+        nScriptCheckThreads += boost::thread::hardware_concurrency();
+    if (nScriptCheckThreads <= 1)
+        nScriptCheckThreads = 0;
+    else if (nScriptCheckThreads > MAX_SCRIPTCHECK_THREADS)
+        nScriptCheckThreads = MAX_SCRIPTCHECK_THREADS;
+
+    fHeadersFirst = GetBoolArg("-headersfirst", true);
+
     fConfChange = GetBoolArg("-confchange", false);
     fMinimizeCoinAge = GetBoolArg("-minimizecoinage", false);
 
@@ -481,6 +513,8 @@ bool AppInit2(boost::thread_group& threadGroup)
     LogPrintf("\n\n\n\n\n\n\n");
     LogPrintf("Ember version %s (%s)\n", FormatFullVersion(), CLIENT_DATE);
     LogPrintf("Using OpenSSL version %s\n", SSLeay_version(SSLEAY_VERSION));
+    LogPrintf("Using %s SHA256 for merkle trees\n", SHA256D64Implementation());
+    LogPrintf("Using %s x13 for batches of block headers\n", Hash9BatchImplementation());
     if (!fLogTimestamps)
         LogPrintf("Startup time: %s\n", DateTimeStrFormat("%x %H:%M:%S", GetTime()));
     LogPrintf("Default data directory %s\n", GetDefaultDataDir().string());
@@ -490,6 +524,12 @@ bool AppInit2(boost::thread_group& threadGroup)
     if (fDaemon)
         fprintf(stdout, "Ember server starting\n");
 
+    if (nScriptCheckThreads) {
+        LogPrintf("Using %u threads for script verification\n", nScriptCheckThreads);
+        for (int i=0; i<nScriptCheckThreads-1; i++)
+            threadGroup.create_thread(&ThreadScriptCheck);
+    }
+
     int64_t nStart;
 
     // ********************************************************* Step 5: verify database integrity
@@ -789,8 +829,12 @@ bool AppInit2(boost::thread_group& threadGroup)
             nStart = GetTimeMillis();
             pwalletMain->ScanForWalletTransactions(pindexRescan, true);
             LogPrintf(" rescan      %15dms\n", GetTimeMillis() - nStart);
-            pwalletMain->SetBestChain(CBlockLocator(pindexBest));
-            nWalletDBUpdated++;
+            // An interrupted rescan has to start over from the old locator
+            if (!ShutdownRequested())
+            {
+                pwalletMain->SetBestChain(CBlockLocator(pindexBest));
+                nWalletDBUpdated++;
+            }
         }
     } // (!fDisableWallet)
 #else // ENABLE_WALLET
@@ -806,6 +850,9 @@ bool AppInit2(boost::thread_group& threadGroup)
     }
     threadGroup.create_thread(boost::bind(&ThreadImport, vImportFiles));
 
+    // Transaction index checks of -checklevel=2 and above
+    threadGroup.create_thread(&ThreadVerifyBlocks);
+
     // ********************************************************* Step 10: load peers
 
     uiInterface.InitMessage(_("Loading addresses..."));
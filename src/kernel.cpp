@@ -51,48 +51,46 @@ static int64_t GetStakeModifierSelectionInterval()
     return nSelectionInterval;
 }
 
-// select a block from the candidate blocks in vSortedByTimestamp, excluding
-// already selected blocks in vSelectedBlocks, and with timestamp up to
+// A block that may contribute a bit to the next stake modifier. The
+// selection hash only depends on the block and the previous modifier, so it
+// is computed once instead of in each of the 64 selection rounds.
+struct CStakeModifierCandidate
+{
+    int64_t nTime;
+    uint256 hashBlock;
+    const CBlockIndex* pindex;
+    uint256 hashSelection;
+    bool fSelected;
+
+    bool operator<(const CStakeModifierCandidate& other) const
+    {
+        return nTime < other.nTime || (nTime == other.nTime && hashBlock < other.hashBlock);
+    }
+};
+
+// select a block from the candidate blocks in vCandidates (sorted by
+// timestamp), excluding already selected blocks, and with timestamp up to
 // nSelectionIntervalStop.
-static bool SelectBlockFromCandidates(vector<pair<int64_t, uint256> >& vSortedByTimestamp, map<uint256, const CBlockIndex*>& mapSelectedBlocks,
-    int64_t nSelectionIntervalStop, uint64_t nStakeModifierPrev, const CBlockIndex** pindexSelected)
+static bool SelectBlockFromCandidates(vector<CStakeModifierCandidate>& vCandidates,
+    int64_t nSelectionIntervalStop, const CBlockIndex** pindexSelected)
 {
-    bool fSelected = false;
-    uint256 hashBest = 0;
+    CStakeModifierCandidate* pcandidateBest = NULL;
     *pindexSelected = (const CBlockIndex*) 0;
-    BOOST_FOREACH(const PAIRTYPE(int64_t, uint256)& item, vSortedByTimestamp)
+    BOOST_FOREACH(CStakeModifierCandidate& candidate, vCandidates)
     {
-        if (!mapBlockIndex.count(item.second))
-            return error("SelectBlockFromCandidates: failed to find block index for candidate block %s", item.second.ToString());
-        const CBlockIndex* pindex = mapBlockIndex[item.second];
-        if (fSelected && pindex->GetBlockTime() > nSelectionIntervalStop)
+        if (pcandidateBest && candidate.nTime > nSelectionIntervalStop)
             break;
-        if (mapSelectedBlocks.count(pindex->GetBlockHash()) > 0)
+        if (candidate.fSelected)
             continue;
-        // compute the selection hash by hashing its proof-hash and the
-        // previous proof-of-stake modifier
-        CDataStream ss(SER_GETHASH, 0);
-        ss << pindex->hashProof << nStakeModifierPrev;
-        uint256 hashSelection = Hash(ss.begin(), ss.end());
-        // the selection hash is divided by 2**32 so that proof-of-stake block
-        // is always favored over proof-of-work block. this is to preserve
-        // the energy efficiency property
-        if (pindex->IsProofOfStake())
-            hashSelection >>= 32;
-        if (fSelected && hashSelection < hashBest)
-        {
-            hashBest = hashSelection;
-            *pindexSelected = (const CBlockIndex*) pindex;
-        }
-        else if (!fSelected)
-        {
-            fSelected = true;
-            hashBest = hashSelection;
-            *pindexSelected = (const CBlockIndex*) pindex;
-        }
+        if (!pcandidateBest || candidate.hashSelection < pcandidateBest->hashSelection)
+            pcandidateBest = &candidate;
     }
-    LogPrint("stakemodifier", "SelectBlockFromCandidates: selection hash=%s\n", hashBest.ToString());
-    return fSelected;
+    if (!pcandidateBest)
+        return false;
+    LogPrint("stakemodifier", "SelectBlockFromCandidates: selection hash=%s\n", pcandidateBest->hashSelection.ToString());
+    pcandidateBest->fSelected = true;
+    *pindexSelected = pcandidateBest->pindex;
+    return true;
 }
 
 // Stake Modifier (hash modifier of proof-of-stake):
@@ -127,35 +125,50 @@ bool ComputeNextStakeModifier(const CBlockIndex* pindexPrev, uint64_t& nStakeMod
         return true;
 
     // Sort candidate blocks by timestamp
-    vector<pair<int64_t, uint256> > vSortedByTimestamp;
-    vSortedByTimestamp.reserve(64 * nModifierInterval / Params().TargetSpacing());
+    vector<CStakeModifierCandidate> vCandidates;
+    vCandidates.reserve(64 * nModifierInterval / Params().TargetSpacing());
     int64_t nSelectionInterval = GetStakeModifierSelectionInterval();
     int64_t nSelectionIntervalStart = (pindexPrev->GetBlockTime() / nModifierInterval) * nModifierInterval - nSelectionInterval;
     const CBlockIndex* pindex = pindexPrev;
     while (pindex && pindex->GetBlockTime() >= nSelectionIntervalStart)
     {
-        vSortedByTimestamp.push_back(make_pair(pindex->GetBlockTime(), pindex->GetBlockHash()));
+        CStakeModifierCandidate candidate;
+        candidate.nTime = pindex->GetBlockTime();
+        candidate.hashBlock = pindex->GetBlockHash();
+        candidate.pindex = pindex;
+        // compute the selection hash by hashing its proof-hash and the
+        // previous proof-of-stake modifier
+        CDataStream ss(SER_GETHASH, 0);
+        ss << pindex->hashProof << nStakeModifier;
+        candidate.hashSelection = Hash(ss.begin(), ss.end());
+        // the selection hash is divided by 2**32 so that proof-of-stake block
+        // is always favored over proof-of-work block. this is to preserve
+        // the energy efficiency property
+        if (pindex->IsProofOfStake())
+            candidate.hashSelection >>= 32;
+        candidate.fSelected = false;
+        vCandidates.push_back(candidate);
         pindex = pindex->pprev;
     }
     int nHeightFirstCandidate = pindex ? (pindex->nHeight + 1) : 0;
-    reverse(vSortedByTimestamp.begin(), vSortedByTimestamp.end());
-    sort(vSortedByTimestamp.begin(), vSortedByTimestamp.end());
+    reverse(vCandidates.begin(), vCandidates.end());
+    sort(vCandidates.begin(), vCandidates.end());
 
     // Select 64 blocks from candidate blocks to generate stake modifier
     uint64_t nStakeModifierNew = 0;
     int64_t nSelectionIntervalStop = nSelectionIntervalStart;
-    map<uint256, const CBlockIndex*> mapSelectedBlocks;
-    for (int nRound=0; nRound<min(64, (int)vSortedByTimestamp.size()); nRound++)
+    vector<const CBlockIndex*> vSelectedBlocks;
+    for (int nRound=0; nRound<min(64, (int)vCandidates.size()); nRound++)
     {
         // add an interval section to the current selection round
         nSelectionIntervalStop += GetStakeModifierSelectionIntervalSection(nRound);
         // select a block from the candidates of current round
-        if (!SelectBlockFromCandidates(vSortedByTimestamp, mapSelectedBlocks, nSelectionIntervalStop, nStakeModifier, &pindex))
+        if (!SelectBlockFromCandidates(vCandidates, nSelectionIntervalStop, &pindex))
             return error("ComputeNextStakeModifier: unable to select block at round %d", nRound);
         // write the entropy bit of the selected block
         nStakeModifierNew |= (((uint64_t)pindex->GetStakeEntropyBit()) << nRound);
         // add the selected block from candidates to selected list
-        mapSelectedBlocks.insert(make_pair(pindex->GetBlockHash(), pindex));
+        vSelectedBlocks.push_back(pindex);
         LogPrint("stakemodifier", "ComputeNextStakeModifier: selected round %d stop=%s height=%d bit=%d\n", nRound, DateTimeStrFormat(nSelectionIntervalStop), pindex->nHeight, pindex->GetStakeEntropyBit());
     }
 
@@ -173,11 +186,11 @@ bool ComputeNextStakeModifier(const CBlockIndex* pindexPrev, uint64_t& nStakeMod
                 strSelectionMap.replace(pindex->nHeight - nHeightFirstCandidate, 1, "=");
             pindex = pindex->pprev;
         }
-        BOOST_FOREACH(const PAIRTYPE(uint256, const CBlockIndex*)& item, mapSelectedBlocks)
+        BOOST_FOREACH(const CBlockIndex* pindexSelected, vSelectedBlocks)
         {
             // 'S' indicates selected proof-of-stake blocks
             // 'W' indicates selected proof-of-work blocks
-            strSelectionMap.replace(item.second->nHeight - nHeightFirstCandidate, 1, item.second->IsProofOfStake()? "S" : "W");
+            strSelectionMap.replace(pindexSelected->nHeight - nHeightFirstCandidate, 1, pindexSelected->IsProofOfStake()? "S" : "W");
         }
         LogPrintf("ComputeNextStakeModifier: selection height [%d, %d] map %s\n", nHeightFirstCandidate, pindexPrev->nHeight, strSelectionMap);
     }
@@ -330,3 +343,74 @@ bool CheckKernel(CBlockIndex* pindexPrev, unsigned int nBits, int64_t nTime, con
 
     return CheckStakeKernelHash(pindexPrev, nBits, block, txindex.pos.nTxPos - txindex.pos.nBlockPos, txPrev, prevout, nTime, hashProofOfStake, targetProofOfStake);
 }
+
+bool GetStakeKernelCandidate(CTxDB& txdb, const COutPoint& prevout, CStakeKernelCandidate& candidate)
+{
+    candidate.prevout = prevout;
+
+    CTxUnspent unspent;
+    if (txdb.ReadUnspent(prevout, unspent))
+    {
+        candidate.nTimeBlockFrom = unspent.nBlockTime;
+        candidate.nTimeTxPrev = unspent.nTime;
+        candidate.nValue = unspent.txout.nValue;
+        return true;
+    }
+
+    CTransaction txPrev;
+    CTxIndex txindex;
+    if (!txPrev.ReadFromDisk(txdb, prevout, txindex))
+        return false;
+
+    // Read block header
+    CBlock block;
+    if (!block.ReadFromDisk(txindex.pos.nFile, txindex.pos.nBlockPos, false))
+        return false;
+
+    candidate.nTimeBlockFrom = block.GetBlockTime();
+    candidate.nTimeTxPrev = txPrev.nTime;
+    candidate.nValue = txPrev.vout[prevout.n].nValue;
+    return true;
+}
+
+bool FindStakeKernel(uint64_t nStakeModifier, unsigned int nBits, const CStakeKernelCandidate& candidate, unsigned int nTimeTx, unsigned int nSearchInterval, unsigned int& nTimeRet)
+{
+    // Weighted target, as in CheckStakeKernelHash()
+    CBigNum bnTarget;
+    bnTarget.SetCompact(nBits);
+    bnTarget *= CBigNum(candidate.nValue);
+    if (bnTarget < 0)
+        return false;
+    // a target that doesn't fit 256 bits is met by any hash
+    bool fAnyHash = bnTarget >= (CBigNum(1) << 256);
+    uint256 hashTarget = bnTarget.getuint256();
+
+    // Same bytes as serializing
+    //   nStakeModifier << nTimeBlockFrom << nTimeTxPrev << prevout.hash << prevout.n << nTimeTx
+    // with only nTimeTx changing between attempts
+    unsigned char data[8 + 4 + 4 + 32 + 4 + 4];
+    unsigned char* p = data;
+    memcpy(p, &nStakeModifier, 8); p += 8;
+    memcpy(p, &candidate.nTimeBlockFrom, 4); p += 4;
+    memcpy(p, &candidate.nTimeTxPrev, 4); p += 4;
+    memcpy(p, candidate.prevout.hash.begin(), 32); p += 32;
+    memcpy(p, &candidate.prevout.n, 4); p += 4;
+    unsigned char* pTimeTx = p;
+
+    for (unsigned int n = 0; n < nSearchInterval; n++)
+    {
+        unsigned int nTime = nTimeTx - n;
+        if (nTime < candidate.nTimeTxPrev)  // Transaction timestamp violation
+            break;
+        if (candidate.nTimeBlockFrom + nStakeMinAge > nTime) // Min age requirement
+            break;
+
+        memcpy(pTimeTx, &nTime, 4);
+        if (fAnyHash || Hash(data, data + sizeof(data)) <= hashTarget)
+        {
+            nTimeRet = nTime;
+            return true;
+        }
+    }
+    return false;
+}
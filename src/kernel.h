@@ -39,4 +39,23 @@ int64_t GetWeight(int64_t nIntervalBeginning, int64_t nIntervalEnd);
 // Convenient for searching a kernel
 bool CheckKernel(CBlockIndex* pindexPrev, unsigned int nBits, int64_t nTime, const COutPoint& prevout, int64_t* pBlockTime = NULL);
 
+// Everything the kernel hash needs to know about a staked output,
+// so that searching for a kernel doesn't have to touch the disk
+struct CStakeKernelCandidate
+{
+    COutPoint prevout;
+    unsigned int nTimeBlockFrom;
+    unsigned int nTimeTxPrev;
+    int64_t nValue;
+};
+
+// Look up the kernel data of an output in the unspent output set,
+// falling back to the transaction index and block file
+bool GetStakeKernelCandidate(CTxDB& txdb, const COutPoint& prevout, CStakeKernelCandidate& candidate);
+
+// Search nSearchInterval timestamps back from nTimeTx for one at which the
+// candidate meets the kernel hash target; same result as calling
+// CheckKernel() for each of them
+bool FindStakeKernel(uint64_t nStakeModifier, unsigned int nBits, const CStakeKernelCandidate& candidate, unsigned int nTimeTx, unsigned int nSearchInterval, unsigned int& nTimeRet);
+
 #endif // PPCOIN_KERNEL_H
@@ -8,6 +8,7 @@
 #include <openssl/obj_mac.h>
 
 #include "key.h"
+#include "ecverify.h"
 
 
 // anonymous namespace with local implementation code (OpenSSL interaction)
@@ -512,6 +513,11 @@ bool CKey::Load(CPrivKey &privkey, CPubKey &vchPubKey, bool fSkipCheck=false) {
 bool CPubKey::Verify(const uint256 &hash, const std::vector<unsigned char>& vchSig) const {
     if (!IsValid())
         return false;
+    int ret = ECVerify(begin(), size(), (const unsigned char*)&hash,
+                       vchSig.empty() ? NULL : &vchSig[0], vchSig.size());
+    if (ret >= 0)
+        return ret == 1;
+    // Encodings the fast path doesn't handle are left to OpenSSL
     CECKey key;
     if (!key.SetPubKey(*this))
         return false;
@@ -698,6 +704,9 @@ bool ECC_InitSanityCheck() {
         return false;
     EC_KEY_free(pkey);
 
+    if (!ECVerifyInit())
+        return false;
+
     // TODO Is there more EC functionality that could be missing?
     return true;
 }
@@ -4,14 +4,21 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include <boost/algorithm/string/replace.hpp>
+#include <boost/bind.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
 #include <boost/lexical_cast.hpp>
 #include <cmath>
+#include <deque>
+
+#ifndef WIN32
+#include <sys/mman.h>
+#endif
 
 #include "alert.h"
 #include "chainparams.h"
 #include "checkpoints.h"
+#include "checkqueue.h"
 #include "db.h"
 #include "init.h"
 #include "kernel.h"
@@ -59,6 +66,8 @@ int64_t nTimeBestReceived = 0;
 bool fImporting = false;
 bool fReindex = false;
 bool fHaveGUI = false;
+bool fHeadersFirst = true;
+int nScriptCheckThreads = 0;
 
 struct COrphanBlock {
     uint256 hashBlock;
@@ -147,16 +156,20 @@ void ResendWalletTransactions(bool fForce) {
 // Registration of network node signals.
 //
 
+void static FinalizeNode(CNode* pnode);
+
 void RegisterNodeSignals(CNodeSignals& nodeSignals)
 {
     nodeSignals.ProcessMessages.connect(&ProcessMessages);
     nodeSignals.SendMessages.connect(&SendMessages);
+    nodeSignals.FinalizeNode.connect(&FinalizeNode);
 }
 
 void UnregisterNodeSignals(CNodeSignals& nodeSignals)
 {
     nodeSignals.ProcessMessages.disconnect(&ProcessMessages);
     nodeSignals.SendMessages.disconnect(&SendMessages);
+    nodeSignals.FinalizeNode.disconnect(&FinalizeNode);
 }
 
 
@@ -605,7 +618,7 @@ int64_t GetMinFee(const CTransaction& tx, unsigned int nBlockSize, enum GetMinFe
 
 
 bool AcceptToMemoryPool(CTxMemPool& pool, CTransaction &tx, bool fLimitFree,
-                        bool* pfMissingInputs)
+                        bool* pfMissingInputs, int64_t nAcceptTime)
 {
     AssertLockHeld(cs_main);
     if (pfMissingInputs)
@@ -647,6 +660,7 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CTransaction &tx, bool fLimitFree,
     }
     }
 
+    CTxMemPoolEntry entry;
     {
         CTxDB txdb("r");
 
@@ -685,6 +699,26 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CTransaction &tx, bool fLimitFree,
         int64_t nFees = tx.GetValueIn(mapInputs)-tx.GetValueOut();
         unsigned int nSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
 
+        // Priority is sum(valuein * age) / txsize over the inputs that are
+        // already in the chain; inputs from the pool don't count
+        double dPriority = 0;
+        int64_t nValueInChain = 0;
+        BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        {
+            if (pool.exists(txin.prevout.hash))
+                continue;
+            int64_t nValueIn = tx.GetOutputFor(txin, mapInputs).nValue;
+            int nConf;
+            CTxUnspent unspent;
+            if (txdb.ReadUnspent(txin.prevout, unspent))
+                nConf = nBestHeight - unspent.nHeight + 1;
+            else
+                nConf = mapInputs[txin.prevout.hash].first.GetDepthInMainChain();
+            nValueInChain += nValueIn;
+            dPriority += (double)nValueIn * nConf;
+        }
+        entry = CTxMemPoolEntry(tx, nFees, nSigOps, nAcceptTime ? nAcceptTime : GetTime(), dPriority / nSize, nBestHeight, nValueInChain);
+
         // Don't accept it if it can't get into a block
         int64_t txMinFee = GetMinFee(tx, 1000, GMF_RELAY, nSize);
         if ((fLimitFree && nFees < txMinFee) || (!fLimitFree && nFees < MIN_TX_FEE))
@@ -692,6 +726,16 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CTransaction &tx, bool fLimitFree,
                          hash.ToString(),
                          nFees, txMinFee);
 
+        // After evictions the pool asks for more than the relay fee for a while
+        if (fLimitFree)
+        {
+            int64_t nPoolMinFee = pool.GetRollingMinFee(nSize);
+            if (nFees < nPoolMinFee)
+                return error("AcceptToMemoryPool : mempool min fee not met %s, %d < %d",
+                             hash.ToString(),
+                             nFees, nPoolMinFee);
+        }
+
         // Continuously rate-limit free transactions
         // This mitigates 'penny-flooding' -- sending thousands of free transactions just to
         // be annoying or make others' transactions take longer to confirm.
@@ -738,7 +782,13 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CTransaction &tx, bool fLimitFree,
     }
 
     // Store transaction in memory
-    pool.addUnchecked(hash, tx);
+    pool.addUnchecked(hash, entry);
+
+    // Keep the pool within -maxmempool; that can throw out this transaction
+    // right away when everything else pays more
+    pool.TrimToSize(GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000);
+    if (!pool.exists(hash))
+        return error("AcceptToMemoryPool : mempool full, %s not accepted", hash.ToString());
 
     SyncWithWallets(tx, NULL);
 
@@ -1057,31 +1107,50 @@ bool GetProofOfStakeReward(CTransaction& tx, CTxDB& txdb, int64_t nFees, int64_t
         goto coinbase_skip;
 
     BOOST_FOREACH(const CTxIn& txin, tx.vin) {
-    	// First try finding the previous transaction in database
-        CTransaction txPrev;
-        CTxIndex txindex;
-        if (!txPrev.ReadFromDisk(txdb, txin.prevout, txindex))
-            continue;  // previous transaction not in main chain
-        if (t < txPrev.nTime) {
-        	LogPrintf("CreateCoinStake : failed to calculate coin age, transaction timestamp violation\n");
-            return false;
-        }
+        int64_t nValuePrev;
+        unsigned int nTimePrev;
+        int64_t nBlockTimePrev;
+
+        // First try the unspent output set, it has everything we need
+        CTxUnspent unspent;
+        if (txdb.ReadUnspent(txin.prevout, unspent)) {
+            if (t < unspent.nTime) {
+                LogPrintf("CreateCoinStake : failed to calculate coin age, transaction timestamp violation\n");
+                return false;
+            }
+            nValuePrev = unspent.txout.nValue;
+            nTimePrev = unspent.nTime;
+            nBlockTimePrev = unspent.nBlockTime;
+        } else {
+            // Then try finding the previous transaction in database
+            CTransaction txPrev;
+            CTxIndex txindex;
+            if (!txPrev.ReadFromDisk(txdb, txin.prevout, txindex))
+                continue;  // previous transaction not in main chain
+            if (t < txPrev.nTime) {
+                LogPrintf("CreateCoinStake : failed to calculate coin age, transaction timestamp violation\n");
+                return false;
+            }
 
-        // Read block header
-        CBlock block;
-        if (!block.ReadFromDisk(txindex.pos.nFile, txindex.pos.nBlockPos, false)) {
-            LogPrintf("CreateCoinStake : unable to read block of previous transaction\n");
-            return false;
+            // Read block header
+            CBlock block;
+            if (!block.ReadFromDisk(txindex.pos.nFile, txindex.pos.nBlockPos, false)) {
+                LogPrintf("CreateCoinStake : unable to read block of previous transaction\n");
+                return false;
+            }
+            nValuePrev = txPrev.vout[txin.prevout.n].nValue;
+            nTimePrev = txPrev.nTime;
+            nBlockTimePrev = block.GetBlockTime();
         }
-        if (block.GetBlockTime() + nStakeMinAge > t)
+        if (nBlockTimePrev + nStakeMinAge > t)
             continue; // only count coins meeting min age requirement
 
-        Coins = txPrev.vout[txin.prevout.n].nValue;
-        Age = (t-txPrev.nTime);
+        Coins = nValuePrev;
+        Age = (t-nTimePrev);
         bnCentSecond += Coins * Age / CENT;
         Coins /= COIN;
         nSubsidyFactually += CoinCCInterest(Coins, Rate, Age/(365.25L * 24.0L * 3600.0L));
-        LogPrintf("COINage coin*age Coins=%s nTimeDiff=%d bnCentSecond=%s Age=%d AgeOverYearSeconds=%d SubsidyFactually=%s Rate=%d\n", Coins.ToString(), t - txPrev.nTime, bnCentSecond.ToString(), Age, Age/(365.25 * 24 * 3600), nSubsidyFactually.ToString(), Rate);
+        LogPrintf("COINage coin*age Coins=%s nTimeDiff=%d bnCentSecond=%s Age=%d AgeOverYearSeconds=%d SubsidyFactually=%s Rate=%d\n", Coins.ToString(), t - nTimePrev, bnCentSecond.ToString(), Age, Age/(365.25 * 24 * 3600), nSubsidyFactually.ToString(), Rate);
     }
 
     bnCoinDay = bnCentSecond * CENT / COIN / (24 * 60 * 60);
@@ -1237,9 +1306,28 @@ bool CTransaction::DisconnectInputs(CTxDB& txdb)
             // Write back
             if (!txdb.UpdateTxIndex(prevout.hash, txindex))
                 return error("DisconnectInputs() : UpdateTxIndex failed");
+
+            // Return the output to the unspent output set
+            CTransaction txPrev;
+            CBlock blockPrev;
+            if (!txPrev.ReadFromDisk(txindex.pos) || prevout.n >= txPrev.vout.size())
+                return error("DisconnectInputs() : ReadFromDisk prev tx failed");
+            if (!blockPrev.ReadFromDisk(txindex.pos.nFile, txindex.pos.nBlockPos, false))
+                return error("DisconnectInputs() : ReadFromDisk prev block failed");
+            map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(blockPrev.GetHash());
+            if (mi == mapBlockIndex.end())
+                return error("DisconnectInputs() : prev block not in index");
+            if (!txPrev.vout[prevout.n].IsEmpty() && !txdb.WriteUnspent(prevout, CTxUnspent(txPrev, prevout.n, mi->second->nHeight, mi->second->nTime)))
+                return error("DisconnectInputs() : WriteUnspent failed");
         }
     }
 
+    // Remove this transaction's outputs from the unspent output set
+    uint256 hash = GetHash();
+    for (unsigned int i = 0; i < vout.size(); i++)
+        if (!txdb.EraseUnspent(COutPoint(hash, i)))
+            return error("DisconnectInputs() : EraseUnspent failed");
+
     // Remove transaction from index
     // This can fail if a duplicate of this transaction was in a chain that got
     // reorganized away. This is only possible if this transaction was completely
@@ -1250,6 +1338,38 @@ bool CTransaction::DisconnectInputs(CTxDB& txdb)
 }
 
 
+// Fill txPrev with the outputs of hashPrev that tx spends, taken from the
+// unspent output set. The other outputs are left null, so txPrev has the
+// shape, nTime and coinbase/coinstake kind of the real transaction, but not
+// its hash. Returns false if any of the outputs is not in the set.
+static bool FetchUnspentPrev(CTxDB& txdb, const CTransaction& tx, const uint256& hashPrev, const CTxIndex& txindex, CTransaction& txPrev)
+{
+    txPrev.SetNull();
+    txPrev.vout.resize(txindex.vSpent.size());
+    unsigned char nFlags = 0;
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+    {
+        if (txin.prevout.hash != hashPrev)
+            continue;
+        if (txin.prevout.n >= txPrev.vout.size())
+            return false;
+        CTxUnspent unspent;
+        if (!txdb.ReadUnspent(txin.prevout, unspent))
+            return false;
+        txPrev.vout[txin.prevout.n] = unspent.txout;
+        txPrev.nTime = unspent.nTime;
+        nFlags = unspent.nFlags;
+    }
+
+    if (nFlags & CTxUnspent::UNSPENT_COINBASE)
+        txPrev.vin.push_back(CTxIn());
+    else
+        txPrev.vin.push_back(CTxIn(COutPoint(0, 0)));
+    if (nFlags & CTxUnspent::UNSPENT_COINSTAKE)
+        txPrev.vout[0].SetEmpty();
+    return true;
+}
+
 bool CTransaction::FetchInputs(CTxDB& txdb, const map<uint256, CTxIndex>& mapTestPool,
                                bool fBlock, bool fMiner, MapPrevTx& inputsRet, bool& fInvalid)
 {
@@ -1296,8 +1416,9 @@ bool CTransaction::FetchInputs(CTxDB& txdb, const map<uint256, CTxIndex>& mapTes
         }
         else
         {
-            // Get prev tx from disk
-            if (!txPrev.ReadFromDisk(txindex.pos))
+            // Get the spent outputs from the unspent output set, or the
+            // whole prev tx from disk if any of them is not in there
+            if (!FetchUnspentPrev(txdb, *this, prevout.hash, txindex, txPrev) && !txPrev.ReadFromDisk(txindex.pos))
                 return error("FetchInputs() : %s ReadFromDisk prev tx %s failed", GetHash().ToString(),  prevout.hash.ToString());
         }
     }
@@ -1348,8 +1469,24 @@ int64_t CTransaction::GetValueIn(const MapPrevTx& inputs) const
 
 }
 
+bool CScriptCheck::operator()() const
+{
+    const CScript &scriptSig = ptxTo->vin[nIn].scriptSig;
+    if (!VerifyScript(scriptSig, scriptPubKey, *ptxTo, nIn, nFlags, nHashType))
+        return error("CScriptCheck() : %s VerifySignature failed on input %u", ptxTo->GetHash().ToString(), nIn);
+    return true;
+}
+
+static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
+
+void ThreadScriptCheck()
+{
+    RenameThread("Ember-scriptch");
+    scriptcheckqueue.Thread();
+}
+
 bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs, map<uint256, CTxIndex>& mapTestPool, const CDiskTxPos& posThisTx,
-    const CBlockIndex* pindexBlock, bool fBlock, bool fMiner, unsigned int flags)
+    const CBlockIndex* pindexBlock, bool fBlock, bool fMiner, unsigned int flags, std::vector<CScriptCheck> *pvChecks)
 {
     // Take over previous transactions' spent pointers
     // fBlock is true when this is called from AcceptBlock when a new best-block is added to the blockchain
@@ -1406,8 +1543,16 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs, map<uint256, CTx
             // still computed and checked, and any change will be caught at the next checkpoint.
             if (!(fBlock && (nBestHeight < Checkpoints::GetTotalBlocksEstimate())))
             {
-                // Verify signature
-                if (!VerifySignature(txPrev, *this, i, flags, 0))
+                // Verify signature. txPrev may hold only the outputs we spend
+                // (see FetchInputs), so check the script directly rather than
+                // through VerifySignature, which also compares txPrev's hash.
+                const CScript& scriptPubKey = txPrev.vout[prevout.n].scriptPubKey;
+                if (pvChecks)
+                {
+                    // Deferred to the caller, which runs them in parallel
+                    pvChecks->push_back(CScriptCheck(scriptPubKey, *this, i, flags, 0));
+                }
+                else if (!VerifyScript(vin[i].scriptSig, scriptPubKey, *this, i, flags, 0))
                 {
                     if (flags & STANDARD_NOT_MANDATORY_VERIFY_FLAGS) {
                         // Check whether the failure was caused by a
@@ -1416,7 +1561,7 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs, map<uint256, CTx
                         // if so, don't trigger DoS protection to
                         // avoid splitting the network between upgraded and
                         // non-upgraded nodes.
-                        if (VerifySignature(txPrev, *this, i, flags & ~STANDARD_NOT_MANDATORY_VERIFY_FLAGS, 0))
+                        if (VerifyScript(vin[i].scriptSig, scriptPubKey, *this, i, flags & ~STANDARD_NOT_MANDATORY_VERIFY_FLAGS, 0))
                             return error("ConnectInputs() : %s non-mandatory VerifySignature failed", GetHash().ToString());
                     }
                     // Failures of other flags indicate a transaction that is
@@ -1466,10 +1611,35 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs, map<uint256, CTx
 
 bool CBlock::DisconnectBlock(CTxDB& txdb, CBlockIndex* pindex)
 {
-    // Disconnect in reverse order
-    for (int i = vtx.size()-1; i >= 0; i--)
-        if (!vtx[i].DisconnectInputs(txdb))
-            return false;
+    CBlockUndo undo;
+    if (txdb.ReadBlockUndo(pindex->GetBlockHash(), undo))
+    {
+        // Remove the block's own transactions, then put back what it spent
+        for (int i = vtx.size()-1; i >= 0; i--)
+        {
+            uint256 hash = vtx[i].GetHash();
+            for (unsigned int n = 0; n < vtx[i].vout.size(); n++)
+                if (!txdb.EraseUnspent(COutPoint(hash, n)))
+                    return error("DisconnectBlock() : EraseUnspent failed");
+            txdb.EraseTxIndex(vtx[i]);
+        }
+        for (unsigned int i = 0; i < undo.vPrevTxIndex.size(); i++)
+            if (!txdb.UpdateTxIndex(undo.vPrevTxIndex[i].first, undo.vPrevTxIndex[i].second))
+                return error("DisconnectBlock() : UpdateTxIndex failed");
+        for (unsigned int i = 0; i < undo.vSpentOutputs.size(); i++)
+            if (!txdb.WriteUnspent(undo.vSpentOutputs[i].first, undo.vSpentOutputs[i].second))
+                return error("DisconnectBlock() : WriteUnspent failed");
+        if (!txdb.EraseBlockUndo(pindex->GetBlockHash()))
+            return error("DisconnectBlock() : EraseBlockUndo failed");
+    }
+    else
+    {
+        // Blocks connected before undo records, or deeper than they are
+        // kept: disconnect in reverse order
+        for (int i = vtx.size()-1; i >= 0; i--)
+            if (!vtx[i].DisconnectInputs(txdb))
+                return false;
+    }
 
     // Update block index on disk without changing it in memory.
     // The memory index structure will be changed after the db commits.
@@ -1491,7 +1661,7 @@ bool CBlock::DisconnectBlock(CTxDB& txdb, CBlockIndex* pindex)
 bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
 {
     // Check it again in case a previous version let a bad block in, but skip BlockSig checking
-    if (!CheckBlock(!fJustCheck, !fJustCheck, false))
+    if (!CheckBlock(!fJustCheck, !fJustCheck, false, pindex->phashBlock))
         return false;
 
     unsigned int flags = SCRIPT_VERIFY_NOCACHE;
@@ -1505,7 +1675,12 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
     else
         nTxPos = pindex->nBlockPos + ::GetSerializeSize(CBlock(), SER_DISK, CLIENT_VERSION) - (2 * GetSizeOfCompactSize(0)) + GetSizeOfCompactSize(vtx.size());
 
+    // Script checks are handed to the -par worker threads while the rest of
+    // the block is processed, and all have to pass before anything is written
+    CCheckQueueControl<CScriptCheck> control(nScriptCheckThreads ? &scriptcheckqueue : NULL);
+
     map<uint256, CTxIndex> mapQueuedChanges;
+    CBlockUndo undo;
     int64_t nFees = 0;
     int64_t nValueIn = 0;
     int64_t nValueOut = 0;
@@ -1574,8 +1749,20 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
                 nNewStakeReward = CBigNum(nTxValueOut) - CBigNum(nTxValueIn);
             }
 
-            if (!tx.ConnectInputs(txdb, mapInputs, mapQueuedChanges, posThisTx, pindex, true, false, flags))
+            // Remember the index entries of earlier transactions as they were
+            // before this block spent from them. Anything already queued was
+            // either created in this block or remembered for an earlier input.
+            if (!fJustCheck)
+            {
+                for (MapPrevTx::const_iterator mi = mapInputs.begin(); mi != mapInputs.end(); ++mi)
+                    if (!mapQueuedChanges.count(mi->first))
+                        undo.vPrevTxIndex.push_back(make_pair(mi->first, mi->second.first));
+            }
+
+            std::vector<CScriptCheck> vChecks;
+            if (!tx.ConnectInputs(txdb, mapInputs, mapQueuedChanges, posThisTx, pindex, true, false, flags, nScriptCheckThreads ? &vChecks : NULL))
                 return false;
+            control.Add(vChecks);
         }
 
         mapQueuedChanges[hashTx] = CTxIndex(posThisTx, tx.vout.size());
@@ -1665,6 +1852,9 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
         }
     }
 
+    if (!control.Wait())
+        return DoS(100, error("ConnectBlock() : script verification failed"));
+
     if (!txdb.WriteBlockIndex(CDiskBlockIndex(pindex)))
         return error("Connect() : WriteBlockIndex for pindex failed");
 
@@ -1678,6 +1868,36 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
             return error("ConnectBlock() : UpdateTxIndex failed");
     }
 
+    // Update the unspent output set, in block order so that outputs created
+    // and spent within this block cancel out
+    set<uint256> setBlockTx;
+    BOOST_FOREACH(const CTransaction& tx, vtx)
+    {
+        if (!tx.IsCoinBase())
+        {
+            BOOST_FOREACH(const CTxIn& txin, tx.vin)
+            {
+                CTxUnspent unspent;
+                if (!setBlockTx.count(txin.prevout.hash) && txdb.ReadUnspent(txin.prevout, unspent))
+                    undo.vSpentOutputs.push_back(make_pair(txin.prevout, unspent));
+                if (!txdb.EraseUnspent(txin.prevout))
+                    return error("ConnectBlock() : EraseUnspent failed");
+            }
+        }
+        if (!txdb.AddUnspent(tx, pindex))
+            return error("ConnectBlock() : AddUnspent failed");
+        setBlockTx.insert(tx.GetHash());
+    }
+
+    // Keep the undo record, and drop the one that just got too deep to be needed
+    if (!txdb.WriteBlockUndo(pindex->GetBlockHash(), undo))
+        return error("ConnectBlock() : WriteBlockUndo failed");
+    const CBlockIndex* pindexExpired = pindex;
+    for (int i = 0; pindexExpired && i < BLOCK_UNDO_DEPTH; i++)
+        pindexExpired = pindexExpired->pprev;
+    if (pindexExpired)
+        txdb.EraseBlockUndo(pindexExpired->GetBlockHash());
+
     // Update block index on disk without changing it in memory.
     // The memory index structure will be changed after the db commits.
     if (pindex->pprev)
@@ -1695,7 +1915,9 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
     return true;
 }
 
-bool static Reorganize(CTxDB& txdb, CBlockIndex* pindexNew)
+// Switch the best chain to pindexNew within the open txdb transaction.
+// pblockNew is the block of pindexNew if the caller has it at hand.
+bool static Reorganize(CTxDB& txdb, CBlockIndex* pindexNew, const CBlock* pblockNew = NULL)
 {
     LogPrintf("REORGANIZE\n");
 
@@ -1751,7 +1973,9 @@ bool static Reorganize(CTxDB& txdb, CBlockIndex* pindexNew)
     {
         CBlockIndex* pindex = vConnect[i];
         CBlock block;
-        if (!block.ReadFromDisk(pindex))
+        if (pindex == pindexNew && pblockNew)
+            block = *pblockNew;
+        else if (!block.ReadFromDisk(pindex))
             return error("Reorganize() : ReadFromDisk for connect failed");
         if (!block.ConnectBlock(txdb, pindex))
         {
@@ -1799,7 +2023,7 @@ bool static Reorganize(CTxDB& txdb, CBlockIndex* pindexNew)
 // Called from inside SetBestChain: attaches a block to the new best chain being built
 bool CBlock::SetBestChainInner(CTxDB& txdb, CBlockIndex *pindexNew)
 {
-    uint256 hash = GetHash();
+    uint256 hash = pindexNew->GetBlockHash();
 
     // Adding to current best branch
     if (!ConnectBlock(txdb, pindexNew) || !txdb.WriteHashBestChain(hash))
@@ -1823,7 +2047,7 @@ bool CBlock::SetBestChainInner(CTxDB& txdb, CBlockIndex *pindexNew)
 
 bool CBlock::SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew)
 {
-    uint256 hash = GetHash();
+    uint256 hash = pindexNew->GetBlockHash();
 
     if (!txdb.TxnBegin())
         return error("SetBestChain() : TxnBegin failed");
@@ -1860,7 +2084,7 @@ bool CBlock::SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew)
             LogPrintf("Postponing %u reconnects\n", vpindexSecondary.size());
 
         // Switch to new best branch
-        if (!Reorganize(txdb, pindexIntermediate))
+        if (!Reorganize(txdb, pindexIntermediate, pindexIntermediate == pindexNew ? this : NULL))
         {
             txdb.TxnAbort();
             InvalidChainFound(pindexNew);
@@ -1937,15 +2161,23 @@ bool CBlock::SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew)
         boost::thread t(runCommand, strCmd); // thread runs free
     }
 
+    // Refresh the block index snapshot now and then, so the deltas replayed
+    // on top of it at startup stay few
+    static int64_t nLastBlockIndexSnapshot = GetTime();
+    if (!fIsInitialDownload && GetTime() - nLastBlockIndexSnapshot > BLOCK_INDEX_SNAPSHOT_INTERVAL)
+    {
+        nLastBlockIndexSnapshot = GetTime();
+        txdb.WriteBlockIndexSnapshot();
+    }
+
     return true;
 }
 
-bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos, const uint256& hashProof)
+bool CBlock::AddToBlockIndex(const uint256& hash, unsigned int nFile, unsigned int nBlockPos, const uint256& hashProof)
 {
     AssertLockHeld(cs_main);
 
     // Check for duplicate
-    uint256 hash = GetHash();
     if (mapBlockIndex.count(hash))
         return error("AddToBlockIndex() : %s already exists", hash.ToString());
 
@@ -1965,7 +2197,7 @@ bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos, const u
     pindexNew->nChainTrust = (pindexNew->pprev ? pindexNew->pprev->nChainTrust : 0) + pindexNew->GetBlockTrust();
 
     // ppcoin: compute stake entropy bit for stake modifier
-    if (!pindexNew->SetStakeEntropyBit(GetStakeEntropyBit()))
+    if (!pindexNew->SetStakeEntropyBit(GetStakeEntropyBit(hash)))
         return error("AddToBlockIndex() : SetStakeEntropyBit() failed");
 
     // Record proof hash value
@@ -2011,7 +2243,7 @@ bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos, const u
 
 
 
-bool CBlock::CheckBlock(bool fCheckPOW, bool fCheckMerkleRoot, bool fCheckSig) const
+bool CBlock::CheckBlock(bool fCheckPOW, bool fCheckMerkleRoot, bool fCheckSig, const uint256* phash) const
 {
     // These are checks that are independent of context
     // that can be verified before saving an orphan block.
@@ -2021,7 +2253,7 @@ bool CBlock::CheckBlock(bool fCheckPOW, bool fCheckMerkleRoot, bool fCheckSig) c
         return DoS(100, error("CheckBlock() : size limits failed"));
 
     // Check proof of work matches claimed amount
-    if (fCheckPOW && IsProofOfWork() && !CheckProofOfWork(GetHash(), nBits))
+    if (fCheckPOW && IsProofOfWork() && !CheckProofOfWork(phash ? *phash : GetHash(), nBits))
         return DoS(50, error("CheckBlock() : proof of work failed"));
 
     // Check timestamp
@@ -2086,11 +2318,10 @@ bool CBlock::CheckBlock(bool fCheckPOW, bool fCheckMerkleRoot, bool fCheckSig) c
     if (fCheckMerkleRoot && hashMerkleRoot != BuildMerkleTree())
         return DoS(100, error("CheckBlock() : hashMerkleRoot mismatch"));
 
-
     return true;
 }
 
-bool CBlock::AcceptBlock()
+bool CBlock::AcceptBlock(const uint256& hash)
 {
     AssertLockHeld(cs_main);
 
@@ -2098,7 +2329,6 @@ bool CBlock::AcceptBlock()
         return DoS(100, error("AcceptBlock() : reject unknown block version %d", nVersion));
 
     // Check for duplicate
-    uint256 hash = GetHash();
     if (mapBlockIndex.count(hash))
         return error("AcceptBlock() : block already in mapBlockIndex");
 
@@ -2158,7 +2388,7 @@ bool CBlock::AcceptBlock()
     // PoW is checked in CheckBlock()
     if (IsProofOfWork())
     {
-        hashProof = GetHash();
+        hashProof = hash;
     }
 
     bool cpSatisfies = Checkpoints::CheckSync(hash, pindexPrev);
@@ -2183,17 +2413,42 @@ bool CBlock::AcceptBlock()
     unsigned int nBlockPos = 0;
     if (!WriteToDisk(nFile, nBlockPos))
         return error("AcceptBlock() : WriteToDisk failed");
-    if (!AddToBlockIndex(nFile, nBlockPos, hashProof))
+    if (!AddToBlockIndex(hash, nFile, nBlockPos, hashProof))
         return error("AcceptBlock() : AddToBlockIndex failed");
 
     // Relay inventory, but don't relay old inventory during initial block download
     int nBlockEstimate = Checkpoints::GetTotalBlocksEstimate();
     if (hashBestChain == hash)
     {
+        // Peers that understand compact blocks get the block straight away,
+        // the others an inv to ask for it
+        CInv inv(MSG_BLOCK, hash);
+        bool fCompact = !IsInitialBlockDownload();
+        CCompactBlock cmpctblock;
+        bool fHaveCompact = false;
         LOCK(cs_vNodes);
         BOOST_FOREACH(CNode* pnode, vNodes)
-            if (nBestHeight > (pnode->nStartingHeight != -1 ? pnode->nStartingHeight - 2000 : nBlockEstimate))
-                pnode->PushInventory(CInv(MSG_BLOCK, hash));
+        {
+            if (nBestHeight <= (pnode->nStartingHeight != -1 ? pnode->nStartingHeight - 2000 : nBlockEstimate))
+                continue;
+            if (!fCompact || !pnode->fCompactBlocks)
+            {
+                pnode->PushInventory(inv);
+                continue;
+            }
+            {
+                LOCK(pnode->cs_inventory);
+                if (pnode->filterInventoryKnown.contains(inv.hash))
+                    continue;
+                pnode->filterInventoryKnown.insert(inv.hash);
+            }
+            if (!fHaveCompact)
+            {
+                cmpctblock = CCompactBlock(*this);
+                fHaveCompact = true;
+            }
+            pnode->PushMessage("cmpctblock", cmpctblock);
+        }
     }
 
     // ppcoin: check pending sync-checkpoint
@@ -2236,144 +2491,631 @@ void PushGetBlocks(CNode* pnode, CBlockIndex* pindexBegin, uint256 hashEnd)
     pnode->PushMessage("getblocks", CBlockLocator(pindexBegin), hashEnd);
 }
 
-bool static ReserealizeBlockSignature(CBlock* pblock)
+//////////////////////////////////////////////////////////////////////////////
+//
+// Headers-first synchronization
+//
+// During initial block download the header chain up to the last hardened
+// checkpoint is fetched first. Block bodies along it are then requested
+// from every suitable peer, at most BLOCK_DOWNLOAD_WINDOW blocks ahead of
+// the best block, instead of walking getblocks/inv against a single peer.
+// Past the last checkpoint sync goes on with getblocks.
+//
+// Most of what makes a block valid can't be checked from its header, so a
+// header chain is only followed as far as the hardened checkpoints vouch
+// for it: the best header only ever moves to a header at a checkpoint, and
+// the headers below it are tied to that checkpoint by their hash links.
+//
+
+// Header of a block we don't have yet, received through "headers"
+struct CHeaderIndex
 {
-    if (pblock->IsProofOfWork()) {
-        pblock->vchBlockSig.clear();
-        return true;
-    }
+    uint256 hashPrev;
+    int nHeight;
+    unsigned int nTime;
+    CNode* pfrom; // peer that sent it, NULL once disconnected
+};
+static map<uint256, CHeaderIndex> mapHeaderIndex;
 
-    return CKey::ReserealizeSignature(pblock->vchBlockSig);
+// Tip of the header chain, always at a hardened checkpoint
+static uint256 hashBestHeader = 0;
+static int nBestHeaderHeight = -1;
+
+// Blocks along the best header chain that are not stored yet, lowest first
+static deque<uint256> vHeaderDownload;
+
+// Blocks requested along the header chain: hash -> (peer, request time)
+static map<uint256, pair<CNode*, int64_t> > mapBlocksInFlight;
+
+// Chain progress, for detecting a header chain that can't be downloaded
+static int nLastProgressHeight = -1;
+static int64_t nLastProgressTime = 0;
+
+static bool IsHeadersFirstSyncing()
+{
+    return fHeadersFirst && (!vHeaderDownload.empty() || nBestHeight < Checkpoints::GetTotalBlocksEstimate());
 }
 
-bool static IsCanonicalBlockSignature(CBlock* pblock)
+// Look up height and time of a header or stored block
+static bool LookupHeader(const uint256& hash, int& nHeight, unsigned int& nTime)
 {
-    if (pblock->IsProofOfWork()) {
-        return pblock->vchBlockSig.empty();
+    map<uint256, CHeaderIndex>::iterator mi = mapHeaderIndex.find(hash);
+    if (mi != mapHeaderIndex.end())
+    {
+        nHeight = mi->second.nHeight;
+        nTime = mi->second.nTime;
+        return true;
     }
-
-    return IsDERSignature(pblock->vchBlockSig, false);
+    map<uint256, CBlockIndex*>::iterator bi = mapBlockIndex.find(hash);
+    if (bi != mapBlockIndex.end())
+    {
+        nHeight = bi->second->nHeight;
+        nTime = bi->second->nTime;
+        return true;
+    }
+    return false;
 }
 
-bool ProcessBlock(CNode* pfrom, CBlock* pblock)
+// Context checks for a header whose block we don't have yet. Whether a
+// block is proof-of-stake can't be told from its header, so proof-of-work
+// is only checked below StartPoSBlock; blocks fetched along the header
+// chain get the full checks in ProcessBlock.
+static bool AcceptBlockHeader(CNode* pfrom, const CBlock& header, const uint256& hash, bool& fNewBest)
 {
-    AssertLockHeld(cs_main);
+    int nHeight;
+    unsigned int nTime;
+    if (LookupHeader(hash, nHeight, nTime))
+    {
+        pfrom->nBestHeaderHeight = std::max(pfrom->nBestHeaderHeight, nHeight);
+        pfrom->hashLastHeader = hash;
+        return true;
+    }
 
-    // Check for duplicate
-    uint256 hash = pblock->GetHash();
-    if (mapBlockIndex.count(hash))
-        return error("ProcessBlock() : already have block %d %s", mapBlockIndex[hash]->nHeight, hash.ToString());
-    if (mapOrphanBlocks.count(hash))
-        return error("ProcessBlock() : already have block (orphan) %s", hash.ToString());
+    if (!LookupHeader(header.hashPrevBlock, nHeight, nTime))
+    {
+        pfrom->Misbehaving(10);
+        return error("AcceptBlockHeader() : prev block %s not found", header.hashPrevBlock.ToString());
+    }
+    nHeight++;
 
-    // ppcoin: check proof-of-stake
-    // Limited duplicity on stake: prevents block flood attack
-    // Duplicate stake allowed only when there is orphan child block
-    if (!TestNet() && pblock->IsProofOfStake() && setStakeSeen.count(pblock->GetProofOfStake()) && !mapOrphanBlocksByPrev.count(hash) && !Checkpoints::WantedByPendingSyncCheckpoint(hash))
-        return error("ProcessBlock() : duplicate proof-of-stake (%s, %d) for block %s", pblock->GetProofOfStake().first.ToString(), pblock->GetProofOfStake().second, hash.ToString());
+    // Nothing past the last checkpoint could become the best header, and
+    // everything at or below the best header is fixed by its checkpoint
+    if (nHeight > Checkpoints::GetTotalBlocksEstimate() || nHeight <= nBestHeaderHeight)
+    {
+        LogPrint("net", "AcceptBlockHeader() : ignoring header %s at %d off the checkpointed chain\n", hash.ToString(), nHeight);
+        return false;
+    }
 
-    CBlockIndex* pcheckpoint = Checkpoints::GetLastSyncCheckpoint();
-    if (pcheckpoint && pblock->hashPrevBlock != hashBestChain && !Checkpoints::WantedByPendingSyncCheckpoint(hash))
+    if (header.nVersion != CBlock::CURRENT_VERSION)
     {
-        // Extra checks to prevent "fill up memory by spamming with bogus blocks"
-        int64_t deltaTime = pblock->GetBlockTime() - pcheckpoint->nTime;
-        if (deltaTime < 0)
-        {
-            if (pfrom)
-                pfrom->Misbehaving(1);
-            return error("ProcessBlock() : block with timestamp before last checkpoint");
-        }
+        pfrom->Misbehaving(100);
+        return error("AcceptBlockHeader() : reject nVersion = %d", header.nVersion);
     }
 
-    // Block signature can be malleated in such a way that it increases block size up to maximum allowed by protocol
-    // For now we just strip garbage from newly received blocks
-    if (!IsCanonicalBlockSignature(pblock)) {
-        if (!ReserealizeBlockSignature(pblock))
-            LogPrintf("WARNING: ProcessBlock() : ReserealizeBlockSignature FAILED\n");
+    if (header.GetBlockTime() > FutureDrift(GetAdjustedTime()))
+        return error("AcceptBlockHeader() : block timestamp too far in the future");
+    if (header.GetBlockTime() <= (int64_t)nTime)
+        return error("AcceptBlockHeader() : block's timestamp is too early");
+
+    if (!Checkpoints::CheckHardened(nHeight, hash))
+    {
+        pfrom->Misbehaving(100);
+        return error("AcceptBlockHeader() : rejected by hardened checkpoint lock-in at %d", nHeight);
     }
 
-    // Preliminary checks
-    if (!pblock->CheckBlock())
-        return error("ProcessBlock() : CheckBlock FAILED");
+    if (nHeight < Params().StartPoSBlock() && !CheckProofOfWork(hash, header.nBits))
+    {
+        pfrom->Misbehaving(50);
+        return error("AcceptBlockHeader() : proof of work failed");
+    }
 
-    // ppcoin: ask for pending sync-checkpoint if any
-    if (!IsInitialBlockDownload())
-        Checkpoints::AskForPendingSyncCheckpoint(pfrom);
+    CBigNum bnTarget;
+    bnTarget.SetCompact(header.nBits);
+    if (bnTarget <= 0)
+    {
+        pfrom->Misbehaving(100);
+        return error("AcceptBlockHeader() : invalid nBits");
+    }
 
-    // If we don't already have its previous block, shunt it off to holding area until we get it
-    if (!mapBlockIndex.count(pblock->hashPrevBlock))
+    CHeaderIndex& entry = mapHeaderIndex[hash];
+    entry.hashPrev = header.hashPrevBlock;
+    entry.nHeight = nHeight;
+    entry.nTime = header.nTime;
+    entry.pfrom = pfrom;
+
+    pfrom->nBestHeaderHeight = std::max(pfrom->nBestHeaderHeight, nHeight);
+    pfrom->hashLastHeader = hash;
+
+    if (Checkpoints::IsHardenedHeight(nHeight))
     {
-        LogPrintf("ProcessBlock: ORPHAN BLOCK %lu, prev=%s\n", (unsigned long)mapOrphanBlocks.size(), pblock->hashPrevBlock.ToString());
+        hashBestHeader = hash;
+        nBestHeaderHeight = nHeight;
+        fNewBest = true;
+    }
+    return true;
+}
 
-        // Accept orphans as long as there is a node to request its parents from
-        if (pfrom) {
-            // ppcoin: check proof-of-stake
-            if (pblock->IsProofOfStake())
-            {
-                // Limited duplicity on stake: prevents block flood attack
-                // Duplicate stake allowed only when there is orphan child block
-                if (!TestNet() && setStakeSeenOrphan.count(pblock->GetProofOfStake()) && !mapOrphanBlocksByPrev.count(hash) && !Checkpoints::WantedByPendingSyncCheckpoint(hash))
-                    return error("ProcessBlock() : duplicate proof-of-stake (%s, %d) for orphan block %s", pblock->GetProofOfStake().first.ToString(), pblock->GetProofOfStake().second, hash.ToString());
-            }
-            PruneOrphanBlocks();
-            COrphanBlock* pblock2 = new COrphanBlock();
-            {
-                CDataStream ss(SER_DISK, CLIENT_VERSION);
-                ss << *pblock;
-                pblock2->vchBlock = std::vector<unsigned char>(ss.begin(), ss.end());
-            }
-            pblock2->hashBlock = hash;
-            pblock2->hashPrev = pblock->hashPrevBlock;
-            pblock2->stake = pblock->GetProofOfStake();
-            mapOrphanBlocks.insert(make_pair(hash, pblock2));
-            mapOrphanBlocksByPrev.insert(make_pair(pblock2->hashPrev, pblock2));
-            if (pblock->IsProofOfStake())
-                setStakeSeenOrphan.insert(pblock->GetProofOfStake());
+// Rebuild the download list after the best header changed
+static void UpdateHeaderDownload()
+{
+    vHeaderDownload.clear();
+    uint256 hash = hashBestHeader;
+    map<uint256, CHeaderIndex>::iterator mi;
+    while ((mi = mapHeaderIndex.find(hash)) != mapHeaderIndex.end())
+    {
+        vHeaderDownload.push_front(hash);
+        hash = mi->second.hashPrev;
+    }
+}
 
-            // Ask this guy to fill in what we're missing
-            PushGetBlocks(pfrom, pindexBest, GetOrphanRoot(hash));
-            // ppcoin: getblocks may not obtain the ancestor block rejected
-            // earlier by duplicate-stake check so we ask for it again directly
-            if (!IsInitialBlockDownload())
-                pfrom->AskFor(CInv(MSG_BLOCK, WantedByOrphan(pblock2)));
+// Drop headers whose blocks have been stored
+static void PruneHeaderDownload()
+{
+    bool fPruned = false;
+    while (!vHeaderDownload.empty() && mapBlockIndex.count(vHeaderDownload.front()))
+    {
+        mapHeaderIndex.erase(vHeaderDownload.front());
+        vHeaderDownload.pop_front();
+        fPruned = true;
+    }
+    // Once the best header chain is stored, what is left at or below the
+    // best block are headers of side chains. Higher ones may still be
+    // waiting for the next checkpoint.
+    if (fPruned && vHeaderDownload.empty())
+    {
+        for (map<uint256, CHeaderIndex>::iterator mi = mapHeaderIndex.begin(); mi != mapHeaderIndex.end(); )
+        {
+            if (mi->second.nHeight <= nBestHeight)
+                mapHeaderIndex.erase(mi++);
+            else
+                ++mi;
         }
-        return true;
     }
+}
 
-    // Store to disk
-    if (!pblock->AcceptBlock())
-        return error("ProcessBlock() : AcceptBlock FAILED");
+static void MarkBlockReceived(const uint256& hash)
+{
+    map<uint256, pair<CNode*, int64_t> >::iterator mi = mapBlocksInFlight.find(hash);
+    if (mi != mapBlocksInFlight.end())
+    {
+        mi->second.first->nBlocksInFlight--;
+        mapBlocksInFlight.erase(mi);
+    }
+}
 
-    // Recursively process any orphan blocks that depended on this one
-    vector<uint256> vWorkQueue;
-    vWorkQueue.push_back(hash);
-    for (unsigned int i = 0; i < vWorkQueue.size(); i++)
+// Forget the headers pnode sent us (or, for NULL, those of disconnected
+// peers) along with everything built on them, and release the blocks
+// requested from pnode. Header sync goes on with the other peers.
+static void DropHeadersFrom(CNode* pnode, const char* pszReason)
+{
+    LogPrintf("DropHeadersFrom() : %s, dropping headers from peer=%s\n", pszReason, pnode ? pnode->addr.ToString() : "(disconnected)");
+
+    // A header comes after its parent in height order, so one pass from
+    // the bottom finds the descendants as well
+    vector<pair<int, uint256> > vSorted;
+    vSorted.reserve(mapHeaderIndex.size());
+    for (map<uint256, CHeaderIndex>::iterator mi = mapHeaderIndex.begin(); mi != mapHeaderIndex.end(); ++mi)
+        vSorted.push_back(make_pair(mi->second.nHeight, mi->first));
+    sort(vSorted.begin(), vSorted.end());
+
+    set<uint256> setDropped;
+    for (unsigned int i = 0; i < vSorted.size(); i++)
     {
-        uint256 hashPrev = vWorkQueue[i];
-        for (multimap<uint256, COrphanBlock*>::iterator mi = mapOrphanBlocksByPrev.lower_bound(hashPrev);
-             mi != mapOrphanBlocksByPrev.upper_bound(hashPrev);
-             ++mi)
+        const CHeaderIndex& entry = mapHeaderIndex[vSorted[i].second];
+        if (entry.pfrom == pnode || setDropped.count(entry.hashPrev))
+            setDropped.insert(vSorted[i].second);
+    }
+    BOOST_FOREACH(const uint256& hash, setDropped)
+        mapHeaderIndex.erase(hash);
+
+    // Fall back to the highest checkpointed header that is left
+    if (setDropped.count(hashBestHeader))
+    {
+        hashBestHeader = 0;
+        nBestHeaderHeight = -1;
+        for (map<uint256, CHeaderIndex>::iterator mi = mapHeaderIndex.begin(); mi != mapHeaderIndex.end(); ++mi)
         {
-            CBlock block;
+            if (mi->second.nHeight > nBestHeaderHeight && Checkpoints::IsHardenedHeight(mi->second.nHeight))
             {
-                CDataStream ss(mi->second->vchBlock, SER_DISK, CLIENT_VERSION);
-                ss >> block;
+                hashBestHeader = mi->first;
+                nBestHeaderHeight = mi->second.nHeight;
             }
-            block.BuildMerkleTree();
-            if (block.AcceptBlock())
-                vWorkQueue.push_back(mi->second->hashBlock);
-            mapOrphanBlocks.erase(mi->second->hashBlock);
-            setStakeSeenOrphan.erase(block.GetProofOfStake());
-            delete mi->second;
         }
-        mapOrphanBlocksByPrev.erase(hashPrev);
+        UpdateHeaderDownload();
     }
+    LogPrint("net", "dropped %u headers, best header %d %s\n", setDropped.size(), nBestHeaderHeight, hashBestHeader.ToString());
 
-    LogPrintf("ProcessBlock: ACCEPTED\n");
+    if (pnode)
+    {
+        for (map<uint256, pair<CNode*, int64_t> >::iterator mi = mapBlocksInFlight.begin(); mi != mapBlocksInFlight.end(); )
+        {
+            if (mi->second.first == pnode)
+                mapBlocksInFlight.erase(mi++);
+            else
+                ++mi;
+        }
+        pnode->nBlocksInFlight = 0;
+        pnode->fHeadersSync = false;
+        pnode->nHeadersRequestTime = 0;
+        pnode->nBestHeaderHeight = -1;
+        pnode->hashLastHeader = 0;
+    }
 
-    // ppcoin: if responsible for sync-checkpoint send it
-    if (pfrom && !CSyncCheckpoint::strMasterPrivKey.empty())
-        Checkpoints::SendSyncCheckpoint(Checkpoints::AutoSelectSyncCheckpoint());
+    // The other peers may have to send what was dropped again
+    LOCK(cs_vNodes);
+    BOOST_FOREACH(CNode* pnode2, vNodes)
+        if (pnode2 != pnode && pnode2->fGetBlocksAfterHeaders && !pnode2->fDisconnect)
+            pnode2->fHeadersSync = true;
+}
+
+// Move header sync from pnode to another peer that isn't syncing headers
+static void HandOverHeadersSync(CNode* pnode)
+{
+    LOCK(cs_vNodes);
+    BOOST_FOREACH(CNode* pnode2, vNodes)
+    {
+        if (pnode2 != pnode && pnode2->fGetBlocksAfterHeaders && !pnode2->fDisconnect && !pnode2->fHeadersSync)
+        {
+            LogPrint("net", "header sync moves from peer=%s to peer=%s\n", pnode->addr.ToString(), pnode2->addr.ToString());
+            pnode2->fHeadersSync = true;
+            return;
+        }
+    }
+}
+
+void PushGetHeaders(CNode* pnode)
+{
+    // Like CBlockLocator::Set, but starting at the last header this peer
+    // sent us and continuing down the block chain it is built on
+    vector<uint256> vHave;
+    int nStep = 1;
+    int nSkip = 0;
+    uint256 hash = pnode->hashLastHeader;
+    if (!mapHeaderIndex.count(hash))
+        hash = hashBestHeader;
+    map<uint256, CHeaderIndex>::iterator mi;
+    while ((mi = mapHeaderIndex.find(hash)) != mapHeaderIndex.end())
+    {
+        if (nSkip == 0)
+        {
+            vHave.push_back(hash);
+            if (vHave.size() > 10)
+                nStep *= 2;
+            nSkip = nStep;
+        }
+        nSkip--;
+        hash = mi->second.hashPrev;
+    }
+    map<uint256, CBlockIndex*>::iterator bi = mapBlockIndex.find(hash);
+    CBlockIndex* pindex = (bi != mapBlockIndex.end()) ? bi->second : pindexBest;
+    while (pindex)
+    {
+        vHave.push_back(pindex->GetBlockHash());
+        for (int i = 0; pindex && i < nStep; i++)
+            pindex = pindex->pprev;
+        if (vHave.size() > 10)
+            nStep *= 2;
+    }
+    vHave.push_back(Params().HashGenesisBlock());
+
+    pnode->fHeadersSync = true;
+    pnode->nHeadersRequestTime = GetTime();
+    pnode->PushMessage("getheaders", CBlockLocator(vHave), uint256(0));
+}
+
+// Append requests for blocks along the best header chain to vGetData
+static void RequestHeaderBlocks(CNode* pto, vector<CInv>& vGetData)
+{
+    int64_t nNow = GetTime();
+
+    // Requests that weren't answered in time are handed to other peers
+    for (map<uint256, pair<CNode*, int64_t> >::iterator mi = mapBlocksInFlight.begin(); mi != mapBlocksInFlight.end(); )
+    {
+        if (mi->second.first == pto && nNow - mi->second.second > BLOCK_DOWNLOAD_TIMEOUT)
+        {
+            LogPrint("net", "block %s from peer=%s timed out\n", mi->first.ToString(), pto->addr.ToString());
+            pto->nBlocksInFlight--;
+            mapBlocksInFlight.erase(mi++);
+        }
+        else
+            ++mi;
+    }
+
+    PruneHeaderDownload();
+    if (vHeaderDownload.empty() || pto->fClient || pto->fDisconnect || !pto->fSuccessfullyConnected)
+        return;
+
+    int nWindow = std::min((int64_t)BLOCK_DOWNLOAD_WINDOW, GetArg("-maxorphanblocks", DEFAULT_MAX_ORPHAN_BLOCKS));
+    int nMaxHeight = std::min(nBestHeight + nWindow, std::max(pto->nStartingHeight, pto->nBestHeaderHeight));
+    int nHeight = mapHeaderIndex[vHeaderDownload.front()].nHeight;
+    for (deque<uint256>::iterator it = vHeaderDownload.begin();
+         it != vHeaderDownload.end() && nHeight <= nMaxHeight && pto->nBlocksInFlight < MAX_BLOCKS_IN_FLIGHT;
+         ++it, ++nHeight)
+    {
+        const uint256& hash = *it;
+        if (mapBlocksInFlight.count(hash) || mapOrphanBlocks.count(hash) || mapBlockIndex.count(hash))
+            continue;
+        mapBlocksInFlight[hash] = make_pair(pto, nNow);
+        pto->nBlocksInFlight++;
+        vGetData.push_back(CInv(MSG_BLOCK, hash));
+    }
+}
+
+CCompactBlock::CCompactBlock(const CBlock& block)
+{
+    header.nVersion = block.nVersion;
+    header.hashPrevBlock = block.hashPrevBlock;
+    header.hashMerkleRoot = block.hashMerkleRoot;
+    header.nTime = block.nTime;
+    header.nBits = block.nBits;
+    header.nNonce = block.nNonce;
+    header.vchBlockSig = block.vchBlockSig;
+    RAND_bytes((unsigned char*)&nShortIdNonce, sizeof(nShortIdNonce));
+
+    // The coinbase and coinstake are new to everyone, so they go whole
+    unsigned int nPrefilled = std::min(block.IsProofOfStake() ? (size_t)2 : (size_t)1, block.vtx.size());
+    vPrefilled.assign(block.vtx.begin(), block.vtx.begin() + nPrefilled);
+    uint256 hashKey = GetShortIdKey();
+    vShortIds.reserve(block.vtx.size() - nPrefilled);
+    for (unsigned int i = nPrefilled; i < block.vtx.size(); i++)
+        vShortIds.push_back(GetShortId(hashKey, block.vtx[i].GetHash()));
+}
+
+// A compact block being rebuilt, waiting for the transactions we asked its sender for
+struct CPartialBlock
+{
+    uint256 hashBlock;
+    CBlock block;
+    std::vector<unsigned int> vMissing; // positions in block.vtx still to fill
+};
+static map<CNode*, CPartialBlock> mapPartialBlocks;
+
+// requires LOCK(cs_main)
+static void ProcessReceivedBlock(CNode* pfrom, CBlock& block, const uint256& hashBlock)
+{
+    CInv inv(MSG_BLOCK, hashBlock);
+    map<uint256, CHeaderIndex>::iterator mi = mapHeaderIndex.find(hashBlock);
+    bool fHeaderChain = (mi != mapHeaderIndex.end());
+    CNode* pnodeHeader = fHeaderChain ? mi->second.pfrom : NULL;
+    MarkBlockReceived(hashBlock);
+
+    if (ProcessBlock(pfrom, &block, hashBlock, false))
+        mapAlreadyAskedFor.erase(inv);
+    if (block.nDoS) {
+        pfrom->Misbehaving(block.nDoS);
+        // The peer that sent its header led us there
+        if (fHeaderChain) {
+            if (pnodeHeader && pnodeHeader != pfrom)
+                pnodeHeader->Misbehaving(block.nDoS);
+            DropHeadersFrom(pnodeHeader, "invalid block on the header chain");
+        }
+    }
+}
+
+// Lay out the block described by a compact block and fill in what the memory
+// pool has. Returns false if it can't be rebuilt this way, e.g. because two of
+// its short ids are the same.
+static bool InitPartialBlock(const CCompactBlock& cmpctblock, CPartialBlock& partial)
+{
+    CBlock& block = partial.block;
+    size_t nTx = cmpctblock.vPrefilled.size() + cmpctblock.vShortIds.size();
+    if (cmpctblock.vPrefilled.empty() || nTx > MAX_BLOCK_SIZE / ::GetSerializeSize(CTransaction(), SER_NETWORK, PROTOCOL_VERSION))
+        return false;
+
+    block = cmpctblock.header;
+    block.vtx.resize(nTx);
+    std::copy(cmpctblock.vPrefilled.begin(), cmpctblock.vPrefilled.end(), block.vtx.begin());
+    vector<bool> vHave(nTx, false);
+    std::fill(vHave.begin(), vHave.begin() + cmpctblock.vPrefilled.size(), true);
+
+    map<uint64_t, unsigned int> mapShortIds;
+    for (unsigned int i = 0; i < cmpctblock.vShortIds.size(); i++)
+        if (!mapShortIds.insert(make_pair(cmpctblock.vShortIds[i], cmpctblock.vPrefilled.size() + i)).second)
+            return false;
+
+    uint256 hashKey = cmpctblock.GetShortIdKey();
+    {
+        LOCK(mempool.cs);
+        for (map<uint256, CTxMemPoolEntry>::const_iterator mi = mempool.mapTx.begin(); mi != mempool.mapTx.end(); ++mi)
+        {
+            map<uint64_t, unsigned int>::iterator it = mapShortIds.find(CCompactBlock::GetShortId(hashKey, mi->first));
+            if (it == mapShortIds.end())
+                continue;
+            unsigned int i = it->second;
+            if (vHave[i])
+            {
+                // two pool transactions share the id, ask for the real one
+                vHave[i] = false;
+                mapShortIds.erase(it);
+                continue;
+            }
+            block.vtx[i] = mi->second.GetTx();
+            vHave[i] = true;
+        }
+    }
+
+    partial.vMissing.clear();
+    for (unsigned int i = 0; i < nTx; i++)
+        if (!vHave[i])
+            partial.vMissing.push_back(i);
+    return true;
+}
+
+// requires LOCK(cs_main)
+static void FinishPartialBlock(CNode* pfrom, CBlock& block, const uint256& hashBlock)
+{
+    // A short id collision leaves the wrong transaction in place, which shows
+    // up as a merkle root mismatch; fetch the block whole in that case
+    if (block.BuildMerkleTree() != block.hashMerkleRoot)
+    {
+        LogPrint("net", "compact block %s did not rebuild, requesting it in full\n", hashBlock.ToString());
+        pfrom->AskFor(CInv(MSG_BLOCK, hashBlock));
+        return;
+    }
+    ProcessReceivedBlock(pfrom, block, hashBlock);
+}
+
+void static FinalizeNode(CNode* pnode)
+{
+    LOCK(cs_main);
+    mapPartialBlocks.erase(pnode);
+    for (map<uint256, pair<CNode*, int64_t> >::iterator mi = mapBlocksInFlight.begin(); mi != mapBlocksInFlight.end(); )
+    {
+        if (mi->second.first == pnode)
+            mapBlocksInFlight.erase(mi++);
+        else
+            ++mi;
+    }
+    pnode->nBlocksInFlight = 0;
+    for (map<uint256, CHeaderIndex>::iterator mi = mapHeaderIndex.begin(); mi != mapHeaderIndex.end(); ++mi)
+        if (mi->second.pfrom == pnode)
+            mi->second.pfrom = NULL;
+}
+
+bool static ReserealizeBlockSignature(CBlock* pblock)
+{
+    if (pblock->IsProofOfWork()) {
+        pblock->vchBlockSig.clear();
+        return true;
+    }
+
+    return CKey::ReserealizeSignature(pblock->vchBlockSig);
+}
+
+bool static IsCanonicalBlockSignature(CBlock* pblock)
+{
+    if (pblock->IsProofOfWork()) {
+        return pblock->vchBlockSig.empty();
+    }
+
+    return IsDERSignature(pblock->vchBlockSig, false);
+}
+
+bool ProcessBlock(CNode* pfrom, CBlock* pblock)
+{
+    return ProcessBlock(pfrom, pblock, pblock->GetHash(), false);
+}
+
+bool ProcessBlock(CNode* pfrom, CBlock* pblock, const uint256& hash, bool fChecked)
+{
+    AssertLockHeld(cs_main);
+
+    // Check for duplicate
+    if (mapBlockIndex.count(hash))
+        return error("ProcessBlock() : already have block %d %s", mapBlockIndex[hash]->nHeight, hash.ToString());
+    if (mapOrphanBlocks.count(hash))
+        return error("ProcessBlock() : already have block (orphan) %s", hash.ToString());
+
+    // ppcoin: check proof-of-stake
+    // Limited duplicity on stake: prevents block flood attack
+    // Duplicate stake allowed only when there is orphan child block
+    if (!TestNet() && pblock->IsProofOfStake() && setStakeSeen.count(pblock->GetProofOfStake()) && !mapOrphanBlocksByPrev.count(hash) && !Checkpoints::WantedByPendingSyncCheckpoint(hash))
+        return error("ProcessBlock() : duplicate proof-of-stake (%s, %d) for block %s", pblock->GetProofOfStake().first.ToString(), pblock->GetProofOfStake().second, hash.ToString());
+
+    CBlockIndex* pcheckpoint = Checkpoints::GetLastSyncCheckpoint();
+    if (pcheckpoint && pblock->hashPrevBlock != hashBestChain && !Checkpoints::WantedByPendingSyncCheckpoint(hash))
+    {
+        // Extra checks to prevent "fill up memory by spamming with bogus blocks"
+        int64_t deltaTime = pblock->GetBlockTime() - pcheckpoint->nTime;
+        if (deltaTime < 0)
+        {
+            if (pfrom)
+                pfrom->Misbehaving(1);
+            return error("ProcessBlock() : block with timestamp before last checkpoint");
+        }
+    }
+
+    // Block signature can be malleated in such a way that it increases block size up to maximum allowed by protocol
+    // For now we just strip garbage from newly received blocks
+    if (!IsCanonicalBlockSignature(pblock)) {
+        if (!ReserealizeBlockSignature(pblock))
+            LogPrintf("WARNING: ProcessBlock() : ReserealizeBlockSignature FAILED\n");
+    }
+
+    // Preliminary checks
+    if (!fChecked && !pblock->CheckBlock(true, true, true, &hash))
+        return error("ProcessBlock() : CheckBlock FAILED");
+
+    // ppcoin: ask for pending sync-checkpoint if any
+    if (!IsInitialBlockDownload())
+        Checkpoints::AskForPendingSyncCheckpoint(pfrom);
+
+    // If we don't already have its previous block, shunt it off to holding area until we get it
+    if (!mapBlockIndex.count(pblock->hashPrevBlock))
+    {
+        LogPrintf("ProcessBlock: ORPHAN BLOCK %lu, prev=%s\n", (unsigned long)mapOrphanBlocks.size(), pblock->hashPrevBlock.ToString());
+
+        // Accept orphans as long as there is a node to request its parents from
+        if (pfrom) {
+            // ppcoin: check proof-of-stake
+            if (pblock->IsProofOfStake())
+            {
+                // Limited duplicity on stake: prevents block flood attack
+                // Duplicate stake allowed only when there is orphan child block
+                if (!TestNet() && setStakeSeenOrphan.count(pblock->GetProofOfStake()) && !mapOrphanBlocksByPrev.count(hash) && !Checkpoints::WantedByPendingSyncCheckpoint(hash))
+                    return error("ProcessBlock() : duplicate proof-of-stake (%s, %d) for orphan block %s", pblock->GetProofOfStake().first.ToString(), pblock->GetProofOfStake().second, hash.ToString());
+            }
+            PruneOrphanBlocks();
+            COrphanBlock* pblock2 = new COrphanBlock();
+            {
+                CDataStream ss(SER_DISK, CLIENT_VERSION);
+                ss << *pblock;
+                pblock2->vchBlock = std::vector<unsigned char>(ss.begin(), ss.end());
+            }
+            pblock2->hashBlock = hash;
+            pblock2->hashPrev = pblock->hashPrevBlock;
+            pblock2->stake = pblock->GetProofOfStake();
+            mapOrphanBlocks.insert(make_pair(hash, pblock2));
+            mapOrphanBlocksByPrev.insert(make_pair(pblock2->hashPrev, pblock2));
+            if (pblock->IsProofOfStake())
+                setStakeSeenOrphan.insert(pblock->GetProofOfStake());
+
+            // Ask this guy to fill in what we're missing, unless the
+            // missing blocks are already being fetched along the header chain
+            if (!IsHeadersFirstSyncing())
+                PushGetBlocks(pfrom, pindexBest, GetOrphanRoot(hash));
+            // ppcoin: getblocks may not obtain the ancestor block rejected
+            // earlier by duplicate-stake check so we ask for it again directly
+            if (!IsInitialBlockDownload())
+                pfrom->AskFor(CInv(MSG_BLOCK, WantedByOrphan(pblock2)));
+        }
+        return true;
+    }
+
+    // Store to disk
+    if (!pblock->AcceptBlock(hash))
+        return error("ProcessBlock() : AcceptBlock FAILED");
+
+    // Recursively process any orphan blocks that depended on this one
+    vector<uint256> vWorkQueue;
+    vWorkQueue.push_back(hash);
+    for (unsigned int i = 0; i < vWorkQueue.size(); i++)
+    {
+        uint256 hashPrev = vWorkQueue[i];
+        for (multimap<uint256, COrphanBlock*>::iterator mi = mapOrphanBlocksByPrev.lower_bound(hashPrev);
+             mi != mapOrphanBlocksByPrev.upper_bound(hashPrev);
+             ++mi)
+        {
+            CBlock block;
+            {
+                CDataStream ss(mi->second->vchBlock, SER_DISK, CLIENT_VERSION);
+                ss >> block;
+            }
+            block.BuildMerkleTree();
+            if (block.AcceptBlock(mi->second->hashBlock))
+                vWorkQueue.push_back(mi->second->hashBlock);
+            mapOrphanBlocks.erase(mi->second->hashBlock);
+            setStakeSeenOrphan.erase(block.GetProofOfStake());
+            delete mi->second;
+        }
+        mapOrphanBlocksByPrev.erase(hashPrev);
+    }
+
+    LogPrintf("ProcessBlock: ACCEPTED\n");
+
+    // ppcoin: if responsible for sync-checkpoint send it
+    if (pfrom && !CSyncCheckpoint::strMasterPrivKey.empty())
+        Checkpoints::SendSyncCheckpoint(Checkpoints::AutoSelectSyncCheckpoint());
 
     return true;
 }
@@ -2498,29 +3240,6 @@ FILE* OpenBlockFile(unsigned int nFile, unsigned int nBlockPos, const char* pszM
     return file;
 }
 
-static unsigned int nCurrentBlockFile = 1;
-
-FILE* AppendBlockFile(unsigned int& nFileRet)
-{
-    nFileRet = 0;
-    while (true)
-    {
-        FILE* file = OpenBlockFile(nCurrentBlockFile, 0, "ab");
-        if (!file)
-            return NULL;
-        if (fseek(file, 0, SEEK_END) != 0)
-            return NULL;
-        // FAT32 file size max 4GB, fseek and ftell max 2GB, so we must stay under 2GB
-        if (ftell(file) < (long)(0x7F000000 - MAX_SIZE))
-        {
-            nFileRet = nCurrentBlockFile;
-            return file;
-        }
-        fclose(file);
-        nCurrentBlockFile++;
-    }
-}
-
 bool LoadBlockIndex(bool fAllowNew)
 {
     LOCK(cs_main);
@@ -2554,7 +3273,7 @@ bool LoadBlockIndex(bool fAllowNew)
         unsigned int nBlockPos;
         if (!block.WriteToDisk(nFile, nBlockPos))
             return error("LoadBlockIndex() : writing genesis block to disk failed");
-        if (!block.AddToBlockIndex(nFile, nBlockPos, Params().HashGenesisBlock()))
+        if (!block.AddToBlockIndex(block.GetHash(), nFile, nBlockPos, Params().HashGenesisBlock()))
             return error("LoadBlockIndex() : genesis block not accepted");
 
         // ppcoin: initialize synchronized checkpoint
@@ -2621,39 +3340,293 @@ void PrintBlockTree()
        }
         nPrevCol = nCol;
 
-        // print columns
-        for (int i = 0; i < nCol; i++)
-            LogPrintf("| ");
+        // print columns
+        for (int i = 0; i < nCol; i++)
+            LogPrintf("| ");
+
+        // print item
+        CBlock block;
+        block.ReadFromDisk(pindex);
+        LogPrintf("%d (%u,%u) %s  %08x  %s  mint %7s  tx %u",
+            pindex->nHeight,
+            pindex->nFile,
+            pindex->nBlockPos,
+            block.GetHash().ToString(),
+            block.nBits,
+            DateTimeStrFormat("%x %H:%M:%S", block.GetBlockTime()),
+            FormatMoney(pindex->nMint),
+            block.vtx.size());
+
+        // put the main time-chain first
+        vector<CBlockIndex*>& vNext = mapNext[pindex];
+        for (unsigned int i = 0; i < vNext.size(); i++)
+        {
+            if (vNext[i]->pnext)
+            {
+                swap(vNext[0], vNext[i]);
+                break;
+            }
+        }
+
+        // iterate children
+        for (unsigned int i = 0; i < vNext.size(); i++)
+            vStack.push_back(make_pair(nCol+i, vNext[i]));
+    }
+}
+
+// Finds the blocks in a -loadblock or bootstrap.dat file. The file is mapped
+// where mmap is available and read sequentially in large chunks otherwise.
+class CBlockFileFramer
+{
+private:
+    FILE* file;
+    bool fMapped;
+    size_t nMapSize;
+    std::vector<unsigned char> vBuf;
+    // pdata holds the nDataSize bytes of the file from offset nDataStart
+    const unsigned char* pdata;
+    uint64_t nDataStart;
+    size_t nDataSize;
+    // offset of the first byte not yet scanned
+    uint64_t nPos;
+
+    // Make the nBytes from nPos available in pdata
+    bool Fill(size_t nBytes)
+    {
+        if (nPos + nBytes <= nDataStart + nDataSize)
+            return true;
+        if (fMapped)
+            return false;
+        size_t nKeep = nDataStart + nDataSize - nPos;
+        if (nKeep > 0)
+            memmove(&vBuf[0], &vBuf[nPos - nDataStart], nKeep);
+        if (vBuf.size() < nBytes)
+            vBuf.resize(nBytes);
+        size_t nRead = fread(&vBuf[nKeep], 1, vBuf.size() - nKeep, file);
+        pdata = &vBuf[0];
+        nDataStart = nPos;
+        nDataSize = nKeep + nRead;
+        return nBytes <= nDataSize;
+    }
+
+public:
+    CBlockFileFramer(FILE* fileIn) : file(fileIn), fMapped(false), nMapSize(0), pdata(NULL), nDataStart(0), nDataSize(0), nPos(0)
+    {
+#ifndef WIN32
+        if (fseek(file, 0, SEEK_END) == 0)
+        {
+            long nFileSize = ftell(file);
+            if (nFileSize > 0)
+            {
+                void* p = mmap(NULL, nFileSize, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+                if (p != MAP_FAILED)
+                {
+#ifdef MADV_SEQUENTIAL
+                    madvise(p, nFileSize, MADV_SEQUENTIAL);
+#endif
+                    pdata = (const unsigned char*)p;
+                    nDataSize = nMapSize = nFileSize;
+                    fMapped = true;
+                }
+            }
+            fseek(file, 0, SEEK_SET);
+        }
+#endif
+        if (!fMapped)
+            vBuf.resize(4 * 1024 * 1024);
+    }
+
+    ~CBlockFileFramer()
+    {
+#ifndef WIN32
+        if (fMapped)
+            munmap((void*)pdata, nMapSize);
+#endif
+    }
+
+    // Copy out the next block that follows the message start and a size
+    bool Next(std::vector<char>& vchBlock)
+    {
+        while (Fill(MESSAGE_START_SIZE))
+        {
+            boost::this_thread::interruption_point();
+            const unsigned char* pbegin = pdata + (nPos - nDataStart);
+            size_t nAvail = nDataStart + nDataSize - nPos;
+            const unsigned char* pfind = (const unsigned char*)memchr(pbegin, Params().MessageStart()[0], nAvail + 1 - MESSAGE_START_SIZE);
+            if (!pfind)
+            {
+                nPos += nAvail + 1 - MESSAGE_START_SIZE;
+                continue;
+            }
+            nPos += pfind - pbegin;
+            if (memcmp(pfind, Params().MessageStart(), MESSAGE_START_SIZE) != 0)
+            {
+                nPos++;
+                continue;
+            }
+            nPos += MESSAGE_START_SIZE;
+
+            if (!Fill(sizeof(unsigned int)))
+                return false;
+            unsigned int nSize;
+            memcpy(&nSize, pdata + (nPos - nDataStart), sizeof(nSize));
+            if (nSize == 0 || nSize > MAX_BLOCK_SIZE)
+                continue;
+            if (!Fill(sizeof(nSize) + nSize))
+            {
+                LogPrintf("LoadExternalBlockFile() : truncated block at end of file\n");
+                return false;
+            }
+            const char* pblock = (const char*)pdata + (nPos - nDataStart) + sizeof(nSize);
+            vchBlock.assign(pblock, pblock + nSize);
+            nPos += sizeof(nSize) + nSize;
+            return true;
+        }
+        return false;
+    }
+};
+
+struct CImportFrame
+{
+    std::vector<char> vchBlock;
+    size_t nSize;
+    CBlock block;
+    uint256 hashBlock;
+    bool fValid;
+    bool fDone;
+
+    CImportFrame() : nSize(0), fValid(false), fDone(false) {}
+};
+
+// Block file import in three stages: a reader thread frames blocks out of the
+// file, worker threads deserialize them and run the context-free checks, and
+// the calling thread connects them in file order.
+class CBlockImporter
+{
+private:
+    boost::mutex mutex;
+    boost::condition_variable cond;
+    // frames in file order; the first nNextCheck have been handed to a worker
+    std::deque<CImportFrame*> vFrames;
+    size_t nNextCheck;
+    size_t nQueuedBytes;
+    bool fEndOfFile;
+    boost::thread_group threadGroup;
+
+    void ThreadRead(FILE* file)
+    {
+        try {
+            CBlockFileFramer framer(file);
+            while (true)
+            {
+                CImportFrame* pframe = new CImportFrame();
+                if (!framer.Next(pframe->vchBlock))
+                {
+                    delete pframe;
+                    break;
+                }
+                pframe->nSize = pframe->vchBlock.size();
+                boost::unique_lock<boost::mutex> lock(mutex);
+                while (nQueuedBytes > 0 && nQueuedBytes + pframe->nSize > IMPORT_QUEUE_BYTES)
+                    cond.wait(lock);
+                nQueuedBytes += pframe->nSize;
+                vFrames.push_back(pframe);
+                cond.notify_all();
+            }
+        }
+        catch (std::exception &e) {
+            LogPrintf("LoadExternalBlockFile() : I/O error caught during load: %s\n", e.what());
+        }
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fEndOfFile = true;
+        cond.notify_all();
+    }
+
+    void ThreadCheck()
+    {
+        while (true)
+        {
+            std::vector<CImportFrame*> vBatch;
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                while (nNextCheck == vFrames.size() && !fEndOfFile)
+                    cond.wait(lock);
+                if (nNextCheck == vFrames.size())
+                    return;
+                while (nNextCheck < vFrames.size() && vBatch.size() < IMPORT_HASH_BATCH)
+                    vBatch.push_back(vFrames[nNextCheck++]);
+            }
 
-        // print item
-        CBlock block;
-        block.ReadFromDisk(pindex);
-        LogPrintf("%d (%u,%u) %s  %08x  %s  mint %7s  tx %u",
-            pindex->nHeight,
-            pindex->nFile,
-            pindex->nBlockPos,
-            block.GetHash().ToString(),
-            block.nBits,
-            DateTimeStrFormat("%x %H:%M:%S", block.GetBlockTime()),
-            FormatMoney(pindex->nMint),
-            block.vtx.size());
+            std::vector<CImportFrame*> vRead;
+            std::vector<unsigned char> vHeaders;
+            BOOST_FOREACH(CImportFrame* pframe, vBatch)
+            {
+                try {
+                    CDataStream ss(pframe->vchBlock, SER_DISK, CLIENT_VERSION);
+                    ss >> pframe->block;
+                    if (!IsCanonicalBlockSignature(&pframe->block) && !ReserealizeBlockSignature(&pframe->block))
+                        LogPrintf("WARNING: LoadExternalBlockFile() : ReserealizeBlockSignature FAILED\n");
+                    vHeaders.insert(vHeaders.end(), BEGIN(pframe->block.nVersion), END(pframe->block.nNonce));
+                    vRead.push_back(pframe);
+                }
+                catch (std::exception &e) {
+                    LogPrintf("LoadExternalBlockFile() : deserialize error caught during load\n");
+                }
+                std::vector<char>().swap(pframe->vchBlock);
+            }
 
-        // put the main time-chain first
-        vector<CBlockIndex*>& vNext = mapNext[pindex];
-        for (unsigned int i = 0; i < vNext.size(); i++)
-        {
-            if (vNext[i]->pnext)
+            // The x13 hashes and the merkle trees are worked out here, so
+            // connecting the blocks doesn't have to
+            std::vector<uint256> vHash(vRead.size());
+            if (!vRead.empty())
+                Hash9Batch(&vHeaders[0], vRead.size(), &vHash[0]);
+            for (unsigned int i = 0; i < vRead.size(); i++)
             {
-                swap(vNext[0], vNext[i]);
-                break;
+                vRead[i]->hashBlock = vHash[i];
+                vRead[i]->fValid = vRead[i]->block.CheckBlock(true, true, true, &vRead[i]->hashBlock);
             }
+
+            boost::unique_lock<boost::mutex> lock(mutex);
+            BOOST_FOREACH(CImportFrame* pframe, vBatch)
+                pframe->fDone = true;
+            cond.notify_all();
         }
+    }
 
-        // iterate children
-        for (unsigned int i = 0; i < vNext.size(); i++)
-            vStack.push_back(make_pair(nCol+i, vNext[i]));
+public:
+    CBlockImporter(FILE* file) : nNextCheck(0), nQueuedBytes(0), fEndOfFile(false)
+    {
+        int nThreads = std::max(1, std::min((int)boost::thread::hardware_concurrency(), MAX_IMPORT_CHECK_THREADS));
+        threadGroup.create_thread(boost::bind(&CBlockImporter::ThreadRead, this, file));
+        for (int i = 0; i < nThreads; i++)
+            threadGroup.create_thread(boost::bind(&CBlockImporter::ThreadCheck, this));
     }
-}
+
+    ~CBlockImporter()
+    {
+        threadGroup.interrupt_all();
+        threadGroup.join_all();
+        BOOST_FOREACH(CImportFrame* pframe, vFrames)
+            delete pframe;
+    }
+
+    // Take the next block in file order once it has been checked, NULL at the end of the file.
+    // The caller deletes the frame.
+    CImportFrame* Next()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (!(vFrames.empty() ? fEndOfFile : vFrames.front()->fDone))
+            cond.wait(lock);
+        if (vFrames.empty())
+            return NULL;
+        CImportFrame* pframe = vFrames.front();
+        vFrames.pop_front();
+        nNextCheck--;
+        nQueuedBytes -= pframe->nSize;
+        cond.notify_all();
+        return pframe;
+    }
+};
 
 bool LoadExternalBlockFile(FILE* fileIn)
 {
@@ -2661,56 +3634,21 @@ bool LoadExternalBlockFile(FILE* fileIn)
 
     int nLoaded = 0;
     {
-        try {
-            CAutoFile blkdat(fileIn, SER_DISK, CLIENT_VERSION);
-            unsigned int nPos = 0;
-            while (nPos != (unsigned int)-1 && blkdat.good())
+        CAutoFile blkdat(fileIn, SER_DISK, CLIENT_VERSION);
+        CBlockImporter importer(fileIn);
+        while (true)
+        {
+            boost::this_thread::interruption_point();
+            CImportFrame* pframe = importer.Next();
+            if (!pframe)
+                break;
+            if (pframe->fValid)
             {
-                boost::this_thread::interruption_point();
-                unsigned char pchData[65536];
-                do {
-                    fseek(blkdat, nPos, SEEK_SET);
-                    int nRead = fread(pchData, 1, sizeof(pchData), blkdat);
-                    if (nRead <= 8)
-                    {
-                        nPos = (unsigned int)-1;
-                        break;
-                    }
-                    void* nFind = memchr(pchData, Params().MessageStart()[0], nRead+1-MESSAGE_START_SIZE);
-                    if (nFind)
-                    {
-                        if (memcmp(nFind, Params().MessageStart(), MESSAGE_START_SIZE)==0)
-                        {
-                            nPos += ((unsigned char*)nFind - pchData) + MESSAGE_START_SIZE;
-                            break;
-                        }
-                        nPos += ((unsigned char*)nFind - pchData) + 1;
-                    }
-                    else
-                        nPos += sizeof(pchData) - MESSAGE_START_SIZE + 1;
-                    boost::this_thread::interruption_point();
-                } while(true);
-                if (nPos == (unsigned int)-1)
-                    break;
-                fseek(blkdat, nPos, SEEK_SET);
-                unsigned int nSize;
-                blkdat >> nSize;
-                if (nSize > 0 && nSize <= MAX_BLOCK_SIZE)
-                {
-                    CBlock block;
-                    blkdat >> block;
-                    LOCK(cs_main);
-                    if (ProcessBlock(NULL,&block))
-                    {
-                        nLoaded++;
-                        nPos += 4 + nSize;
-                    }
-                }
+                LOCK(cs_main);
+                if (ProcessBlock(NULL, &pframe->block, pframe->hashBlock, true))
+                    nLoaded++;
             }
-        }
-        catch (std::exception &e) {
-            LogPrintf("%s() : Deserialize or I/O error caught during load\n",
-                   __PRETTY_FUNCTION__);
+            delete pframe;
         }
     }
     LogPrintf("Loaded %i blocks from external file in %dms\n", nLoaded, GetTimeMillis() - nStart);
@@ -2734,25 +3672,167 @@ void ThreadImport(std::vector<boost::filesystem::path> vImportFiles)
 {
     RenameThread("Ember-loadblk");
 
-    CImportingNow imp;
+    {
+        CImportingNow imp;
+
+        // -loadblock=
+        BOOST_FOREACH(boost::filesystem::path &path, vImportFiles) {
+            FILE *file = fopen(path.string().c_str(), "rb");
+            if (file)
+                LoadExternalBlockFile(file);
+        }
+
+        // hardcoded $DATADIR/bootstrap.dat
+        filesystem::path pathBootstrap = GetDataDir() / "bootstrap.dat";
+        if (filesystem::exists(pathBootstrap)) {
+            FILE *file = fopen(pathBootstrap.string().c_str(), "rb");
+            if (file) {
+                filesystem::path pathBootstrapOld = GetDataDir() / "bootstrap.dat.old";
+                LoadExternalBlockFile(file);
+                RenameOver(pathBootstrap, pathBootstrapOld);
+            }
+        }
+    }
+
+    // Transactions that were in the pool at the last shutdown
+    if (GetBoolArg("-persistmempool", DEFAULT_PERSIST_MEMPOOL))
+        LoadMempool();
+    mempool.SetLoaded(!ShutdownRequested());
+}
+
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// Memory pool persistence
+//
+
+static const uint64_t MEMPOOL_DUMP_VERSION = 1;
+
+// Queue a pool transaction for DumpMempool after the pool transactions it
+// spends, so that reading the file back accepts them in order. Walks the
+// parents with an explicit stack, as unconfirmed chains can be long.
+static void QueueMempoolDump(const uint256& hashIn, set<uint256>& setQueued, vector<pair<CTransaction, int64_t> >& vQueue)
+{
+    // a transaction goes on the stack twice: first to push its parents,
+    // then, once they are all queued, to queue itself
+    vector<pair<uint256, bool> > vStack;
+    vStack.push_back(make_pair(hashIn, false));
+    while (!vStack.empty())
+    {
+        uint256 hash = vStack.back().first;
+        bool fParentsQueued = vStack.back().second;
+        vStack.pop_back();
+        map<uint256, CTxMemPoolEntry>::const_iterator mi = mempool.mapTx.find(hash);
+        if (mi == mempool.mapTx.end())
+            continue;
+        if (fParentsQueued)
+        {
+            vQueue.push_back(make_pair(mi->second.GetTx(), mi->second.GetTime()));
+            continue;
+        }
+        if (!setQueued.insert(hash).second)
+            continue;
+        vStack.push_back(make_pair(hash, true));
+        BOOST_FOREACH(const uint256& hashParent, mi->second.setParents)
+            if (!setQueued.count(hashParent))
+                vStack.push_back(make_pair(hashParent, false));
+    }
+}
+
+bool DumpMempool()
+{
+    int64_t nStart = GetTimeMillis();
+
+    vector<pair<CTransaction, int64_t> > vQueue;
+    {
+        LOCK(mempool.cs);
+        set<uint256> setQueued;
+        vQueue.reserve(mempool.mapTx.size());
+        for (map<uint256, CTxMemPoolEntry>::const_iterator mi = mempool.mapTx.begin(); mi != mempool.mapTx.end(); ++mi)
+            QueueMempoolDump(mi->first, setQueued, vQueue);
+    }
 
-    // -loadblock=
-    BOOST_FOREACH(boost::filesystem::path &path, vImportFiles) {
-        FILE *file = fopen(path.string().c_str(), "rb");
-        if (file)
-            LoadExternalBlockFile(file);
+    // Write a temporary file and move it into place, so a crash while
+    // writing leaves the previous dump
+    filesystem::path pathMempool = GetDataDir() / "mempool.dat";
+    filesystem::path pathTmp = GetDataDir() / "mempool.dat.new";
+    FILE *file = fopen(pathTmp.string().c_str(), "wb");
+    CAutoFile fileout = CAutoFile(file, SER_DISK, CLIENT_VERSION);
+    if (!fileout)
+        return error("DumpMempool() : open failed");
+
+    try {
+        fileout << MEMPOOL_DUMP_VERSION;
+        fileout << FLATDATA(Params().MessageStart());
+        fileout << (uint64_t)vQueue.size();
+        for (unsigned int i = 0; i < vQueue.size(); i++)
+            fileout << vQueue[i].first << vQueue[i].second;
     }
+    catch (std::exception &e) {
+        return error("DumpMempool() : I/O error");
+    }
+    FileCommit(fileout);
+    fileout.fclose();
+
+    if (!RenameOver(pathTmp, pathMempool))
+        return error("DumpMempool() : Rename-into-place failed");
+
+    LogPrintf("Dumped %u transactions to mempool.dat  %dms\n", vQueue.size(), GetTimeMillis() - nStart);
+    return true;
+}
+
+bool LoadMempool()
+{
+    int64_t nStart = GetTimeMillis();
 
-    // hardcoded $DATADIR/bootstrap.dat
-    filesystem::path pathBootstrap = GetDataDir() / "bootstrap.dat";
-    if (filesystem::exists(pathBootstrap)) {
-        FILE *file = fopen(pathBootstrap.string().c_str(), "rb");
-        if (file) {
-            filesystem::path pathBootstrapOld = GetDataDir() / "bootstrap.dat.old";
-            LoadExternalBlockFile(file);
-            RenameOver(pathBootstrap, pathBootstrapOld);
+    filesystem::path pathMempool = GetDataDir() / "mempool.dat";
+    FILE *file = fopen(pathMempool.string().c_str(), "rb");
+    CAutoFile filein = CAutoFile(file, SER_DISK, CLIENT_VERSION);
+    if (!filein)
+        return false;
+
+    // The file is read one transaction at a time, and each goes through the
+    // usual checks again since the chain may have moved on
+    uint64_t nAccepted = 0, nFailed = 0, nAlready = 0;
+    try {
+        uint64_t nVersion;
+        filein >> nVersion;
+        if (nVersion != MEMPOOL_DUMP_VERSION)
+            return error("LoadMempool() : unknown version %u", nVersion);
+
+        unsigned char pchMsgTmp[4];
+        filein >> FLATDATA(pchMsgTmp);
+        if (memcmp(pchMsgTmp, Params().MessageStart(), sizeof(pchMsgTmp)))
+            return error("LoadMempool() : invalid network magic number");
+
+        uint64_t nCount;
+        filein >> nCount;
+        for (uint64_t i = 0; i < nCount; i++)
+        {
+            boost::this_thread::interruption_point();
+            if (ShutdownRequested())
+                return false;
+
+            CTransaction tx;
+            int64_t nTime;
+            filein >> tx >> nTime;
+
+            LOCK(cs_main);
+            if (mempool.exists(tx.GetHash()))
+                nAlready++;
+            else if (AcceptToMemoryPool(mempool, tx, false, NULL, nTime))
+                nAccepted++;
+            else
+                nFailed++;
         }
     }
+    catch (std::exception &e) {
+        return error("LoadMempool() : I/O error or stream data corrupted");
+    }
+
+    LogPrintf("Loaded %u transactions from mempool.dat (%u failed, %u already in the pool)  %dms\n",
+              nAccepted, nFailed, nAlready, GetTimeMillis() - nStart);
+    return true;
 }
 
 
@@ -2883,9 +3963,11 @@ void static ProcessGetData(CNode* pfrom)
                 map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(inv.hash);
                 if (mi != mapBlockIndex.end())
                 {
-                    CBlock block;
-                    block.ReadFromDisk((*mi).second);
-                    pfrom->PushMessage("block", block);
+                    // The disk and network serializations of a block are the same,
+                    // so the stored bytes go out as they are
+                    CSerializeData vchBlock(CSerializeData::allocator_type(false));
+                    if (ReadRawBlockFromDisk(vchBlock, (*mi).second->nFile, (*mi).second->nBlockPos))
+                        pfrom->PushRawMessage("block", vchBlock);
 
                     // Trigger them to send a getblocks request for the next batch of inventory
                     if (inv.hash == pfrom->hashContinue)
@@ -2904,13 +3986,16 @@ void static ProcessGetData(CNode* pfrom)
             {
                 // Send stream from relay memory
                 bool pushed = false;
+                boost::shared_ptr<const CDataStream> pss;
                 {
                     LOCK(cs_mapRelay);
-                    map<CInv, CDataStream>::iterator mi = mapRelay.find(inv);
-                    if (mi != mapRelay.end()) {
-                        pfrom->PushMessage(inv.GetCommand(), (*mi).second);
-                        pushed = true;
-                    }
+                    relaymap_t::const_iterator mi = mapRelay.find(inv);
+                    if (mi != mapRelay.end())
+                        pss = (*mi).second;
+                }
+                if (pss) {
+                    pfrom->PushMessage(inv.GetCommand(), *pss);
+                    pushed = true;
                 }
                 if (!pushed && inv.type == MSG_TX) {
                     CTransaction tx;
@@ -3016,6 +4101,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             pfrom->PushVersion();
 
         pfrom->fClient = !(pfrom->nServices & NODE_NETWORK);
+        pfrom->fCompactBlocks = pfrom->nVersion >= COMPACT_BLOCKS_VERSION && GetBoolArg("-compactblocks", true);
 
         // Change version
         pfrom->PushMessage("verack");
@@ -3070,8 +4156,11 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         LogPrintf("receive version message: version %d, blocks=%d, us=%s, them=%s, peer=%s\n", pfrom->nVersion, pfrom->nStartingHeight, addrMe.ToString(), addrFrom.ToString(), pfrom->addr.ToString());
 
         // ppcoin: ask for pending sync-checkpoint if any
-        if (!IsInitialBlockDownload())
-            Checkpoints::AskForPendingSyncCheckpoint(pfrom);
+        {
+            LOCK(cs_main);
+            if (!IsInitialBlockDownload())
+                Checkpoints::AskForPendingSyncCheckpoint(pfrom);
+        }
 
         if (GetBoolArg("-synctime", true))
             AddTimeData(pfrom->addr, nTime);
@@ -3179,6 +4268,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
 
         LOCK(cs_main);
         CTxDB txdb("r");
+        bool fHeadersSyncing = IsHeadersFirstSyncing();
 
         for (unsigned int nInv = 0; nInv < vInv.size(); nInv++)
         {
@@ -3191,8 +4281,10 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             LogPrint("net", "  got inventory: %s  %s\n", inv.ToString(), fAlreadyHave ? "have" : "new");
 
             if (!fAlreadyHave) {
-                if (!fImporting)
+                if (!fImporting && !mapBlocksInFlight.count(inv.hash))
                     pfrom->AskFor(inv);
+            } else if (fHeadersSyncing) {
+                // missing blocks are fetched along the header chain
             } else if (inv.type == MSG_BLOCK && mapOrphanBlocks.count(inv.hash)) {
                 PushGetBlocks(pfrom, pindexBest, GetOrphanRoot(inv.hash));
             } else if (nInv == nLastBlock) {
@@ -3270,6 +4362,8 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         CSyncCheckpoint checkpoint;
         vRecv >> checkpoint;
 
+        // looks up mapBlockIndex, which other handlers may be extending
+        LOCK(cs_main);
         if (checkpoint.ProcessSyncCheckpoint(pfrom))
         {
             // Relay
@@ -3306,7 +4400,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         }
 
         vector<CBlock> vHeaders;
-        int nLimit = 2000;
+        int nLimit = MAX_HEADERS_RESULTS;
         LogPrint("net", "getheaders %d to %s\n", (pindex ? pindex->nHeight : -1), hashStop.ToString());
         for (; pindex; pindex = pindex->pnext)
         {
@@ -3318,6 +4412,56 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     }
 
 
+    else if (strCommand == "headers")
+    {
+        vector<CBlock> vHeaders;
+        vRecv >> vHeaders;
+        if (vHeaders.size() > MAX_HEADERS_RESULTS)
+        {
+            pfrom->Misbehaving(20);
+            return error("message headers size() = %u", vHeaders.size());
+        }
+
+        LOCK(cs_main);
+
+        // Ignore headers we didn't ask for
+        if (!fHeadersFirst || pfrom->nHeadersRequestTime == 0)
+            return true;
+        pfrom->nHeadersRequestTime = 0;
+
+        // Hash the whole message at once, on this handler thread
+        vector<unsigned char> vData;
+        vData.reserve(vHeaders.size() * BLOCK_HEADER_SIZE);
+        BOOST_FOREACH(const CBlock& header, vHeaders)
+            vData.insert(vData.end(), BEGIN(header.nVersion), END(header.nNonce));
+        vector<uint256> vHash(vHeaders.size());
+        if (!vHeaders.empty())
+            Hash9Batch(&vData[0], vHeaders.size(), &vHash[0]);
+
+        size_t nHeadersBefore = mapHeaderIndex.size();
+        bool fNewBest = false;
+        for (unsigned int i = 0; i < vHeaders.size(); i++)
+        {
+            if (!AcceptBlockHeader(pfrom, vHeaders[i], vHash[i], fNewBest))
+            {
+                pfrom->fHeadersSync = false;
+                break;
+            }
+        }
+        if (fNewBest)
+            UpdateHeaderDownload();
+        if (pfrom->fDisconnect)
+            DropHeadersFrom(pfrom, "invalid header");
+
+        // A short answer means the peer has nothing more for us; a full one
+        // that didn't add any headers would only repeat itself
+        if (vHeaders.size() < MAX_HEADERS_RESULTS || mapHeaderIndex.size() <= nHeadersBefore)
+            pfrom->fHeadersSync = false;
+
+        LogPrint("net", "received %u headers from peer=%s, best header %d %s\n", vHeaders.size(), pfrom->addr.ToString(), nBestHeaderHeight, hashBestHeader.ToString());
+    }
+
+
     else if (strCommand == "tx")
     {
         vector<uint256> vWorkQueue;
@@ -3398,10 +4542,102 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         pfrom->AddInventoryKnown(inv);
 
         LOCK(cs_main);
+        ProcessReceivedBlock(pfrom, block, hashBlock);
+    }
+
+
+    else if (strCommand == "cmpctblock")
+    {
+        CCompactBlock cmpctblock;
+        vRecv >> cmpctblock;
+        uint256 hashBlock = cmpctblock.header.GetHash();
+
+        LogPrint("net", "received compact block %s\n", hashBlock.ToString());
+
+        CInv inv(MSG_BLOCK, hashBlock);
+        pfrom->AddInventoryKnown(inv);
+
+        LOCK(cs_main);
+        if (mapBlockIndex.count(hashBlock) || mapOrphanBlocks.count(hashBlock))
+            return true;
+
+        // Only rebuild blocks on top of our best chain, while our memory pool
+        // is current; otherwise treat it like an inv
+        CPartialBlock partial;
+        partial.hashBlock = hashBlock;
+        if (cmpctblock.header.hashPrevBlock != hashBestChain || IsInitialBlockDownload() ||
+            !InitPartialBlock(cmpctblock, partial))
+        {
+            if (!fImporting && !mapBlocksInFlight.count(hashBlock))
+                pfrom->AskFor(inv);
+            return true;
+        }
+
+        if (partial.vMissing.empty())
+        {
+            mapPartialBlocks.erase(pfrom);
+            FinishPartialBlock(pfrom, partial.block, hashBlock);
+        }
+        else
+        {
+            LogPrint("net", "compact block %s missing %u of %u transactions\n", hashBlock.ToString(), partial.vMissing.size(), partial.block.vtx.size());
+            pfrom->PushMessage("getblocktxn", hashBlock, partial.vMissing);
+            mapPartialBlocks[pfrom] = partial;
+        }
+    }
+
+
+    else if (strCommand == "getblocktxn")
+    {
+        uint256 hashBlock;
+        vector<unsigned int> vIndexes;
+        vRecv >> hashBlock >> vIndexes;
+
+        LOCK(cs_main);
+        map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+        CBlock block;
+        if (mi == mapBlockIndex.end() || !block.ReadFromDisk((*mi).second))
+            return true;
+
+        vector<CTransaction> vtx;
+        vtx.reserve(vIndexes.size());
+        BOOST_FOREACH(unsigned int nIndex, vIndexes)
+        {
+            if (nIndex >= block.vtx.size())
+            {
+                pfrom->Misbehaving(20);
+                return error("message getblocktxn index %u out of range", nIndex);
+            }
+            vtx.push_back(block.vtx[nIndex]);
+        }
+        pfrom->PushMessage("blocktxn", hashBlock, vtx);
+    }
+
+
+    else if (strCommand == "blocktxn")
+    {
+        uint256 hashBlock;
+        vector<CTransaction> vtx;
+        vRecv >> hashBlock >> vtx;
+
+        LOCK(cs_main);
+        map<CNode*, CPartialBlock>::iterator mi = mapPartialBlocks.find(pfrom);
+        if (mi == mapPartialBlocks.end() || mi->second.hashBlock != hashBlock)
+            return true;
+        CPartialBlock partial;
+        std::swap(partial, mi->second);
+        mapPartialBlocks.erase(mi);
+        if (mapBlockIndex.count(hashBlock))
+            return true;
 
-        if (ProcessBlock(pfrom, &block))
-            mapAlreadyAskedFor.erase(inv);
-        if (block.nDoS) pfrom->Misbehaving(block.nDoS);
+        if (vtx.size() != partial.vMissing.size())
+        {
+            pfrom->AskFor(CInv(MSG_BLOCK, hashBlock));
+            return true;
+        }
+        for (unsigned int i = 0; i < vtx.size(); i++)
+            partial.block.vtx[partial.vMissing[i]] = vtx[i];
+        FinishPartialBlock(pfrom, partial.block, hashBlock);
     }
 
 
@@ -3414,7 +4650,10 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     {
         // Don't return addresses older than nCutOff timestamp
         int64_t nCutOff = GetTime() - (nNodeLifespan * 24 * 60 * 60);
-        pfrom->vAddrToSend.clear();
+        {
+            LOCK(pfrom->cs_known);
+            pfrom->vAddrToSend.clear();
+        }
         vector<CAddress> vAddr = addrman.GetAddr();
         BOOST_FOREACH(const CAddress &addr, vAddr)
             if(addr.nTime > nCutOff)
@@ -3424,8 +4663,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
 
     else if (strCommand == "mempool")
     {
-        LOCK(cs_main);
-
+        // the pool has its own lock, no need to wait on cs_main
         std::vector<uint256> vtxid;
         mempool.queryHashes(vtxid);
         vector<CInv> vInv;
@@ -3525,12 +4763,20 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         vRecv >> alert;
 
         uint256 alertHash = alert.GetHash();
-        if (pfrom->setKnown.count(alertHash) == 0)
+        bool fKnown;
+        {
+            LOCK(pfrom->cs_known);
+            fKnown = pfrom->setKnown.count(alertHash) != 0;
+        }
+        if (!fKnown)
         {
             if (alert.ProcessAlert())
             {
                 // Relay
-                pfrom->setKnown.insert(alertHash);
+                {
+                    LOCK(pfrom->cs_known);
+                    pfrom->setKnown.insert(alertHash);
+                }
                 {
                     LOCK(cs_vNodes);
                     BOOST_FOREACH(CNode* pnode, vNodes)
@@ -3689,45 +4935,109 @@ bool ProcessMessages(CNode* pfrom)
 
 bool SendMessages(CNode* pto, bool fSendTrickle)
 {
-    TRY_LOCK(cs_main, lockMain);
-    if (lockMain) {
-        // Don't send anything until we get their version message
-        if (pto->nVersion == 0)
-            return true;
+    // Don't send anything until we get their version message
+    if (pto->nVersion == 0)
+        return true;
 
-        //
-        // Message: ping
-        //
-        bool pingSend = false;
-        if (pto->fPingQueued) {
-            // RPC ping request by user
-            pingSend = true;
+    // Pings and addr relay only involve this peer, so they go out even
+    // while another thread holds cs_main to connect a block
+    //
+    // Message: ping
+    //
+    bool pingSend = false;
+    if (pto->fPingQueued) {
+        // RPC ping request by user
+        pingSend = true;
+    }
+    if (pto->nPingNonceSent == 0 && pto->nPingUsecStart + PING_INTERVAL * 1000000 < GetTimeMicros()) {
+        // Ping automatically sent as a latency probe & keepalive.
+        pingSend = true;
+    }
+    if (pingSend) {
+        uint64_t nonce = 0;
+        while (nonce == 0) {
+            RAND_bytes((unsigned char*)&nonce, sizeof(nonce));
         }
-        if (pto->nPingNonceSent == 0 && pto->nPingUsecStart + PING_INTERVAL * 1000000 < GetTimeMicros()) {
-            // Ping automatically sent as a latency probe & keepalive.
-            pingSend = true;
+        pto->fPingQueued = false;
+        pto->nPingUsecStart = GetTimeMicros();
+        if (pto->nVersion > BIP0031_VERSION) {
+            pto->nPingNonceSent = nonce;
+            pto->PushMessage("ping", nonce);
+        } else {
+            // Peer is too old to support ping command with nonce, pong will never arrive.
+            pto->nPingNonceSent = 0;
+            pto->PushMessage("ping");
         }
-        if (pingSend) {
-            uint64_t nonce = 0;
-            while (nonce == 0) {
-                RAND_bytes((unsigned char*)&nonce, sizeof(nonce));
-            }
-            pto->fPingQueued = false;
-            pto->nPingUsecStart = GetTimeMicros();
-            if (pto->nVersion > BIP0031_VERSION) {
-                pto->nPingNonceSent = nonce;
-                pto->PushMessage("ping", nonce);
-            } else {
-                // Peer is too old to support ping command with nonce, pong will never arrive.
-                pto->nPingNonceSent = 0;
-                pto->PushMessage("ping");
+    }
+
+    //
+    // Message: addr
+    //
+    if (fSendTrickle)
+    {
+        vector<CAddress> vAddr;
+        {
+            LOCK(pto->cs_known);
+            vAddr.reserve(pto->vAddrToSend.size());
+            BOOST_FOREACH(const CAddress& addr, pto->vAddrToSend)
+            {
+                // returns true if wasn't already contained in the set
+                if (pto->setAddrKnown.insert(addr).second)
+                    vAddr.push_back(addr);
             }
+            pto->vAddrToSend.clear();
         }
+        // receiver rejects addr messages larger than 1000
+        for (unsigned int i = 0; i < vAddr.size(); i += 1000)
+            pto->PushMessage("addr", vector<CAddress>(vAddr.begin() + i, vAddr.begin() + min(vAddr.size(), (size_t)i + 1000)));
+    }
 
+    TRY_LOCK(cs_main, lockMain);
+    if (lockMain) {
         // Start block sync
         if (pto->fStartSync && !fImporting && !fReindex) {
             pto->fStartSync = false;
-            PushGetBlocks(pto, pindexBest, uint256(0));
+            if (IsHeadersFirstSyncing()) {
+                pto->fHeadersSync = true;
+                pto->fGetBlocksAfterHeaders = true;
+            } else
+                PushGetBlocks(pto, pindexBest, uint256(0));
+        }
+
+        // Headers-first sync: keep the header chain ahead of the best block
+        if (fHeadersFirst && !fImporting && !fReindex) {
+            if (pto->nHeadersRequestTime != 0 && GetTime() - pto->nHeadersRequestTime > HEADERS_RESPONSE_TIMEOUT) {
+                LogPrint("net", "getheaders to peer=%s timed out\n", pto->addr.ToString());
+                pto->nHeadersRequestTime = 0;
+                pto->fHeadersSync = false;
+                HandOverHeadersSync(pto);
+            }
+            if (pto->fHeadersSync && pto->nHeadersRequestTime == 0 && nBestHeaderHeight - nBestHeight < MAX_HEADERS_AHEAD)
+                PushGetHeaders(pto);
+
+            if (nBestHeight != nLastProgressHeight) {
+                nLastProgressHeight = nBestHeight;
+                nLastProgressTime = GetTime();
+            } else if (IsHeadersFirstSyncing() && GetTime() - nLastProgressTime > HEADERS_STALL_TIMEOUT) {
+                // Blame the peer that sent the header of the next block we
+                // need; with no header chain at all, ask this peer for blocks
+                nLastProgressTime = GetTime();
+                if (!vHeaderDownload.empty()) {
+                    CNode* pnode = mapHeaderIndex[vHeaderDownload.front()].pfrom;
+                    if (pnode)
+                        pnode->fDisconnect = true;
+                    DropHeadersFrom(pnode, "no progress along the header chain");
+                } else {
+                    PushGetBlocks(pto, pindexBest, uint256(0));
+                }
+            }
+
+            // Past the checkpointed range, go on with getblocks
+            if (pto->fGetBlocksAfterHeaders && !IsHeadersFirstSyncing()) {
+                pto->fGetBlocksAfterHeaders = false;
+                pto->fHeadersSync = false;
+                PushGetBlocks(pto, pindexBest, uint256(0));
+            }
         }
 
         // Resend wallet transactions that haven't gotten in a block yet
@@ -3747,7 +5057,10 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             {
                 // Periodically clear setAddrKnown to allow refresh broadcasts
                 if (nLastRebroadcast)
+                {
+                    LOCK(pnode->cs_known);
                     pnode->setAddrKnown.clear();
+                }
 
                 // Rebroadcast our address
                 AdvertizeLocal(pnode);
@@ -3756,33 +5069,6 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
                 nLastRebroadcast = GetTime();
         }
 
-        //
-        // Message: addr
-        //
-        if (fSendTrickle)
-        {
-            vector<CAddress> vAddr;
-            vAddr.reserve(pto->vAddrToSend.size());
-            BOOST_FOREACH(const CAddress& addr, pto->vAddrToSend)
-            {
-                // returns true if wasn't already contained in the set
-                if (pto->setAddrKnown.insert(addr).second)
-                {
-                    vAddr.push_back(addr);
-                    // receiver rejects addr messages larger than 1000
-                    if (vAddr.size() >= 1000)
-                    {
-                        pto->PushMessage("addr", vAddr);
-                        vAddr.clear();
-                    }
-                }
-            }
-            pto->vAddrToSend.clear();
-            if (!vAddr.empty())
-                pto->PushMessage("addr", vAddr);
-        }
-
-
         //
         // Message: inventory
         //
@@ -3794,7 +5080,7 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             vInvWait.reserve(pto->vInventoryToSend.size());
             BOOST_FOREACH(const CInv& inv, pto->vInventoryToSend)
             {
-                if (pto->setInventoryKnown.count(inv))
+                if (pto->filterInventoryKnown.contains(inv.hash))
                     continue;
 
                 // trickle out tx inv to protect privacy
@@ -3815,15 +5101,13 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
                     }
                 }
 
-                // returns true if wasn't already contained in the set
-                if (pto->setInventoryKnown.insert(inv).second)
+                // a repeat of this item later in vInventoryToSend is skipped above
+                pto->filterInventoryKnown.insert(inv.hash);
+                vInv.push_back(inv);
+                if (vInv.size() >= 1000)
                 {
-                    vInv.push_back(inv);
-                    if (vInv.size() >= 1000)
-                    {
-                        pto->PushMessage("inv", vInv);
-                        vInv.clear();
-                    }
+                    pto->PushMessage("inv", vInv);
+                    vInv.clear();
                 }
             }
             pto->vInventoryToSend = vInvWait;
@@ -3855,6 +5139,8 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             }
             pto->mapAskFor.erase(pto->mapAskFor.begin());
         }
+        if (fHeadersFirst && !fImporting && !fReindex)
+            RequestHeaderBlocks(pto, vGetData);
         if (!vGetData.empty())
             pto->PushMessage("getdata", vGetData);
 
@@ -8,9 +8,9 @@
 #include "core.h"
 #include "bignum.h"
 #include "sync.h"
-#include "txmempool.h"
 #include "net.h"
 #include "hashblock.h"
+#include "blockstore.h"
 //#include "script.h"
 //#include "scrypt.h"
 
@@ -22,6 +22,7 @@ class CInv;
 class CKeyItem;
 class CNode;
 class CReserveKey;
+class CTxMemPool;
 class CWallet;
 
 /** The maximum allowed size for a serialized block, in bytes (network rule) */
@@ -40,12 +41,46 @@ static const unsigned int MAX_TX_SIGOPS = MAX_BLOCK_SIGOPS/5;
 static const unsigned int MAX_ORPHAN_TRANSACTIONS = MAX_BLOCK_SIZE/100;
 /** Default for -maxorphanblocks, maximum number of orphan blocks kept in memory */
 static const unsigned int DEFAULT_MAX_ORPHAN_BLOCKS = 750;
+/** Maximum number of script-checking threads allowed */
+static const int MAX_SCRIPTCHECK_THREADS = 16;
+/** -par default (number of script-checking threads, 0 = auto) */
+static const int DEFAULT_SCRIPTCHECK_THREADS = 0;
+/** Maximum number of threads checking blocks read from a -loadblock or bootstrap.dat file */
+static const int MAX_IMPORT_CHECK_THREADS = 16;
+/** Bytes of blocks read ahead of the one being connected during a block file import */
+static const size_t IMPORT_QUEUE_BYTES = 64 * 1024 * 1024;
+/** Blocks an import check thread takes at once, so their headers can be hashed together */
+static const size_t IMPORT_HASH_BATCH = 8;
 /** The maximum number of entries in an 'inv' protocol message */
 static const unsigned int MAX_INV_SZ = 50000;
+/** The maximum number of headers in a 'headers' protocol message */
+static const unsigned int MAX_HEADERS_RESULTS = 2000;
+/** Number of blocks that can be requested from a single peer at a time during headers-first sync */
+static const int MAX_BLOCKS_IN_FLIGHT = 16;
+/** Headers-first sync only fetches blocks this far ahead of the best block (bounded by -maxorphanblocks) */
+static const int BLOCK_DOWNLOAD_WINDOW = 512;
+/** Headers-first sync does not request headers further than this ahead of the best block */
+static const int MAX_HEADERS_AHEAD = 50000;
+/** Seconds before an unanswered block request is handed to another peer */
+static const int64_t BLOCK_DOWNLOAD_TIMEOUT = 60;
+/** Seconds without chain progress before the peer that sent the stuck header chain is dropped */
+static const int64_t HEADERS_STALL_TIMEOUT = 10 * 60;
+/** Seconds before an unanswered getheaders is given up and header sync moves to another peer */
+static const int64_t HEADERS_RESPONSE_TIMEOUT = 2 * 60;
+/** Undo records are kept for this many blocks below the tip */
+static const int BLOCK_UNDO_DEPTH = 1000;
+/** Seconds between rewrites of the block index snapshot */
+static const int64_t BLOCK_INDEX_SNAPSHOT_INTERVAL = 24 * 60 * 60;
 /** Fees smaller than this (in satoshi) are considered zero fee (for transaction creation) */
 static const int64_t MIN_TX_FEE = 10000;
 /** Fees smaller than this (in satoshi) are considered zero fee (for relaying) */
 static const int64_t MIN_RELAY_TX_FEE = MIN_TX_FEE;
+/** Default for -maxmempool, memory used by the transaction memory pool in megabytes */
+static const unsigned int DEFAULT_MAX_MEMPOOL_SIZE = 300;
+/** Default for -persistmempool, keep the memory pool in mempool.dat across restarts */
+static const bool DEFAULT_PERSIST_MEMPOOL = true;
+/** Seconds for the minimum fee rate raised by memory pool evictions to halve */
+static const int64_t MEMPOOL_ROLLING_FEE_HALFLIFE = 12 * 60 * 60;
 /** No amount larger than this (in satoshi) is valid */
 static const uint64_t MAX_MONEY = 4000000000 * COIN; // 850 Million
 inline bool MoneyRange(int64_t nValue) { return (nValue >= 0 && nValue <= MAX_MONEY); }
@@ -78,9 +113,11 @@ extern const std::string strMessageMagic;
 extern int64_t nTimeBestReceived;
 extern bool fImporting;
 extern bool fReindex;
+extern bool fHeadersFirst;
 struct COrphanBlock;
 extern std::map<uint256, COrphanBlock*> mapOrphanBlocks;
 extern bool fHaveGUI;
+extern int nScriptCheckThreads;
 
 // Settings
 extern bool fUseFastIndex;
@@ -92,6 +129,7 @@ extern bool fMinimizeCoinAge;
 static const uint64_t nMinDiskSpace = 52428800;
 
 class CReserveKey;
+class CScriptCheck;
 class CTxDB;
 class CTxIndex;
 class CWalletInterface;
@@ -113,17 +151,23 @@ void RegisterNodeSignals(CNodeSignals& nodeSignals);
 void UnregisterNodeSignals(CNodeSignals& nodeSignals);
 
 void PushGetBlocks(CNode* pnode, CBlockIndex* pindexBegin, uint256 hashEnd);
+/** Ask a peer for the headers following our best known header */
+void PushGetHeaders(CNode* pnode);
 
 bool ProcessBlock(CNode* pfrom, CBlock* pblock);
+/** Process a block whose hash the caller already has; fChecked says a full
+ * CheckBlock() has passed on it, as the block importer's workers do. */
+bool ProcessBlock(CNode* pfrom, CBlock* pblock, const uint256& hash, bool fChecked);
 bool CheckDiskSpace(uint64_t nAdditionalBytes=0);
 FILE* OpenBlockFile(unsigned int nFile, unsigned int nBlockPos, const char* pszMode="rb");
-FILE* AppendBlockFile(unsigned int& nFileRet);
 bool LoadBlockIndex(bool fAllowNew=true);
 void PrintBlockTree();
 CBlockIndex* FindBlockByHeight(int nHeight);
 bool ProcessMessages(CNode* pfrom);
 bool SendMessages(CNode* pto, bool fSendTrickle);
 void ThreadImport(std::vector<boost::filesystem::path> vImportFiles);
+/** Run an instance of the script checking thread */
+void ThreadScriptCheck();
 
 bool CheckProofOfWork(uint256 hash, unsigned int nBits);
 unsigned int GetNextTargetRequired(const CBlockIndex* pindexLast, bool fProofOfStake);
@@ -138,7 +182,11 @@ void ThreadStakeMiner(CWallet *pwallet);
 
 
 /** (try to) add transaction to memory pool **/
-bool AcceptToMemoryPool(CTxMemPool& pool, CTransaction &tx, bool fLimitFree, bool* pfMissingInputs);
+bool AcceptToMemoryPool(CTxMemPool& pool, CTransaction &tx, bool fLimitFree, bool* pfMissingInputs, int64_t nAcceptTime = 0);
+/** Write the memory pool to mempool.dat, for LoadMempool after a restart */
+bool DumpMempool();
+/** Read mempool.dat back, accepting its transactions to the pool again */
+bool LoadMempool();
 
 
 
@@ -202,6 +250,33 @@ typedef std::map<uint256, std::pair<CTxIndex, CTransaction> > MapPrevTx;
 
 int64_t GetMinFee(const CTransaction& tx, unsigned int nBlockSize = 1, enum GetMinFee_mode mode = GMF_BLOCK, unsigned int nBytes = 0);
 
+/** Hash of a transaction, filled in when it's deserialized. A copy starts out
+ * empty, so copied transactions can be modified freely; a move keeps it. */
+class CTxHashCache
+{
+public:
+    uint256 hash;
+    bool fSet;
+
+    CTxHashCache() : fSet(false) {}
+    CTxHashCache(const CTxHashCache&) : fSet(false) {}
+    CTxHashCache(CTxHashCache&& other) noexcept : hash(other.hash), fSet(other.fSet) { other.fSet = false; }
+
+    CTxHashCache& operator=(const CTxHashCache&)
+    {
+        fSet = false;
+        return *this;
+    }
+
+    CTxHashCache& operator=(CTxHashCache&& other) noexcept
+    {
+        hash = other.hash;
+        fSet = other.fSet;
+        other.fSet = false;
+        return *this;
+    }
+};
+
 /** The basic transaction that is broadcasted on the network and contained in
  * blocks.  A transaction can contain multiple inputs and outputs.
  */
@@ -219,6 +294,9 @@ public:
     mutable int nDoS;
     bool DoS(int nDoSIn, bool fIn) const { nDoS += nDoSIn; return fIn; }
 
+    // memory only
+    CTxHashCache hashCache;
+
     CTransaction()
     {
         SetNull();
@@ -237,6 +315,13 @@ public:
         READWRITE(vin);
         READWRITE(vout);
         READWRITE(nLockTime);
+        if (fRead)
+        {
+            CTxHashCache& cache = const_cast<CTransaction*>(this)->hashCache;
+            cache.fSet = false;
+            cache.hash = GetHash();
+            cache.fSet = true;
+        }
     )
 
     void SetNull()
@@ -247,6 +332,7 @@ public:
         vout.clear();
         nLockTime = 0;
         nDoS = 0;  // Denial-of-service prevention
+        hashCache.fSet = false;
     }
 
     bool IsNull() const
@@ -256,6 +342,8 @@ public:
 
     uint256 GetHash() const
     {
+        if (hashCache.fSet)
+            return hashCache.hash;
         return SerializeHash(*this);
     }
 
@@ -297,7 +385,10 @@ public:
 
     bool ReadFromDisk(CDiskTxPos pos, FILE** pfileRet=NULL)
     {
-        CAutoFile filein = CAutoFile(OpenBlockFile(pos.nFile, 0, pfileRet ? "rb+" : "rb"), SER_DISK, CLIENT_VERSION);
+        if (!pfileRet)
+            return ReadTransactionFromDisk(*this, pos.nFile, pos.nBlockPos, pos.nTxPos);
+
+        CAutoFile filein = CAutoFile(OpenBlockFile(pos.nFile, 0, "rb+"), SER_DISK, CLIENT_VERSION);
         if (!filein)
             return error("CTransaction::ReadFromDisk() : OpenBlockFile failed");
 
@@ -382,11 +473,13 @@ public:
         @param[in] pindexBlock
         @param[in] fBlock	true if called from ConnectBlock
         @param[in] fMiner	true if called from CreateNewBlock
+        @param[out] pvChecks	if not NULL, script checks are appended here instead of being run
         @return Returns true if all checks succeed
      */
     bool ConnectInputs(CTxDB& txdb, MapPrevTx inputs,
                        std::map<uint256, CTxIndex>& mapTestPool, const CDiskTxPos& posThisTx,
-                       const CBlockIndex* pindexBlock, bool fBlock, bool fMiner, unsigned int flags = STANDARD_SCRIPT_VERIFY_FLAGS);
+                       const CBlockIndex* pindexBlock, bool fBlock, bool fMiner, unsigned int flags = STANDARD_SCRIPT_VERIFY_FLAGS,
+                       std::vector<CScriptCheck> *pvChecks = NULL);
     bool CheckTransaction() const;
     const CTxOut& GetOutputFor(const CTxIn& input, const MapPrevTx& inputs) const;
 };
@@ -408,6 +501,35 @@ public:
     )
 };
 
+/** Closure representing one script verification.
+ *  Note that this stores a reference to the spending transaction.
+ */
+class CScriptCheck
+{
+private:
+    CScript scriptPubKey;
+    const CTransaction *ptxTo;
+    unsigned int nIn;
+    unsigned int nFlags;
+    int nHashType;
+
+public:
+    CScriptCheck() : ptxTo(0), nIn(0), nFlags(0), nHashType(0) {}
+    CScriptCheck(const CScript& scriptPubKeyIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, int nHashTypeIn) :
+        scriptPubKey(scriptPubKeyIn), ptxTo(&txToIn), nIn(nInIn), nFlags(nFlagsIn), nHashType(nHashTypeIn) {}
+
+    bool operator()() const;
+
+    void swap(CScriptCheck &check)
+    {
+        scriptPubKey.swap(check.scriptPubKey);
+        std::swap(ptxTo, check.ptxTo);
+        std::swap(nIn, check.nIn);
+        std::swap(nFlags, check.nFlags);
+        std::swap(nHashType, check.nHashType);
+    }
+};
+
 /** Check for standard transaction types
     @param[in] mapInputs	Map of previous transactions that have outputs we're spending
     @return True if all inputs (scriptSigs) use only standard transaction forms
@@ -551,6 +673,99 @@ public:
 };
 
 
+/**  A txdb record for one unspent output of a main chain transaction. It holds
+ * everything input validation needs about the output, so spending it doesn't
+ * require reading the whole previous transaction back from the block files.
+ */
+class CTxUnspent
+{
+public:
+    enum
+    {
+        UNSPENT_COINBASE  = (1 << 0),
+        UNSPENT_COINSTAKE = (1 << 1),
+    };
+
+    CTxOut txout;
+    int nHeight;             // height of the block containing the transaction
+    unsigned int nTime;      // transaction timestamp
+    unsigned int nBlockTime; // timestamp of the block containing the transaction
+    unsigned char nFlags;
+
+    CTxUnspent()
+    {
+        SetNull();
+    }
+
+    CTxUnspent(const CTransaction& tx, unsigned int n, int nHeightIn, unsigned int nBlockTimeIn)
+    {
+        txout = tx.vout[n];
+        nHeight = nHeightIn;
+        nTime = tx.nTime;
+        nBlockTime = nBlockTimeIn;
+        nFlags = 0;
+        if (tx.IsCoinBase())
+            nFlags |= UNSPENT_COINBASE;
+        if (tx.IsCoinStake())
+            nFlags |= UNSPENT_COINSTAKE;
+    }
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(nFlags);
+        READWRITE(VARINT(nHeight));
+        READWRITE(nTime);
+        READWRITE(nBlockTime);
+        READWRITE(REF(CTxOutCompressor(REF(txout))));
+    )
+
+    void SetNull()
+    {
+        txout.SetNull();
+        nHeight = 0;
+        nTime = 0;
+        nBlockTime = 0;
+        nFlags = 0;
+    }
+
+    bool IsNull() const
+    {
+        return txout.IsNull();
+    }
+
+    bool IsCoinBase() const
+    {
+        return (nFlags & UNSPENT_COINBASE);
+    }
+
+    bool IsCoinStake() const
+    {
+        return (nFlags & UNSPENT_COINSTAKE);
+    }
+};
+
+
+/** Undo record of a main chain block: what it changed outside its own
+ * transactions, as it was before the block was connected. Disconnecting the
+ * block writes these back instead of looking up and rewriting what every
+ * input spent.
+ */
+class CBlockUndo
+{
+public:
+    // Index entries of earlier transactions the block spent from
+    std::vector<std::pair<uint256, CTxIndex> > vPrevTxIndex;
+    // Unspent outputs of earlier transactions the block spent
+    std::vector<std::pair<COutPoint, CTxUnspent> > vSpentOutputs;
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(vPrevTxIndex);
+        READWRITE(vSpentOutputs);
+    )
+};
+
+
 
 
 
@@ -649,11 +864,11 @@ public:
     void UpdateTime(const CBlockIndex* pindexPrev);
 
     // entropy bit for stake modifier if chosen by modifier
-    unsigned int GetStakeEntropyBit() const
+    unsigned int GetStakeEntropyBit(const uint256& hashBlock) const
     {
         // Take last bit of block hash as entropy bit
-        unsigned int nEntropyBit = ((GetHash().GetLow64()) & 1llu);
-        LogPrint("stakemodifier", "GetStakeEntropyBit: hashBlock=%s nEntropyBit=%u\n", GetHash().ToString(), nEntropyBit);
+        unsigned int nEntropyBit = ((hashBlock.GetLow64()) & 1llu);
+        LogPrint("stakemodifier", "GetStakeEntropyBit: hashBlock=%s nEntropyBit=%u\n", hashBlock.ToString(), nEntropyBit);
         return nEntropyBit;
     }
 
@@ -685,17 +900,20 @@ public:
     uint256 BuildMerkleTree() const
     {
         vMerkleTree.clear();
+        vMerkleTree.reserve(vtx.size() * 2 + 16);
         BOOST_FOREACH(const CTransaction& tx, vtx)
             vMerkleTree.push_back(tx.GetHash());
         int j = 0;
         for (int nSize = vtx.size(); nSize > 1; nSize = (nSize + 1) / 2)
         {
-            for (int i = 0; i < nSize; i += 2)
-            {
-                int i2 = std::min(i+1, nSize-1);
-                vMerkleTree.push_back(Hash(BEGIN(vMerkleTree[j+i]),  END(vMerkleTree[j+i]),
-                                           BEGIN(vMerkleTree[j+i2]), END(vMerkleTree[j+i2])));
-            }
+            // The pairs of a level are adjacent 64-byte inputs, hashed as one
+            // batch. An odd node out at the end is paired with itself.
+            int nPairs = nSize / 2;
+            vMerkleTree.resize(j + nSize + (nSize + 1) / 2);
+            SHA256D64(vMerkleTree[j+nSize].begin(), vMerkleTree[j].begin(), nPairs);
+            if (nSize & 1)
+                vMerkleTree[j+nSize+nPairs] = Hash(BEGIN(vMerkleTree[j+nSize-1]), END(vMerkleTree[j+nSize-1]),
+                                                   BEGIN(vMerkleTree[j+nSize-1]), END(vMerkleTree[j+nSize-1]));
             j += nSize;
         }
         return (vMerkleTree.empty() ? 0 : vMerkleTree.back());
@@ -735,51 +953,20 @@ public:
 
     bool WriteToDisk(unsigned int& nFileRet, unsigned int& nBlockPosRet)
     {
-        // Open history file to append
-        CAutoFile fileout = CAutoFile(AppendBlockFile(nFileRet), SER_DISK, CLIENT_VERSION);
-        if (!fileout)
-            return error("CBlock::WriteToDisk() : AppendBlockFile failed");
-
-        // Write index header
-        unsigned int nSize = fileout.GetSerializeSize(*this);
-        fileout << FLATDATA(Params().MessageStart()) << nSize;
-
-        // Write block
-        long fileOutPos = ftell(fileout);
-        if (fileOutPos < 0)
-            return error("CBlock::WriteToDisk() : ftell failed");
-        nBlockPosRet = fileOutPos;
-        fileout << *this;
-
-        // Flush stdio buffers and commit to disk before returning
-        fflush(fileout);
-        if (!IsInitialBlockDownload() || (nBestHeight+1) % 500 == 0)
-            FileCommit(fileout);
-
-        return true;
+        return WriteBlockToDisk(*this, nFileRet, nBlockPosRet, !IsInitialBlockDownload() || (nBestHeight+1) % 500 == 0);
     }
 
     bool ReadFromDisk(unsigned int nFile, unsigned int nBlockPos, bool fReadTransactions=true)
     {
         SetNull();
 
-        // Open history file to read
-        CAutoFile filein = CAutoFile(OpenBlockFile(nFile, nBlockPos, "rb"), SER_DISK, CLIENT_VERSION);
-        if (!filein)
-            return error("CBlock::ReadFromDisk() : OpenBlockFile failed");
         if (!fReadTransactions)
-            filein.nType |= SER_BLOCKHEADERONLY;
-
-        // Read block
-        try {
-            filein >> *this;
-        }
-        catch (std::exception &e) {
-            return error("%s() : deserialize or I/O error", __PRETTY_FUNCTION__);
-        }
+            return ReadBlockHeaderFromDisk(*this, nFile, nBlockPos);
+        if (!ReadBlockFromDisk(*this, nFile, nBlockPos))
+            return false;
 
         // Check the header
-        if (fReadTransactions && IsProofOfWork() && !CheckProofOfWork(GetHash(), nBits))
+        if (IsProofOfWork() && !CheckProofOfWork(GetHash(), nBits))
             return error("CBlock::ReadFromDisk() : errors in block header");
 
         return true;
@@ -814,9 +1001,10 @@ public:
     bool ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck=false);
     bool ReadFromDisk(const CBlockIndex* pindex, bool fReadTransactions=true);
     bool SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew);
-    bool AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos, const uint256& hashProof);
-    bool CheckBlock(bool fCheckPOW=true, bool fCheckMerkleRoot=true, bool fCheckSig=true) const;
-    bool AcceptBlock();
+    bool AddToBlockIndex(const uint256& hash, unsigned int nFile, unsigned int nBlockPos, const uint256& hashProof);
+    // phash, if given, is the block's hash, to save working it out again
+    bool CheckBlock(bool fCheckPOW=true, bool fCheckMerkleRoot=true, bool fCheckSig=true, const uint256* phash=NULL) const;
+    bool AcceptBlock(const uint256& hash);
     bool SignBlock(CWallet& keystore, int64_t nFees);
     bool CheckBlockSignature() const;
 
@@ -826,6 +1014,56 @@ private:
 
 
 
+/** A block as relayed to peers that understand compact blocks: the header
+ * and block signature, the coinbase and coinstake sent whole since no peer
+ * can have them yet, and short ids for the remaining transactions, which the
+ * receiver looks up in its memory pool.
+ */
+class CCompactBlock
+{
+public:
+    CBlock header;
+    uint64_t nShortIdNonce;
+    std::vector<CTransaction> vPrefilled; // the leading transactions of the block
+    std::vector<uint64_t> vShortIds; // the rest, in block order
+
+    CCompactBlock()
+    {
+        nShortIdNonce = 0;
+    }
+
+    explicit CCompactBlock(const CBlock& block);
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(header.nVersion);
+        READWRITE(header.hashPrevBlock);
+        READWRITE(header.hashMerkleRoot);
+        READWRITE(header.nTime);
+        READWRITE(header.nBits);
+        READWRITE(header.nNonce);
+        READWRITE(header.vchBlockSig);
+        READWRITE(nShortIdNonce);
+        READWRITE(vPrefilled);
+        READWRITE(vShortIds);
+    )
+
+    // Salted per block, so ids that collide in one block won't in the next
+    uint256 GetShortIdKey() const
+    {
+        uint256 hashBlock = header.GetHash();
+        return Hash(BEGIN(hashBlock), END(hashBlock), BEGIN(nShortIdNonce), END(nShortIdNonce));
+    }
+
+    static uint64_t GetShortId(const uint256& hashKey, const uint256& hashTx)
+    {
+        uint256 hash = hashKey ^ hashTx;
+        return Hash(BEGIN(hash), END(hash)).GetLow64();
+    }
+};
+
+
+
 
 
 
@@ -1108,11 +1346,14 @@ public:
         READWRITE(blockHash);
     )
 
-    uint256 GetBlockHash() const
+    // Whether the hash stored with the entry can be trusted instead of hashing the header
+    bool HasStoredHash() const
     {
-        if (fUseFastIndex && (nTime < GetAdjustedTime() - 24 * 60 * 60) && blockHash != 0)
-            return blockHash;
+        return fUseFastIndex && (nTime < GetAdjustedTime() - 24 * 60 * 60) && blockHash != 0;
+    }
 
+    CBlock GetBlockHeader() const
+    {
         CBlock block;
         block.nVersion        = nVersion;
         block.hashPrevBlock   = hashPrev;
@@ -1120,8 +1361,15 @@ public:
         block.nTime           = nTime;
         block.nBits           = nBits;
         block.nNonce          = nNonce;
+        return block;
+    }
+
+    uint256 GetBlockHash() const
+    {
+        if (HasStoredHash())
+            return blockHash;
 
-        const_cast<CDiskBlockIndex*>(this)->blockHash = block.GetHash();
+        const_cast<CDiskBlockIndex*>(this)->blockHash = GetBlockHeader().GetHash();
 
         return blockHash;
     }
@@ -1294,4 +1542,7 @@ protected:
     friend void ::UnregisterAllWallets();
 };
 
+// The pool holds CTransactions by value, so it can only be defined here
+#include "txmempool.h"
+
 #endif
@@ -53,49 +53,24 @@ void SHA256Transform(void* pstate, void* pinput, const void* pinit)
         ((uint32_t*)pstate)[i] = ctx.h[i];
 }
 
-// Some explaining would be appreciated
-class COrphan
-{
-public:
-    CTransaction* ptx;
-    set<uint256> setDependsOn;
-    double dPriority;
-    double dFeePerKb;
-
-    COrphan(CTransaction* ptxIn)
-    {
-        ptx = ptxIn;
-        dPriority = dFeePerKb = 0;
-    }
-};
-
-
 uint64_t nLastBlockTx = 0;
 uint64_t nLastBlockSize = 0;
 int64_t nLastCoinStakeSearchInterval = 0;
 int64_t nCoinStakeFailedAttempts = 0;
 
-// We want to sort transactions by priority and fee, so:
-typedef boost::tuple<double, double, CTransaction*> TxPriority;
+// Pool entries are taken by priority, and by fee once past the priority
+// area; for a heap the comparison is inverted so the best is on top
 class TxPriorityCompare
 {
     bool byFee;
 public:
     TxPriorityCompare(bool _byFee) : byFee(_byFee) { }
-    bool operator()(const TxPriority& a, const TxPriority& b)
+    bool operator()(const CTxMemPoolEntry* a, const CTxMemPoolEntry* b)
     {
         if (byFee)
-        {
-            if (a.get<1>() == b.get<1>())
-                return a.get<0>() < b.get<0>();
-            return a.get<1>() < b.get<1>();
-        }
+            return CompareTxMemPoolEntryByFeeRate()(b, a);
         else
-        {
-            if (a.get<0>() == b.get<0>())
-                return a.get<1>() < b.get<1>();
-            return a.get<0>() < b.get<0>();
-        }
+            return CompareTxMemPoolEntryByPriority()(b, a);
     }
 };
 
@@ -167,80 +142,16 @@ CBlock* CreateNewBlock(CReserveKey& reservekey, bool fProofOfStake, int64_t* pFe
         LOCK2(cs_main, mempool.cs);
         CTxDB txdb("r");
 
-        // Priority order to process transactions
-        list<COrphan> vOrphan; // list memory doesn't move
-        map<uint256, vector<COrphan*> > mapDependers;
-
-        // This vector will be sorted into a priority queue:
-        vector<TxPriority> vecPriority;
-        vecPriority.reserve(mempool.mapTx.size());
-        for (map<uint256, CTransaction>::iterator mi = mempool.mapTx.begin(); mi != mempool.mapTx.end(); ++mi)
-        {
-            CTransaction& tx = (*mi).second;
-            if (tx.IsCoinBase() || tx.IsCoinStake() || !IsFinalTx(tx, nHeight))
-                continue;
-
-            COrphan* porphan = NULL;
-            double dPriority = 0;
-            int64_t nTotalIn = 0;
-            bool fMissingInputs = false;
-            BOOST_FOREACH(const CTxIn& txin, tx.vin)
-            {
-                // Read prev transaction
-                CTransaction txPrev;
-                CTxIndex txindex;
-                if (!txPrev.ReadFromDisk(txdb, txin.prevout, txindex))
-                {
-                    // This should never happen; all transactions in the memory
-                    // pool should connect to either transactions in the chain
-                    // or other transactions in the memory pool.
-                    if (!mempool.mapTx.count(txin.prevout.hash))
-                    {
-                        LogPrintf("ERROR: mempool transaction missing input\n");
-                        if (fDebug) assert("mempool transaction missing input" == 0);
-                        fMissingInputs = true;
-                        if (porphan)
-                            vOrphan.pop_back();
-                        break;
-                    }
-
-                    // Has to wait for dependencies
-                    if (!porphan)
-                    {
-                        // Use list for automatic deletion
-                        vOrphan.push_back(COrphan(&tx));
-                        porphan = &vOrphan.back();
-                    }
-                    mapDependers[txin.prevout.hash].push_back(porphan);
-                    porphan->setDependsOn.insert(txin.prevout.hash);
-                    nTotalIn += mempool.mapTx[txin.prevout.hash].vout[txin.prevout.n].nValue;
-                    continue;
-                }
-                int64_t nValueIn = txPrev.vout[txin.prevout.n].nValue;
-                nTotalIn += nValueIn;
-
-                int nConf = txindex.GetDepthInMainChain();
-                dPriority += (double)nValueIn * nConf;
-            }
-            if (fMissingInputs) continue;
-
-            // Priority is sum(valuein * age) / txsize
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            dPriority /= nTxSize;
-
-            // This is a more accurate fee-per-kilobyte than is used by the client code, because the
-            // client code rounds up the size to the nearest 1K. That's good, because it gives an
-            // incentive to create smaller transactions.
-            double dFeePerKb =  double(nTotalIn-tx.GetValueOut()) / (double(nTxSize)/1000.0);
-
-            if (porphan)
-            {
-                porphan->dPriority = dPriority;
-                porphan->dFeePerKb = dFeePerKb;
-            }
-            else
-                vecPriority.push_back(TxPriority(dPriority, dFeePerKb, &(*mi).second));
-        }
+        // The pool keeps its entries ordered by priority and by fee rate,
+        // so the block is filled by walking those indexes. A transaction
+        // that spends another pool transaction not in the block yet waits
+        // in mapDependers, and goes on the vecReady heap once its last
+        // missing parent has been added.
+        map<uint256, vector<const CTxMemPoolEntry*> > mapDependers;
+        map<const CTxMemPoolEntry*, unsigned int> mapWaiting;
+        set<const CTxMemPoolEntry*> setDone;
+        set<uint256> setInBlock;
+        vector<const CTxMemPoolEntry*> vecReady;
 
         // Collect transactions into block
         map<uint256, CTxIndex> mapTestPool;
@@ -250,25 +161,70 @@ CBlock* CreateNewBlock(CReserveKey& reservekey, bool fProofOfStake, int64_t* pFe
         bool fSortedByFee = (nBlockPrioritySize <= 0);
 
         TxPriorityCompare comparer(fSortedByFee);
-        std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
+        set<const CTxMemPoolEntry*, CompareTxMemPoolEntryByPriority>::const_iterator itPriority = mempool.setByPriority.begin();
+        set<const CTxMemPoolEntry*, CompareTxMemPoolEntryByFeeRate>::const_iterator itFeeRate = mempool.setByFeeRate.begin();
 
-        while (!vecPriority.empty())
+        while (true)
         {
-            // Take highest priority transaction off the priority queue:
-            double dPriority = vecPriority.front().get<0>();
-            double dFeePerKb = vecPriority.front().get<1>();
-            CTransaction& tx = *(vecPriority.front().get<2>());
+            // Take the best of the next index entry and the ready dependers
+            const CTxMemPoolEntry* pentry = NULL;
+            if (!fSortedByFee)
+            {
+                while (itPriority != mempool.setByPriority.end() && (setDone.count(*itPriority) || mapWaiting.count(*itPriority)))
+                    ++itPriority;
+                if (itPriority != mempool.setByPriority.end())
+                    pentry = *itPriority;
+            }
+            else
+            {
+                while (itFeeRate != mempool.setByFeeRate.end() && (setDone.count(*itFeeRate) || mapWaiting.count(*itFeeRate)))
+                    ++itFeeRate;
+                if (itFeeRate != mempool.setByFeeRate.end())
+                    pentry = *itFeeRate;
+            }
+            if (!vecReady.empty() && (!pentry || comparer(pentry, vecReady.front())))
+            {
+                pentry = vecReady.front();
+                std::pop_heap(vecReady.begin(), vecReady.end(), comparer);
+                vecReady.pop_back();
+                if (setDone.count(pentry))
+                    continue;
+            }
+            if (!pentry)
+                break;
+            setDone.insert(pentry);
 
-            std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
-            vecPriority.pop_back();
+            const CTransaction& tx = pentry->GetTx();
+            if (tx.IsCoinBase() || tx.IsCoinStake() || !IsFinalTx(tx, nHeight))
+                continue;
+
+            // Has to wait for dependencies
+            unsigned int nMissing = 0;
+            BOOST_FOREACH(const uint256& hashParent, pentry->setParents)
+            {
+                if (!setInBlock.count(hashParent))
+                {
+                    mapDependers[hashParent].push_back(pentry);
+                    nMissing++;
+                }
+            }
+            if (nMissing)
+            {
+                setDone.erase(pentry);
+                mapWaiting[pentry] = nMissing;
+                continue;
+            }
+
+            double dPriority = pentry->GetPriority(nBestHeight);
+            double dFeePerKb = pentry->GetFeePerKb();
 
             // Size limits
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+            unsigned int nTxSize = pentry->GetTxSize();
             if (nBlockSize + nTxSize >= nBlockMaxSize)
                 continue;
 
-            // Legacy limits on sigOps:
-            unsigned int nTxSigOps = GetLegacySigOpCount(tx);
+            // Limits on sigOps:
+            unsigned int nTxSigOps = pentry->GetSigOps();
             if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
                 continue;
 
@@ -290,29 +246,26 @@ CBlock* CreateNewBlock(CReserveKey& reservekey, bool fProofOfStake, int64_t* pFe
             {
                 fSortedByFee = true;
                 comparer = TxPriorityCompare(fSortedByFee);
-                std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
+                std::make_heap(vecReady.begin(), vecReady.end(), comparer);
             }
 
             // Connecting shouldn't fail due to dependency on other memory pool transactions
             // because we're already processing them in order of dependency
+            CTransaction txConnect(tx);
             map<uint256, CTxIndex> mapTestPoolTmp(mapTestPool);
             MapPrevTx mapInputs;
             bool fInvalid;
-            if (!tx.FetchInputs(txdb, mapTestPoolTmp, false, true, mapInputs, fInvalid))
+            if (!txConnect.FetchInputs(txdb, mapTestPoolTmp, false, true, mapInputs, fInvalid))
                 continue;
 
-            int64_t nTxFees = tx.GetValueIn(mapInputs)-tx.GetValueOut();
+            int64_t nTxFees = pentry->GetFee();
             if (nTxFees < nMinFee)
                 continue;
 
-            nTxSigOps += GetP2SHSigOpCount(tx, mapInputs);
-            if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
-                continue;
-
             // Note that flags: we don't want to set mempool/IsStandard()
             // policy here, but we still have to ensure that the block we
             // create only contains transactions that are valid in new blocks.
-            if (!tx.ConnectInputs(txdb, mapInputs, mapTestPoolTmp, CDiskTxPos(1,1,1), pindexPrev, false, true, MANDATORY_SCRIPT_VERIFY_FLAGS))
+            if (!txConnect.ConnectInputs(txdb, mapInputs, mapTestPoolTmp, CDiskTxPos(1,1,1), pindexPrev, false, true, MANDATORY_SCRIPT_VERIFY_FLAGS))
                 continue;
             mapTestPoolTmp[tx.GetHash()] = CTxIndex(CDiskTxPos(1,1,1), tx.vout.size());
             swap(mapTestPool, mapTestPoolTmp);
@@ -330,22 +283,22 @@ CBlock* CreateNewBlock(CReserveKey& reservekey, bool fProofOfStake, int64_t* pFe
                        dPriority, dFeePerKb, tx.GetHash().ToString());
             }
 
-            // Add transactions that depend on this one to the priority queue
+            // Transactions that depend on this one can go in now
             uint256 hash = tx.GetHash();
-            if (mapDependers.count(hash))
+            setInBlock.insert(hash);
+            map<uint256, vector<const CTxMemPoolEntry*> >::iterator mi = mapDependers.find(hash);
+            if (mi != mapDependers.end())
             {
-                BOOST_FOREACH(COrphan* porphan, mapDependers[hash])
+                BOOST_FOREACH(const CTxMemPoolEntry* pdepender, mi->second)
                 {
-                    if (!porphan->setDependsOn.empty())
+                    if (--mapWaiting[pdepender] == 0)
                     {
-                        porphan->setDependsOn.erase(hash);
-                        if (porphan->setDependsOn.empty())
-                        {
-                            vecPriority.push_back(TxPriority(porphan->dPriority, porphan->dFeePerKb, porphan->ptx));
-                            std::push_heap(vecPriority.begin(), vecPriority.end(), comparer);
-                        }
+                        mapWaiting.erase(pdepender);
+                        vecReady.push_back(pdepender);
+                        std::push_heap(vecReady.begin(), vecReady.end(), comparer);
                     }
                 }
+                mapDependers.erase(mi);
             }
         }
 
@@ -11,10 +11,18 @@
 #include "ui_interface.h"
 #include "init.h"
 
+#include <limits>
+
 #ifdef WIN32
 #include <string.h>
 #endif
 
+#if defined(__linux__)
+#define USE_EPOLL
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
+
 #ifdef USE_UPNP
 #include <miniupnpc/miniwget.h>
 #include <miniupnpc/miniupnpc.h>
@@ -29,6 +37,7 @@ using namespace std;
 using namespace boost;
 
 static const int MAX_OUTBOUND_CONNECTIONS = 4098;
+static const unsigned int SOCKET_RECV_BUFFER_SIZE = 0x10000;
 bool run_once = true;
 bool did_run = false;
 
@@ -57,7 +66,7 @@ CAddrMan addrman;
 
 vector<CNode*> vNodes;
 CCriticalSection cs_vNodes;
-map<CInv, CDataStream> mapRelay;
+relaymap_t mapRelay;
 deque<pair<int64_t, CInv> > vRelayExpiration;
 CCriticalSection cs_mapRelay;
 map<CInv, int64_t> mapAlreadyAskedFor;
@@ -297,6 +306,54 @@ CNode* FindNode(const CService& addr)
     return NULL;
 }
 
+#ifdef USE_EPOLL
+// Edge-triggered readiness of the sockets, only touched by the socket thread
+static const unsigned int SOCKET_RECV_READY = 1;
+static const unsigned int SOCKET_SEND_READY = 2;
+static int hEpoll = -1;
+static int hSocketWakeEvent = -1;
+static map<CNode*, unsigned int> mapSocketReady;
+static set<CNode*> setSocketActive;
+// Nodes that queued data the optimistic write couldn't send, drained by the socket thread
+static CCriticalSection cs_vSocketWake;
+static vector<CNode*> vSocketWake;
+
+static void RegisterNodeSocket(CNode* pnode)
+{
+    if (hEpoll == -1 || pnode->hSocket == INVALID_SOCKET)
+        return;
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    event.data.ptr = pnode;
+    // EEXIST: the socket thread picked the node up from vNodes while starting
+    if (epoll_ctl(hEpoll, EPOLL_CTL_ADD, pnode->hSocket, &event) == -1 && errno != EEXIST)
+    {
+        LogPrintf("epoll_ctl add failed for %s, error %d\n", pnode->addrName, errno);
+        pnode->fDisconnect = true;
+    }
+}
+
+static void UnregisterNodeSocket(CNode* pnode)
+{
+    // closing the socket isn't enough if a forked child still holds it open
+    if (hEpoll != -1 && pnode->hSocket != INVALID_SOCKET)
+        epoll_ctl(hEpoll, EPOLL_CTL_DEL, pnode->hSocket, NULL);
+}
+
+static void ForgetNodeSocket(CNode* pnode)
+{
+    mapSocketReady.erase(pnode);
+    setSocketActive.erase(pnode);
+    LOCK(cs_vSocketWake);
+    vSocketWake.erase(remove(vSocketWake.begin(), vSocketWake.end(), pnode), vSocketWake.end());
+}
+#else
+static void RegisterNodeSocket(CNode* pnode) {}
+static void UnregisterNodeSocket(CNode* pnode) {}
+static void ForgetNodeSocket(CNode* pnode) {}
+#endif
+
 CNode* ConnectNode(CAddress addrConnect, const char *pszDest)
 {
     if (pszDest == NULL) {
@@ -346,6 +403,7 @@ CNode* ConnectNode(CAddress addrConnect, const char *pszDest)
             LOCK(cs_vNodes);
             vNodes.push_back(pnode);
         }
+        RegisterNodeSocket(pnode);
 
         pnode->nTimeConnected = GetTime();
         return pnode;
@@ -364,6 +422,7 @@ void CNode::CloseSocketDisconnect()
     if (hSocket != INVALID_SOCKET)
     {
         LogPrint("net", "disconnecting node %s\n", addrName);
+        UnregisterNodeSocket(this);
         closesocket(hSocket);
         hSocket = INVALID_SOCKET;
     }
@@ -390,6 +449,43 @@ void CNode::PushVersion()
                 nLocalHostNonce, FormatSubVersion(CLIENT_NAME, CLIENT_VERSION, std::vector<string>()), nBestHeight);
 }
 
+void CNode::PushRawMessage(const char* pszCommand, CSerializeData& vchPayload)
+{
+    // Frame the payload with its own header, and queue the two separately
+    CMessageHeader hdr(pszCommand, vchPayload.size());
+    uint256 hash = Hash(vchPayload.begin(), vchPayload.end());
+    memcpy(&hdr.nChecksum, &hash, sizeof(hdr.nChecksum));
+    CDataStream ssHeader(SER_NETWORK, INIT_PROTO_VERSION);
+    ssHeader << hdr;
+
+    LOCK(cs_vSend);
+    if (mapArgs.count("-dropmessagestest") && GetRand(atoi(mapArgs["-dropmessagestest"])) == 0)
+    {
+        LogPrint("net", "dropmessages DROPPING SEND MESSAGE\n");
+        return;
+    }
+
+    LogPrint("net", "sending: %s (%d bytes)\n", pszCommand, vchPayload.size());
+    bool fWasEmpty = vSendMsg.empty();
+    vSendMsg.push_back(CSerializeData());
+    ssHeader.GetAndClear(vSendMsg.back());
+    nSendSize += vSendMsg.back().size();
+    if (!vchPayload.empty())
+    {
+        vSendMsg.push_back(CSerializeData());
+        vSendMsg.back().swap(vchPayload);
+        nSendSize += vSendMsg.back().size();
+    }
+
+    // If write queue was empty, attempt "optimistic write", as EndMessage does
+    if (fWasEmpty)
+    {
+        SocketSendData(this);
+        if (!vSendMsg.empty())
+            WakeSocketHandler(this);
+    }
+}
+
 
 
 
@@ -482,7 +578,7 @@ void CNode::copyStats(CNodeStats &stats)
 #undef X
 
 
-void CNode::RecvMsg(char *buf, int32_t buf_len) {
+int CNode::RecvMsg(char *buf, int32_t buf_len) {
     int32_t buf_len_ = (buf_len = recv(hSocket, buf, buf_len, MSG_DONTWAIT));
     if (buf_len < 0) {
         int nErr = WSAGetLastError();
@@ -493,14 +589,14 @@ void CNode::RecvMsg(char *buf, int32_t buf_len) {
             }
             CloseSocketDisconnect();
         }
-        return;
+        return 0;
     } else if (buf_len == 0) {
         // socket closed
         if (!fDisconnect) {
             LogPrint("net", "Socket closed properly\n");
         }
         CloseSocketDisconnect();
-        return;
+        return 0;
     }
     while (buf_len > 0) { // absorb network data
         if (vRecvMsg.empty() || vRecvMsg.back().complete()) {
@@ -517,7 +613,7 @@ void CNode::RecvMsg(char *buf, int32_t buf_len) {
         if (handled < 0) {
             LogPrint("net", "Socket handled incorrectly on continuation\n");
             CloseSocketDisconnect();
-            return;
+            return 0;
         }
         buf += handled;
         buf_len -= handled;
@@ -528,7 +624,7 @@ void CNode::RecvMsg(char *buf, int32_t buf_len) {
     nLastRecv = GetTime();
     nRecvBytes += buf_len_;
     RecordBytesRecv(buf_len_);
-    return;
+    return buf_len_;
 }
 
 int CNetMessage::readHeader(const char *pch, unsigned int nBytes)
@@ -632,75 +728,221 @@ void SocketSendData(CNode *pnode)
 
 static list<CNode*> vNodesDisconnected;
 
-void ThreadSocketHandler()
+// requires LOCK(pnode->cs_vSend)
+void WakeSocketHandler(CNode* pnode)
 {
-    unsigned int nPrevNodeCount = 0;
+#ifdef USE_EPOLL
+    if (hSocketWakeEvent == -1)
+        return;
+    {
+        LOCK(cs_vSocketWake);
+        vSocketWake.push_back(pnode);
+    }
+    uint64_t nOne = 1;
+    if (write(hSocketWakeEvent, &nOne, sizeof(nOne)) != sizeof(nOne) && errno != EAGAIN)
+        LogPrint("net", "socket wakeup write failed, error %d\n", errno);
+#endif
+}
 
-    while (!ShutdownRequested())
+static void DisconnectNodes(unsigned int& nPrevNodeCount)
+{
     {
-        //
-        // Disconnect nodes
-        //
+        LOCK(cs_vNodes);
+        // Disconnect unused nodes
+        vector<CNode*> vNodesCopy = vNodes;
+        BOOST_FOREACH(CNode* pnode, vNodesCopy)
         {
-            LOCK(cs_vNodes);
-            // Disconnect unused nodes
-            vector<CNode*> vNodesCopy = vNodes;
-            BOOST_FOREACH(CNode* pnode, vNodesCopy)
+            if (pnode->fDisconnect ||
+                (pnode->GetRefCount() <= 0 && pnode->vRecvMsg.empty() && pnode->nSendSize == 0 && pnode->ssSend.empty()))
             {
-                if (pnode->fDisconnect ||
-                    (pnode->GetRefCount() <= 0 && pnode->vRecvMsg.empty() && pnode->nSendSize == 0 && pnode->ssSend.empty()))
-                {
-                    // remove from vNodes
-                    vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
+                // remove from vNodes
+                vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
 
-                    // release outbound grant (if any)
-                    pnode->grantOutbound.Release();
+                // release outbound grant (if any)
+                pnode->grantOutbound.Release();
 
-                    // close socket and cleanup
-                    pnode->CloseSocketDisconnect();
+                // close socket and cleanup
+                pnode->CloseSocketDisconnect();
 
-                    // hold in disconnected pool until all refs are released
-                    if (pnode->fNetworkNode || pnode->fInbound)
-                        pnode->Release();
-                    vNodesDisconnected.push_back(pnode);
-                }
+                // hold in disconnected pool until all refs are released
+                if (pnode->fNetworkNode || pnode->fInbound)
+                    pnode->Release();
+                vNodesDisconnected.push_back(pnode);
             }
         }
+    }
+    {
+        // Delete disconnected nodes
+        list<CNode*> vNodesDisconnectedCopy = vNodesDisconnected;
+        BOOST_FOREACH(CNode* pnode, vNodesDisconnectedCopy)
         {
-            // Delete disconnected nodes
-            list<CNode*> vNodesDisconnectedCopy = vNodesDisconnected;
-            BOOST_FOREACH(CNode* pnode, vNodesDisconnectedCopy)
+            // wait until threads are done using it
+            if (pnode->GetRefCount() <= 0)
             {
-                // wait until threads are done using it
-                if (pnode->GetRefCount() <= 0)
+                bool fDelete = false;
                 {
-                    bool fDelete = false;
+                    TRY_LOCK(pnode->cs_vSend, lockSend);
+                    if (lockSend)
                     {
-                        TRY_LOCK(pnode->cs_vSend, lockSend);
-                        if (lockSend)
+                        TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+                        if (lockRecv)
                         {
-                            TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                            if (lockRecv)
-                            {
-                                TRY_LOCK(pnode->cs_inventory, lockInv);
-                                if (lockInv)
-                                    fDelete = true;
-                            }
+                            TRY_LOCK(pnode->cs_inventory, lockInv);
+                            if (lockInv)
+                                fDelete = true;
                         }
                     }
-                    if (fDelete)
-                    {
-                        vNodesDisconnected.remove(pnode);
-                        delete pnode;
-                    }
+                }
+                if (fDelete)
+                {
+                    vNodesDisconnected.remove(pnode);
+                    ForgetNodeSocket(pnode);
+                    g_signals.FinalizeNode(pnode);
+                    delete pnode;
                 }
             }
         }
-        if(vNodes.size() != nPrevNodeCount) {
-            nPrevNodeCount = vNodes.size();
-            uiInterface.NotifyNumConnectionsChanged(nPrevNodeCount);
+    }
+    if(vNodes.size() != nPrevNodeCount) {
+        nPrevNodeCount = vNodes.size();
+        uiInterface.NotifyNumConnectionsChanged(nPrevNodeCount);
+    }
+}
+
+static void AcceptConnection(SOCKET hListenSocket)
+{
+    struct sockaddr_storage sockaddr;
+    socklen_t len = sizeof(sockaddr);
+    SOCKET hSocket = accept(hListenSocket, (struct sockaddr*)&sockaddr, &len);
+    CAddress addr;
+    int nInbound = 0;
+
+    if (hSocket != INVALID_SOCKET)
+        if (!addr.SetSockAddr((const struct sockaddr*)&sockaddr))
+            LogPrintf("Warning: Unknown socket family\n");
+
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vNodes)
+            if (pnode->fInbound)
+                nInbound++;
+    }
+
+    if (hSocket == INVALID_SOCKET)
+    {
+        int nErr = WSAGetLastError();
+        if (nErr != WSAEWOULDBLOCK)
+            LogPrintf("socket error accept failed: %d\n", nErr);
+    }
+    else if (nInbound >= min(MAX_OUTBOUND_CONNECTIONS, (int)GetArg("-maxconnections", 24)))
+    {
+        closesocket(hSocket);
+    }
+    else if (CNode::IsBanned(addr))
+    {
+        LogPrintf("connection from %s dropped (banned)\n", addr.ToString());
+        closesocket(hSocket);
+    }
+    else
+    {
+        LogPrint("net", "accepted connection %s\n", addr.ToString());
+        CNode* pnode = new CNode(hSocket, addr, "", true);
+        pnode->AddRef();
+        {
+            LOCK(cs_vNodes);
+            vNodes.push_back(pnode);
         }
+        RegisterNodeSocket(pnode);
+    }
+}
 
+// Returns the number of bytes read, so callers can tell whether the socket may hold more
+static int ReceiveFromNode(CNode* pnode, bool& fLocked)
+{
+    fLocked = false;
+    if (pnode->hSocket == INVALID_SOCKET)
+        return 0;
+    TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+    if (!lockRecv)
+        return 0;
+    fLocked = true;
+    if (pnode->GetTotalRecvSize() > ReceiveFloodSize()) {
+        if (!pnode->fDisconnect)
+            LogPrintf("socket recv flood control disconnect (%u bytes)\n", pnode->GetTotalRecvSize());
+        pnode->CloseSocketDisconnect();
+        return 0;
+    }
+    // typical socket buffer is 8K-64K
+    char pchBuf[SOCKET_RECV_BUFFER_SIZE];
+    int nBytes = pnode->RecvMsg(pchBuf, sizeof(pchBuf));
+    if (nBytes > 0 && !pnode->vRecvMsg.empty() && pnode->vRecvMsg.front().complete())
+        WakeMessageHandler();
+    return nBytes;
+}
+
+static void InactivityCheck(CNode* pnode)
+{
+    //
+    // Inactivity checking, and version checking
+    //
+    int64_t nTime = GetTime();
+    if (nTime - pnode->nTimeConnected > 60)
+    {
+        if (pnode->nLastRecv == 0 || pnode->nLastSend == 0)
+        {
+            LogPrint("net", "socket no message in first 60 seconds, %d %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0);
+            pnode->fDisconnect = true;
+        }
+        else if (nTime - pnode->nLastSend > TIMEOUT_INTERVAL)
+        {
+            LogPrintf("socket sending timeout: %ds\n", nTime - pnode->nLastSend);
+            pnode->fDisconnect = true;
+        }
+        else if (nTime - pnode->nLastRecv > (pnode->nVersion > BIP0031_VERSION ? TIMEOUT_INTERVAL : 90*60))
+        {
+            LogPrintf("socket receive timeout: %ds\n", nTime - pnode->nLastRecv);
+            pnode->fDisconnect = true;
+        }
+        else if (pnode->nPingNonceSent && pnode->nPingUsecStart + TIMEOUT_INTERVAL * 1000000 < GetTimeMicros())
+        {
+            LogPrintf("ping timeout: %fs\n", 0.000001 * (GetTimeMicros() - pnode->nPingUsecStart));
+            pnode->fDisconnect = true;
+        }
+    }
+    // 5 minutes after the MIN_PEER changeover, get rid of old peers
+    if (run_once && nTime >= (MIN_PEER_PROTO_VERSION_WHEN+(60*5))) {
+        did_run = true;
+        if (pnode->nVersion < MIN_PEER_PROTO_VERSION) {
+            pnode->fDisconnect = true;
+        }
+    }
+}
+
+#ifdef USE_EPOLL
+static void InactivityCheckAll()
+{
+    vector<CNode*> vNodesCopy;
+    {
+        LOCK(cs_vNodes);
+        vNodesCopy = vNodes;
+    }
+    // only the socket thread deletes nodes, so the copy stays valid
+    BOOST_FOREACH(CNode* pnode, vNodesCopy)
+        InactivityCheck(pnode);
+
+    if (did_run) {
+        run_once = false; // outside of loop nodes, if we got rid of min_peers then don't run after that.
+    }
+}
+#endif
+
+static void ThreadSocketHandlerSelect()
+{
+    unsigned int nPrevNodeCount = 0;
+
+    while (!ShutdownRequested())
+    {
+        DisconnectNodes(nPrevNodeCount);
 
         //
         // Find which sockets have data to receive
@@ -768,51 +1010,8 @@ void ThreadSocketHandler()
         // Accept new connections
         //
         BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
-        if (hListenSocket != INVALID_SOCKET && FD_ISSET(hListenSocket, &fdsetRecv))
-        {
-            struct sockaddr_storage sockaddr;
-            socklen_t len = sizeof(sockaddr);
-            SOCKET hSocket = accept(hListenSocket, (struct sockaddr*)&sockaddr, &len);
-            CAddress addr;
-            int nInbound = 0;
-
-            if (hSocket != INVALID_SOCKET)
-                if (!addr.SetSockAddr((const struct sockaddr*)&sockaddr))
-                    LogPrintf("Warning: Unknown socket family\n");
-
-            {
-                LOCK(cs_vNodes);
-                BOOST_FOREACH(CNode* pnode, vNodes)
-                    if (pnode->fInbound)
-                        nInbound++;
-            }
-
-            if (hSocket == INVALID_SOCKET)
-            {
-                int nErr = WSAGetLastError();
-                if (nErr != WSAEWOULDBLOCK)
-                    LogPrintf("socket error accept failed: %d\n", nErr);
-            }
-            else if (nInbound >= min(MAX_OUTBOUND_CONNECTIONS, (int)GetArg("-maxconnections", 24)))
-            {
-                closesocket(hSocket);
-            }
-            else if (CNode::IsBanned(addr))
-            {
-                LogPrintf("connection from %s dropped (banned)\n", addr.ToString());
-                closesocket(hSocket);
-            }
-            else
-            {
-                LogPrint("net", "accepted connection %s\n", addr.ToString());
-                CNode* pnode = new CNode(hSocket, addr, "", true);
-                pnode->AddRef();
-                {
-                    LOCK(cs_vNodes);
-                    vNodes.push_back(pnode);
-                }
-            }
-        }
+            if (hListenSocket != INVALID_SOCKET && FD_ISSET(hListenSocket, &fdsetRecv))
+                AcceptConnection(hListenSocket);
 
 
         //
@@ -836,20 +1035,8 @@ void ThreadSocketHandler()
                 continue;
             if (FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError))
             {
-                TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                if (lockRecv)
-                {
-                    if (pnode->GetTotalRecvSize() > ReceiveFloodSize()) {
-                        if (!pnode->fDisconnect)
-                            LogPrintf("socket recv flood control disconnect (%u bytes)\n", pnode->GetTotalRecvSize());
-                        pnode->CloseSocketDisconnect();
-                    }
-                    else {
-                        // typical socket buffer is 8K-64K
-                        char pchBuf[0x10000];
-                        pnode->RecvMsg(pchBuf, sizeof(pchBuf));
-                    }
-                }
+                bool fLocked;
+                ReceiveFromNode(pnode, fLocked);
             }
 
             //
@@ -864,40 +1051,7 @@ void ThreadSocketHandler()
                     SocketSendData(pnode);
             }
 
-            //
-            // Inactivity checking, and version checking
-            //
-            int64_t nTime = GetTime();
-            if (nTime - pnode->nTimeConnected > 60)
-            {
-                if (pnode->nLastRecv == 0 || pnode->nLastSend == 0)
-                {
-                    LogPrint("net", "socket no message in first 60 seconds, %d %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0);
-                    pnode->fDisconnect = true;
-                }
-                else if (nTime - pnode->nLastSend > TIMEOUT_INTERVAL)
-                {
-                    LogPrintf("socket sending timeout: %ds\n", nTime - pnode->nLastSend);
-                    pnode->fDisconnect = true;
-                }
-                else if (nTime - pnode->nLastRecv > (pnode->nVersion > BIP0031_VERSION ? TIMEOUT_INTERVAL : 90*60))
-                {
-                    LogPrintf("socket receive timeout: %ds\n", nTime - pnode->nLastRecv);
-                    pnode->fDisconnect = true;
-                }
-                else if (pnode->nPingNonceSent && pnode->nPingUsecStart + TIMEOUT_INTERVAL * 1000000 < GetTimeMicros())
-                {
-                    LogPrintf("ping timeout: %fs\n", 0.000001 * (GetTimeMicros() - pnode->nPingUsecStart));
-                    pnode->fDisconnect = true;
-                }
-            }
-            // 5 minutes after the MIN_PEER changeover, get rid of old peers
-            if (run_once && nTime >= (MIN_PEER_PROTO_VERSION_WHEN+(60*5))) {
-                did_run = true;
-                if (pnode->nVersion < MIN_PEER_PROTO_VERSION) {
-                    pnode->fDisconnect = true;
-                }
-            }
+            InactivityCheck(pnode);
         }
 
         {
@@ -912,6 +1066,219 @@ void ThreadSocketHandler()
     }
 }
 
+#ifdef USE_EPOLL
+// Listening sockets are registered with a pointer into vhListenSocket, nodes with the CNode
+static bool IsListenSocketEvent(const struct epoll_event& event)
+{
+    return !vhListenSocket.empty() && event.data.ptr >= (void*)&vhListenSocket[0] &&
+           event.data.ptr < (void*)(&vhListenSocket[0] + vhListenSocket.size());
+}
+
+// Service one node whose socket is known to be ready. Returns true if it must be
+// visited again without waiting for another edge (more data, or a lock was busy).
+static bool ServiceReadyNode(CNode* pnode, bool& fMoreData)
+{
+    unsigned int& nReady = mapSocketReady[pnode];
+    if (pnode->hSocket == INVALID_SOCKET)
+        return false;
+
+    //
+    // Send
+    //
+    bool fSendQueued;
+    {
+        TRY_LOCK(pnode->cs_vSend, lockSend);
+        if (!lockSend)
+            return true;
+        if ((nReady & SOCKET_SEND_READY) && !pnode->vSendMsg.empty())
+        {
+            SocketSendData(pnode);
+            // anything left over waits for the kernel to signal EPOLLOUT
+            if (!pnode->vSendMsg.empty())
+                nReady &= ~SOCKET_SEND_READY;
+        }
+        fSendQueued = !pnode->vSendMsg.empty();
+    }
+
+    //
+    // Receive, but not while draining the write queue
+    //
+    if (fSendQueued || !(nReady & SOCKET_RECV_READY))
+        return false;
+    bool fLocked;
+    int nBytes = ReceiveFromNode(pnode, fLocked);
+    if (!fLocked)
+        return true;
+    // a short read means the socket was drained, the next edge will bring us back
+    if (nBytes < (int)SOCKET_RECV_BUFFER_SIZE)
+    {
+        nReady &= ~SOCKET_RECV_READY;
+        return false;
+    }
+    fMoreData = true;
+    return true;
+}
+
+static void ThreadSocketHandlerEpoll()
+{
+    static const int MAX_EPOLL_EVENTS = 256;
+    struct epoll_event vEvents[MAX_EPOLL_EVENTS];
+    unsigned int nPrevNodeCount = 0;
+    int64_t nLastSweep = 0;
+    int64_t nLastInactivityCheck = 0;
+    int nTimeout = 0;
+
+    while (!ShutdownRequested())
+    {
+        // fDisconnect is set from other threads without waking us, so sweep
+        // for it on a timer rather than on every event
+        int64_t nNow = GetTimeMillis();
+        if (nNow - nLastSweep >= 100)
+        {
+            DisconnectNodes(nPrevNodeCount);
+            nLastSweep = nNow;
+        }
+        if (nNow - nLastInactivityCheck >= 1000)
+        {
+            InactivityCheckAll();
+            nLastInactivityCheck = nNow;
+        }
+
+        int nEvents = epoll_wait(hEpoll, vEvents, MAX_EPOLL_EVENTS, nTimeout);
+        boost::this_thread::interruption_point();
+        if (nEvents == -1)
+        {
+            if (errno != EINTR)
+            {
+                LogPrintf("socket epoll_wait error %d\n", errno);
+                MilliSleep(50);
+            }
+            nEvents = 0;
+        }
+
+        for (int i = 0; i < nEvents; i++)
+        {
+            if (IsListenSocketEvent(vEvents[i]))
+            {
+                AcceptConnection(*(SOCKET*)vEvents[i].data.ptr);
+                continue;
+            }
+            if (vEvents[i].data.ptr == &hSocketWakeEvent)
+            {
+                uint64_t nCount;
+                if (read(hSocketWakeEvent, &nCount, sizeof(nCount)) < 0 && errno != EAGAIN)
+                    LogPrint("net", "socket wakeup read failed, error %d\n", errno);
+                vector<CNode*> vWake;
+                {
+                    LOCK(cs_vSocketWake);
+                    vWake.swap(vSocketWake);
+                }
+                BOOST_FOREACH(CNode* pnode, vWake)
+                    setSocketActive.insert(pnode);
+                continue;
+            }
+            CNode* pnode = (CNode*)vEvents[i].data.ptr;
+            unsigned int& nReady = mapSocketReady[pnode];
+            if (vEvents[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+                nReady |= SOCKET_RECV_READY;
+            if (vEvents[i].events & EPOLLOUT)
+                nReady |= SOCKET_SEND_READY;
+            setSocketActive.insert(pnode);
+        }
+
+        //
+        // Service the sockets with work to do
+        //
+        vector<CNode*> vNodesActive(setSocketActive.begin(), setSocketActive.end());
+        {
+            LOCK(cs_vNodes);
+            BOOST_FOREACH(CNode* pnode, vNodesActive)
+                pnode->AddRef();
+        }
+        bool fMoreData = false;
+        BOOST_FOREACH(CNode* pnode, vNodesActive)
+        {
+            boost::this_thread::interruption_point();
+            if (!ServiceReadyNode(pnode, fMoreData))
+                setSocketActive.erase(pnode);
+        }
+        {
+            LOCK(cs_vNodes);
+            BOOST_FOREACH(CNode* pnode, vNodesActive)
+                pnode->Release();
+        }
+
+        // Come straight back if a socket still has data, back off briefly if
+        // only busy locks held us up, otherwise sleep until the next edge
+        if (fMoreData)
+            nTimeout = 0;
+        else if (!setSocketActive.empty())
+            nTimeout = 10;
+        else
+            nTimeout = 100;
+    }
+}
+
+static bool InitSocketEvents()
+{
+    hEpoll = epoll_create1(EPOLL_CLOEXEC);
+    if (hEpoll == -1)
+    {
+        LogPrintf("epoll_create1 failed, error %d, falling back to select()\n", errno);
+        return false;
+    }
+    hSocketWakeEvent = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (hSocketWakeEvent == -1)
+    {
+        LogPrintf("eventfd failed, error %d, falling back to select()\n", errno);
+        close(hEpoll);
+        hEpoll = -1;
+        return false;
+    }
+
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.ptr = &hSocketWakeEvent;
+    bool fOk = epoll_ctl(hEpoll, EPOLL_CTL_ADD, hSocketWakeEvent, &event) == 0;
+    // listening sockets stay level-triggered so a busy accept backlog is never lost
+    for (unsigned int i = 0; i < vhListenSocket.size(); i++)
+    {
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN;
+        event.data.ptr = &vhListenSocket[i];
+        fOk = fOk && epoll_ctl(hEpoll, EPOLL_CTL_ADD, vhListenSocket[i], &event) == 0;
+    }
+    if (!fOk)
+    {
+        LogPrintf("epoll_ctl failed, error %d, falling back to select()\n", errno);
+        close(hSocketWakeEvent);
+        close(hEpoll);
+        hSocketWakeEvent = hEpoll = -1;
+        return false;
+    }
+
+    // pick up the nodes connected before we started
+    LOCK(cs_vNodes);
+    BOOST_FOREACH(CNode* pnode, vNodes)
+        RegisterNodeSocket(pnode);
+    return true;
+}
+#endif
+
+void ThreadSocketHandler()
+{
+#ifdef USE_EPOLL
+    if (InitSocketEvents())
+    {
+        LogPrintf("Using epoll for socket events\n");
+        ThreadSocketHandlerEpoll();
+        return;
+    }
+#endif
+    ThreadSocketHandlerSelect();
+}
+
 
 
 
@@ -1394,9 +1761,27 @@ void static StartSync(const vector<CNode*> &vNodes) {
     }
 }
 
-void ThreadMessageHandler()
+// Message handler threads sleep on this until the socket thread has complete
+// messages for them, or for at most 100ms so SendMessages still runs
+static boost::mutex mutexMessageHandler;
+static boost::condition_variable condMessageHandler;
+static unsigned int nMessageHandlerWakeups = 0;
+// Only compared against, never dereferenced, so a stale pointer is harmless
+static CNode* pnodeTrickle = NULL;
+
+void WakeMessageHandler()
+{
+    {
+        boost::lock_guard<boost::mutex> lock(mutexMessageHandler);
+        nMessageHandlerWakeups++;
+    }
+    condMessageHandler.notify_all();
+}
+
+void ThreadMessageHandler(int nThread)
 {
     SetThreadPriority(THREAD_PRIORITY_BELOW_NORMAL);
+    unsigned int nWakeupsSeen = 0;
     while (!ShutdownRequested()) {
         boost::this_thread::interruption_point();
         bool fHaveSyncNode = false;
@@ -1411,13 +1796,23 @@ void ThreadMessageHandler()
                     fHaveSyncNode = true;
             }
         }
-        if (!fHaveSyncNode)
+
+        // The first thread picks the sync and trickle nodes for everyone
+        CNode* pnodeTrickleRound;
+        {
+            boost::lock_guard<boost::mutex> lock(mutexMessageHandler);
+            nWakeupsSeen = nMessageHandlerWakeups;
+            if (nThread == 0)
+                pnodeTrickle = vNodesCopy.empty() ? NULL : vNodesCopy[GetRand(vNodesCopy.size())];
+            pnodeTrickleRound = pnodeTrickle;
+        }
+        if (nThread == 0 && !fHaveSyncNode)
             StartSync(vNodesCopy);
 
-        // Poll the connected nodes for messages
-        CNode* pnodeTrickle = NULL;
+        // Start at a different node in each thread, so they spread out
+        // instead of queueing up behind each other
         if (!vNodesCopy.empty())
-            pnodeTrickle = vNodesCopy[GetRand(vNodesCopy.size())];
+            rotate(vNodesCopy.begin(), vNodesCopy.begin() + (nThread % vNodesCopy.size()), vNodesCopy.end());
 
         bool fSleep = true;
 
@@ -1426,6 +1821,11 @@ void ThreadMessageHandler()
             if (pnode->fDisconnect)
                 continue;
 
+            // Another thread has this node, it'll handle its messages in order
+            TRY_LOCK(pnode->cs_messageHandler, lockHandler);
+            if (!lockHandler)
+                continue;
+
             // Receive messages
             {
                 TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
@@ -1449,7 +1849,7 @@ void ThreadMessageHandler()
             {
                 TRY_LOCK(pnode->cs_vSend, lockSend);
                 if (lockSend)
-                    g_signals.SendMessages(pnode, pnode == pnodeTrickle);
+                    g_signals.SendMessages(pnode, pnode == pnodeTrickleRound);
             }
             boost::this_thread::interruption_point();
         }
@@ -1460,7 +1860,11 @@ void ThreadMessageHandler()
         }
 
         if (fSleep)
-            MilliSleep(100);
+        {
+            boost::unique_lock<boost::mutex> lock(mutexMessageHandler);
+            if (nWakeupsSeen == nMessageHandlerWakeups)
+                condMessageHandler.timed_wait(lock, boost::posix_time::milliseconds(100));
+        }
     }
 }
 
@@ -1682,8 +2086,10 @@ void StartNode(boost::thread_group& threadGroup)
     // Initiate outbound connections
     threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "opencon", &ThreadOpenConnections));
 
-    // Process messages
-    threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "msghand", &ThreadMessageHandler));
+    // Process messages, several peers at a time
+    int nMessageHandlers = max(1, min((int)GetArg("-msghandlers", DEFAULT_MESSAGE_HANDLERS), MAX_MESSAGE_HANDLERS));
+    for (int i = 0; i < nMessageHandlers; i++)
+        threadGroup.create_thread(boost::bind(&TraceThread<boost::function<void()> >, "msghand", boost::function<void()>(boost::bind(&ThreadMessageHandler, i))));
 
     // Dump network addresses
     threadGroup.create_thread(boost::bind(&LoopForever<void (*)()>, "dumpaddr", &DumpAddresses, DUMP_ADDRESSES_INTERVAL * 1000));
@@ -1726,6 +2132,23 @@ public:
 }
 instance_of_cnetcleanup;
 
+CInvHasher::CInvHasher()
+{
+    nSalt = GetRand(std::numeric_limits<uint64_t>::max());
+}
+
+size_t CInvHasher::operator()(const CInv& inv) const
+{
+    // MurmurHash3's 64 bit finalizer, so every bit of the salt reaches the bucket index
+    uint64_t k = (inv.hash.GetLow64() ^ nSalt) + inv.type;
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return (size_t)k;
+}
+
 void RelayTransaction(const CTransaction& tx, const uint256& hash)
 {
     CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
@@ -1747,8 +2170,8 @@ void RelayTransaction(const CTransaction& tx, const uint256& hash, const CDataSt
         }
 
         // Save original serialized message so newer versions are preserved
-        mapRelay.insert(std::make_pair(inv, ss));
-        vRelayExpiration.push_back(std::make_pair(GetTime() + 15 * 60, inv));
+        if (mapRelay.insert(std::make_pair(inv, boost::shared_ptr<const CDataStream>(new CDataStream(ss)))).second)
+            vRelayExpiration.push_back(std::make_pair(GetTime() + RELAY_EXPIRY_TIME, inv));
     }
 
     RelayInventory(inv);
@@ -8,6 +8,8 @@
 #include <deque>
 #include <boost/array.hpp>
 #include <boost/foreach.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/unordered_map.hpp>
 #include <boost/signals2/signal.hpp>
 #include <openssl/rand.h>
 
@@ -17,6 +19,7 @@
 #endif
 
 #include "mruset.h"
+#include "bloom.h"
 #include "netbase.h"
 #include "protocol.h"
 #include "addrman.h"
@@ -31,6 +34,14 @@ extern int nBestHeight;
 static const int PING_INTERVAL = 2 * 60;
 /** Time after which to disconnect, after waiting for a ping response (or inactivity). */
 static const int TIMEOUT_INTERVAL = 20 * 60;
+/** Default number of threads processing peer messages (-msghandlers) */
+static const int DEFAULT_MESSAGE_HANDLERS = 4;
+/** Maximum number of message handler threads */
+static const int MAX_MESSAGE_HANDLERS = 16;
+/** Number of recent inventory items remembered per peer, so they aren't announced back to it */
+static const unsigned int INVENTORY_KNOWN_ELEMENTS = 10000;
+/** Seconds a relayed transaction is kept in mapRelay for peers to getdata it */
+static const int RELAY_EXPIRY_TIME = 15 * 60;
 
 inline unsigned int ReceiveFloodSize() { return 1000*GetArg("-maxreceivebuffer", 5*1000); }
 inline unsigned int SendBufferSize() { return 1000*GetArg("-maxsendbuffer", 1*1000); }
@@ -47,12 +58,15 @@ bool BindListenPort(const CService &bindAddr, std::string& strError=REF(std::str
 void StartNode(boost::thread_group& threadGroup);
 bool StopNode();
 void SocketSendData(CNode *pnode);
+void WakeSocketHandler(CNode *pnode);
+void WakeMessageHandler();
 
 // Signals for message handling
 struct CNodeSignals
 {
     boost::signals2::signal<bool (CNode*)> ProcessMessages;
     boost::signals2::signal<bool (CNode*, bool)> SendMessages;
+    boost::signals2::signal<void (CNode*)> FinalizeNode;
 };
 
 CNodeSignals& GetNodeSignals();
@@ -97,7 +111,22 @@ extern CAddrMan addrman;
 
 extern std::vector<CNode*> vNodes;
 extern CCriticalSection cs_vNodes;
-extern std::map<CInv, CDataStream> mapRelay;
+/** Hashes CInv for the relay cache, keyed per process so peers can't pick colliding entries */
+class CInvHasher
+{
+public:
+    CInvHasher();
+    size_t operator()(const CInv& inv) const;
+
+private:
+    uint64_t nSalt;
+};
+
+/** Serialized transactions kept for peers that getdata our announcements. Entries
+ * are shared, so a message can be pushed after cs_mapRelay is released. */
+typedef boost::unordered_map<CInv, boost::shared_ptr<const CDataStream>, CInvHasher> relaymap_t;
+
+extern relaymap_t mapRelay;
 extern std::deque<std::pair<int64_t, CInv> > vRelayExpiration;
 extern CCriticalSection cs_mapRelay;
 extern std::map<CInv, int64_t> mapAlreadyAskedFor;
@@ -146,6 +175,8 @@ public:
     int64_t nTime;                  // time (in microseconds) of message receipt.
 
     CNetMessage(int nTypeIn, int nVersionIn) : hdrbuf(nTypeIn, nVersionIn), vRecv(nTypeIn, nVersionIn) {
+        hdrbuf.SetCleanse(false);
+        vRecv.SetCleanse(false);
         hdrbuf.resize(24);
         in_data = false;
         nHdrPos = 0;
@@ -191,6 +222,9 @@ public:
     std::deque<CInv> vRecvGetData;
     std::deque<CNetMessage> vRecvMsg;
     CCriticalSection cs_vRecvMsg;
+    // held by the message handler thread servicing this node, so its
+    // messages are processed in order by one thread at a time
+    CCriticalSection cs_messageHandler;
     uint64_t nRecvBytes;
     int nRecvVersion;
 
@@ -224,16 +258,28 @@ public:
     uint256 hashLastGetBlocksEnd;
     int nStartingHeight;
     bool fStartSync;
+    bool fCompactBlocks; // announce new blocks to this peer as compact blocks
+
+    // headers-first sync
+    bool fHeadersSync; // peer may have more headers for us
+    int64_t nHeadersRequestTime; // time of the outstanding getheaders, or 0
+    int nBestHeaderHeight; // highest header this peer sent us
+    uint256 hashLastHeader; // last header this peer sent us, where its next getheaders starts
+    bool fGetBlocksAfterHeaders; // peer synced headers first; send getblocks once that's done
+    int nBlocksInFlight; // blocks requested from this peer along the header chain
 
     // flood relay
     std::vector<CAddress> vAddrToSend;
     mruset<CAddress> setAddrKnown;
     bool fGetAddr;
     std::set<uint256> setKnown;
+    // other peers' handlers relay addresses and alerts to us, so the
+    // known sets and vAddrToSend are protected by cs_known
+    CCriticalSection cs_known;
     uint256 hashCheckpointKnown; // ppcoin: known sent sync-checkpoint
 
     // inventory based relay
-    mruset<CInv> setInventoryKnown;
+    CRollingBloomFilter filterInventoryKnown;
     std::vector<CInv> vInventoryToSend;
     CCriticalSection cs_inventory;
     std::multimap<int64_t, CInv> mapAskFor;
@@ -248,8 +294,9 @@ public:
     // Whether a ping is requested.
     bool fPingQueued;
 
-    CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn = "", bool fInboundIn=false) : ssSend(SER_NETWORK, INIT_PROTO_VERSION), setAddrKnown(5000)
+    CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn = "", bool fInboundIn=false) : ssSend(SER_NETWORK, INIT_PROTO_VERSION), setAddrKnown(5000), filterInventoryKnown(INVENTORY_KNOWN_ELEMENTS, 0.000001)
     {
+        ssSend.SetCleanse(false);
         nServices = 0;
         hSocket = hSocketIn;
         nRecvVersion = INIT_PROTO_VERSION;
@@ -276,10 +323,16 @@ public:
         hashLastGetBlocksEnd = 0;
         nStartingHeight = -1;
         fStartSync = false;
+        fCompactBlocks = false;
+        fHeadersSync = false;
+        nHeadersRequestTime = 0;
+        nBestHeaderHeight = -1;
+        hashLastHeader = 0;
+        fGetBlocksAfterHeaders = false;
+        nBlocksInFlight = 0;
         fGetAddr = false;
         nMisbehavior = 0;
         hashCheckpointKnown = 0;
-        setInventoryKnown.max_size(SendBufferSize() / 1000);
         nPingNonceSent = 0;
         nPingUsecStart = 0;
         nPingUsecTime = 0;
@@ -328,7 +381,7 @@ public:
     }
 
     // requires LOCK(cs_vRecvMsg)
-    void RecvMsg(char *buf, int32_t buf_len);
+    int RecvMsg(char *buf, int32_t buf_len);
 
     // requires LOCK(cs_vRecvMsg)
     void SetRecvVersion(int nVersionIn)
@@ -353,6 +406,7 @@ public:
 
     void AddAddressKnown(const CAddress& addr)
     {
+        LOCK(cs_known);
         setAddrKnown.insert(addr);
     }
 
@@ -361,6 +415,7 @@ public:
         // Known checking here is only to save space from duplicates.
         // SendMessages will filter it again for knowns that were added
         // after addresses were pushed.
+        LOCK(cs_known);
         if (addr.IsValid() && !setAddrKnown.count(addr))
             vAddrToSend.push_back(addr);
     }
@@ -370,7 +425,7 @@ public:
     {
         {
             LOCK(cs_inventory);
-            setInventoryKnown.insert(inv);
+            filterInventoryKnown.insert(inv.hash);
         }
     }
 
@@ -378,7 +433,7 @@ public:
     {
         {
             LOCK(cs_inventory);
-            if (!setInventoryKnown.count(inv))
+            if (!filterInventoryKnown.contains(inv.hash))
                 vInventoryToSend.push_back(inv);
         }
     }
@@ -453,15 +508,24 @@ public:
         ssSend.GetAndClear(*it);
         nSendSize += (*it).size();
 
-        // If write queue empty, attempt "optimistic write"
+        // If write queue empty, attempt "optimistic write", and hand
+        // whatever the kernel didn't take to the socket thread
         if (it == vSendMsg.begin())
+        {
             SocketSendData(this);
+            if (!vSendMsg.empty())
+                WakeSocketHandler(this);
+        }
 
         LEAVE_CRITICAL_SECTION(cs_vSend);
     }
 
     void PushVersion();
 
+    // Queue an already serialized payload without copying it through ssSend;
+    // vchPayload is swapped into the send queue and left empty
+    void PushRawMessage(const char* pszCommand, CSerializeData& vchPayload);
+
 
     void PushMessage(const char* pszCommand)
     {
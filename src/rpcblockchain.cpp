@@ -7,6 +7,7 @@
 #include "main.h"
 #include "kernel.h"
 #include "checkpoints.h"
+#include "txdb.h"
 
 using namespace json_spirit;
 using namespace std;
@@ -203,6 +204,29 @@ Value getrawmempool(const Array& params, bool fHelp)
     return a;
 }
 
+Value getmempoolinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getmempoolinfo\n"
+            "Returns details on the transaction memory pool.");
+
+    Object obj;
+    {
+        LOCK(mempool.cs);
+        uint64_t nBytes = 0;
+        for (map<uint256, CTxMemPoolEntry>::const_iterator mi = mempool.mapTx.begin(); mi != mempool.mapTx.end(); ++mi)
+            nBytes += mi->second.GetTxSize();
+        obj.push_back(Pair("size",       (uint64_t)mempool.mapTx.size()));
+        obj.push_back(Pair("bytes",      nBytes));
+        obj.push_back(Pair("usage",      (uint64_t)mempool.DynamicMemoryUsage()));
+    }
+    obj.push_back(Pair("maxmempool",     (int64_t)GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000));
+    obj.push_back(Pair("mempoolminfee",  ValueFromAmount(mempool.GetRollingMinFee(1000))));
+    obj.push_back(Pair("loaded",         mempool.IsLoaded()));
+    return obj;
+}
+
 Value getblockhash(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() != 1)
@@ -295,3 +319,26 @@ Value getcheckpoint(const Array& params, bool fHelp)
 
     return result;
 }
+
+Value getverifyprogress(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getverifyprogress\n"
+            "Show the progress of the -checklevel transaction index checks that run after startup.");
+
+    int nCheckLevel, nBlocks, nVerified;
+    bool fRunning;
+    Object result;
+    if (!GetBlockVerifyStatus(nCheckLevel, nBlocks, nVerified, fRunning))
+    {
+        result.push_back(Pair("running", false));
+        return result;
+    }
+    result.push_back(Pair("running", fRunning));
+    result.push_back(Pair("checklevel", nCheckLevel));
+    result.push_back(Pair("blocks", nBlocks));
+    result.push_back(Pair("verified", nVerified));
+    result.push_back(Pair("progress", nBlocks ? (double)nVerified / nBlocks : 1.0));
+    return result;
+}
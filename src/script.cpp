@@ -3,9 +3,10 @@
 // Distributed under the MIT/X11 software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include <atomic>
+#include <limits>
+
 #include <boost/foreach.hpp>
-#include <boost/tuple/tuple.hpp>
-#include <boost/tuple/tuple_comparison.hpp>
 
 using namespace std;
 using namespace boost;
@@ -1251,66 +1252,144 @@ uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int
 }
 
 
-// Valid signature cache, to avoid doing expensive ECDSA signature checking
-// twice for every transaction (once when accepted into memory pool, and
-// again when accepted into the block chain)
+struct CSignatureCache::CBucket
+{
+    std::atomic<uint32_t> nSequence;
+    uint32_t nUnused;
+    std::atomic<uint64_t> vKeys[BUCKET_ENTRIES * 2];
+    uint64_t nPadding;
+};
+BOOST_STATIC_ASSERT(sizeof(CSignatureCache::CBucket) == CSignatureCache::BUCKET_SIZE);
 
-class CSignatureCache
+CSignatureCache::CSignatureCache(uint64_t nMaxBytes)
 {
-private:
-     // sigdata_type is (signature hash, signature, public key):
-    typedef boost::tuple<uint256, std::vector<unsigned char>, CPubKey> sigdata_type;
-    std::set< sigdata_type> setValid;
-    boost::shared_mutex cs_sigcache;
+    nSalt = GetRandHash();
+    pAllocation = NULL;
+    pBuckets = NULL;
+    nBucketMask = 0;
+
+    nMaxBytes = std::min(nMaxBytes, (uint64_t)MAX_SIG_CACHE_MB << 20);
+    nMaxBytes = std::min(nMaxBytes, (uint64_t)std::numeric_limits<size_t>::max() / 2);
+    if (nMaxBytes < sizeof(CBucket))
+        return;
+    uint64_t nBuckets = 1;
+    while (nBuckets * 2 * sizeof(CBucket) <= nMaxBytes)
+        nBuckets *= 2;
+
+    // align the buckets to cache lines
+    pAllocation = calloc(nBuckets * sizeof(CBucket) + 63, 1);
+    if (!pAllocation)
+        return;
+    pBuckets = (CBucket*)(((uintptr_t)pAllocation + 63) & ~(uintptr_t)63);
+    nBucketMask = nBuckets - 1;
+    LogPrintf("Using %u MiB for up to %u cached signatures\n", GetMemoryUsage() >> 20, GetCapacity());
+}
 
-public:
-    bool
-    Get(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
-    {
-        boost::shared_lock<boost::shared_mutex> lock(cs_sigcache);
+CSignatureCache::~CSignatureCache()
+{
+    free(pAllocation);
+}
 
-        sigdata_type k(hash, vchSig, pubKey);
-        std::set<sigdata_type>::iterator mi = setValid.find(k);
-        if (mi != setValid.end())
-            return true;
+uint256 CSignatureCache::GetEntry(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey) const
+{
+    CHashWriter ss(SER_GETHASH, 0);
+    ss << nSalt << hash << vchSig << pubKey;
+    uint256 entry = ss.GetHash();
+    // zero marks an empty slot
+    *entry.begin() |= 1;
+    return entry;
+}
+
+uint64_t CSignatureCache::GetCapacity() const
+{
+    return pBuckets ? ((uint64_t)nBucketMask + 1) * BUCKET_ENTRIES : 0;
+}
+
+uint64_t CSignatureCache::GetMemoryUsage() const
+{
+    return pBuckets ? ((uint64_t)nBucketMask + 1) * sizeof(CBucket) : 0;
+}
+
+bool CSignatureCache::Get(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey) const
+{
+    if (!pBuckets)
         return false;
-    }
 
-    void Set(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
+    uint256 entry = GetEntry(hash, vchSig, pubKey);
+    uint64_t nKey0 = entry.Get64(0), nKey1 = entry.Get64(1);
+    const CBucket& bucket = pBuckets[entry.Get64(2) & nBucketMask];
+    while (true)
     {
-        // DoS prevention: limit cache size to less than 10MB
-        // (~200 bytes per cache entry times 50,000 entries)
-        // Since there are a maximum of 20,000 signature operations per block
-        // 50,000 is a reasonable default.
-        int64_t nMaxCacheSize = GetArg("-maxsigcachesize", 50000);
-        if (nMaxCacheSize <= 0) return;
+        uint32_t nSequence = bucket.nSequence.load(std::memory_order_acquire);
+        if (nSequence & 1)
+            continue;
+        bool fFound = false;
+        for (int i = 0; i < BUCKET_ENTRIES; i++)
+            if (bucket.vKeys[2 * i].load(std::memory_order_relaxed) == nKey0 &&
+                bucket.vKeys[2 * i + 1].load(std::memory_order_relaxed) == nKey1)
+                fFound = true;
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (bucket.nSequence.load(std::memory_order_relaxed) == nSequence)
+            return fFound;
+    }
+}
 
-        boost::unique_lock<boost::shared_mutex> lock(cs_sigcache);
+void CSignatureCache::Set(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
+{
+    if (!pBuckets)
+        return;
 
-        while (static_cast<int64_t>(setValid.size()) > nMaxCacheSize)
-        {
-            // Evict a random entry. Random because that helps
-            // foil would-be DoS attackers who might try to pre-generate
-            // and re-use a set of valid signatures just-slightly-greater
-            // than our cache size.
-            uint256 randomHash = GetRandHash();
-            std::vector<unsigned char> unused;
-            std::set<sigdata_type>::iterator it =
-                setValid.lower_bound(sigdata_type(randomHash, unused, unused));
-            if (it == setValid.end())
-                it = setValid.begin();
-            setValid.erase(*it);
-        }
+    uint256 entry = GetEntry(hash, vchSig, pubKey);
+    CBucket& bucket = pBuckets[entry.Get64(2) & nBucketMask];
+
+    LOCK(cs_sigcache);
+
+    // Overwrite a random entry of the bucket when it's full. Random
+    // because that helps foil would-be DoS attackers who might try to
+    // pre-generate and re-use a set of valid signatures that map to the
+    // same bucket; the salted hash itself provides the randomness.
+    int nSlot = entry.Get64(3) % BUCKET_ENTRIES;
+    for (int i = 0; i < BUCKET_ENTRIES; i++)
+    {
+        if (bucket.vKeys[2 * i].load(std::memory_order_relaxed) == entry.Get64(0) &&
+            bucket.vKeys[2 * i + 1].load(std::memory_order_relaxed) == entry.Get64(1))
+            return;
+        if (bucket.vKeys[2 * i].load(std::memory_order_relaxed) == 0)
+            nSlot = i;
+    }
 
-        sigdata_type k(hash, vchSig, pubKey);
-        setValid.insert(k);
+    uint32_t nSequence = bucket.nSequence.load(std::memory_order_relaxed);
+    bucket.nSequence.store(nSequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    bucket.vKeys[2 * nSlot].store(entry.Get64(0), std::memory_order_relaxed);
+    bucket.vKeys[2 * nSlot + 1].store(entry.Get64(1), std::memory_order_relaxed);
+    bucket.nSequence.store(nSequence + 2, std::memory_order_release);
+}
+
+uint64_t GetMaxSigCacheBytes()
+{
+    // -maxsigcachesize is the older option and counts signatures; it only
+    // applies when -sigcachemb isn't given
+    if (mapArgs.count("-maxsigcachesize") && !mapArgs.count("-sigcachemb"))
+    {
+        int64_t nMaxSize = GetArg("-maxsigcachesize", 0);
+        if (nMaxSize <= 0)
+            return 0;
+        uint64_t nBytes = (uint64_t)std::min(nMaxSize, (int64_t)1 << 40) * CSignatureCache::BUCKET_SIZE / CSignatureCache::BUCKET_ENTRIES;
+        LogPrintf("Sizing the signature cache for -maxsigcachesize=%d signatures (%u bytes), use -sigcachemb to give megabytes\n", nMaxSize, nBytes);
+        return nBytes;
     }
-};
+
+    int64_t nMegabytes = GetArg("-sigcachemb", DEFAULT_SIG_CACHE_MB);
+    if (nMegabytes <= 0)
+        return 0;
+    return (uint64_t)std::min(nMegabytes, (int64_t)MAX_SIG_CACHE_MB) << 20;
+}
 
 bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubKey, const CScript &scriptCode,
               const CTransaction& txTo, unsigned int nIn, int nHashType, int flags)
 {
-    static CSignatureCache signatureCache;
+    static CSignatureCache signatureCache(GetMaxSigCacheBytes());
 
     CPubKey pubkey(vchPubKey);
     if (!pubkey.IsValid())
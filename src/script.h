@@ -24,6 +24,10 @@ class CTransaction;
 
 static const unsigned int MAX_SCRIPT_ELEMENT_SIZE = 520; // bytes
 static const unsigned int MAX_OP_RETURN_RELAY = 40;      // bytes
+/** Default for -sigcachemb */
+static const unsigned int DEFAULT_SIG_CACHE_MB = 32;
+/** Largest signature cache, in megabytes */
+static const unsigned int MAX_SIG_CACHE_MB = 16384;
 
 /** Signature hash types/flags */
 enum
@@ -716,6 +720,52 @@ bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const C
                    unsigned int flags, int nHashType);
 bool VerifySignature(const CTransaction& txFrom, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType);
 
+/** Valid signature cache, to avoid doing expensive ECDSA signature checking
+ * twice for every transaction (once when accepted into memory pool, and
+ * again when accepted into the block chain)
+ *
+ * Entries are the first 128 bits of a salted hash of (signature hash,
+ * signature, public key), kept in a fixed table of cache line sized buckets
+ * of three entries each. Lookups take no lock: a bucket's sequence number is
+ * odd while it's being written and changes with every write, so a reader
+ * that saw it change just looks again.
+ */
+class CSignatureCache
+{
+public:
+    static const int BUCKET_ENTRIES = 3;
+    static const unsigned int BUCKET_SIZE = 64;
+    struct CBucket;
+
+private:
+    uint256 nSalt;
+    void* pAllocation;
+    CBucket* pBuckets;
+    uint32_t nBucketMask;
+    CCriticalSection cs_sigcache;  // serializes writers
+
+    uint256 GetEntry(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey) const;
+
+    CSignatureCache(const CSignatureCache&);
+    CSignatureCache& operator=(const CSignatureCache&);
+
+public:
+    /** Use the largest power of two number of buckets that fits in nMaxBytes */
+    CSignatureCache(uint64_t nMaxBytes);
+    ~CSignatureCache();
+
+    bool Get(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey) const;
+    void Set(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey);
+
+    /** Number of signatures the table has room for */
+    uint64_t GetCapacity() const;
+    uint64_t GetMemoryUsage() const;
+};
+
+/** Size of the signature cache from -sigcachemb, or from the number of
+ * signatures in -maxsigcachesize */
+uint64_t GetMaxSigCacheBytes();
+
 // Given two sets of signatures for scriptPubKey, possibly with OP_0 placeholders,
 // combine them intelligently and return the result.
 CScript CombineSignatures(CScript scriptPubKey, const CTransaction& txTo, unsigned int nIn, const CScript& scriptSig1, const CScript& scriptSig2);
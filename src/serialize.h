@@ -1116,10 +1116,26 @@ public:
         return (*this);
     }
 
+    // Hands the buffer itself over when it can, rather than copying it out
     void GetAndClear(CSerializeData &data) {
-        data.insert(data.end(), begin(), end());
+        if (data.empty() && nReadPos == 0)
+        {
+            // the allocator goes along with the buffer, keep ours for the next one
+            allocator_type alloc = vch.get_allocator();
+            data.swap(vch);
+            vector_type(alloc).swap(vch);
+        }
+        else
+            data.insert(data.end(), begin(), end());
         clear();
     }
+
+    // Buffers that never hold key material can skip zeroing when freed
+    void SetCleanse(bool fCleanse)
+    {
+        vector_type vchNew(vch.begin(), vch.end(), allocator_type(fCleanse));
+        vch.swap(vchNew);
+    }
 };
 
 
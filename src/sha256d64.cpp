@@ -0,0 +1,337 @@
+// Copyright (c) 2016 The Ember developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "hash.h"
+
+#include <stdint.h>
+#include <string.h>
+
+// The vector kernels are built with per-function target attributes, so the
+// rest of the program doesn't need -msse4.1 / -mavx2 and still runs on CPUs
+// without them. Which one is used is decided from cpuid at the first call.
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define USE_SHA256D64_X86
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+typedef void (*SHA256D64Func)(unsigned char* pout, const unsigned char* pin, size_t nBlocks);
+
+static void SHA256D64Generic(unsigned char* pout, const unsigned char* pin, size_t nBlocks)
+{
+    for (size_t i = 0; i < nBlocks; i++)
+    {
+        uint256 hash = Hash(pin + 64 * i, pin + 64 * i + 64);
+        memcpy(pout + 32 * i, hash.begin(), 32);
+    }
+}
+
+#ifdef USE_SHA256D64_X86
+
+static const uint32_t SHA256_K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static const uint32_t SHA256_IV[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+static inline uint32_t ReadBE32(const unsigned char* p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+static inline void WriteBE32(unsigned char* p, uint32_t x)
+{
+    p[0] = x >> 24;
+    p[1] = x >> 16;
+    p[2] = x >> 8;
+    p[3] = x;
+}
+
+// The multi-lane kernels run the same three compressions as the generic
+// code: the 64-byte input, the constant padding block of a 64-byte message,
+// and the 32-byte first hash with its padding. Lane i of every vector holds
+// a word of input i.
+
+#define SHA256_LANES_KERNEL(NAME, TARGET, VEC, SET1, ADD, XOR, OR, AND, SRLI, SLLI, LOADLANES, STORELANES) \
+namespace NAME {                                                                          \
+                                                                                          \
+__attribute__((target(TARGET))) static inline VEC K(uint32_t x) { return SET1((int)x); } \
+__attribute__((target(TARGET))) static inline VEC Ror(VEC x, int n) { return OR(SRLI(x, n), SLLI(x, 32 - n)); } \
+__attribute__((target(TARGET))) static inline VEC Sigma0(VEC x) { return XOR(XOR(Ror(x, 2), Ror(x, 13)), Ror(x, 22)); } \
+__attribute__((target(TARGET))) static inline VEC Sigma1(VEC x) { return XOR(XOR(Ror(x, 6), Ror(x, 11)), Ror(x, 25)); } \
+__attribute__((target(TARGET))) static inline VEC sigma0(VEC x) { return XOR(XOR(Ror(x, 7), Ror(x, 18)), SRLI(x, 3)); } \
+__attribute__((target(TARGET))) static inline VEC sigma1(VEC x) { return XOR(XOR(Ror(x, 17), Ror(x, 19)), SRLI(x, 10)); } \
+                                                                                          \
+__attribute__((target(TARGET))) static void Transform(VEC s[8], const VEC win[16])       \
+{                                                                                         \
+    VEC w[64];                                                                            \
+    for (int t = 0; t < 16; t++)                                                          \
+        w[t] = win[t];                                                                    \
+    for (int t = 16; t < 64; t++)                                                         \
+        w[t] = ADD(ADD(sigma1(w[t - 2]), w[t - 7]), ADD(sigma0(w[t - 15]), w[t - 16]));   \
+    VEC a = s[0], b = s[1], c = s[2], d = s[3], e = s[4], f = s[5], g = s[6], h = s[7];   \
+    for (int t = 0; t < 64; t++)                                                          \
+    {                                                                                     \
+        VEC ch = XOR(g, AND(e, XOR(f, g)));                                               \
+        VEC maj = OR(AND(a, b), AND(c, OR(a, b)));                                        \
+        VEC t1 = ADD(ADD(ADD(h, Sigma1(e)), ADD(ch, K(SHA256_K[t]))), w[t]);              \
+        VEC t2 = ADD(Sigma0(a), maj);                                                     \
+        h = g; g = f; f = e; e = ADD(d, t1);                                              \
+        d = c; c = b; b = a; a = ADD(t1, t2);                                             \
+    }                                                                                     \
+    s[0] = ADD(s[0], a); s[1] = ADD(s[1], b); s[2] = ADD(s[2], c); s[3] = ADD(s[3], d);   \
+    s[4] = ADD(s[4], e); s[5] = ADD(s[5], f); s[6] = ADD(s[6], g); s[7] = ADD(s[7], h);   \
+}                                                                                         \
+                                                                                          \
+__attribute__((target(TARGET))) static void SHA256D64(unsigned char* pout, const unsigned char* pin) \
+{                                                                                         \
+    VEC w[16], s[8];                                                                      \
+    for (int t = 0; t < 16; t++)                                                          \
+        w[t] = LOADLANES(pin + 4 * t);                                                    \
+    for (int i = 0; i < 8; i++)                                                           \
+        s[i] = K(SHA256_IV[i]);                                                           \
+    Transform(s, w);                                                                      \
+    w[0] = K(0x80000000);                                                                 \
+    for (int t = 1; t < 15; t++)                                                          \
+        w[t] = K(0);                                                                      \
+    w[15] = K(512);                                                                       \
+    Transform(s, w);                                                                      \
+                                                                                          \
+    for (int i = 0; i < 8; i++)                                                           \
+    {                                                                                     \
+        w[i] = s[i];                                                                      \
+        s[i] = K(SHA256_IV[i]);                                                           \
+    }                                                                                     \
+    w[8] = K(0x80000000);                                                                 \
+    for (int t = 9; t < 15; t++)                                                          \
+        w[t] = K(0);                                                                      \
+    w[15] = K(256);                                                                       \
+    Transform(s, w);                                                                      \
+    for (int i = 0; i < 8; i++)                                                           \
+        STORELANES(pout + 4 * i, s[i]);                                                   \
+}                                                                                         \
+                                                                                          \
+}
+
+// Word t of each of the 4 inputs, which are 64 bytes apart
+#define LOAD_LANES_4(p) _mm_set_epi32(ReadBE32((p) + 192), ReadBE32((p) + 128), ReadBE32((p) + 64), ReadBE32(p))
+#define STORE_LANES_4(p, v) do { \
+        WriteBE32((p), _mm_extract_epi32(v, 0)); WriteBE32((p) + 32, _mm_extract_epi32(v, 1)); \
+        WriteBE32((p) + 64, _mm_extract_epi32(v, 2)); WriteBE32((p) + 96, _mm_extract_epi32(v, 3)); \
+    } while (0)
+
+#define LOAD_LANES_8(p) _mm256_set_epi32(ReadBE32((p) + 448), ReadBE32((p) + 384), ReadBE32((p) + 320), ReadBE32((p) + 256), \
+                                         ReadBE32((p) + 192), ReadBE32((p) + 128), ReadBE32((p) + 64), ReadBE32(p))
+#define STORE_LANES_8(p, v) do { \
+        WriteBE32((p), _mm256_extract_epi32(v, 0)); WriteBE32((p) + 32, _mm256_extract_epi32(v, 1)); \
+        WriteBE32((p) + 64, _mm256_extract_epi32(v, 2)); WriteBE32((p) + 96, _mm256_extract_epi32(v, 3)); \
+        WriteBE32((p) + 128, _mm256_extract_epi32(v, 4)); WriteBE32((p) + 160, _mm256_extract_epi32(v, 5)); \
+        WriteBE32((p) + 192, _mm256_extract_epi32(v, 6)); WriteBE32((p) + 224, _mm256_extract_epi32(v, 7)); \
+    } while (0)
+
+SHA256_LANES_KERNEL(sse41, "sse4.1", __m128i, _mm_set1_epi32, _mm_add_epi32, _mm_xor_si128, _mm_or_si128,
+                    _mm_and_si128, _mm_srli_epi32, _mm_slli_epi32, LOAD_LANES_4, STORE_LANES_4)
+SHA256_LANES_KERNEL(avx2, "avx2", __m256i, _mm256_set1_epi32, _mm256_add_epi32, _mm256_xor_si256, _mm256_or_si256,
+                    _mm256_and_si256, _mm256_srli_epi32, _mm256_slli_epi32, LOAD_LANES_8, STORE_LANES_8)
+
+static void SHA256D64SSE41(unsigned char* pout, const unsigned char* pin, size_t nBlocks)
+{
+    for (; nBlocks >= 4; nBlocks -= 4, pin += 256, pout += 128)
+        sse41::SHA256D64(pout, pin);
+    SHA256D64Generic(pout, pin, nBlocks);
+}
+
+static void SHA256D64AVX2(unsigned char* pout, const unsigned char* pin, size_t nBlocks)
+{
+    for (; nBlocks >= 8; nBlocks -= 8, pin += 512, pout += 256)
+        avx2::SHA256D64(pout, pin);
+    SHA256D64SSE41(pout, pin, nBlocks);
+}
+
+// SHA-NI computes one message at a time, but fast enough that it beats the
+// multi-lane kernels on every CPU that has it
+namespace shani {
+
+#define SHANI_TARGET __attribute__((target("sha,sse4.1")))
+
+SHANI_TARGET static inline __m128i ByteSwap(__m128i x)
+{
+    return _mm_shuffle_epi8(x, _mm_set_epi8(12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3));
+}
+
+// Rounds 4*i .. 4*i+3 with the message words in m
+SHANI_TARGET static inline void QuadRound(__m128i& s0, __m128i& s1, __m128i m, int i)
+{
+    __m128i msg = _mm_add_epi32(m, _mm_loadu_si128((const __m128i*)&SHA256_K[4 * i]));
+    s1 = _mm_sha256rnds2_epu32(s1, s0, msg);
+    s0 = _mm_sha256rnds2_epu32(s0, s1, _mm_shuffle_epi32(msg, 0x0e));
+}
+
+// m0..m3 hold message words 4*i-16 .. 4*i-1; replace m0 with words 4*i .. 4*i+3
+SHANI_TARGET static inline void NextMessage(__m128i& m0, __m128i m1, __m128i m2, __m128i m3)
+{
+    m0 = _mm_sha256msg1_epu32(m0, m1);
+    m0 = _mm_add_epi32(m0, _mm_alignr_epi8(m3, m2, 4));
+    m0 = _mm_sha256msg2_epu32(m0, m3);
+}
+
+// Compress the 16 big endian message words in m into the state, which is
+// kept in the ABEF / CDGH order the SHA instructions use
+SHANI_TARGET static void Transform(__m128i& abef, __m128i& cdgh, __m128i m[4])
+{
+    __m128i s0 = abef, s1 = cdgh;
+    for (int i = 0; i < 16; i++)
+    {
+        if (i >= 4)
+            NextMessage(m[i & 3], m[(i + 1) & 3], m[(i + 2) & 3], m[(i + 3) & 3]);
+        QuadRound(s0, s1, m[i & 3], i);
+    }
+    abef = _mm_add_epi32(abef, s0);
+    cdgh = _mm_add_epi32(cdgh, s1);
+}
+
+SHANI_TARGET static void InitState(__m128i& abef, __m128i& cdgh)
+{
+    abef = _mm_set_epi32(SHA256_IV[0], SHA256_IV[1], SHA256_IV[4], SHA256_IV[5]);
+    cdgh = _mm_set_epi32(SHA256_IV[2], SHA256_IV[3], SHA256_IV[6], SHA256_IV[7]);
+}
+
+// The state as the words a b c d and e f g h, lowest lane first
+SHANI_TARGET static void GetState(__m128i abef, __m128i cdgh, __m128i& abcd, __m128i& efgh)
+{
+    __m128i t1 = _mm_shuffle_epi32(abef, 0x1b);
+    __m128i t2 = _mm_shuffle_epi32(cdgh, 0x1b);
+    abcd = _mm_unpacklo_epi64(t1, t2);
+    efgh = _mm_unpackhi_epi64(t1, t2);
+}
+
+SHANI_TARGET static void SHA256D64(unsigned char* pout, const unsigned char* pin, size_t nBlocks)
+{
+    for (size_t n = 0; n < nBlocks; n++, pin += 64, pout += 32)
+    {
+        __m128i abef, cdgh, m[4];
+        InitState(abef, cdgh);
+        for (int i = 0; i < 4; i++)
+            m[i] = ByteSwap(_mm_loadu_si128((const __m128i*)(pin + 16 * i)));
+        Transform(abef, cdgh, m);
+        m[0] = _mm_set_epi32(0, 0, 0, 0x80000000);
+        m[1] = _mm_setzero_si128();
+        m[2] = _mm_setzero_si128();
+        m[3] = _mm_set_epi32(512, 0, 0, 0);
+        Transform(abef, cdgh, m);
+
+        GetState(abef, cdgh, m[0], m[1]);
+        m[2] = _mm_set_epi32(0, 0, 0, 0x80000000);
+        m[3] = _mm_set_epi32(256, 0, 0, 0);
+        InitState(abef, cdgh);
+        Transform(abef, cdgh, m);
+
+        GetState(abef, cdgh, m[0], m[1]);
+        _mm_storeu_si128((__m128i*)pout, ByteSwap(m[0]));
+        _mm_storeu_si128((__m128i*)(pout + 16), ByteSwap(m[1]));
+    }
+}
+
+}
+
+static void SHA256D64SHANI(unsigned char* pout, const unsigned char* pin, size_t nBlocks)
+{
+    shani::SHA256D64(pout, pin, nBlocks);
+}
+
+static uint64_t ReadXCR0()
+{
+    uint32_t a, d;
+    __asm__ ("xgetbv" : "=a"(a), "=d"(d) : "c"(0));
+    return ((uint64_t)d << 32) | a;
+}
+
+#endif // USE_SHA256D64_X86
+
+struct CSHA256D64Impl
+{
+    SHA256D64Func pfn;
+    const char* pszName;
+    bool fSSE41, fAVX2, fSHA;
+
+    CSHA256D64Impl() : pfn(SHA256D64Generic), pszName("generic"), fSSE41(false), fAVX2(false), fSHA(false)
+    {
+#ifdef USE_SHA256D64_X86
+        unsigned int eax, ebx, ecx, edx;
+        if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+            return;
+        fSSE41 = (ecx >> 19) & 1;
+        // AVX registers also need saving by the OS
+        bool fAVX = ((ecx >> 27) & 1) && ((ecx >> 28) & 1) && (ReadXCR0() & 6) == 6;
+        if (__get_cpuid_max(0, NULL) >= 7)
+        {
+            __cpuid_count(7, 0, eax, ebx, ecx, edx);
+            fAVX2 = fAVX && ((ebx >> 5) & 1);
+            fSHA = (ebx >> 29) & 1;
+        }
+        if (fSHA && fSSE41)
+        {
+            pfn = SHA256D64SHANI;
+            pszName = "shani";
+        }
+        else if (fAVX2)
+        {
+            pfn = SHA256D64AVX2;
+            pszName = "avx2";
+        }
+        else if (fSSE41)
+        {
+            pfn = SHA256D64SSE41;
+            pszName = "sse4.1";
+        }
+#endif
+    }
+};
+
+static const CSHA256D64Impl& GetSHA256D64Impl()
+{
+    static const CSHA256D64Impl impl;
+    return impl;
+}
+
+void SHA256D64(unsigned char* pout, const unsigned char* pin, size_t nBlocks)
+{
+    if (nBlocks > 0)
+        GetSHA256D64Impl().pfn(pout, pin, nBlocks);
+}
+
+const char* SHA256D64Implementation()
+{
+    return GetSHA256D64Impl().pszName;
+}
+
+bool SHA256D64With(const char* pszName, unsigned char* pout, const unsigned char* pin, size_t nBlocks)
+{
+    SHA256D64Func pfn = NULL;
+    if (strcmp(pszName, "generic") == 0)
+        pfn = SHA256D64Generic;
+#ifdef USE_SHA256D64_X86
+    // the wider kernels finish odd batches with the narrower ones
+    const CSHA256D64Impl& impl = GetSHA256D64Impl();
+    if (strcmp(pszName, "sse4.1") == 0 && impl.fSSE41)
+        pfn = SHA256D64SSE41;
+    else if (strcmp(pszName, "avx2") == 0 && impl.fAVX2 && impl.fSSE41)
+        pfn = SHA256D64AVX2;
+    else if (strcmp(pszName, "shani") == 0 && impl.fSHA && impl.fSSE41)
+        pfn = SHA256D64SHANI;
+#endif
+    if (!pfn)
+        return false;
+    pfn(pout, pin, nBlocks);
+    return true;
+}
@@ -0,0 +1,85 @@
+#include <boost/test/unit_test.hpp>
+
+#include <vector>
+
+#include "bloom.h"
+#include "uint256.h"
+#include "util.h"
+
+using namespace std;
+
+static vector<uint256> RandomHashes(int nCount)
+{
+    vector<uint256> vHash;
+    for (int i = 0; i < nCount; i++)
+        vHash.push_back(GetRandHash());
+    return vHash;
+}
+
+static int CountContained(const CRollingBloomFilter& filter, const vector<uint256>& vHash)
+{
+    int nCount = 0;
+    for (unsigned int i = 0; i < vHash.size(); i++)
+        if (filter.contains(vHash[i]))
+            nCount++;
+    return nCount;
+}
+
+BOOST_AUTO_TEST_SUITE(bloom_tests)
+
+BOOST_AUTO_TEST_CASE(rolling_bloom_insert_contains)
+{
+    CRollingBloomFilter filter(100, 0.001);
+    vector<uint256> vHash = RandomHashes(100);
+    BOOST_CHECK(CountContained(filter, vHash) == 0);
+    for (unsigned int i = 0; i < vHash.size(); i++)
+    {
+        filter.insert(vHash[i]);
+        BOOST_CHECK(filter.contains(vHash[i]));
+    }
+    BOOST_CHECK_EQUAL(CountContained(filter, vHash), 100);
+
+    // reset forgets everything and picks a new key
+    filter.reset();
+    BOOST_CHECK(CountContained(filter, vHash) <= 1);
+    filter.insert(vHash[0]);
+    BOOST_CHECK(filter.contains(vHash[0]));
+}
+
+// The last nElements / 2 entries are always there; an entry is gone once
+// three more generations have been started after its own
+BOOST_AUTO_TEST_CASE(rolling_bloom_rollover)
+{
+    CRollingBloomFilter filter(200, 0.001);
+    vector<uint256> vOld = RandomHashes(100);
+    for (unsigned int i = 0; i < vOld.size(); i++)
+        filter.insert(vOld[i]);
+
+    vector<uint256> vNew = RandomHashes(2000);
+    for (unsigned int i = 0; i < vNew.size(); i++)
+    {
+        filter.insert(vNew[i]);
+        for (unsigned int j = (i >= 99 ? i - 99 : 0); j <= i; j += 7)
+            BOOST_CHECK(filter.contains(vNew[j]));
+        BOOST_CHECK(filter.contains(vNew[i >= 99 ? i - 99 : 0]));
+    }
+    // the old generation was wiped long ago, only false positives remain
+    BOOST_CHECK(CountContained(filter, vOld) <= 2);
+    BOOST_CHECK(CountContained(filter, vector<uint256>(vNew.begin(), vNew.begin() + 1000)) <= 5);
+}
+
+// At full load of 3 * nElements / 2 entries the false positive rate stays
+// around the requested one
+BOOST_AUTO_TEST_CASE(rolling_bloom_false_positive_rate)
+{
+    CRollingBloomFilter filter(1000, 0.01);
+    vector<uint256> vInserted = RandomHashes(1500);
+    for (unsigned int i = 0; i < vInserted.size(); i++)
+        filter.insert(vInserted[i]);
+    BOOST_CHECK_EQUAL(CountContained(filter, vInserted), 1500);
+
+    int nFalsePositives = CountContained(filter, RandomHashes(20000));
+    BOOST_CHECK(nFalsePositives < 20000 * 0.01 * 2);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,143 @@
+#include <boost/test/unit_test.hpp>
+
+#include <atomic>
+#include <vector>
+
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+
+#include "checkqueue.h"
+#include "util.h"
+
+using namespace std;
+
+static std::atomic<int> nChecksRun(0);
+
+// Counts how often it is run, and fails if asked to
+class CTestCheck
+{
+private:
+    bool fPass;
+    int* pnRun;
+
+public:
+    CTestCheck() : fPass(true), pnRun(NULL) {}
+    CTestCheck(bool fPassIn, int* pnRunIn = NULL) : fPass(fPassIn), pnRun(pnRunIn) {}
+
+    bool operator()()
+    {
+        nChecksRun++;
+        if (pnRun)
+            (*pnRun)++;
+        return fPass;
+    }
+
+    void swap(CTestCheck& check)
+    {
+        std::swap(fPass, check.fPass);
+        std::swap(pnRun, check.pnRun);
+    }
+};
+
+// A queue with nWorkers threads besides the master, stopped on destruction
+class CTestQueue
+{
+public:
+    CCheckQueue<CTestCheck> queue;
+    boost::thread_group threadGroup;
+
+    CTestQueue(int nWorkers) : queue(4)
+    {
+        for (int i = 0; i < nWorkers; i++)
+            threadGroup.create_thread(boost::bind(&CCheckQueue<CTestCheck>::Thread, &queue));
+    }
+
+    ~CTestQueue()
+    {
+        threadGroup.interrupt_all();
+        threadGroup.join_all();
+    }
+};
+
+BOOST_AUTO_TEST_SUITE(checkqueue_tests)
+
+// Every check runs exactly once, whatever order and batching the workers pick
+BOOST_AUTO_TEST_CASE(checkqueue_all_run)
+{
+    CTestQueue tq(3);
+    for (int nChecks = 0; nChecks < 1000; nChecks += 1 + GetRandInt(100))
+    {
+        vector<int> vRun(nChecks, 0);
+        {
+            CCheckQueueControl<CTestCheck> control(&tq.queue);
+            for (int i = 0; i < nChecks; )
+            {
+                vector<CTestCheck> vChecks;
+                int nBatch = std::min(nChecks - i, 1 + GetRandInt(20));
+                for (int j = 0; j < nBatch; j++, i++)
+                    vChecks.push_back(CTestCheck(true, &vRun[i]));
+                control.Add(vChecks);
+            }
+            BOOST_CHECK(control.Wait());
+        }
+        for (int i = 0; i < nChecks; i++)
+            BOOST_CHECK_EQUAL(vRun[i], 1);
+    }
+}
+
+// One failing check fails the whole batch, and checks still queued are skipped
+BOOST_AUTO_TEST_CASE(checkqueue_early_failure)
+{
+    CTestQueue tq(0);
+    nChecksRun = 0;
+    CCheckQueueControl<CTestCheck> control(&tq.queue);
+    vector<CTestCheck> vChecks;
+    for (int i = 0; i < 100; i++)
+        vChecks.push_back(CTestCheck(i != 99));
+    // the queue is drained from the back, so the failure comes first
+    control.Add(vChecks);
+    BOOST_CHECK(!control.Wait());
+    BOOST_CHECK(nChecksRun < 100);
+
+    CTestQueue tqWorkers(3);
+    for (int nFail = 0; nFail < 10; nFail++)
+    {
+        CCheckQueueControl<CTestCheck> controlWorkers(&tqWorkers.queue);
+        vector<CTestCheck> vMixed;
+        for (int i = 0; i < 200; i++)
+            vMixed.push_back(CTestCheck(i != nFail * 20));
+        controlWorkers.Add(vMixed);
+        BOOST_CHECK(!controlWorkers.Wait());
+    }
+}
+
+// After a failure the queue is clean again for the next block
+BOOST_AUTO_TEST_CASE(checkqueue_control_reuse)
+{
+    CTestQueue tq(3);
+    for (int i = 0; i < 20; i++)
+    {
+        bool fFail = (i % 3 == 1);
+        CCheckQueueControl<CTestCheck> control(&tq.queue);
+        vector<CTestCheck> vChecks;
+        for (int j = 0; j < 50; j++)
+            vChecks.push_back(CTestCheck(!(fFail && j == 25)));
+        control.Add(vChecks);
+        BOOST_CHECK_EQUAL(control.Wait(), !fFail);
+    }
+
+    // A control that is never waited on finishes the work when it goes away
+    nChecksRun = 0;
+    {
+        CCheckQueueControl<CTestCheck> control(&tq.queue);
+        vector<CTestCheck> vChecks(10, CTestCheck(true));
+        control.Add(vChecks);
+    }
+    BOOST_CHECK_EQUAL(nChecksRun, 10);
+
+    // Without a queue, a control accepts nothing and always succeeds
+    CCheckQueueControl<CTestCheck> controlNull(NULL);
+    BOOST_CHECK(controlNull.Wait());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,319 @@
+#include <boost/test/unit_test.hpp>
+
+#include <string.h>
+#include <vector>
+
+#include <openssl/bn.h>
+#include <openssl/ec.h>
+#include <openssl/ecdsa.h>
+#include <openssl/obj_mac.h>
+
+#include "ecverify.h"
+#include "uint256.h"
+#include "util.h"
+
+using namespace std;
+
+typedef vector<unsigned char> valtype;
+
+// The group order n of secp256k1
+static const unsigned char pchOrder[32] = {
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xfe,
+    0xba, 0xae, 0xdc, 0xe6, 0xaf, 0x48, 0xa0, 0x3b, 0xbf, 0xd2, 0x5e, 0x8c, 0xd0, 0x36, 0x41, 0x41
+};
+
+static valtype BNToBytes(const BIGNUM* bn)
+{
+    valtype vch(32, 0);
+    int nBytes = BN_num_bytes(bn);
+    BN_bn2bin(bn, &vch[32 - nBytes]);
+    return vch;
+}
+
+// DER encode a signature from big endian r and s of any length
+static valtype EncodeSig(const valtype& r, const valtype& s)
+{
+    valtype vch[2] = {r, s};
+    valtype vchSig(2, 0);
+    vchSig[0] = 0x30;
+    for (int i = 0; i < 2; i++)
+    {
+        valtype& v = vch[i];
+        while (v.size() > 1 && v[0] == 0 && !(v[1] & 0x80))
+            v.erase(v.begin());
+        if (v.empty())
+            v.push_back(0);
+        if (v[0] & 0x80)
+            v.insert(v.begin(), 0);
+        vchSig.push_back(0x02);
+        vchSig.push_back(v.size());
+        vchSig.insert(vchSig.end(), v.begin(), v.end());
+    }
+    vchSig[1] = vchSig.size() - 2;
+    return vchSig;
+}
+
+// Split a DER signature made by OpenSSL into 32 byte r and s
+static void DecodeSig(const valtype& vchSig, valtype& r, valtype& s)
+{
+    unsigned int nLenR = vchSig[3];
+    valtype vr(vchSig.begin() + 4, vchSig.begin() + 4 + nLenR);
+    valtype vs(vchSig.begin() + 6 + nLenR, vchSig.begin() + 6 + nLenR + vchSig[5 + nLenR]);
+    BIGNUM* bn = BN_bin2bn(&vr[0], vr.size(), NULL);
+    r = BNToBytes(bn);
+    BN_bin2bn(&vs[0], vs.size(), bn);
+    s = BNToBytes(bn);
+    BN_free(bn);
+}
+
+static valtype GetPubKey(const EC_GROUP* group, const EC_POINT* point, bool fCompressed)
+{
+    valtype vch(65);
+    size_t nSize = EC_POINT_point2oct(group, point, fCompressed ? POINT_CONVERSION_COMPRESSED : POINT_CONVERSION_UNCOMPRESSED,
+                                      &vch[0], vch.size(), NULL);
+    vch.resize(nSize);
+    return vch;
+}
+
+static int OpenSSLVerify(const valtype& vchPubKey, const unsigned char* pchHash, const valtype& vchSig)
+{
+    EC_KEY* pkey = EC_KEY_new_by_curve_name(NID_secp256k1);
+    const unsigned char* pbegin = &vchPubKey[0];
+    int nRet = 0;
+    if (o2i_ECPublicKey(&pkey, &pbegin, vchPubKey.size()))
+        nRet = ECDSA_verify(0, pchHash, 32, &vchSig[0], vchSig.size(), pkey) == 1;
+    EC_KEY_free(pkey);
+    return nRet;
+}
+
+// Check the fast path against OpenSSL, and return OpenSSL's verdict. Only
+// odd encodings may be handed back to OpenSSL with -1.
+static int CheckVerify(const valtype& vchPubKey, const unsigned char* pchHash, const valtype& vchSig, bool fMayDefer = false)
+{
+    int nExpected = OpenSSLVerify(vchPubKey, pchHash, vchSig);
+    int nFast = ECVerify(&vchPubKey[0], vchPubKey.size(), pchHash, &vchSig[0], vchSig.size());
+#ifdef __SIZEOF_INT128__
+    if (!fMayDefer)
+        BOOST_CHECK(nFast != -1);
+#endif
+    if (nFast != -1)
+        BOOST_CHECK_EQUAL(nFast, nExpected);
+    return nExpected;
+}
+
+struct ECVerifySetup {
+    EC_GROUP* group;
+    BIGNUM* bnOrder;
+    BN_CTX* ctx;
+
+    ECVerifySetup()
+    {
+        BOOST_REQUIRE(ECVerifyInit());
+        group = EC_GROUP_new_by_curve_name(NID_secp256k1);
+        bnOrder = BN_bin2bn(pchOrder, 32, NULL);
+        ctx = BN_CTX_new();
+    }
+
+    ~ECVerifySetup()
+    {
+        BN_CTX_free(ctx);
+        BN_free(bnOrder);
+        EC_GROUP_free(group);
+    }
+};
+
+BOOST_FIXTURE_TEST_SUITE(ecverify_tests, ECVerifySetup)
+
+BOOST_AUTO_TEST_CASE(ecverify_random)
+{
+    for (int i = 0; i < 200; i++)
+    {
+        EC_KEY* pkey = EC_KEY_new_by_curve_name(NID_secp256k1);
+        BOOST_REQUIRE(EC_KEY_generate_key(pkey));
+        valtype vchPubKey = GetPubKey(group, EC_KEY_get0_public_key(pkey), i % 2 == 0);
+
+        uint256 hash = GetRandHash();
+        const unsigned char* pchHash = hash.begin();
+        valtype vchSig(ECDSA_size(pkey));
+        unsigned int nSize = vchSig.size();
+        BOOST_REQUIRE(ECDSA_sign(0, pchHash, 32, &vchSig[0], &nSize, pkey));
+        vchSig.resize(nSize);
+
+        BOOST_CHECK_EQUAL(CheckVerify(vchPubKey, pchHash, vchSig), 1);
+
+        // another message
+        uint256 hashOther = hash;
+        hashOther.begin()[GetRandInt(32)] ^= 1 << GetRandInt(8);
+        BOOST_CHECK_EQUAL(CheckVerify(vchPubKey, hashOther.begin(), vchSig), 0);
+
+        // another key
+        EC_KEY* pkeyOther = EC_KEY_new_by_curve_name(NID_secp256k1);
+        BOOST_REQUIRE(EC_KEY_generate_key(pkeyOther));
+        BOOST_CHECK_EQUAL(CheckVerify(GetPubKey(group, EC_KEY_get0_public_key(pkeyOther), i % 2 == 1), pchHash, vchSig), 0);
+        EC_KEY_free(pkeyOther);
+
+        valtype r, s;
+        DecodeSig(vchSig, r, s);
+
+        // a changed s
+        valtype sBad = s;
+        sBad[GetRandInt(32)] ^= 1 << GetRandInt(8);
+        CheckVerify(vchPubKey, pchHash, EncodeSig(r, sBad));
+
+        // high S, n - s, is just as valid
+        BIGNUM* bn = BN_bin2bn(&s[0], 32, NULL);
+        BN_sub(bn, bnOrder, bn);
+        BOOST_CHECK_EQUAL(CheckVerify(vchPubKey, pchHash, EncodeSig(r, BNToBytes(bn))), 1);
+        BN_free(bn);
+
+        EC_KEY_free(pkey);
+    }
+}
+
+// Hashes at or above the group order are reduced
+BOOST_AUTO_TEST_CASE(ecverify_large_hash)
+{
+    EC_KEY* pkey = EC_KEY_new_by_curve_name(NID_secp256k1);
+    BOOST_REQUIRE(EC_KEY_generate_key(pkey));
+    valtype vchPubKey = GetPubKey(group, EC_KEY_get0_public_key(pkey), true);
+
+    valtype vHashes[4];
+    vHashes[0] = valtype(32, 0xff);
+    vHashes[1] = valtype(pchOrder, pchOrder + 32);
+    vHashes[2] = vHashes[1];
+    vHashes[2][31]++;
+    vHashes[3] = valtype(32, 0);
+    for (int i = 0; i < 4; i++)
+    {
+        valtype vchSig(ECDSA_size(pkey));
+        unsigned int nSize = vchSig.size();
+        BOOST_REQUIRE(ECDSA_sign(0, &vHashes[i][0], 32, &vchSig[0], &nSize, pkey));
+        vchSig.resize(nSize);
+        BOOST_CHECK_EQUAL(CheckVerify(vchPubKey, &vHashes[i][0], vchSig), 1);
+    }
+    // n and 0 are the same hash
+    valtype vchSig(ECDSA_size(pkey));
+    unsigned int nSize = vchSig.size();
+    BOOST_REQUIRE(ECDSA_sign(0, &vHashes[1][0], 32, &vchSig[0], &nSize, pkey));
+    vchSig.resize(nSize);
+    BOOST_CHECK_EQUAL(CheckVerify(vchPubKey, &vHashes[3][0], vchSig), 1);
+    EC_KEY_free(pkey);
+}
+
+// r and s have to be in [1, n - 1]
+BOOST_AUTO_TEST_CASE(ecverify_out_of_range)
+{
+    EC_KEY* pkey = EC_KEY_new_by_curve_name(NID_secp256k1);
+    BOOST_REQUIRE(EC_KEY_generate_key(pkey));
+    valtype vchPubKey = GetPubKey(group, EC_KEY_get0_public_key(pkey), true);
+    uint256 hash = GetRandHash();
+    valtype vchSig(ECDSA_size(pkey));
+    unsigned int nSize = vchSig.size();
+    BOOST_REQUIRE(ECDSA_sign(0, hash.begin(), 32, &vchSig[0], &nSize, pkey));
+    vchSig.resize(nSize);
+    valtype r, s;
+    DecodeSig(vchSig, r, s);
+
+    valtype vZero(1, 0);
+    valtype vOrder(pchOrder, pchOrder + 32);
+    valtype vOrderPlusR = vOrder;
+    BIGNUM* bn = BN_bin2bn(&r[0], 32, NULL);
+    BN_add(bn, bn, bnOrder);
+    vOrderPlusR.assign(BN_num_bytes(bn), 0);
+    BN_bn2bin(bn, &vOrderPlusR[0]);
+    BN_free(bn);
+
+    BOOST_CHECK_EQUAL(CheckVerify(vchPubKey, hash.begin(), EncodeSig(vZero, s), true), 0);
+    BOOST_CHECK_EQUAL(CheckVerify(vchPubKey, hash.begin(), EncodeSig(r, vZero), true), 0);
+    BOOST_CHECK_EQUAL(CheckVerify(vchPubKey, hash.begin(), EncodeSig(vZero, vZero), true), 0);
+    BOOST_CHECK_EQUAL(CheckVerify(vchPubKey, hash.begin(), EncodeSig(vOrder, s), true), 0);
+    BOOST_CHECK_EQUAL(CheckVerify(vchPubKey, hash.begin(), EncodeSig(r, vOrder), true), 0);
+    // r + n is congruent to r, but still out of range
+    BOOST_CHECK_EQUAL(CheckVerify(vchPubKey, hash.begin(), EncodeSig(vOrderPlusR, s), true), 0);
+    BOOST_CHECK_EQUAL(CheckVerify(vchPubKey, hash.begin(), EncodeSig(r, s)), 1);
+    EC_KEY_free(pkey);
+}
+
+// A signature whose nonce point R has its x coordinate in [n, p), so r is
+// R.x - n. Such signatures can't be made without knowing the nonce for a
+// given key, but a key can be made to fit a chosen R: with u1 = z / s and
+// u2 = r / s, Q = (R - u1 G) / u2 satisfies u1 G + u2 Q = R.
+BOOST_AUTO_TEST_CASE(ecverify_r_above_order)
+{
+    BIGNUM* bnX = BN_new();
+    BIGNUM* bnR = BN_new();
+    BIGNUM* bnS = BN_new();
+    BIGNUM* bnZ = BN_new();
+    BIGNUM* bnSInv = BN_new();
+    BIGNUM* bnU1 = BN_new();
+    BIGNUM* bnU2Inv = BN_new();
+    EC_POINT* pointR = EC_POINT_new(group);
+    EC_POINT* pointT = EC_POINT_new(group);
+    EC_POINT* pointQ = EC_POINT_new(group);
+
+    for (int nTest = 0; nTest < 2; nTest++)
+    {
+        // nTest 0: R.x in [n, p). nTest 1: R.x at or just above p - n, the
+        // smallest r for which r + n is no longer a field element.
+        // n itself is on the curve, but would make r zero
+        BN_copy(bnX, bnOrder);
+        BN_add_word(bnX, 1);
+        if (nTest == 1)
+        {
+            BIGNUM* bnP = BN_new();
+            EC_GROUP_get_curve_GFp(group, bnP, NULL, NULL, ctx);
+            BN_sub(bnX, bnP, bnOrder);
+            BN_free(bnP);
+        }
+        while (!EC_POINT_set_compressed_coordinates_GFp(group, pointR, bnX, 0, ctx))
+            BN_add_word(bnX, 1);
+        BN_copy(bnR, bnX);
+        if (nTest == 0)
+            BN_sub(bnR, bnX, bnOrder);
+
+        for (int i = 0; i < 20; i++)
+        {
+            uint256 hash = GetRandHash();
+            BN_bin2bn(hash.begin(), 32, bnZ);
+            BN_nnmod(bnZ, bnZ, bnOrder, ctx);
+            uint256 hashS = GetRandHash();
+            BN_bin2bn(hashS.begin(), 32, bnS);
+            BN_nnmod(bnS, bnS, bnOrder, ctx);
+            BN_mod_inverse(bnSInv, bnS, bnOrder, ctx);
+            BN_mod_mul(bnU1, bnZ, bnSInv, bnOrder, ctx);
+            BN_mod_mul(bnU2Inv, bnR, bnSInv, bnOrder, ctx);
+            BN_mod_inverse(bnU2Inv, bnU2Inv, bnOrder, ctx);
+
+            EC_POINT_mul(group, pointT, bnU1, NULL, NULL, ctx);
+            EC_POINT_invert(group, pointT, ctx);
+            EC_POINT_add(group, pointT, pointR, pointT, ctx);
+            EC_POINT_mul(group, pointQ, NULL, pointT, bnU2Inv, ctx);
+
+            valtype vchSig = EncodeSig(BNToBytes(bnR), BNToBytes(bnS));
+            for (int nCompressed = 0; nCompressed < 2; nCompressed++)
+            {
+                valtype vchPubKey = GetPubKey(group, pointQ, nCompressed == 1);
+                BOOST_CHECK_EQUAL(CheckVerify(vchPubKey, hash.begin(), vchSig), 1);
+                uint256 hashOther = hash;
+                hashOther.begin()[0] ^= 0x80;
+                BOOST_CHECK_EQUAL(CheckVerify(vchPubKey, hashOther.begin(), vchSig), 0);
+                // the unreduced x coordinate isn't a valid r
+                if (nTest == 0)
+                    BOOST_CHECK_EQUAL(CheckVerify(vchPubKey, hash.begin(), EncodeSig(BNToBytes(bnX), BNToBytes(bnS)), true), 0);
+            }
+        }
+    }
+
+    EC_POINT_free(pointQ);
+    EC_POINT_free(pointT);
+    EC_POINT_free(pointR);
+    BN_free(bnU2Inv);
+    BN_free(bnU1);
+    BN_free(bnSInv);
+    BN_free(bnZ);
+    BN_free(bnS);
+    BN_free(bnR);
+    BN_free(bnX);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,66 @@
+#include <boost/test/unit_test.hpp>
+
+#include <string.h>
+#include <vector>
+
+#include "hashblock.h"
+#include "util.h"
+
+using namespace std;
+
+static const char* pszImplementations[] = {"generic", "avx2"};
+
+BOOST_AUTO_TEST_SUITE(hash9batch_tests)
+
+// Every implementation this CPU can run gives the same hashes as Hash9 one
+// header at a time, for batch sizes that leave every possible remainder
+BOOST_AUTO_TEST_CASE(hash9batch_implementations_match)
+{
+    for (size_t nCount = 0; nCount <= 17; nCount++)
+    {
+        vector<unsigned char> vHeaders(BLOCK_HEADER_SIZE * nCount + 1);
+        for (size_t i = 0; i < vHeaders.size(); i++)
+            vHeaders[i] = GetRandInt(256);
+
+        vector<uint256> vExpected(nCount);
+        for (size_t i = 0; i < nCount; i++)
+            vExpected[i] = Hash9(&vHeaders[BLOCK_HEADER_SIZE * i], &vHeaders[BLOCK_HEADER_SIZE * i] + BLOCK_HEADER_SIZE);
+
+        for (unsigned int n = 0; n < sizeof(pszImplementations) / sizeof(pszImplementations[0]); n++)
+        {
+            // one guard hash after the outputs catches implementations writing too much
+            vector<uint256> vHash(nCount + 1, uint256(1));
+            if (!Hash9BatchWith(pszImplementations[n], &vHeaders[0], nCount, &vHash[0]))
+                continue;
+            for (size_t i = 0; i < nCount; i++)
+                BOOST_CHECK_MESSAGE(vHash[i] == vExpected[i], pszImplementations[n] << " differs for header " << i << " of " << nCount);
+            BOOST_CHECK(vHash[nCount] == uint256(1));
+        }
+    }
+}
+
+// Eight copies of the main network genesis header, enough to fill every
+// lane of the AVX2 kernel, all hash to the genesis hash
+BOOST_AUTO_TEST_CASE(hash9batch_genesis)
+{
+    unsigned char header[BLOCK_HEADER_SIZE] = {0};
+    uint32_t nVersion = 1, nTime = 1476532800, nBits = 0x1e0fffff, nNonce = 180782;
+    uint256 hashMerkleRoot("0xb6602abe6f7422a367781fe8a1a8d8536a286c956b4db296066f9c486a93e25d");
+    memcpy(header, &nVersion, 4);
+    memcpy(header + 36, hashMerkleRoot.begin(), 32);
+    memcpy(header + 68, &nTime, 4);
+    memcpy(header + 72, &nBits, 4);
+    memcpy(header + 76, &nNonce, 4);
+
+    vector<unsigned char> vHeaders;
+    for (int i = 0; i < 8; i++)
+        vHeaders.insert(vHeaders.end(), header, header + BLOCK_HEADER_SIZE);
+    uint256 hashGenesis("0x00000ff60784c4c8ceed0866d00de5742529ef3f1911e245f4126c5c293c88cd");
+
+    vector<uint256> vHash(8);
+    Hash9Batch(&vHeaders[0], 8, &vHash[0]);
+    for (int i = 0; i < 8; i++)
+        BOOST_CHECK(vHash[i] == hashGenesis);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
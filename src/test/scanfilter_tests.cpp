@@ -0,0 +1,172 @@
+#include <boost/test/unit_test.hpp>
+
+#include <vector>
+
+#include "key.h"
+#include "script.h"
+#include "uint256.h"
+#include "util.h"
+#include "wallet.h"
+
+using namespace std;
+
+// The filter only looks at script bytes, so any well formed key will do
+static CPubKey RandomPubKey(bool fCompressed)
+{
+    vector<unsigned char> vch;
+    vch.push_back(fCompressed ? 0x02 : 0x04);
+    for (int i = 0; i < (fCompressed ? 1 : 2); i++)
+    {
+        uint256 hash = GetRandHash();
+        vch.insert(vch.end(), hash.begin(), hash.end());
+    }
+    return CPubKey(vch);
+}
+
+static CScript PayToPubKey(const CPubKey& pubkey)
+{
+    CScript script;
+    script << pubkey << OP_CHECKSIG;
+    return script;
+}
+
+static CScript PayToKeyHash(const CPubKey& pubkey)
+{
+    CScript script;
+    script.SetDestination(pubkey.GetID());
+    return script;
+}
+
+static CScript PayToScriptHash(const CScript& redeemScript)
+{
+    CScript script;
+    script.SetDestination(redeemScript.GetID());
+    return script;
+}
+
+// A push of vch with OP_PUSHDATA1, where a direct push would do
+static CScript& PushNonMinimal(CScript& script, const vector<unsigned char>& vch)
+{
+    script.push_back(OP_PUSHDATA1);
+    script.push_back((unsigned char)vch.size());
+    script.insert(script.end(), vch.begin(), vch.end());
+    return script;
+}
+
+// Fill a filter the way ScanForWalletTransactions does
+class CScanFilterTest
+{
+public:
+    vector<CPubKey> vKeys;
+    vector<CScript> vRedeemScripts;
+    CWalletScanFilter filter;
+
+    CScanFilterTest(int nKeys)
+    {
+        for (int i = 0; i < nKeys; i++)
+        {
+            vKeys.push_back(RandomPubKey(i % 2 == 0));
+            filter.Insert(PayToKeyHash(vKeys[i]));
+            filter.Insert(PayToPubKey(vKeys[i]));
+        }
+        for (int i = 0; i < nKeys / 10; i++)
+        {
+            CScript redeemScript;
+            redeemScript << OP_1 << vKeys[i] << vKeys[i + 1] << OP_2 << OP_CHECKMULTISIG;
+            vRedeemScripts.push_back(redeemScript);
+            filter.Insert(PayToScriptHash(redeemScript));
+        }
+        filter.Finish();
+    }
+};
+
+BOOST_AUTO_TEST_SUITE(scanfilter_tests)
+
+// No false negatives for the scripts the filter holds
+BOOST_AUTO_TEST_CASE(scanfilter_standard)
+{
+    for (int nKeys = 10; nKeys <= 10000; nKeys *= 10)
+    {
+        CScanFilterTest test(nKeys);
+        for (unsigned int i = 0; i < test.vKeys.size(); i++)
+        {
+            BOOST_CHECK(test.filter.Match(PayToKeyHash(test.vKeys[i])));
+            BOOST_CHECK(test.filter.Match(PayToPubKey(test.vKeys[i])));
+        }
+        for (unsigned int i = 0; i < test.vRedeemScripts.size(); i++)
+            BOOST_CHECK(test.filter.Match(PayToScriptHash(test.vRedeemScripts[i])));
+
+        // Standard scripts for other keys and redeem scripts are never taken
+        for (int i = 0; i < 1000; i++)
+        {
+            CPubKey pubkey = RandomPubKey(i % 2 == 0);
+            BOOST_CHECK(!test.filter.Match(PayToKeyHash(pubkey)));
+            BOOST_CHECK(!test.filter.Match(PayToPubKey(pubkey)));
+            CScript redeemScript;
+            redeemScript << OP_1 << pubkey << OP_1 << OP_CHECKMULTISIG;
+            BOOST_CHECK(!test.filter.Match(PayToScriptHash(redeemScript)));
+        }
+    }
+}
+
+// Scripts IsMine() may accept in a form the set doesn't hold are let through
+BOOST_AUTO_TEST_CASE(scanfilter_irregular)
+{
+    CScanFilterTest test(100);
+    const CPubKey& pubkeyCompressed = test.vKeys[0];
+    const CPubKey& pubkeyUncompressed = test.vKeys[1];
+    BOOST_CHECK(pubkeyCompressed.IsCompressed());
+    BOOST_CHECK(!pubkeyUncompressed.IsCompressed());
+
+    // bare multisig
+    CScript scriptMulti;
+    scriptMulti << OP_1 << pubkeyCompressed << pubkeyUncompressed << OP_2 << OP_CHECKMULTISIG;
+    BOOST_CHECK(test.filter.Match(scriptMulti));
+    CScript scriptMultiOther;
+    scriptMultiOther << OP_1 << RandomPubKey(true) << OP_1 << OP_CHECKMULTISIG;
+    BOOST_CHECK(test.filter.Match(scriptMultiOther));
+
+    // pay to public key with OP_PUSHDATA1, compressed and uncompressed
+    CScript scriptPubKey;
+    PushNonMinimal(scriptPubKey, vector<unsigned char>(pubkeyCompressed.begin(), pubkeyCompressed.end())) << OP_CHECKSIG;
+    BOOST_CHECK(test.filter.Match(scriptPubKey));
+    scriptPubKey.clear();
+    PushNonMinimal(scriptPubKey, vector<unsigned char>(pubkeyUncompressed.begin(), pubkeyUncompressed.end())) << OP_CHECKSIG;
+    BOOST_CHECK(test.filter.Match(scriptPubKey));
+
+    // pay to key hash with OP_PUSHDATA1
+    CKeyID keyid = pubkeyCompressed.GetID();
+    CScript scriptKeyHash;
+    scriptKeyHash << OP_DUP << OP_HASH160;
+    PushNonMinimal(scriptKeyHash, vector<unsigned char>(keyid.begin(), keyid.end())) << OP_EQUALVERIFY << OP_CHECKSIG;
+    BOOST_CHECK(test.filter.Match(scriptKeyHash));
+}
+
+BOOST_AUTO_TEST_CASE(scanfilter_negative)
+{
+    CScanFilterTest test(100);
+
+    // too short to pay anyone
+    CScript scriptShort;
+    scriptShort << OP_TRUE;
+    BOOST_CHECK(!test.filter.Match(scriptShort));
+    BOOST_CHECK(!test.filter.Match(CScript()));
+
+    // data carrier
+    CScript scriptData;
+    uint256 hash = GetRandHash();
+    scriptData << OP_RETURN << vector<unsigned char>(hash.begin(), hash.end());
+    BOOST_CHECK(!test.filter.Match(scriptData));
+
+    // the key without a signature check
+    CScript scriptPush;
+    scriptPush << test.vKeys[0];
+    BOOST_CHECK(!test.filter.Match(scriptPush));
+
+    // pay to script hash of a redeem script the wallet doesn't have
+    CScript redeemScript;
+    redeemScript << test.vKeys[0] << OP_CHECKSIG;
+    BOOST_CHECK(!test.filter.Match(PayToScriptHash(redeemScript)));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
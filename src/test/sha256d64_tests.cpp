@@ -0,0 +1,76 @@
+#include <boost/test/unit_test.hpp>
+
+#include <string.h>
+#include <vector>
+
+#include "hash.h"
+#include "util.h"
+
+using namespace std;
+
+static const char* pszImplementations[] = {"generic", "sse4.1", "avx2", "shani"};
+
+BOOST_AUTO_TEST_SUITE(sha256d64_tests)
+
+// Every kernel this CPU can run gives the same hashes as double SHA-256 one
+// block at a time, for batch sizes that leave every possible remainder
+BOOST_AUTO_TEST_CASE(sha256d64_kernels_match)
+{
+    for (size_t nBlocks = 1; nBlocks <= 33; nBlocks++)
+    {
+        vector<unsigned char> vIn(64 * nBlocks + 1);
+        for (size_t i = 0; i < vIn.size(); i++)
+            vIn[i] = GetRandInt(256);
+
+        vector<unsigned char> vExpected(32 * nBlocks);
+        for (size_t i = 0; i < nBlocks; i++)
+        {
+            uint256 hash = Hash(&vIn[64 * i], &vIn[64 * i] + 64);
+            memcpy(&vExpected[32 * i], hash.begin(), 32);
+        }
+
+        for (unsigned int n = 0; n < sizeof(pszImplementations) / sizeof(pszImplementations[0]); n++)
+        {
+            // one guard byte after the outputs catches kernels writing too much
+            vector<unsigned char> vOut(32 * nBlocks + 1, 0xa5);
+            if (!SHA256D64With(pszImplementations[n], &vOut[0], &vIn[0], nBlocks))
+                continue;
+            BOOST_CHECK_MESSAGE(memcmp(&vOut[0], &vExpected[0], 32 * nBlocks) == 0,
+                                pszImplementations[n] << " differs for " << nBlocks << " blocks");
+            BOOST_CHECK_EQUAL(vOut[32 * nBlocks], 0xa5);
+        }
+
+        vector<unsigned char> vOut(32 * nBlocks + 1);
+        SHA256D64(&vOut[0], &vIn[0], nBlocks);
+        BOOST_CHECK(memcmp(&vOut[0], &vExpected[0], 32 * nBlocks) == 0);
+    }
+}
+
+// An empty batch writes nothing
+BOOST_AUTO_TEST_CASE(sha256d64_empty)
+{
+    unsigned char pchIn[1] = {0};
+    for (unsigned int n = 0; n < sizeof(pszImplementations) / sizeof(pszImplementations[0]); n++)
+    {
+        unsigned char pchOut[1] = {0xa5};
+        if (SHA256D64With(pszImplementations[n], pchOut, pchIn, 0))
+            BOOST_CHECK_EQUAL(pchOut[0], 0xa5);
+    }
+    unsigned char pchOut[1] = {0xa5};
+    SHA256D64(pchOut, pchIn, 0);
+    BOOST_CHECK_EQUAL(pchOut[0], 0xa5);
+}
+
+BOOST_AUTO_TEST_CASE(sha256d64_implementations)
+{
+    BOOST_CHECK(!SHA256D64With("none", NULL, NULL, 0));
+    unsigned char pchOut[32];
+    unsigned char pchIn[64] = {0};
+    BOOST_CHECK(SHA256D64With("generic", pchOut, pchIn, 1));
+    // the selected implementation is one the CPU can run
+    vector<unsigned char> vOut(32);
+    BOOST_CHECK(SHA256D64With(SHA256D64Implementation(), &vOut[0], pchIn, 1));
+    BOOST_CHECK(memcmp(&vOut[0], pchOut, 32) == 0);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
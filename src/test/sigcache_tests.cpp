@@ -0,0 +1,151 @@
+#include <boost/test/unit_test.hpp>
+
+#include <vector>
+
+#include "key.h"
+#include "script.h"
+#include "uint256.h"
+#include "util.h"
+
+using namespace std;
+
+// Entries only need to be distinct, so random signature bytes will do
+static vector<unsigned char> RandomSig()
+{
+    uint256 hash = GetRandHash();
+    return vector<unsigned char>(hash.begin(), hash.end());
+}
+
+// The cache never parses the key, it only hashes its bytes
+static CPubKey TestPubKey()
+{
+    vector<unsigned char> vch = RandomSig();
+    vch.insert(vch.begin(), 0x02);
+    return CPubKey(vch);
+}
+
+BOOST_AUTO_TEST_SUITE(sigcache_tests)
+
+BOOST_AUTO_TEST_CASE(sigcache_set_get)
+{
+    CSignatureCache cache(1 << 20);
+    CPubKey pubkey = TestPubKey();
+    CPubKey pubkeyOther = TestPubKey();
+
+    vector<uint256> vHash;
+    vector<vector<unsigned char> > vSig;
+    for (int i = 0; i < 100; i++)
+    {
+        vHash.push_back(GetRandHash());
+        vSig.push_back(RandomSig());
+        BOOST_CHECK(!cache.Get(vHash[i], vSig[i], pubkey));
+        cache.Set(vHash[i], vSig[i], pubkey);
+        BOOST_CHECK(cache.Get(vHash[i], vSig[i], pubkey));
+    }
+
+    // A miss whenever any part of the triple differs
+    BOOST_CHECK(!cache.Get(vHash[0], vSig[1], pubkey));
+    BOOST_CHECK(!cache.Get(vHash[1], vSig[0], pubkey));
+    BOOST_CHECK(!cache.Get(vHash[0], vSig[0], pubkeyOther));
+    BOOST_CHECK(!cache.Get(GetRandHash(), vSig[0], pubkey));
+
+    // Setting an entry twice keeps it, and doesn't push anything else out
+    cache.Set(vHash[0], vSig[0], pubkey);
+    int nHits = 0;
+    for (unsigned int i = 0; i < vHash.size(); i++)
+        if (cache.Get(vHash[i], vSig[i], pubkey))
+            nHits++;
+    BOOST_CHECK_EQUAL(nHits, 100);
+}
+
+// A single bucket holds three entries; a fourth takes one of their slots,
+// and from then on every new entry replaces one
+BOOST_AUTO_TEST_CASE(sigcache_eviction)
+{
+    CSignatureCache cache(CSignatureCache::BUCKET_SIZE);
+    BOOST_CHECK_EQUAL(cache.GetCapacity(), (uint64_t)CSignatureCache::BUCKET_ENTRIES);
+    CPubKey pubkey = TestPubKey();
+
+    for (int nRound = 0; nRound < 20; nRound++)
+    {
+        vector<uint256> vHash;
+        vector<vector<unsigned char> > vSig;
+        for (int i = 0; i < 4; i++)
+        {
+            vHash.push_back(GetRandHash());
+            vSig.push_back(RandomSig());
+            cache.Set(vHash[i], vSig[i], pubkey);
+            BOOST_CHECK(cache.Get(vHash[i], vSig[i], pubkey));
+        }
+        int nHits = 0;
+        for (int i = 0; i < 4; i++)
+            if (cache.Get(vHash[i], vSig[i], pubkey))
+                nHits++;
+        if (nRound == 0)
+            BOOST_CHECK(nHits == CSignatureCache::BUCKET_ENTRIES);
+        BOOST_CHECK(nHits <= CSignatureCache::BUCKET_ENTRIES);
+        BOOST_CHECK(cache.Get(vHash[3], vSig[3], pubkey));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(sigcache_sizing)
+{
+    // The largest power of two number of buckets that fits
+    CSignatureCache cache1MB(1 << 20);
+    BOOST_CHECK_EQUAL(cache1MB.GetMemoryUsage(), (uint64_t)1 << 20);
+    BOOST_CHECK_EQUAL(cache1MB.GetCapacity(), (uint64_t)(1 << 20) / CSignatureCache::BUCKET_SIZE * CSignatureCache::BUCKET_ENTRIES);
+
+    CSignatureCache cacheOdd((1 << 20) + (1 << 19));
+    BOOST_CHECK_EQUAL(cacheOdd.GetMemoryUsage(), (uint64_t)1 << 20);
+
+    // Too small for a single bucket disables the cache
+    CSignatureCache cacheNone(CSignatureCache::BUCKET_SIZE - 1);
+    BOOST_CHECK_EQUAL(cacheNone.GetCapacity(), 0U);
+    BOOST_CHECK_EQUAL(cacheNone.GetMemoryUsage(), 0U);
+    uint256 hash = GetRandHash();
+    vector<unsigned char> vchSig = RandomSig();
+    CPubKey pubkey = TestPubKey();
+    cacheNone.Set(hash, vchSig, pubkey);
+    BOOST_CHECK(!cacheNone.Get(hash, vchSig, pubkey));
+}
+
+// -sigcachemb is in megabytes, -maxsigcachesize is the older number of
+// signatures and only counts without -sigcachemb
+BOOST_AUTO_TEST_CASE(sigcache_options)
+{
+    mapArgs.erase("-sigcachemb");
+    mapArgs.erase("-maxsigcachesize");
+    BOOST_CHECK_EQUAL(GetMaxSigCacheBytes(), (uint64_t)DEFAULT_SIG_CACHE_MB << 20);
+
+    mapArgs["-sigcachemb"] = "0";
+    BOOST_CHECK_EQUAL(GetMaxSigCacheBytes(), 0U);
+    mapArgs["-sigcachemb"] = "-1";
+    BOOST_CHECK_EQUAL(GetMaxSigCacheBytes(), 0U);
+    mapArgs["-sigcachemb"] = "100";
+    BOOST_CHECK_EQUAL(GetMaxSigCacheBytes(), (uint64_t)100 << 20);
+    mapArgs["-sigcachemb"] = strprintf("%u", MAX_SIG_CACHE_MB + 1);
+    BOOST_CHECK_EQUAL(GetMaxSigCacheBytes(), (uint64_t)MAX_SIG_CACHE_MB << 20);
+
+    // a count never turns into megabytes, however small
+    mapArgs.erase("-sigcachemb");
+    mapArgs["-maxsigcachesize"] = "10000";
+    BOOST_CHECK_EQUAL(GetMaxSigCacheBytes(), (uint64_t)10000 * CSignatureCache::BUCKET_SIZE / CSignatureCache::BUCKET_ENTRIES);
+    mapArgs["-maxsigcachesize"] = "0";
+    BOOST_CHECK_EQUAL(GetMaxSigCacheBytes(), 0U);
+
+    // the old default of 50000 signatures comes out at about a megabyte
+    mapArgs["-maxsigcachesize"] = "50000";
+    uint64_t nBytes = GetMaxSigCacheBytes();
+    BOOST_CHECK(nBytes >= (uint64_t)50000 * CSignatureCache::BUCKET_SIZE / CSignatureCache::BUCKET_ENTRIES);
+    BOOST_CHECK(nBytes < (uint64_t)2 << 20);
+    CSignatureCache cache(nBytes);
+    BOOST_CHECK(cache.GetCapacity() * 2 > 50000);
+
+    mapArgs["-sigcachemb"] = "100";
+    BOOST_CHECK_EQUAL(GetMaxSigCacheBytes(), (uint64_t)100 << 20);
+
+    mapArgs.erase("-sigcachemb");
+    mapArgs.erase("-maxsigcachesize");
+}
+
+BOOST_AUTO_TEST_SUITE_END()
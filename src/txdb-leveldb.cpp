@@ -8,32 +8,83 @@
 #include <boost/version.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
+#include <boost/scoped_ptr.hpp>
 
 #include <leveldb/env.h>
 #include <leveldb/cache.h>
 #include <leveldb/filter_policy.h>
 #include <memenv/memenv.h>
 
+#ifndef WIN32
+#include <sys/mman.h>
+#endif
+
 #include "kernel.h"
 #include "checkpoints.h"
 #include "txdb.h"
 #include "util.h"
 #include "main.h"
 #include "chainparams.h"
+#include "init.h"
+#include "ui_interface.h"
 
 using namespace std;
 using namespace boost;
 
 leveldb::DB *txdb; // global pointer for LevelDB object instance
 
+// Write-back cache in front of the "utxo" records. Entries are either clean
+// copies of what is on disk, or dirty changes made by committed transactions
+// that FlushUnspent has not written out yet. A null entry is a dirty erase.
+struct CUnspentCacheEntry
+{
+    CTxUnspent unspent;
+    bool fDirty;
+};
+
+static CCriticalSection cs_unspentCache;
+static map<COutPoint, CUnspentCacheEntry> mapUnspentCache;
+static size_t nUnspentCacheUsage = 0;
+static size_t nUnspentCacheLimit = 0;
+static int64_t nLastUnspentFlush = 0;
+
+// Write dirty unspent outputs at least this often, so an unclean shutdown
+// doesn't leave too much for RebuildUnspent to redo
+static const int64_t UNSPENT_FLUSH_INTERVAL = 10 * 60;
+
+// Whether the loaded block index came from (or was saved to) a snapshot,
+// in which case index writes must be recorded as deltas
+static bool fBlockIndexSnapshot = false;
+
 static leveldb::Options GetOptions() {
     leveldb::Options options;
+    // -dbcache is shared between LevelDB's block cache and the unspent output cache
     int nCacheSizeMB = GetArg("-dbcache", 25);
-    options.block_cache = leveldb::NewLRUCache(nCacheSizeMB * 1048576);
+    options.block_cache = leveldb::NewLRUCache(std::max(nCacheSizeMB / 2, 1) * 1048576);
     options.filter_policy = leveldb::NewBloomFilterPolicy(10);
+    nUnspentCacheLimit = std::max(nCacheSizeMB - nCacheSizeMB / 2, 1) * 1048576;
     return options;
 }
 
+static size_t GetUnspentUsage(const CTxUnspent& unspent)
+{
+    // rough per-entry cost of a map node holding the record
+    return sizeof(COutPoint) + sizeof(CUnspentCacheEntry) + 4 * sizeof(void*) + unspent.txout.scriptPubKey.capacity();
+}
+
+static void UpdateUnspentCache(const COutPoint& outpoint, const CTxUnspent& unspent, bool fDirty)
+{
+    AssertLockHeld(cs_unspentCache);
+    map<COutPoint, CUnspentCacheEntry>::iterator mi = mapUnspentCache.find(outpoint);
+    if (mi == mapUnspentCache.end())
+        mi = mapUnspentCache.insert(make_pair(outpoint, CUnspentCacheEntry())).first;
+    else
+        nUnspentCacheUsage -= GetUnspentUsage(mi->second.unspent);
+    mi->second.unspent = unspent;
+    mi->second.fDirty = fDirty;
+    nUnspentCacheUsage += GetUnspentUsage(unspent);
+}
+
 static void init_blockindex(leveldb::Options& options, bool fRemoveOld = false, bool fCreateBootstrap = false) {
     // First time init.
     filesystem::path directory = GetDataDir() / "txleveldb";
@@ -128,6 +179,13 @@ CTxDB::CTxDB(const char* pszMode)
 
 void CTxDB::Close()
 {
+    if (pdb)
+        FlushUnspent();
+    {
+        LOCK(cs_unspentCache);
+        mapUnspentCache.clear();
+        nUnspentCacheUsage = 0;
+    }
     delete txdb;
     txdb = pdb = NULL;
     delete options.filter_policy;
@@ -142,6 +200,8 @@ bool CTxDB::TxnBegin()
 {
     assert(!activeBatch);
     activeBatch = new leveldb::WriteBatch();
+    mapBatchIndex.clear();
+    mapUnspentBatch.clear();
     return true;
 }
 
@@ -151,55 +211,40 @@ bool CTxDB::TxnCommit()
     leveldb::Status status = pdb->Write(leveldb::WriteOptions(), activeBatch);
     delete activeBatch;
     activeBatch = NULL;
+    mapBatchIndex.clear();
     if (!status.ok()) {
+        mapUnspentBatch.clear();
         LogPrintf("LevelDB batch commit failure: %s\n", status.ToString());
         return false;
     }
-    return true;
-}
-
-class CBatchScanner : public leveldb::WriteBatch::Handler {
-public:
-    std::string needle;
-    bool *deleted;
-    std::string *foundValue;
-    bool foundEntry;
-
-    CBatchScanner() : foundEntry(false) {}
-
-    virtual void Put(const leveldb::Slice& key, const leveldb::Slice& value) {
-        if (key.ToString() == needle) {
-            foundEntry = true;
-            *deleted = false;
-            *foundValue = value.ToString();
-        }
-    }
 
-    virtual void Delete(const leveldb::Slice& key) {
-        if (key.ToString() == needle) {
-            foundEntry = true;
-            *deleted = true;
-        }
+    // The batch is on disk, so its unspent output changes are now part of
+    // the committed state
+    if (!mapUnspentBatch.empty())
+    {
+        LOCK(cs_unspentCache);
+        for (map<COutPoint, CTxUnspent>::iterator mi = mapUnspentBatch.begin(); mi != mapUnspentBatch.end(); ++mi)
+            UpdateUnspentCache(mi->first, mi->second, true);
+        mapUnspentBatch.clear();
+        if (nUnspentCacheUsage > nUnspentCacheLimit || GetTime() - nLastUnspentFlush > UNSPENT_FLUSH_INTERVAL)
+            return FlushUnspent();
     }
-};
+    return true;
+}
 
 // When performing a read, if we have an active batch we need to check it first
 // before reading from the database, as the rest of the code assumes that once
-// a database transaction begins reads are consistent with it. It would be good
-// to change that assumption in future and avoid the performance hit, though in
-// practice it does not appear to be large.
+// a database transaction begins reads are consistent with it.
 bool CTxDB::ScanBatch(const CDataStream &key, string *value, bool *deleted) const {
     assert(activeBatch);
     *deleted = false;
-    CBatchScanner scanner;
-    scanner.needle = key.str();
-    scanner.deleted = deleted;
-    scanner.foundValue = value;
-    leveldb::Status status = activeBatch->Iterate(&scanner);
-    if (!status.ok()) {
-        throw runtime_error(status.ToString());
-    }
-    return scanner.foundEntry;
+    map<string, pair<bool, string> >::const_iterator mi = mapBatchIndex.find(key.str());
+    if (mi == mapBatchIndex.end())
+        return false;
+    *deleted = mi->second.first;
+    if (!*deleted)
+        *value = mi->second.second;
+    return true;
 }
 
 bool CTxDB::ReadTxIndex(uint256 hash, CTxIndex& txindex)
@@ -260,7 +305,10 @@ bool CTxDB::ReadDiskTx(COutPoint outpoint, CTransaction& tx)
 
 bool CTxDB::WriteBlockIndex(const CDiskBlockIndex& blockindex)
 {
-    return Write(make_pair(string("blockindex"), blockindex.GetBlockHash()), blockindex);
+    uint256 hash = blockindex.GetBlockHash();
+    if (fBlockIndexSnapshot && !Write(make_pair(string("blockIndexDelta"), hash), '\0'))
+        return false;
+    return Write(make_pair(string("blockindex"), hash), blockindex);
 }
 
 bool CTxDB::ReadHashBestChain(uint256& hashBestChain)
@@ -303,6 +351,269 @@ bool CTxDB::WriteCheckpointPubKey(const string& strPubKey)
     return Write(string("strCheckpointPubKey"), strPubKey);
 }
 
+bool CTxDB::ReadUnspent(const COutPoint& outpoint, CTxUnspent& unspent)
+{
+    unspent.SetNull();
+    if (activeBatch)
+    {
+        map<COutPoint, CTxUnspent>::const_iterator mi = mapUnspentBatch.find(outpoint);
+        if (mi != mapUnspentBatch.end())
+        {
+            unspent = mi->second;
+            return !unspent.IsNull();
+        }
+    }
+
+    LOCK(cs_unspentCache);
+    map<COutPoint, CUnspentCacheEntry>::const_iterator mi = mapUnspentCache.find(outpoint);
+    if (mi != mapUnspentCache.end())
+    {
+        unspent = mi->second.unspent;
+        return !unspent.IsNull();
+    }
+
+    // "utxo" records never go through activeBatch, so skip ScanBatch and
+    // read the database directly
+    CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+    ssKey << make_pair(string("utxo"), outpoint);
+    string strValue;
+    leveldb::Status status = pdb->Get(leveldb::ReadOptions(), ssKey.str(), &strValue);
+    if (!status.ok())
+    {
+        if (!status.IsNotFound())
+            LogPrintf("LevelDB read failure: %s\n", status.ToString());
+        return false;
+    }
+    try {
+        CDataStream ssValue(strValue.data(), strValue.data() + strValue.size(), SER_DISK, CLIENT_VERSION);
+        ssValue >> unspent;
+    }
+    catch (std::exception &e) {
+        unspent.SetNull();
+        return false;
+    }
+    UpdateUnspentCache(outpoint, unspent, false);
+    return true;
+}
+
+bool CTxDB::WriteUnspent(const COutPoint& outpoint, const CTxUnspent& unspent)
+{
+    if (fReadOnly)
+        assert(!"WriteUnspent called on database in read-only mode");
+
+    if (activeBatch)
+    {
+        mapUnspentBatch[outpoint] = unspent;
+        return true;
+    }
+    LOCK(cs_unspentCache);
+    UpdateUnspentCache(outpoint, unspent, true);
+    return true;
+}
+
+bool CTxDB::EraseUnspent(const COutPoint& outpoint)
+{
+    return WriteUnspent(outpoint, CTxUnspent());
+}
+
+bool CTxDB::AddUnspent(const CTransaction& tx, const CBlockIndex* pindex)
+{
+    uint256 hash = tx.GetHash();
+    for (unsigned int i = 0; i < tx.vout.size(); i++)
+    {
+        // The empty first output of a coinstake is a marker, not a coin
+        if (tx.vout[i].IsEmpty())
+            continue;
+        if (!WriteUnspent(COutPoint(hash, i), CTxUnspent(tx, i, pindex->nHeight, pindex->nTime)))
+            return false;
+    }
+    return true;
+}
+
+bool CTxDB::ReadBlockUndo(const uint256& hash, CBlockUndo& undo)
+{
+    return Read(make_pair(string("blockundo"), hash), undo);
+}
+
+bool CTxDB::WriteBlockUndo(const uint256& hash, const CBlockUndo& undo)
+{
+    return Write(make_pair(string("blockundo"), hash), undo);
+}
+
+bool CTxDB::EraseBlockUndo(const uint256& hash)
+{
+    return Erase(make_pair(string("blockundo"), hash));
+}
+
+// Write all dirty unspent outputs to the database, along with the best chain
+// they correspond to. If the cache has outgrown -dbcache it is emptied, and
+// entries are read back in as they are needed.
+bool CTxDB::FlushUnspent()
+{
+    assert(!activeBatch);
+    LOCK(cs_unspentCache);
+
+    uint256 hashBest = 0;
+    ReadHashBestChain(hashBest);
+
+    leveldb::WriteBatch batch;
+    unsigned int nWritten = 0;
+    for (map<COutPoint, CUnspentCacheEntry>::iterator mi = mapUnspentCache.begin(); mi != mapUnspentCache.end(); ++mi)
+    {
+        if (!mi->second.fDirty)
+            continue;
+        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+        ssKey << make_pair(string("utxo"), mi->first);
+        if (mi->second.unspent.IsNull())
+            batch.Delete(ssKey.str());
+        else
+        {
+            CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+            ssValue << mi->second.unspent;
+            batch.Put(ssKey.str(), ssValue.str());
+        }
+        nWritten++;
+    }
+    CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+    ssKey << string("hashUnspentBestChain");
+    CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+    ssValue << hashBest;
+    batch.Put(ssKey.str(), ssValue.str());
+
+    leveldb::Status status = pdb->Write(leveldb::WriteOptions(), &batch);
+    if (!status.ok())
+        return error("CTxDB::FlushUnspent() : LevelDB write failure: %s", status.ToString());
+
+    if (nUnspentCacheUsage > nUnspentCacheLimit)
+    {
+        mapUnspentCache.clear();
+        nUnspentCacheUsage = 0;
+    }
+    else
+    {
+        map<COutPoint, CUnspentCacheEntry>::iterator mi = mapUnspentCache.begin();
+        while (mi != mapUnspentCache.end())
+        {
+            if (mi->second.unspent.IsNull())
+            {
+                nUnspentCacheUsage -= GetUnspentUsage(mi->second.unspent);
+                mapUnspentCache.erase(mi++);
+            }
+            else
+            {
+                mi->second.fDirty = false;
+                ++mi;
+            }
+        }
+    }
+    nLastUnspentFlush = GetTime();
+
+    LogPrint("db", "CTxDB::FlushUnspent() : wrote %u unspent outputs at %s\n", nWritten, hashBest.ToString());
+    return true;
+}
+
+// Recreate the "utxo" records from the transaction index. Used when they
+// were not written out for the current best chain, i.e. after an unclean
+// shutdown or when upgrading from a database without them.
+bool CTxDB::RebuildUnspent()
+{
+    LogPrintf("Rebuilding unspent output set, this may take a while...\n");
+    int64_t nStart = GetTimeMillis();
+
+    {
+        LOCK(cs_unspentCache);
+        mapUnspentCache.clear();
+        nUnspentCacheUsage = 0;
+    }
+
+    map<pair<unsigned int, unsigned int>, CBlockIndex*> mapBlockPos;
+    for (CBlockIndex* pindex = pindexBest; pindex; pindex = pindex->pprev)
+        mapBlockPos[make_pair(pindex->nFile, pindex->nBlockPos)] = pindex;
+
+    CDataStream ssPrefix(SER_DISK, CLIENT_VERSION);
+    ssPrefix << string("utxo");
+    leveldb::WriteBatch batch;
+    leveldb::Iterator *iterator = pdb->NewIterator(leveldb::ReadOptions());
+    for (iterator->Seek(ssPrefix.str()); iterator->Valid() && iterator->key().starts_with(ssPrefix.str()); iterator->Next())
+        batch.Delete(iterator->key());
+
+    CDataStream ssStartKey(SER_DISK, CLIENT_VERSION);
+    ssStartKey << make_pair(string("tx"), uint256(0));
+    unsigned int nOutputs = 0;
+    unsigned int nBatched = 0;
+    for (iterator->Seek(ssStartKey.str()); iterator->Valid(); iterator->Next())
+    {
+        boost::this_thread::interruption_point();
+        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+        ssKey.write(iterator->key().data(), iterator->key().size());
+        CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+        ssValue.write(iterator->value().data(), iterator->value().size());
+        string strType;
+        ssKey >> strType;
+        if (strType != "tx")
+            break;
+        uint256 hash;
+        ssKey >> hash;
+        CTxIndex txindex;
+        ssValue >> txindex;
+
+        bool fUnspent = false;
+        BOOST_FOREACH(const CDiskTxPos& pos, txindex.vSpent)
+            if (pos.IsNull())
+                fUnspent = true;
+        if (!fUnspent)
+            continue;
+
+        map<pair<unsigned int, unsigned int>, CBlockIndex*>::iterator mi = mapBlockPos.find(make_pair(txindex.pos.nFile, txindex.pos.nBlockPos));
+        if (mi == mapBlockPos.end())
+            continue; // not in the best chain
+        CTransaction tx;
+        if (!tx.ReadFromDisk(txindex.pos))
+        {
+            delete iterator;
+            return error("CTxDB::RebuildUnspent() : ReadFromDisk failed for %s", hash.ToString());
+        }
+
+        for (unsigned int i = 0; i < tx.vout.size() && i < txindex.vSpent.size(); i++)
+        {
+            if (!txindex.vSpent[i].IsNull() || tx.vout[i].IsEmpty())
+                continue;
+            CDataStream ssUnspentKey(SER_DISK, CLIENT_VERSION);
+            ssUnspentKey << make_pair(string("utxo"), COutPoint(hash, i));
+            CDataStream ssUnspent(SER_DISK, CLIENT_VERSION);
+            ssUnspent << CTxUnspent(tx, i, mi->second->nHeight, mi->second->nTime);
+            batch.Put(ssUnspentKey.str(), ssUnspent.str());
+            nOutputs++;
+        }
+
+        if (++nBatched >= 100000)
+        {
+            leveldb::Status status = pdb->Write(leveldb::WriteOptions(), &batch);
+            if (!status.ok())
+            {
+                delete iterator;
+                return error("CTxDB::RebuildUnspent() : LevelDB write failure: %s", status.ToString());
+            }
+            batch.Clear();
+            nBatched = 0;
+        }
+    }
+    delete iterator;
+
+    CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+    ssKey << string("hashUnspentBestChain");
+    CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+    ssValue << hashBestChain;
+    batch.Put(ssKey.str(), ssValue.str());
+    leveldb::Status status = pdb->Write(leveldb::WriteOptions(), &batch);
+    if (!status.ok())
+        return error("CTxDB::RebuildUnspent() : LevelDB write failure: %s", status.ToString());
+    nLastUnspentFlush = GetTime();
+
+    LogPrintf("Rebuilt unspent output set with %u outputs in %dms\n", nOutputs, GetTimeMillis() - nStart);
+    return true;
+}
+
 static CBlockIndex *InsertBlockIndex(uint256 hash)
 {
     if (hash == 0)
@@ -323,42 +634,232 @@ static CBlockIndex *InsertBlockIndex(uint256 hash)
     return pindexNew;
 }
 
-bool CTxDB::LoadBlockIndex()
+// Block index snapshot
+//
+// blkindex.dat holds the whole block index as fixed size records in height
+// order, so that startup can map it and build mapBlockIndex without walking
+// every "blockindex" entry in LevelDB. Records refer to their neighbours by
+// record number, and carry the chain trust so it needn't be recomputed.
+//
+// The database stores the checksum of the snapshot it belongs to. Index
+// entries written after the snapshot are also recorded under
+// "blockIndexDelta" keys, in the same batch, and are replayed on top of the
+// snapshot at load time. Writing a new snapshot clears them again.
+
+static const int BLOCK_INDEX_SNAPSHOT_VERSION = 1;
+
+struct CBlockIndexSnapshotRecord
 {
-    if (mapBlockIndex.size() > 0) {
-        // Already loaded once in this session. It can happen during migration
-        // from BDB.
+    uint256 hashBlock;
+    uint256 hashProof;
+    uint256 hashMerkleRoot;
+    uint256 nChainTrust;
+    uint256 hashPrevoutStake;
+    int64_t nMint;
+    uint64_t nMoneySupply;
+    uint64_t nStakeModifier;
+    int32_t nPrev;
+    int32_t nNext;
+    uint32_t nFile;
+    uint32_t nBlockPos;
+    int32_t nHeight;
+    uint32_t nFlags;
+    uint32_t nPrevoutStake;
+    uint32_t nStakeTime;
+    int32_t nVersion;
+    uint32_t nTime;
+    uint32_t nBits;
+    uint32_t nNonce;
+};
+BOOST_STATIC_ASSERT(sizeof(CBlockIndexSnapshotRecord) == 232);
+
+struct CBlockIndexSnapshotHeader
+{
+    unsigned char pchMessageStart[4];
+    int32_t nVersion;
+    uint32_t nRecordSize;
+    uint32_t nRecords;
+};
+BOOST_STATIC_ASSERT(sizeof(CBlockIndexSnapshotHeader) == 16);
+
+static boost::filesystem::path GetBlockIndexSnapshotPath()
+{
+    return GetDataDir() / "blkindex.dat";
+}
+
+// Read-only view of the snapshot file. The file is mapped where mmap is
+// available and read into memory otherwise.
+class CBlockIndexSnapshotFile
+{
+private:
+    const unsigned char* pdata;
+    size_t nSize;
+    bool fMapped;
+    std::vector<unsigned char> vData;
+
+public:
+    CBlockIndexSnapshotFile() : pdata(NULL), nSize(0), fMapped(false) {}
+
+    ~CBlockIndexSnapshotFile()
+    {
+#ifndef WIN32
+        if (fMapped)
+            munmap((void*)pdata, nSize);
+#endif
+    }
+
+    bool Open(const boost::filesystem::path& path)
+    {
+        FILE* file = fopen(path.string().c_str(), "rb");
+        if (!file)
+            return false;
+        fseek(file, 0, SEEK_END);
+        long nFileSize = ftell(file);
+        if (nFileSize <= 0) {
+            fclose(file);
+            return false;
+        }
+        nSize = nFileSize;
+#ifndef WIN32
+        void* p = mmap(NULL, nSize, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+        if (p != MAP_FAILED) {
+#ifdef MADV_SEQUENTIAL
+            madvise(p, nSize, MADV_SEQUENTIAL);
+#endif
+            pdata = (const unsigned char*)p;
+            fMapped = true;
+            fclose(file);
+            return true;
+        }
+#endif
+        vData.resize(nSize);
+        fseek(file, 0, SEEK_SET);
+        bool fRead = fread(&vData[0], 1, nSize, file) == nSize;
+        fclose(file);
+        if (!fRead)
+            return false;
+        pdata = &vData[0];
         return true;
     }
-    // The block index is an in-memory structure that maps hashes to on-disk
-    // locations where the contents of the block can be found. Here, we scan it
-    // out of the DB and into mapBlockIndex.
+
+    const unsigned char* data() const { return pdata; }
+    size_t size() const { return nSize; }
+};
+
+static void ClearBlockIndex()
+{
+    BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
+        delete item.second;
+    mapBlockIndex.clear();
+    setStakeSeen.clear();
+    pindexGenesisBlock = NULL;
+}
+
+bool CTxDB::LoadBlockIndexSnapshot()
+{
+    uint256 hashSnapshot;
+    if (!Read(string("blockIndexSnapshot"), hashSnapshot))
+        return false;
+
+    int64_t nStart = GetTimeMillis();
+    CBlockIndexSnapshotFile file;
+    if (!file.Open(GetBlockIndexSnapshotPath()))
+    {
+        LogPrintf("LoadBlockIndexSnapshot() : cannot open %s\n", GetBlockIndexSnapshotPath().string());
+        Erase(string("blockIndexSnapshot"));
+        return false;
+    }
+
+    // Check the header, the checksum, and that this is the snapshot the
+    // database was last synchronized with
+    CBlockIndexSnapshotHeader header;
+    if (file.size() < sizeof(header) + sizeof(uint256))
+    {
+        Erase(string("blockIndexSnapshot"));
+        return error("LoadBlockIndexSnapshot() : file too short");
+    }
+    memcpy(&header, file.data(), sizeof(header));
+    size_t nRecordBytes = file.size() - sizeof(header) - sizeof(uint256);
+    uint256 hashFile;
+    memcpy(&hashFile, file.data() + file.size() - sizeof(uint256), sizeof(uint256));
+    if (memcmp(header.pchMessageStart, Params().MessageStart(), sizeof(header.pchMessageStart)) != 0 ||
+        header.nVersion != BLOCK_INDEX_SNAPSHOT_VERSION ||
+        header.nRecordSize != sizeof(CBlockIndexSnapshotRecord) ||
+        nRecordBytes != (size_t)header.nRecords * sizeof(CBlockIndexSnapshotRecord) ||
+        hashFile != hashSnapshot ||
+        Hash(file.data(), file.data() + file.size() - sizeof(uint256)) != hashFile)
+    {
+        Erase(string("blockIndexSnapshot"));
+        return error("LoadBlockIndexSnapshot() : snapshot is invalid or does not match the database");
+    }
+
+    // First pass creates the entries, second pass links them
+    const unsigned char* pbegin = file.data() + sizeof(header);
+    vector<CBlockIndex*> vIndex(header.nRecords);
+    CBlockIndexSnapshotRecord record;
+    for (unsigned int i = 0; i < header.nRecords; i++)
+    {
+        if (i % 4096 == 0)
+            boost::this_thread::interruption_point();
+        memcpy(&record, pbegin + (size_t)i * sizeof(record), sizeof(record));
+        CBlockIndex* pindexNew    = InsertBlockIndex(record.hashBlock);
+        pindexNew->nFile          = record.nFile;
+        pindexNew->nBlockPos      = record.nBlockPos;
+        pindexNew->nChainTrust    = record.nChainTrust;
+        pindexNew->nHeight        = record.nHeight;
+        pindexNew->nMint          = record.nMint;
+        pindexNew->nMoneySupply   = record.nMoneySupply;
+        pindexNew->nFlags         = record.nFlags;
+        pindexNew->nStakeModifier = record.nStakeModifier;
+        pindexNew->prevoutStake   = COutPoint(record.hashPrevoutStake, record.nPrevoutStake);
+        pindexNew->nStakeTime     = record.nStakeTime;
+        pindexNew->hashProof      = record.hashProof;
+        pindexNew->nVersion       = record.nVersion;
+        pindexNew->hashMerkleRoot = record.hashMerkleRoot;
+        pindexNew->nTime          = record.nTime;
+        pindexNew->nBits          = record.nBits;
+        pindexNew->nNonce         = record.nNonce;
+        vIndex[i] = pindexNew;
+    }
+    for (unsigned int i = 0; i < header.nRecords; i++)
+    {
+        memcpy(&record, pbegin + (size_t)i * sizeof(record), sizeof(record));
+        if (record.nPrev >= (int32_t)header.nRecords || record.nNext >= (int32_t)header.nRecords)
+        {
+            ClearBlockIndex();
+            Erase(string("blockIndexSnapshot"));
+            return error("LoadBlockIndexSnapshot() : bad record link at %u", i);
+        }
+        CBlockIndex* pindex = vIndex[i];
+        pindex->pprev = record.nPrev >= 0 ? vIndex[record.nPrev] : NULL;
+        pindex->pnext = record.nNext >= 0 ? vIndex[record.nNext] : NULL;
+    }
+
+    // Replay index entries written since the snapshot
     leveldb::Iterator *iterator = pdb->NewIterator(leveldb::ReadOptions());
-    // Seek to start key.
     CDataStream ssStartKey(SER_DISK, CLIENT_VERSION);
-    ssStartKey << make_pair(string("blockindex"), uint256(0));
+    ssStartKey << make_pair(string("blockIndexDelta"), uint256(0));
     iterator->Seek(ssStartKey.str());
-    // Now read each entry.
-    while (iterator->Valid())
+    vector<pair<int, CBlockIndex*> > vDeltaByHeight;
+    for (; iterator->Valid(); iterator->Next())
     {
-        boost::this_thread::interruption_point();
-        // Unpack keys and values.
         CDataStream ssKey(SER_DISK, CLIENT_VERSION);
         ssKey.write(iterator->key().data(), iterator->key().size());
-        CDataStream ssValue(SER_DISK, CLIENT_VERSION);
-        ssValue.write(iterator->value().data(), iterator->value().size());
         string strType;
         ssKey >> strType;
-        // Did we reach the end of the data to read?
-        if (strType != "blockindex")
+        if (strType != "blockIndexDelta")
             break;
+        uint256 hash;
+        ssKey >> hash;
         CDiskBlockIndex diskindex;
-        ssValue >> diskindex;
-
-        uint256 blockHash = diskindex.GetBlockHash();
-
-        // Construct block index object
-        CBlockIndex* pindexNew    = InsertBlockIndex(blockHash);
+        if (!Read(make_pair(string("blockindex"), hash), diskindex))
+        {
+            delete iterator;
+            ClearBlockIndex();
+            Erase(string("blockIndexSnapshot"));
+            return error("LoadBlockIndexSnapshot() : missing block index entry for delta %s", hash.ToString());
+        }
+        CBlockIndex* pindexNew    = InsertBlockIndex(hash);
         pindexNew->pprev          = InsertBlockIndex(diskindex.hashPrev);
         pindexNew->pnext          = InsertBlockIndex(diskindex.hashNext);
         pindexNew->nFile          = diskindex.nFile;
@@ -376,21 +877,703 @@ bool CTxDB::LoadBlockIndex()
         pindexNew->nTime          = diskindex.nTime;
         pindexNew->nBits          = diskindex.nBits;
         pindexNew->nNonce         = diskindex.nNonce;
+        vDeltaByHeight.push_back(make_pair(pindexNew->nHeight, pindexNew));
+    }
+    delete iterator;
+    sort(vDeltaByHeight.begin(), vDeltaByHeight.end());
+    BOOST_FOREACH(const PAIRTYPE(int, CBlockIndex*)& item, vDeltaByHeight)
+    {
+        CBlockIndex* pindex = item.second;
+        pindex->nChainTrust = (pindex->pprev ? pindex->pprev->nChainTrust : 0) + pindex->GetBlockTrust();
+    }
 
-        // Watch for genesis block
-        if (pindexGenesisBlock == NULL && blockHash == Params().HashGenesisBlock())
-            pindexGenesisBlock = pindexNew;
+    BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
+    {
+        CBlockIndex* pindex = item.second;
+        if (!pindex->CheckIndex())
+        {
+            int nHeight = pindex->nHeight;
+            ClearBlockIndex();
+            Erase(string("blockIndexSnapshot"));
+            return error("LoadBlockIndexSnapshot() : CheckIndex failed at %d", nHeight);
+        }
+        // NovaCoin: build setStakeSeen
+        if (pindex->IsProofOfStake())
+            setStakeSeen.insert(make_pair(pindex->prevoutStake, pindex->nStakeTime));
+    }
+    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(Params().HashGenesisBlock());
+    if (mi != mapBlockIndex.end())
+        pindexGenesisBlock = mi->second;
 
-        if (!pindexNew->CheckIndex()) {
-            delete iterator;
-            return error("LoadBlockIndex() : CheckIndex failed at %d", pindexNew->nHeight);
+    fBlockIndexSnapshot = true;
+    LogPrintf("LoadBlockIndexSnapshot() : loaded %u entries and %u deltas in %dms\n",
+        header.nRecords, vDeltaByHeight.size(), GetTimeMillis() - nStart);
+    return true;
+}
+
+bool CTxDB::WriteBlockIndexSnapshot()
+{
+    if (activeBatch)
+        return error("WriteBlockIndexSnapshot() : called inside a transaction");
+    if (mapBlockIndex.empty())
+        return true;
+
+    int64_t nStart = GetTimeMillis();
+    vector<pair<int, const CBlockIndex*> > vSortedByHeight;
+    vSortedByHeight.reserve(mapBlockIndex.size());
+    BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
+        vSortedByHeight.push_back(make_pair(item.second->nHeight, item.second));
+    sort(vSortedByHeight.begin(), vSortedByHeight.end());
+    map<const CBlockIndex*, int> mapRecord;
+    for (unsigned int i = 0; i < vSortedByHeight.size(); i++)
+        mapRecord[vSortedByHeight[i].second] = i;
+
+    boost::filesystem::path pathTmp = GetDataDir() / strprintf("blkindex.dat.%04x", (unsigned int)GetRand(0x10000));
+    FILE* file = fopen(pathTmp.string().c_str(), "wb");
+    if (!file)
+        return error("WriteBlockIndexSnapshot() : open failed");
+
+    CHashWriter hasher(SER_DISK, CLIENT_VERSION);
+    CBlockIndexSnapshotHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.pchMessageStart, Params().MessageStart(), sizeof(header.pchMessageStart));
+    header.nVersion = BLOCK_INDEX_SNAPSHOT_VERSION;
+    header.nRecordSize = sizeof(CBlockIndexSnapshotRecord);
+    header.nRecords = vSortedByHeight.size();
+    hasher.write((const char*)&header, sizeof(header));
+    bool fOk = fwrite(&header, sizeof(header), 1, file) == 1;
+
+    CBlockIndexSnapshotRecord record = CBlockIndexSnapshotRecord();
+    for (unsigned int i = 0; fOk && i < vSortedByHeight.size(); i++)
+    {
+        const CBlockIndex* pindex = vSortedByHeight[i].second;
+        record.hashBlock        = pindex->GetBlockHash();
+        record.hashProof        = pindex->hashProof;
+        record.hashMerkleRoot   = pindex->hashMerkleRoot;
+        record.nChainTrust      = pindex->nChainTrust;
+        record.hashPrevoutStake = pindex->prevoutStake.hash;
+        record.nMint            = pindex->nMint;
+        record.nMoneySupply     = pindex->nMoneySupply;
+        record.nStakeModifier   = pindex->nStakeModifier;
+        record.nPrev            = pindex->pprev ? mapRecord[pindex->pprev] : -1;
+        record.nNext            = pindex->pnext ? mapRecord[pindex->pnext] : -1;
+        record.nFile            = pindex->nFile;
+        record.nBlockPos        = pindex->nBlockPos;
+        record.nHeight          = pindex->nHeight;
+        record.nFlags           = pindex->nFlags;
+        record.nPrevoutStake    = pindex->prevoutStake.n;
+        record.nStakeTime       = pindex->nStakeTime;
+        record.nVersion         = pindex->nVersion;
+        record.nTime            = pindex->nTime;
+        record.nBits            = pindex->nBits;
+        record.nNonce           = pindex->nNonce;
+        hasher.write((const char*)&record, sizeof(record));
+        fOk = fwrite(&record, sizeof(record), 1, file) == 1;
+    }
+    uint256 hashSnapshot = hasher.GetHash();
+    if (fOk)
+        fOk = fwrite(&hashSnapshot, sizeof(hashSnapshot), 1, file) == 1;
+    if (fOk)
+        FileCommit(file);
+    fclose(file);
+    if (!fOk)
+    {
+        boost::filesystem::remove(pathTmp);
+        return error("WriteBlockIndexSnapshot() : I/O error");
+    }
+    if (!RenameOver(pathTmp, GetBlockIndexSnapshotPath()))
+        return error("WriteBlockIndexSnapshot() : Rename-into-place failed");
+
+    // Point the database at the new snapshot and drop the deltas it covers
+    leveldb::WriteBatch batch;
+    leveldb::Iterator *iterator = pdb->NewIterator(leveldb::ReadOptions());
+    CDataStream ssStartKey(SER_DISK, CLIENT_VERSION);
+    ssStartKey << make_pair(string("blockIndexDelta"), uint256(0));
+    for (iterator->Seek(ssStartKey.str()); iterator->Valid(); iterator->Next())
+    {
+        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+        ssKey.write(iterator->key().data(), iterator->key().size());
+        string strType;
+        ssKey >> strType;
+        if (strType != "blockIndexDelta")
+            break;
+        batch.Delete(iterator->key());
+    }
+    delete iterator;
+    CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+    ssKey << string("blockIndexSnapshot");
+    CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+    ssValue << hashSnapshot;
+    batch.Put(ssKey.str(), ssValue.str());
+    leveldb::Status status = pdb->Write(leveldb::WriteOptions(), &batch);
+    if (!status.ok())
+        return error("WriteBlockIndexSnapshot() : LevelDB write failure: %s", status.ToString());
+
+    fBlockIndexSnapshot = true;
+    LogPrint("db", "WriteBlockIndexSnapshot() : wrote %u entries in %dms\n",
+        vSortedByHeight.size(), GetTimeMillis() - nStart);
+    return true;
+}
+
+// -checkblocks verification
+//
+// The blocks to verify are split into chunks of consecutive heights that a
+// pool of threads checks in any order. Block validity (level 1 and 7) is
+// checked before LoadBlockIndex returns. The transaction index checks of
+// levels 2-6 are left to ThreadVerifyBlocks, so the node can start serving
+// in the meantime. Its progress is stored in the database, so a restart only
+// checks the blocks it didn't get to.
+
+static const unsigned int BLOCK_VERIFY_CHUNK = 64;
+
+// Main chain block positions mapped to their height
+typedef map<pair<unsigned int, unsigned int>, int> BlockPosMap;
+
+struct CBlockVerifyProgress
+{
+    int nCheckLevel;
+    uint256 hashTop;
+    int nHeightDone;
+
+    CBlockVerifyProgress()
+    {
+        nCheckLevel = 0;
+        hashTop = 0;
+        nHeightDone = 0;
+    }
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(nCheckLevel);
+        READWRITE(hashTop);
+        READWRITE(nHeightDone);
+    )
+};
+
+struct CBlockVerifyJob
+{
+    // Set up before the workers start
+    bool fDeep;
+    int nCheckLevel;
+    std::vector<CBlockIndex*> vBlocks; // highest first
+    BlockPosMap mapBlockPos;
+    uint256 hashTop;
+    size_t nUpper;   // blocks above a range completed by an earlier run
+    int nHeightDone; // low end of that range, or -1 if there is none
+
+    // Shared with the workers
+    CCriticalSection cs;
+    size_t nNextChunk;
+    std::vector<bool> vChunkDone;
+    size_t nVerified;
+    bool fReadError;
+    std::vector<CBlockIndex*> vBad;
+    bool fRunning;
+
+    CBlockVerifyJob()
+    {
+        fDeep = false;
+        nCheckLevel = 0;
+        hashTop = 0;
+        nUpper = 0;
+        nHeightDone = -1;
+        nNextChunk = 0;
+        nVerified = 0;
+        fReadError = false;
+        fRunning = false;
+    }
+};
+
+// The pending or running transaction index check, for ThreadVerifyBlocks
+// and RPC
+static boost::scoped_ptr<CBlockVerifyJob> pjobVerifyDeep;
+
+static bool IsInMainChain(const CBlockIndex* pindex)
+{
+    return pindex->pnext != NULL || pindex == pindexBest;
+}
+
+// Whether a spend recorded at pos was made by a main chain block at or above nHeight
+static bool IsMainChainSpend(const CBlockVerifyJob& job, const pair<unsigned int, unsigned int>& pos, int nHeight)
+{
+    BlockPosMap::const_iterator mi = job.mapBlockPos.find(pos);
+    if (mi != job.mapBlockPos.end())
+        return mi->second >= nHeight;
+    if (!job.fDeep)
+        return false;
+
+    // The spend may be in a block connected since the check started
+    CBlock block;
+    if (!block.ReadFromDisk(pos.first, pos.second, false))
+        return false;
+    LOCK(cs_main);
+    map<uint256, CBlockIndex*>::iterator it = mapBlockIndex.find(block.GetHash());
+    if (it == mapBlockIndex.end())
+        return false;
+    const CBlockIndex* pindex = it->second;
+    return pindex->nFile == pos.first && pindex->nBlockPos == pos.second &&
+           pindex->nHeight >= nHeight && IsInMainChain(pindex);
+}
+
+static bool VerifyBlockIndexEntry(CTxDB& txdb, CBlockIndex* pindex, CBlockVerifyJob& job, bool& fReadError)
+{
+    int nCheckLevel = job.nCheckLevel;
+    CBlock block;
+    if (!block.ReadFromDisk(pindex))
+    {
+        LogPrintf("LoadBlockIndex() : *** cannot read block at %d, hash=%s\n", pindex->nHeight, pindex->GetBlockHash().ToString());
+        fReadError = true;
+        return false;
+    }
+    if (!job.fDeep)
+    {
+        // check level 1: verify block validity
+        // check level 7: verify block signature too
+        if (nCheckLevel>0 && !block.CheckBlock(true, true, (nCheckLevel>6)))
+        {
+            LogPrintf("LoadBlockIndex() : *** found bad block at %d, hash=%s\n", pindex->nHeight, pindex->GetBlockHash().ToString());
+            return false;
         }
+        return true;
+    }
 
-        // NovaCoin: build setStakeSeen
-        if (pindexNew->IsProofOfStake())
-            setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
+    bool fOk = true;
+    // check level 2: verify transaction index validity
+    BOOST_FOREACH(const CTransaction &tx, block.vtx)
+    {
+        uint256 hashTx = tx.GetHash();
+        CTxIndex txindex;
+        if (txdb.ReadTxIndex(hashTx, txindex))
+        {
+            // check level 3: checker transaction hashes
+            if (nCheckLevel>2 || pindex->nFile != txindex.pos.nFile || pindex->nBlockPos != txindex.pos.nBlockPos)
+            {
+                // either an error or a duplicate transaction
+                CTransaction txFound;
+                if (!txFound.ReadFromDisk(txindex.pos))
+                {
+                    LogPrintf("LoadBlockIndex() : *** cannot read mislocated transaction %s\n", hashTx.ToString());
+                    fOk = false;
+                }
+                else
+                    if (txFound.GetHash() != hashTx) // not a duplicate tx
+                    {
+                        LogPrintf("LoadBlockIndex(): *** invalid tx position for %s\n", hashTx.ToString());
+                        fOk = false;
+                    }
+            }
+            // check level 4: check whether spent txouts were spent within the main chain
+            unsigned int nOutput = 0;
+            if (nCheckLevel>3)
+            {
+                BOOST_FOREACH(const CDiskTxPos &txpos, txindex.vSpent)
+                {
+                    if (!txpos.IsNull())
+                    {
+                        pair<unsigned int, unsigned int> posFind = make_pair(txpos.nFile, txpos.nBlockPos);
+                        if (!IsMainChainSpend(job, posFind, pindex->nHeight))
+                        {
+                            LogPrintf("LoadBlockIndex(): *** found bad spend at %d, hashBlock=%s, hashTx=%s\n", pindex->nHeight, pindex->GetBlockHash().ToString(), hashTx.ToString());
+                            fOk = false;
+                        }
+                        // check level 6: check whether spent txouts were spent by a valid transaction that consume them
+                        if (nCheckLevel>5)
+                        {
+                            CTransaction txSpend;
+                            if (!txSpend.ReadFromDisk(txpos))
+                            {
+                                LogPrintf("LoadBlockIndex(): *** cannot read spending transaction of %s:%i from disk\n", hashTx.ToString(), nOutput);
+                                fOk = false;
+                            }
+                            else if (!txSpend.CheckTransaction())
+                            {
+                                LogPrintf("LoadBlockIndex(): *** spending transaction of %s:%i is invalid\n", hashTx.ToString(), nOutput);
+                                fOk = false;
+                            }
+                            else
+                            {
+                                bool fFound = false;
+                                BOOST_FOREACH(const CTxIn &txin, txSpend.vin)
+                                    if (txin.prevout.hash == hashTx && txin.prevout.n == nOutput)
+                                        fFound = true;
+                                if (!fFound)
+                                {
+                                    LogPrintf("LoadBlockIndex(): *** spending transaction of %s:%i does not spend it\n", hashTx.ToString(), nOutput);
+                                    fOk = false;
+                                }
+                            }
+                        }
+                    }
+                    nOutput++;
+                }
+            }
+        }
+        // check level 5: check whether all prevouts are marked spent
+        if (nCheckLevel>4)
+        {
+             BOOST_FOREACH(const CTxIn &txin, tx.vin)
+             {
+                  CTxIndex txindex;
+                  if (txdb.ReadTxIndex(txin.prevout.hash, txindex))
+                      if (txindex.vSpent.size()-1 < txin.prevout.n || txindex.vSpent[txin.prevout.n].IsNull())
+                      {
+                          LogPrintf("LoadBlockIndex(): *** found unspent prevout %s:%i in %s\n", txin.prevout.hash.ToString(), txin.prevout.n, hashTx.ToString());
+                          fOk = false;
+                      }
+             }
+        }
+    }
+    return fOk;
+}
+
+// Store how far the finished chunks reach down from the top without a gap
+static void WriteBlockVerifyProgress(CBlockVerifyJob& job)
+{
+    CBlockVerifyProgress progress;
+    {
+        LOCK(job.cs);
+        if (!job.vBad.empty() || job.fReadError)
+            return;
+        size_t nChunks = 0;
+        while (nChunks < job.vChunkDone.size() && job.vChunkDone[nChunks])
+            nChunks++;
+        size_t nDone = std::min(nChunks * BLOCK_VERIFY_CHUNK, job.vBlocks.size());
+        if (nDone == 0 || nDone < job.nUpper)
+            return;
+        progress.nCheckLevel = job.nCheckLevel;
+        progress.hashTop = job.hashTop;
+        progress.nHeightDone = nDone > job.nUpper ? job.vBlocks[nDone - 1]->nHeight : job.nHeightDone;
+    }
+    CTxDB txdb;
+    txdb.WriteBlockVerifyProgress(progress);
+}
 
-        iterator->Next();
+static void BlockVerifyWorker(CBlockVerifyJob* pjob)
+{
+    CBlockVerifyJob& job = *pjob;
+    CTxDB txdb("r");
+    while (true)
+    {
+        size_t nChunk;
+        {
+            LOCK(job.cs);
+            if (job.nNextChunk >= job.vChunkDone.size() || (job.fReadError && !job.fDeep))
+                return;
+            nChunk = job.nNextChunk++;
+        }
+        size_t nBegin = nChunk * BLOCK_VERIFY_CHUNK;
+        size_t nEnd = std::min(nBegin + BLOCK_VERIFY_CHUNK, job.vBlocks.size());
+        std::vector<CBlockIndex*> vBad;
+        bool fReadError = false;
+        for (size_t i = nBegin; i < nEnd; i++)
+        {
+            boost::this_thread::interruption_point();
+            if (!VerifyBlockIndexEntry(txdb, job.vBlocks[i], job, fReadError))
+                vBad.push_back(job.vBlocks[i]);
+        }
+        {
+            LOCK(job.cs);
+            job.vChunkDone[nChunk] = true;
+            job.nVerified += nEnd - nBegin;
+            job.vBad.insert(job.vBad.end(), vBad.begin(), vBad.end());
+            job.fReadError |= fReadError;
+        }
+        if (job.fDeep)
+            WriteBlockVerifyProgress(job);
+    }
+}
+
+// Check all blocks of the job, using the calling thread and -par - 1 more
+static void RunBlockVerifyJob(CBlockVerifyJob& job)
+{
+    job.vChunkDone.assign((job.vBlocks.size() + BLOCK_VERIFY_CHUNK - 1) / BLOCK_VERIFY_CHUNK, false);
+    {
+        LOCK(job.cs);
+        job.fRunning = true;
+    }
+    boost::thread_group threadGroup;
+    for (int i = 1; i < nScriptCheckThreads; i++)
+        threadGroup.create_thread(boost::bind(&BlockVerifyWorker, &job));
+    try
+    {
+        BlockVerifyWorker(&job);
+    }
+    catch (boost::thread_interrupted)
+    {
+        threadGroup.interrupt_all();
+        threadGroup.join_all();
+        LOCK(job.cs);
+        job.fRunning = false;
+        throw;
+    }
+    threadGroup.join_all();
+    LOCK(job.cs);
+    job.fRunning = false;
+}
+
+// Collect main chain blocks from pindexFrom down to nHeightStop, highest first
+static void GetBlocksToVerify(CBlockIndex* pindexFrom, int nHeightStop, CBlockVerifyJob& job)
+{
+    for (CBlockIndex* pindex = pindexFrom; pindex && pindex->pprev && pindex->nHeight >= nHeightStop; pindex = pindex->pprev)
+        job.vBlocks.push_back(pindex);
+}
+
+static void BuildBlockPosMap(CBlockVerifyJob& job, int nHeightStop)
+{
+    for (CBlockIndex* pindex = pindexBest; pindex && pindex->nHeight >= nHeightStop; pindex = pindex->pprev)
+        job.mapBlockPos[make_pair(pindex->nFile, pindex->nBlockPos)] = pindex->nHeight;
+}
+
+static bool ReorganizeToFork(CBlockIndex* pindexFork)
+{
+    // Reorg back to the fork
+    LogPrintf("LoadBlockIndex() : *** moving best chain pointer back to block %d\n", pindexFork->nHeight);
+    CBlock block;
+    if (!block.ReadFromDisk(pindexFork))
+        return error("LoadBlockIndex() : block.ReadFromDisk failed");
+    CTxDB txdb;
+    if (!block.SetBestChain(txdb, pindexFork))
+        return error("LoadBlockIndex() : SetBestChain failed");
+    return true;
+}
+
+static bool CompareBlockHeight(const CBlockIndex* pa, const CBlockIndex* pb)
+{
+    return pa->nHeight < pb->nHeight;
+}
+
+bool CTxDB::WriteBlockVerifyProgress(const CBlockVerifyProgress& progress)
+{
+    return Write(string("checkBlocksProgress"), progress);
+}
+
+bool CTxDB::VerifyBlockIndex()
+{
+    int nCheckLevel = GetArg("-checklevel", 1);
+    int nCheckDepth = GetArg( "-checkblocks", 500);
+    if (nCheckDepth == 0)
+        nCheckDepth = 1000000000; // suffices until the year 19000
+    if (nCheckDepth > nBestHeight)
+        nCheckDepth = nBestHeight;
+    LogPrintf("Verifying last %i blocks at level %i\n", nCheckDepth, nCheckLevel);
+    int nHeightStop = nBestHeight - nCheckDepth;
+
+    CBlockVerifyJob job;
+    job.nCheckLevel = nCheckLevel;
+    GetBlocksToVerify(pindexBest, nHeightStop, job);
+    RunBlockVerifyJob(job);
+    if (job.fReadError)
+        return error("LoadBlockIndex() : block.ReadFromDisk failed");
+    if (!job.vBad.empty())
+    {
+        boost::this_thread::interruption_point();
+        CBlockIndex* pindexBad = *std::min_element(job.vBad.begin(), job.vBad.end(), CompareBlockHeight);
+        if (!ReorganizeToFork(pindexBad->pprev))
+            return false;
+        nHeightStop = std::min(nHeightStop, nBestHeight);
+    }
+
+    if (nCheckLevel < 2)
+        return true;
+
+    // Leave the transaction index checks to ThreadVerifyBlocks, skipping
+    // what an earlier run at the same level or above already covered
+    CBlockVerifyJob* pjob = new CBlockVerifyJob();
+    pjob->fDeep = true;
+    pjob->nCheckLevel = nCheckLevel;
+    pjob->hashTop = hashBestChain;
+    CBlockVerifyProgress progress;
+    map<uint256, CBlockIndex*>::iterator mi;
+    if (Read(string("checkBlocksProgress"), progress) && progress.nCheckLevel >= nCheckLevel &&
+        (mi = mapBlockIndex.find(progress.hashTop)) != mapBlockIndex.end() && IsInMainChain(mi->second) &&
+        progress.nHeightDone <= mi->second->nHeight)
+    {
+        CBlockIndex* pindexDone = mi->second;
+        for (CBlockIndex* pindex = pindexBest; pindex != pindexDone && pindex->nHeight >= nHeightStop; pindex = pindex->pprev)
+            pjob->vBlocks.push_back(pindex);
+        pjob->nUpper = pjob->vBlocks.size();
+        pjob->nHeightDone = progress.nHeightDone;
+        CBlockIndex* pindexLower = pindexDone;
+        while (pindexLower && pindexLower->nHeight >= progress.nHeightDone)
+            pindexLower = pindexLower->pprev;
+        GetBlocksToVerify(pindexLower, nHeightStop, *pjob);
+    }
+    else
+        GetBlocksToVerify(pindexBest, nHeightStop, *pjob);
+    BuildBlockPosMap(*pjob, nHeightStop);
+    LogPrintf("LoadBlockIndex() : %u blocks left for transaction index checks at level %i\n", pjob->vBlocks.size(), nCheckLevel);
+    pjobVerifyDeep.reset(pjob);
+    return true;
+}
+
+void ThreadVerifyBlocks()
+{
+    if (!pjobVerifyDeep)
+        return;
+    CBlockVerifyJob& job = *pjobVerifyDeep;
+
+    RenameThread("Ember-verify");
+    int64_t nStart = GetTimeMillis();
+    RunBlockVerifyJob(job);
+    LogPrintf("ThreadVerifyBlocks() : checked %u blocks at level %i in %dms\n", job.vBlocks.size(), job.nCheckLevel, GetTimeMillis() - nStart);
+
+    // A failure seen while blocks were being connected may be a race with
+    // the index updates, so only act on it if it's still there with cs_main
+    // held, and the block is still in the main chain
+    std::vector<CBlockIndex*> vBad;
+    {
+        LOCK(job.cs);
+        vBad = job.vBad;
+        job.fReadError = false;
+    }
+    sort(vBad.begin(), vBad.end(), CompareBlockHeight);
+    LOCK(cs_main);
+    CTxDB txdb("r");
+    BOOST_FOREACH(CBlockIndex* pindex, vBad)
+    {
+        bool fReadError = false;
+        if (!IsInMainChain(pindex) || VerifyBlockIndexEntry(txdb, pindex, job, fReadError))
+            continue;
+        if (!ReorganizeToFork(pindex->pprev))
+        {
+            // The best chain still contains a block whose transaction index
+            // entries are wrong; don't keep running on top of it
+            string strMessage = _("Error: Failed to move the best chain back past a block with a corrupt transaction index, shutting down");
+            strMiscWarning = strMessage;
+            LogPrintf("*** %s\n", strMessage);
+            uiInterface.ThreadSafeMessageBox(strMessage, "", CClientUIInterface::MSG_ERROR);
+            StartShutdown();
+            return;
+        }
+        LOCK(job.cs);
+        job.vBad.clear();
+        return;
+    }
+    {
+        LOCK(job.cs);
+        job.vBad.clear();
+    }
+    WriteBlockVerifyProgress(job);
+}
+
+bool GetBlockVerifyStatus(int& nCheckLevel, int& nBlocks, int& nVerified, bool& fRunning)
+{
+    if (!pjobVerifyDeep)
+        return false;
+    CBlockVerifyJob& job = *pjobVerifyDeep;
+    LOCK(job.cs);
+    nCheckLevel = job.nCheckLevel;
+    nBlocks = job.vBlocks.size();
+    nVerified = job.nVerified;
+    fRunning = job.fRunning;
+    return true;
+}
+
+bool CTxDB::LoadBlockIndexGuts()
+{
+    // The block index is an in-memory structure that maps hashes to on-disk
+    // locations where the contents of the block can be found. Here, we scan it
+    // out of the DB and into mapBlockIndex.
+    leveldb::Iterator *iterator = pdb->NewIterator(leveldb::ReadOptions());
+    // Seek to start key.
+    CDataStream ssStartKey(SER_DISK, CLIENT_VERSION);
+    ssStartKey << make_pair(string("blockindex"), uint256(0));
+    iterator->Seek(ssStartKey.str());
+    // Now read each entry. Entries are collected in chunks so that the hashes
+    // that aren't stored with them (-fastindex=0, recent blocks) can be
+    // computed as one batch.
+    vector<CDiskBlockIndex> vDiskIndex;
+    vector<uint256> vBlockHash;
+    vector<size_t> vHashPos;
+    vector<unsigned char> vHeaders;
+    bool fDone = false;
+    while (!fDone)
+    {
+        boost::this_thread::interruption_point();
+        vDiskIndex.clear();
+        while (vDiskIndex.size() < 4096)
+        {
+            if (!iterator->Valid())
+            {
+                fDone = true;
+                break;
+            }
+            // Unpack keys and values.
+            CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+            ssKey.write(iterator->key().data(), iterator->key().size());
+            CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+            ssValue.write(iterator->value().data(), iterator->value().size());
+            string strType;
+            ssKey >> strType;
+            // Did we reach the end of the data to read?
+            if (strType != "blockindex")
+            {
+                fDone = true;
+                break;
+            }
+            vDiskIndex.push_back(CDiskBlockIndex());
+            ssValue >> vDiskIndex.back();
+            iterator->Next();
+        }
+
+        vBlockHash.resize(vDiskIndex.size());
+        vHashPos.clear();
+        vHeaders.clear();
+        for (size_t i = 0; i < vDiskIndex.size(); i++)
+        {
+            if (vDiskIndex[i].HasStoredHash())
+            {
+                vBlockHash[i] = vDiskIndex[i].GetBlockHash();
+                continue;
+            }
+            CBlock header = vDiskIndex[i].GetBlockHeader();
+            vHeaders.insert(vHeaders.end(), BEGIN(header.nVersion), END(header.nNonce));
+            vHashPos.push_back(i);
+        }
+        vector<uint256> vHashes(vHashPos.size());
+        if (!vHashPos.empty())
+            Hash9Batch(&vHeaders[0], vHashPos.size(), &vHashes[0], true);
+        for (size_t i = 0; i < vHashPos.size(); i++)
+            vBlockHash[vHashPos[i]] = vHashes[i];
+
+        for (size_t i = 0; i < vDiskIndex.size(); i++)
+        {
+            const CDiskBlockIndex& diskindex = vDiskIndex[i];
+            const uint256& blockHash = vBlockHash[i];
+
+            // Construct block index object
+            CBlockIndex* pindexNew    = InsertBlockIndex(blockHash);
+            pindexNew->pprev          = InsertBlockIndex(diskindex.hashPrev);
+            pindexNew->pnext          = InsertBlockIndex(diskindex.hashNext);
+            pindexNew->nFile          = diskindex.nFile;
+            pindexNew->nBlockPos      = diskindex.nBlockPos;
+            pindexNew->nHeight        = diskindex.nHeight;
+            pindexNew->nMint          = diskindex.nMint;
+            pindexNew->nMoneySupply   = diskindex.nMoneySupply;
+            pindexNew->nFlags         = diskindex.nFlags;
+            pindexNew->nStakeModifier = diskindex.nStakeModifier;
+            pindexNew->prevoutStake   = diskindex.prevoutStake;
+            pindexNew->nStakeTime     = diskindex.nStakeTime;
+            pindexNew->hashProof      = diskindex.hashProof;
+            pindexNew->nVersion       = diskindex.nVersion;
+            pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
+            pindexNew->nTime          = diskindex.nTime;
+            pindexNew->nBits          = diskindex.nBits;
+            pindexNew->nNonce         = diskindex.nNonce;
+
+            // Watch for genesis block
+            if (pindexGenesisBlock == NULL && blockHash == Params().HashGenesisBlock())
+                pindexGenesisBlock = pindexNew;
+
+            if (!pindexNew->CheckIndex()) {
+                delete iterator;
+                return error("LoadBlockIndex() : CheckIndex failed at %d", pindexNew->nHeight);
+            }
+
+            // NovaCoin: build setStakeSeen
+            if (pindexNew->IsProofOfStake())
+                setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
+        }
     }
     delete iterator;
 
@@ -411,6 +1594,19 @@ bool CTxDB::LoadBlockIndex()
         pindex->nChainTrust = (pindex->pprev ? pindex->pprev->nChainTrust : 0) + pindex->GetBlockTrust();
     }
 
+    return true;
+}
+
+bool CTxDB::LoadBlockIndex()
+{
+    if (mapBlockIndex.size() > 0) {
+        // Already loaded once in this session. It can happen during migration
+        // from BDB.
+        return true;
+    }
+    if (!LoadBlockIndexSnapshot() && !LoadBlockIndexGuts())
+        return false;
+
     // Load hashBestChain pointer to end of best chain
     if (!ReadHashBestChain(hashBestChain))
     {
@@ -438,133 +1634,15 @@ bool CTxDB::LoadBlockIndex()
     ReadBestInvalidTrust(bnBestInvalidTrust);
     nBestInvalidTrust = bnBestInvalidTrust.getuint256();
 
-    // Verify blocks in the best chain
-    int nCheckLevel = GetArg("-checklevel", 1);
-    int nCheckDepth = GetArg( "-checkblocks", 500);
-    if (nCheckDepth == 0)
-        nCheckDepth = 1000000000; // suffices until the year 19000
-    if (nCheckDepth > nBestHeight)
-        nCheckDepth = nBestHeight;
-    LogPrintf("Verifying last %i blocks at level %i\n", nCheckDepth, nCheckLevel);
-    CBlockIndex* pindexFork = NULL;
-    map<pair<unsigned int, unsigned int>, CBlockIndex*> mapBlockPos;
-    for (CBlockIndex* pindex = pindexBest; pindex && pindex->pprev; pindex = pindex->pprev)
+    // The unspent output set is only usable if it was written out for the
+    // chain we are starting from
+    uint256 hashUnspentBestChain = 0;
+    if (!Read(string("hashUnspentBestChain"), hashUnspentBestChain) || hashUnspentBestChain != hashBestChain)
     {
-        boost::this_thread::interruption_point();
-        if (pindex->nHeight < nBestHeight-nCheckDepth)
-            break;
-        CBlock block;
-        if (!block.ReadFromDisk(pindex))
-            return error("LoadBlockIndex() : block.ReadFromDisk failed");
-        // check level 1: verify block validity
-        // check level 7: verify block signature too
-        if (nCheckLevel>0 && !block.CheckBlock(true, true, (nCheckLevel>6)))
-        {
-            LogPrintf("LoadBlockIndex() : *** found bad block at %d, hash=%s\n", pindex->nHeight, pindex->GetBlockHash().ToString());
-            pindexFork = pindex->pprev;
-        }
-        // check level 2: verify transaction index validity
-        if (nCheckLevel>1)
-        {
-            pair<unsigned int, unsigned int> pos = make_pair(pindex->nFile, pindex->nBlockPos);
-            mapBlockPos[pos] = pindex;
-            BOOST_FOREACH(const CTransaction &tx, block.vtx)
-            {
-                uint256 hashTx = tx.GetHash();
-                CTxIndex txindex;
-                if (ReadTxIndex(hashTx, txindex))
-                {
-                    // check level 3: checker transaction hashes
-                    if (nCheckLevel>2 || pindex->nFile != txindex.pos.nFile || pindex->nBlockPos != txindex.pos.nBlockPos)
-                    {
-                        // either an error or a duplicate transaction
-                        CTransaction txFound;
-                        if (!txFound.ReadFromDisk(txindex.pos))
-                        {
-                            LogPrintf("LoadBlockIndex() : *** cannot read mislocated transaction %s\n", hashTx.ToString());
-                            pindexFork = pindex->pprev;
-                        }
-                        else
-                            if (txFound.GetHash() != hashTx) // not a duplicate tx
-                            {
-                                LogPrintf("LoadBlockIndex(): *** invalid tx position for %s\n", hashTx.ToString());
-                                pindexFork = pindex->pprev;
-                            }
-                    }
-                    // check level 4: check whether spent txouts were spent within the main chain
-                    unsigned int nOutput = 0;
-                    if (nCheckLevel>3)
-                    {
-                        BOOST_FOREACH(const CDiskTxPos &txpos, txindex.vSpent)
-                        {
-                            if (!txpos.IsNull())
-                            {
-                                pair<unsigned int, unsigned int> posFind = make_pair(txpos.nFile, txpos.nBlockPos);
-                                if (!mapBlockPos.count(posFind))
-                                {
-                                    LogPrintf("LoadBlockIndex(): *** found bad spend at %d, hashBlock=%s, hashTx=%s\n", pindex->nHeight, pindex->GetBlockHash().ToString(), hashTx.ToString());
-                                    pindexFork = pindex->pprev;
-                                }
-                                // check level 6: check whether spent txouts were spent by a valid transaction that consume them
-                                if (nCheckLevel>5)
-                                {
-                                    CTransaction txSpend;
-                                    if (!txSpend.ReadFromDisk(txpos))
-                                    {
-                                        LogPrintf("LoadBlockIndex(): *** cannot read spending transaction of %s:%i from disk\n", hashTx.ToString(), nOutput);
-                                        pindexFork = pindex->pprev;
-                                    }
-                                    else if (!txSpend.CheckTransaction())
-                                    {
-                                        LogPrintf("LoadBlockIndex(): *** spending transaction of %s:%i is invalid\n", hashTx.ToString(), nOutput);
-                                        pindexFork = pindex->pprev;
-                                    }
-                                    else
-                                    {
-                                        bool fFound = false;
-                                        BOOST_FOREACH(const CTxIn &txin, txSpend.vin)
-                                            if (txin.prevout.hash == hashTx && txin.prevout.n == nOutput)
-                                                fFound = true;
-                                        if (!fFound)
-                                        {
-                                            LogPrintf("LoadBlockIndex(): *** spending transaction of %s:%i does not spend it\n", hashTx.ToString(), nOutput);
-                                            pindexFork = pindex->pprev;
-                                        }
-                                    }
-                                }
-                            }
-                            nOutput++;
-                        }
-                    }
-                }
-                // check level 5: check whether all prevouts are marked spent
-                if (nCheckLevel>4)
-                {
-                     BOOST_FOREACH(const CTxIn &txin, tx.vin)
-                     {
-                          CTxIndex txindex;
-                          if (ReadTxIndex(txin.prevout.hash, txindex))
-                              if (txindex.vSpent.size()-1 < txin.prevout.n || txindex.vSpent[txin.prevout.n].IsNull())
-                              {
-                                  LogPrintf("LoadBlockIndex(): *** found unspent prevout %s:%i in %s\n", txin.prevout.hash.ToString(), txin.prevout.n, hashTx.ToString());
-                                  pindexFork = pindex->pprev;
-                              }
-                     }
-                }
-            }
-        }
-    }
-    if (pindexFork)
-    {
-        boost::this_thread::interruption_point();
-        // Reorg back to the fork
-        LogPrintf("LoadBlockIndex() : *** moving best chain pointer back to block %d\n", pindexFork->nHeight);
-        CBlock block;
-        if (!block.ReadFromDisk(pindexFork))
-            return error("LoadBlockIndex() : block.ReadFromDisk failed");
-        CTxDB txdb;
-        block.SetBestChain(txdb, pindexFork);
+        if (!RebuildUnspent())
+            return error("CTxDB::LoadBlockIndex() : RebuildUnspent failed");
     }
 
-    return true;
+    // Verify blocks in the best chain
+    return VerifyBlockIndex();
 }
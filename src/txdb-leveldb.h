@@ -15,6 +15,8 @@
 #include <leveldb/db.h>
 #include <leveldb/write_batch.h>
 
+struct CBlockVerifyProgress;
+
 // Class that provides access to a LevelDB. Note that this class is frequently
 // instantiated on the stack and then destroyed again, so instantiation has to
 // be very cheap. Unfortunately that means, a CTxDB instance is actually just a
@@ -46,10 +48,19 @@ private:
     // A batch stores up writes and deletes for atomic application. When this
     // field is non-NULL, writes/deletes go there instead of directly to disk.
     leveldb::WriteBatch *activeBatch;
+    // The latest value of each key written to activeBatch, flagged true if
+    // it was deleted, so reads inside a transaction don't have to scan the
+    // whole batch.
+    std::map<std::string, std::pair<bool, std::string> > mapBatchIndex;
     leveldb::Options options;
     bool fReadOnly;
     int nVersion;
 
+    // Unspent output changes made while activeBatch is non-NULL. They are
+    // moved into the shared unspent output cache by TxnCommit, and dropped
+    // by TxnAbort. A null entry records an erase.
+    std::map<COutPoint, CTxUnspent> mapUnspentBatch;
+
 protected:
     // Returns true and sets (value,false) if activeBatch contains the given key
     // or leaves value alone and sets deleted = true if activeBatch contains a
@@ -112,6 +123,7 @@ protected:
 
         if (activeBatch) {
             activeBatch->Put(ssKey.str(), ssValue.str());
+            mapBatchIndex[ssKey.str()] = std::make_pair(false, ssValue.str());
             return true;
         }
         leveldb::Status status = pdb->Put(leveldb::WriteOptions(), ssKey.str(), ssValue.str());
@@ -135,6 +147,7 @@ protected:
         ssKey << key;
         if (activeBatch) {
             activeBatch->Delete(ssKey.str());
+            mapBatchIndex[ssKey.str()] = std::make_pair(true, std::string());
             return true;
         }
         leveldb::Status status = pdb->Delete(leveldb::WriteOptions(), ssKey.str());
@@ -169,6 +182,8 @@ public:
     {
         delete activeBatch;
         activeBatch = NULL;
+        mapBatchIndex.clear();
+        mapUnspentBatch.clear();
         return true;
     }
 
@@ -201,10 +216,28 @@ public:
     bool WriteSyncCheckpoint(uint256 hashCheckpoint);
     bool ReadCheckpointPubKey(std::string& strPubKey);
     bool WriteCheckpointPubKey(const std::string& strPubKey);
+    bool ReadUnspent(const COutPoint& outpoint, CTxUnspent& unspent);
+    bool WriteUnspent(const COutPoint& outpoint, const CTxUnspent& unspent);
+    bool EraseUnspent(const COutPoint& outpoint);
+    bool AddUnspent(const CTransaction& tx, const CBlockIndex* pindex);
+    bool ReadBlockUndo(const uint256& hash, CBlockUndo& undo);
+    bool WriteBlockUndo(const uint256& hash, const CBlockUndo& undo);
+    bool EraseBlockUndo(const uint256& hash);
+    bool FlushUnspent();
     bool LoadBlockIndex();
+    bool WriteBlockIndexSnapshot();
+    bool WriteBlockVerifyProgress(const CBlockVerifyProgress& progress);
 private:
     bool LoadBlockIndexGuts();
+    bool LoadBlockIndexSnapshot();
+    bool RebuildUnspent();
+    bool VerifyBlockIndex();
 };
 
+// Run the -checklevel transaction index checks left by LoadBlockIndex
+void ThreadVerifyBlocks();
+// Progress of those checks, false if there are none
+bool GetBlockVerifyStatus(int& nCheckLevel, int& nBlocks, int& nVerified, bool& fRunning);
+
 
 #endif // BITCOIN_DB_H
@@ -7,10 +7,73 @@
 #include "txmempool.h"
 #include "main.h" // for CTransaction
 
+#include <cmath>
+
 using namespace std;
 
+// Approximate heap usage of an allocation: malloc keeps a word of
+// bookkeeping and hands out multiples of 16 bytes
+static inline size_t MallocUsage(size_t nAlloc)
+{
+    if (nAlloc == 0)
+        return 0;
+    return ((nAlloc + sizeof(void*) + 15) >> 4) << 4;
+}
+
+// Nodes of std::map and std::set hold three pointers and a colour besides
+// the element
+static inline size_t TreeNodeUsage(size_t nElement)
+{
+    return MallocUsage(nElement + 4 * sizeof(void*));
+}
+
+CTxMemPoolEntry::CTxMemPoolEntry()
+{
+    nFee = 0;
+    nTxSize = 0;
+    nSigOps = 0;
+    nTime = 0;
+    dPriority = 0.0;
+    nHeight = 0;
+    nValueInChain = 0;
+    nUsageSize = 0;
+}
+
+CTxMemPoolEntry::CTxMemPoolEntry(const CTransaction& txIn, int64_t nFeeIn, unsigned int nSigOpsIn, int64_t nTimeIn,
+                                 double dPriorityIn, unsigned int nHeightIn, int64_t nValueInChainIn) :
+    tx(txIn), nFee(nFeeIn), nSigOps(nSigOpsIn), nTime(nTimeIn), dPriority(dPriorityIn),
+    nHeight(nHeightIn), nValueInChain(nValueInChainIn)
+{
+    hash = tx.GetHash();
+    nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+
+    // The entry in mapTx and both indexes, and per input the mapNextTx
+    // entry and at most one parent
+    nUsageSize = TreeNodeUsage(sizeof(std::pair<const uint256, CTxMemPoolEntry>)) +
+                 2 * TreeNodeUsage(sizeof(const CTxMemPoolEntry*)) +
+                 tx.vin.size() * (TreeNodeUsage(sizeof(std::pair<const COutPoint, CInPoint>)) + TreeNodeUsage(sizeof(uint256)));
+    // and what the transaction itself allocates
+    nUsageSize += MallocUsage(tx.vin.capacity() * sizeof(CTxIn)) + MallocUsage(tx.vout.capacity() * sizeof(CTxOut));
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        nUsageSize += MallocUsage(txin.scriptSig.capacity());
+    BOOST_FOREACH(const CTxOut& txout, tx.vout)
+        nUsageSize += MallocUsage(txout.scriptPubKey.capacity());
+}
+
+double CTxMemPoolEntry::GetPriority(unsigned int nCurrentHeight) const
+{
+    if (nCurrentHeight <= nHeight)
+        return dPriority;
+    return dPriority + (double)nValueInChain * (nCurrentHeight - nHeight) / nTxSize;
+}
+
 CTxMemPool::CTxMemPool()
 {
+    nTransactionsUpdated = 0;
+    fLoaded = false;
+    nTotalUsage = 0;
+    dRollingMinFeePerKb = 0;
+    nLastRollingFeeUpdate = 0;
 }
 
 unsigned int CTxMemPool::GetTransactionsUpdated() const
@@ -25,16 +88,34 @@ void CTxMemPool::AddTransactionsUpdated(unsigned int n)
     nTransactionsUpdated += n;
 }
 
-bool CTxMemPool::addUnchecked(const uint256& hash, CTransaction &tx)
+bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry)
 {
     // Add to memory pool without checking anything.
     // Used by main.cpp AcceptToMemoryPool(), which DOES do
     // all the appropriate checks.
     LOCK(cs);
     {
-        mapTx[hash] = tx;
+        CTxMemPoolEntry& newentry = mapTx[hash];
+        newentry = entry;
+        const CTransaction& tx = newentry.GetTx();
+        newentry.setParents.clear();
         for (unsigned int i = 0; i < tx.vin.size(); i++)
-            mapNextTx[tx.vin[i].prevout] = CInPoint(&mapTx[hash], i);
+        {
+            mapNextTx[tx.vin[i].prevout] = CInPoint(&tx, i);
+            if (mapTx.count(tx.vin[i].prevout.hash))
+                newentry.setParents.insert(tx.vin[i].prevout.hash);
+        }
+        // A transaction put back after a reorganization can have children
+        // in the pool already
+        for (unsigned int i = 0; i < tx.vout.size(); i++)
+        {
+            std::map<COutPoint, CInPoint>::iterator it = mapNextTx.find(COutPoint(hash, i));
+            if (it != mapNextTx.end())
+                mapTx[it->second.ptx->GetHash()].setParents.insert(hash);
+        }
+        setByFeeRate.insert(&newentry);
+        setByPriority.insert(&newentry);
+        nTotalUsage += newentry.GetUsageSize();
         nTransactionsUpdated++;
     }
     return true;
@@ -57,6 +138,15 @@ bool CTxMemPool::remove(const CTransaction &tx, bool fRecursive)
             }
             BOOST_FOREACH(const CTxIn& txin, tx.vin)
                 mapNextTx.erase(txin.prevout);
+            for (unsigned int i = 0; i < tx.vout.size(); i++) {
+                std::map<COutPoint, CInPoint>::iterator it = mapNextTx.find(COutPoint(hash, i));
+                if (it != mapNextTx.end())
+                    mapTx[it->second.ptx->GetHash()].setParents.erase(hash);
+            }
+            const CTxMemPoolEntry* pentry = &mapTx[hash];
+            setByFeeRate.erase(pentry);
+            setByPriority.erase(pentry);
+            nTotalUsage -= pentry->GetUsageSize();
             mapTx.erase(hash);
             nTransactionsUpdated++;
         }
@@ -82,8 +172,11 @@ bool CTxMemPool::removeConflicts(const CTransaction &tx)
 void CTxMemPool::clear()
 {
     LOCK(cs);
+    setByFeeRate.clear();
+    setByPriority.clear();
     mapTx.clear();
     mapNextTx.clear();
+    nTotalUsage = 0;
     ++nTransactionsUpdated;
 }
 
@@ -93,15 +186,104 @@ void CTxMemPool::queryHashes(std::vector<uint256>& vtxid)
 
     LOCK(cs);
     vtxid.reserve(mapTx.size());
-    for (map<uint256, CTransaction>::iterator mi = mapTx.begin(); mi != mapTx.end(); ++mi)
+    for (map<uint256, CTxMemPoolEntry>::iterator mi = mapTx.begin(); mi != mapTx.end(); ++mi)
         vtxid.push_back((*mi).first);
 }
 
+void CTxMemPool::CalculateDescendants(const uint256& hash, set<uint256>& setDescendants)
+{
+    LOCK(cs);
+    vector<uint256> vToVisit(1, hash);
+    while (!vToVisit.empty())
+    {
+        uint256 hashVisit = vToVisit.back();
+        vToVisit.pop_back();
+        if (!setDescendants.insert(hashVisit).second)
+            continue;
+        map<uint256, CTxMemPoolEntry>::const_iterator mi = mapTx.find(hashVisit);
+        if (mi == mapTx.end())
+            continue;
+        for (unsigned int i = 0; i < mi->second.GetTx().vout.size(); i++)
+        {
+            map<COutPoint, CInPoint>::const_iterator it = mapNextTx.find(COutPoint(hashVisit, i));
+            if (it != mapNextTx.end())
+                vToVisit.push_back(it->second.ptx->GetHash());
+        }
+    }
+}
+
+void CTxMemPool::TrimToSize(size_t nSizeLimit)
+{
+    LOCK(cs);
+    unsigned int nEvicted = 0;
+    double dMaxEvictedFeePerKb = 0;
+    while (nTotalUsage > nSizeLimit && !setByFeeRate.empty())
+    {
+        // The transaction a new block would take last goes first, and with
+        // it everything that spends it. The package is worth at least its
+        // own fee rate, and more if its descendants pay for it.
+        const CTxMemPoolEntry* pentry = *setByFeeRate.rbegin();
+        set<uint256> setDescendants;
+        CalculateDescendants(pentry->GetHash(), setDescendants);
+        int64_t nPackageFees = 0;
+        unsigned int nPackageSize = 0;
+        BOOST_FOREACH(const uint256& hash, setDescendants)
+        {
+            map<uint256, CTxMemPoolEntry>::const_iterator mi = mapTx.find(hash);
+            if (mi == mapTx.end())
+                continue;
+            nPackageFees += mi->second.GetFee();
+            nPackageSize += mi->second.GetTxSize();
+        }
+        double dFeePerKb = std::max(pentry->GetFeePerKb(), double(nPackageFees) / (double(nPackageSize) / 1000.0));
+        dMaxEvictedFeePerKb = std::max(dMaxEvictedFeePerKb, dFeePerKb);
+
+        CTransaction tx = pentry->GetTx();
+        remove(tx, true);
+        nEvicted += setDescendants.size();
+    }
+
+    if (nEvicted)
+    {
+        // Anything paying less than what was just thrown out would only
+        // be evicted again
+        double dNewMinFeePerKb = dMaxEvictedFeePerKb + MIN_RELAY_TX_FEE;
+        if (dNewMinFeePerKb > dRollingMinFeePerKb)
+        {
+            dRollingMinFeePerKb = dNewMinFeePerKb;
+            nLastRollingFeeUpdate = GetTime();
+        }
+        LogPrint("mempool", "TrimToSize : evicted %u transactions, minimum fee now %.0f per kB\n", nEvicted, dRollingMinFeePerKb);
+    }
+}
+
+int64_t CTxMemPool::GetRollingMinFee(unsigned int nBytes)
+{
+    LOCK(cs);
+    if (dRollingMinFeePerKb == 0)
+        return 0;
+
+    int64_t nNow = GetTime();
+    if (nNow > nLastRollingFeeUpdate)
+    {
+        dRollingMinFeePerKb /= pow(2.0, double(nNow - nLastRollingFeeUpdate) / MEMPOOL_ROLLING_FEE_HALFLIFE);
+        nLastRollingFeeUpdate = nNow;
+
+        // The normal relay rules take over again from here
+        if (dRollingMinFeePerKb < MIN_RELAY_TX_FEE / 2)
+        {
+            dRollingMinFeePerKb = 0;
+            return 0;
+        }
+    }
+    return (int64_t)(dRollingMinFeePerKb * nBytes / 1000);
+}
+
 bool CTxMemPool::lookup(uint256 hash, CTransaction& result) const
 {
     LOCK(cs);
-    std::map<uint256, CTransaction>::const_iterator i = mapTx.find(hash);
+    std::map<uint256, CTxMemPoolEntry>::const_iterator i = mapTx.find(hash);
     if (i == mapTx.end()) return false;
-    result = i->second;
+    result = i->second.GetTx();
     return true;
 }
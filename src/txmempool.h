@@ -6,6 +6,79 @@
 #define BITCOIN_TXMEMPOOL_H
 
 #include "core.h"
+#include "main.h"
+
+#include <set>
+
+/** A transaction in the memory pool, together with what block assembly
+ * needs to know about it. All of it is worked out once, when the transaction
+ * is accepted, so that building a block doesn't have to look at the inputs
+ * of every pool transaction again.
+ */
+class CTxMemPoolEntry
+{
+private:
+    CTransaction tx;
+    uint256 hash;            // txid, so the indexes needn't rehash to compare
+    int64_t nFee;            // inputs minus outputs
+    unsigned int nTxSize;    // serialized size
+    unsigned int nSigOps;    // legacy and pay-to-script-hash sigops
+    int64_t nTime;           // local time when the transaction entered the pool
+    double dPriority;        // priority when the transaction entered the pool
+    unsigned int nHeight;    // best height when the transaction entered the pool
+    int64_t nValueInChain;   // value of the inputs that were already in the chain
+    size_t nUsageSize;       // memory the pool needs for this entry
+
+public:
+    // pool transactions this one spends
+    std::set<uint256> setParents;
+
+    CTxMemPoolEntry();
+    CTxMemPoolEntry(const CTransaction& txIn, int64_t nFeeIn, unsigned int nSigOpsIn, int64_t nTimeIn,
+                    double dPriorityIn, unsigned int nHeightIn, int64_t nValueInChainIn);
+
+    const CTransaction& GetTx() const { return tx; }
+    const uint256& GetHash() const { return hash; }
+    int64_t GetFee() const { return nFee; }
+    unsigned int GetTxSize() const { return nTxSize; }
+    unsigned int GetSigOps() const { return nSigOps; }
+    int64_t GetTime() const { return nTime; }
+    unsigned int GetHeight() const { return nHeight; }
+    size_t GetUsageSize() const { return nUsageSize; }
+
+    // Fee per 1000 bytes, without the rounding of the size the fee rules use
+    double GetFeePerKb() const { return double(nFee) / (double(nTxSize) / 1000.0); }
+
+    // Priority is sum(valuein * age) / txsize, with the inputs that were in
+    // the chain at entry growing older as blocks arrive
+    double GetPriority(unsigned int nCurrentHeight) const;
+};
+
+/** Orders entries by fee rate, highest first */
+class CompareTxMemPoolEntryByFeeRate
+{
+public:
+    bool operator()(const CTxMemPoolEntry* a, const CTxMemPoolEntry* b) const
+    {
+        double fa = a->GetFeePerKb(), fb = b->GetFeePerKb();
+        if (fa != fb)
+            return fa > fb;
+        return a->GetHash() < b->GetHash();
+    }
+};
+
+/** Orders entries by their priority at entry, highest first */
+class CompareTxMemPoolEntryByPriority
+{
+public:
+    bool operator()(const CTxMemPoolEntry* a, const CTxMemPoolEntry* b) const
+    {
+        double pa = a->GetPriority(a->GetHeight()), pb = b->GetPriority(b->GetHeight());
+        if (pa != pb)
+            return pa > pb;
+        return a->GetHash() < b->GetHash();
+    }
+};
 
 /*
  * CTxMemPool stores valid-according-to-the-current-best-chain
@@ -21,19 +94,37 @@ class CTxMemPool
 {
 private:
     unsigned int nTransactionsUpdated;
+    bool fLoaded;                // mempool.dat has been read back
+    uint64_t nTotalUsage;        // sum of the entries' GetUsageSize()
+    double dRollingMinFeePerKb;  // raised by evictions, decays over time
+    int64_t nLastRollingFeeUpdate;
 
 public:
     mutable CCriticalSection cs;
-    std::map<uint256, CTransaction> mapTx;
+    std::map<uint256, CTxMemPoolEntry> mapTx;
     std::map<COutPoint, CInPoint> mapNextTx;
 
+    // Indexes of the entries in mapTx
+    std::set<const CTxMemPoolEntry*, CompareTxMemPoolEntryByFeeRate> setByFeeRate;
+    std::set<const CTxMemPoolEntry*, CompareTxMemPoolEntryByPriority> setByPriority;
+
     CTxMemPool();
 
-    bool addUnchecked(const uint256& hash, CTransaction &tx);
+    bool addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry);
     bool remove(const CTransaction &tx, bool fRecursive = false);
     bool removeConflicts(const CTransaction &tx);
     void clear();
     void queryHashes(std::vector<uint256>& vtxid);
+    void CalculateDescendants(const uint256& hash, std::set<uint256>& setDescendants);
+
+    /** Evict the transactions with the lowest fee rate, together with
+     * whatever spends them, until the pool uses no more than nSizeLimit
+     * bytes of memory. */
+    void TrimToSize(size_t nSizeLimit);
+
+    /** The fee a transaction of nBytes needs to get in while evictions are
+     * recent; zero when the pool hasn't been full for a while. */
+    int64_t GetRollingMinFee(unsigned int nBytes);
     unsigned int GetTransactionsUpdated() const;
     void AddTransactionsUpdated(unsigned int n);
 
@@ -43,6 +134,24 @@ public:
         return mapTx.size();
     }
 
+    size_t DynamicMemoryUsage() const
+    {
+        LOCK(cs);
+        return nTotalUsage;
+    }
+
+    bool IsLoaded() const
+    {
+        LOCK(cs);
+        return fLoaded;
+    }
+
+    void SetLoaded(bool fLoadedIn)
+    {
+        LOCK(cs);
+        fLoaded = fLoadedIn;
+    }
+
     bool exists(uint256 hash) const
     {
         LOCK(cs);
@@ -30,7 +30,7 @@ static const int DATABASE_VERSION = 70509;
 // network protocol versioning
 //
 
-static const int PROTOCOL_VERSION = 77780;
+static const int PROTOCOL_VERSION = 77781;
 
 // intial proto version, to be increased after version/verack negotiation
 static const int INIT_PROTO_VERSION = 210;
@@ -55,4 +55,7 @@ static const int BIP0031_VERSION = 60000;
 // "mempool" command, enhanced "getdata" behavior starts with this version:
 static const int MEMPOOL_GD_VERSION = 60002;
 
+// "cmpctblock", "getblocktxn" and "blocktxn" commands start with this version
+static const int COMPACT_BLOCKS_VERSION = 77781;
+
 #endif
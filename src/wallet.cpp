@@ -7,6 +7,7 @@
 
 #include "base58.h"
 #include "coincontrol.h"
+#include "init.h"
 #include "kernel.h"
 #include "net.h"
 #include "timedata.h"
@@ -429,11 +430,19 @@ void CWallet::MarkDirty()
 {
     {
         LOCK(cs_wallet);
+        fBalanceFullUpdate = true;
         BOOST_FOREACH(PAIRTYPE(const uint256, CWalletTx)& item, mapWallet)
             item.second.MarkDirty();
     }
 }
 
+void CWallet::MarkBalanceDirty(const uint256& hash) const
+{
+    LOCK(cs_wallet);
+    if (!fBalanceFullUpdate)
+        setBalanceDirty.insert(hash);
+}
+
 bool CWallet::AddToWallet(const CWalletTx& wtxIn)
 {
     uint256 hash = wtxIn.GetHash();
@@ -590,6 +599,25 @@ bool CWallet::AddToWalletIfInvolvingMe(const CTransaction& tx, const CBlock* pbl
 }
 
 void CWallet::SyncTransaction(const CTransaction& tx, const CBlock* pblock, bool fConnect) {
+    {
+        // Spent or disconnected outputs can't be staked with the kernel data we have
+        LOCK(cs_wallet);
+        if (!mapStakeCandidates.empty())
+        {
+            if (fConnect)
+            {
+                BOOST_FOREACH(const CTxIn& txin, tx.vin)
+                    mapStakeCandidates.erase(txin.prevout);
+            }
+            else
+            {
+                uint256 hash = tx.GetHash();
+                for (unsigned int i = 0; i < tx.vout.size(); i++)
+                    mapStakeCandidates.erase(COutPoint(hash, i));
+            }
+        }
+    }
+
     if (!fConnect)
     {
         // wallets need to refund inputs when disconnecting coinstake
@@ -611,7 +639,10 @@ void CWallet::EraseFromWallet(const uint256 &hash)
     {
         LOCK(cs_wallet);
         if (mapWallet.erase(hash))
+        {
             CWalletDB(strWalletFile).EraseTx(hash);
+            MarkBalanceDirty(hash);
+        }
     }
     return;
 }
@@ -871,6 +902,179 @@ bool CWalletTx::WriteToDisk()
     return CWalletDB(pwallet->strWalletFile).WriteTx(GetHash(), *this);
 }
 
+uint64_t CWalletScanFilter::Slot(const CScript& script) const
+{
+    // Every script in the set carries a key hash, script hash or public
+    // key in the middle, so eight bytes from there spread well enough.
+    uint64_t n;
+    memcpy(&n, &script[script.size() / 2 - 4], sizeof(n));
+    return ((n ^ script.size()) * 0x9e3779b97f4a7c15ULL) >> nShift;
+}
+
+// Scripts IsMine() may accept although they aren't in the set: bare
+// multisig, and key scripts with non-minimal pushes.
+bool CWalletScanFilter::IsIrregular(const CScript& script)
+{
+    unsigned int n = script.size();
+    if (script[n - 1] == OP_CHECKMULTISIG)
+        return true;
+    if (script[n - 1] != OP_CHECKSIG)
+        return false;
+    if (n == 25 && script[0] == OP_DUP && script[1] == OP_HASH160 && script[2] == 20 && script[23] == OP_EQUALVERIFY)
+        return false;
+    if ((n == 35 && script[0] == 33) || (n == 67 && script[0] == 65))
+        return false;
+    return true;
+}
+
+void CWalletScanFilter::Finish()
+{
+    int nBits = 16;
+    while (nBits < 40 && ((uint64_t)1 << nBits) < 16 * (uint64_t)setScripts.size())
+        nBits++;
+    nShift = 64 - nBits;
+    vBits.assign(((uint64_t)1 << nBits) / 64, 0);
+    BOOST_FOREACH(const CScript& script, setScripts)
+    {
+        uint64_t nSlot = Slot(script);
+        vBits[nSlot / 64] |= (uint64_t)1 << (nSlot % 64);
+    }
+}
+
+bool CWalletScanFilter::Match(const CScript& script) const
+{
+    if (script.size() < 8)
+        return false;
+    if (IsIrregular(script))
+        return true;
+    uint64_t nSlot = Slot(script);
+    if (!((vBits[nSlot / 64] >> (nSlot % 64)) & 1))
+        return false;
+    return setScripts.count(script) > 0;
+}
+
+struct CWalletScanBlock
+{
+    CBlockIndex* pindex;
+    CBlock block;
+    std::vector<uint256> vTxHash;
+    // transactions with an output that may be ours
+    std::vector<bool> vMatch;
+    bool fRead;
+
+    CWalletScanBlock(CBlockIndex* pindexIn) : pindex(pindexIn), fRead(false) {}
+};
+
+// Rescan in two stages: worker threads read blocks straight from the block
+// files, bypassing the block cache, and test every output against the filter;
+// the calling thread takes them back in chain order.
+class CWalletScanner
+{
+private:
+    const CWalletScanFilter& filter;
+    const std::vector<CBlockIndex*>& vBlocks;
+    boost::mutex mutex;
+    boost::condition_variable cond;
+    std::map<size_t, CWalletScanBlock*> mapDone;
+    size_t nNextRead;
+    size_t nNextTake;
+    boost::thread_group threadGroup;
+
+    void Read(CWalletScanBlock* pscan)
+    {
+        std::vector<char> vchBlock;
+        if (!ReadRawBlockFromDisk(vchBlock, pscan->pindex->nFile, pscan->pindex->nBlockPos))
+            return;
+        try {
+            CDataStream ss(vchBlock, SER_DISK, CLIENT_VERSION);
+            ss >> pscan->block;
+        }
+        catch (std::exception &e) {
+            LogPrintf("ScanForWalletTransactions() : deserialize error in block %d\n", pscan->pindex->nHeight);
+            return;
+        }
+        if (pscan->block.GetHash() != pscan->pindex->GetBlockHash())
+        {
+            LogPrintf("ScanForWalletTransactions() : block %d doesn't match index\n", pscan->pindex->nHeight);
+            return;
+        }
+
+        pscan->vTxHash.reserve(pscan->block.vtx.size());
+        pscan->vMatch.assign(pscan->block.vtx.size(), false);
+        for (unsigned int i = 0; i < pscan->block.vtx.size(); i++)
+        {
+            const CTransaction& tx = pscan->block.vtx[i];
+            pscan->vTxHash.push_back(tx.GetHash());
+            BOOST_FOREACH(const CTxOut& txout, tx.vout)
+            {
+                if (filter.Match(txout.scriptPubKey))
+                {
+                    pscan->vMatch[i] = true;
+                    break;
+                }
+            }
+        }
+        pscan->fRead = true;
+    }
+
+    void ThreadRead()
+    {
+        while (true)
+        {
+            size_t n;
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                while (nNextRead < vBlocks.size() && nNextRead >= nNextTake + RESCAN_QUEUE_BLOCKS)
+                    cond.wait(lock);
+                if (nNextRead == vBlocks.size())
+                    return;
+                n = nNextRead++;
+            }
+
+            CWalletScanBlock* pscan = new CWalletScanBlock(vBlocks[n]);
+            Read(pscan);
+
+            boost::unique_lock<boost::mutex> lock(mutex);
+            mapDone[n] = pscan;
+            cond.notify_all();
+        }
+    }
+
+public:
+    CWalletScanner(const CWalletScanFilter& filterIn, const std::vector<CBlockIndex*>& vBlocksIn) :
+        filter(filterIn), vBlocks(vBlocksIn), nNextRead(0), nNextTake(0)
+    {
+        int nThreads = std::max(1, std::min((int)boost::thread::hardware_concurrency(), MAX_RESCAN_THREADS));
+        for (int i = 0; i < nThreads; i++)
+            threadGroup.create_thread(boost::bind(&CWalletScanner::ThreadRead, this));
+    }
+
+    ~CWalletScanner()
+    {
+        threadGroup.interrupt_all();
+        threadGroup.join_all();
+        BOOST_FOREACH(PAIRTYPE(const size_t, CWalletScanBlock*)& item, mapDone)
+            delete item.second;
+    }
+
+    // Take the next block in chain order, NULL after the last one. The caller
+    // deletes it.
+    CWalletScanBlock* Next()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        if (nNextTake == vBlocks.size())
+            return NULL;
+        std::map<size_t, CWalletScanBlock*>::iterator mi;
+        while ((mi = mapDone.find(nNextTake)) == mapDone.end())
+            cond.wait(lock);
+        CWalletScanBlock* pscan = mi->second;
+        mapDone.erase(mi);
+        nNextTake++;
+        cond.notify_all();
+        return pscan;
+    }
+};
+
 // Scan the block chain (starting in pindexStart) for transactions
 // from or to us. If fUpdate is true, found transactions that already
 // exist in the wallet will be updated.
@@ -878,28 +1082,109 @@ int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
 {
     int ret = 0;
 
-    CBlockIndex* pindex = pindexStart;
+    // Take the blocks to scan and the wallet's scripts and transactions up
+    // front; reading the blocks needs no lock.
+    std::vector<CBlockIndex*> vBlocks;
+    CWalletScanFilter filter;
+    set<uint256> setWalletTx;
     {
         LOCK2(cs_main, cs_wallet);
-        while (pindex)
+        for (CBlockIndex* pindex = pindexStart; pindex; pindex = pindex->pnext)
         {
             // no need to read and scan block, if block was created before
             // our wallet birthday (as adjusted for block time variability)
-            if (nTimeFirstKey && (pindex->nTime < (nTimeFirstKey - 7200))) {
-                pindex = pindex->pnext;
+            if (nTimeFirstKey && (pindex->nTime < (nTimeFirstKey - 7200)))
                 continue;
+            vBlocks.push_back(pindex);
+        }
+        if (vBlocks.empty())
+            return 0;
+
+        std::set<CKeyID> setKeys;
+        GetKeys(setKeys);
+        BOOST_FOREACH(const CKeyID& keyid, setKeys)
+        {
+            CScript scriptPubKey;
+            scriptPubKey.SetDestination(keyid);
+            filter.Insert(scriptPubKey);
+            CPubKey pubkey;
+            if (GetPubKey(keyid, pubkey))
+            {
+                scriptPubKey.clear();
+                scriptPubKey << pubkey << OP_CHECKSIG;
+                filter.Insert(scriptPubKey);
             }
+        }
+        {
+            LOCK(cs_KeyStore);
+            BOOST_FOREACH(const PAIRTYPE(const CScriptID, CScript)& item, mapScripts)
+            {
+                CScript scriptPubKey;
+                scriptPubKey.SetDestination(item.first);
+                filter.Insert(scriptPubKey);
+            }
+        }
+        filter.Finish();
+
+        BOOST_FOREACH(const PAIRTYPE(const uint256, CWalletTx)& item, mapWallet)
+            setWalletTx.insert(item.first);
+    }
+
+    int64_t nStart = GetTimeMillis();
+    int64_t nLastProgress = nStart;
+    CWalletScanner scanner(filter, vBlocks);
+    for (size_t i = 0; i < vBlocks.size(); i++)
+    {
+        if (ShutdownRequested())
+        {
+            LogPrintf("ScanForWalletTransactions() : interrupted at block %d\n", vBlocks[i]->nHeight);
+            break;
+        }
+
+        CWalletScanBlock* pscan = scanner.Next();
+        if (!pscan->fRead)
+        {
+            delete pscan;
+            continue;
+        }
 
-            CBlock block;
-            block.ReadFromDisk(pindex, true);
-            BOOST_FOREACH(CTransaction& tx, block.vtx)
+        // Besides outputs that may pay us, anything spending or updating a
+        // wallet transaction goes through AddToWalletIfInvolvingMe
+        std::vector<unsigned int> vCandidates;
+        for (unsigned int j = 0; j < pscan->block.vtx.size(); j++)
+        {
+            bool fCandidate = pscan->vMatch[j] || setWalletTx.count(pscan->vTxHash[j]);
+            for (unsigned int k = 0; !fCandidate && k < pscan->block.vtx[j].vin.size(); k++)
+                fCandidate = setWalletTx.count(pscan->block.vtx[j].vin[k].prevout.hash) > 0;
+            if (fCandidate)
+                vCandidates.push_back(j);
+        }
+
+        if (!vCandidates.empty())
+        {
+            LOCK2(cs_main, cs_wallet);
+            // A block disconnected meanwhile is synced again if it comes back
+            if (pscan->pindex->IsInMainChain())
             {
-                if (AddToWalletIfInvolvingMe(tx, &block, fUpdate))
-                    ret++;
+                BOOST_FOREACH(unsigned int j, vCandidates)
+                {
+                    if (AddToWalletIfInvolvingMe(pscan->block.vtx[j], &pscan->block, fUpdate))
+                    {
+                        setWalletTx.insert(pscan->vTxHash[j]);
+                        ret++;
+                    }
+                }
             }
-            pindex = pindex->pnext;
+        }
+        delete pscan;
+
+        if (GetTimeMillis() - nLastProgress > 10000)
+        {
+            nLastProgress = GetTimeMillis();
+            LogPrintf("Rescanning... block %d, %d%% done\n", vBlocks[i]->nHeight, (int)((i + 1) * 100 / vBlocks.size()));
         }
     }
+    LogPrintf("ScanForWalletTransactions() : %u blocks, %d transactions found in %dms\n", vBlocks.size(), ret, GetTimeMillis() - nStart);
     return ret;
 }
 
@@ -1048,50 +1333,117 @@ void CWallet::ResendWalletTransactions(bool fForce)
 //
 
 
-int64_t CWallet::GetBalance() const
+// Work out again what a transaction adds to the balances; pwtx is NULL
+// when it has left the wallet
+void CWallet::UpdateBalance(const uint256& hash, const CWalletTx* pwtx) const
 {
-    int64_t nTotal = 0;
+    map<uint256, CWalletBalance>::iterator mi = mapBalanceContribution.find(hash);
+    if (mi != mapBalanceContribution.end())
     {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            if (pcoin->IsTrusted())
-                nTotal += pcoin->GetAvailableCredit();
-        }
+        balanceTotal -= mi->second;
+        mapBalanceContribution.erase(mi);
     }
+    setBalanceVolatile.erase(hash);
+    setAvailableTx.erase(hash);
+    if (!pwtx)
+        return;
 
-    return nTotal;
-}
+    const CWalletTx& wtx = *pwtx;
+    bool fFinal = IsFinalTx(wtx);
+    bool fTrusted = wtx.IsTrusted();
+    int nDepth = wtx.GetDepthInMainChain();
+    bool fImmature = (wtx.IsCoinBase() || wtx.IsCoinStake()) && wtx.GetBlocksToMaturity() > 0;
+
+    CWalletBalance balance;
+    if (fTrusted)
+        balance.nTrusted = wtx.GetAvailableCredit();
+    if (!fFinal || (!fTrusted && nDepth == 0))
+        balance.nUnconfirmed = wtx.GetAvailableCredit();
+    if (fImmature && nDepth > 0)
+    {
+        if (wtx.IsCoinBase())
+            balance.nImmature = balance.nNewMint = GetCredit(wtx);
+        else
+            balance.nStake = GetCredit(wtx);
+    }
+    if (!balance.IsNull())
+    {
+        mapBalanceContribution[hash] = balance;
+        balanceTotal += balance;
+    }
 
-int64_t CWallet::GetUnconfirmedBalance() const
-{
-    int64_t nTotal = 0;
+    // Confirmed, mature transactions stay as they are until they change
+    // themselves or their block is disconnected
+    if (!fFinal || nDepth <= 0 || fImmature)
+        setBalanceVolatile.insert(hash);
+
+    for (unsigned int i = 0; i < wtx.vout.size(); i++)
     {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        if (!wtx.IsSpent(i) && IsMine(wtx.vout[i]))
         {
-            const CWalletTx* pcoin = &(*it).second;
-            if (!IsFinalTx(*pcoin) || (!pcoin->IsTrusted() && pcoin->GetDepthInMainChain() == 0))
-                nTotal += pcoin->GetAvailableCredit();
+            setAvailableTx.insert(hash);
+            break;
         }
     }
-    return nTotal;
 }
 
-int64_t CWallet::GetImmatureBalance() const
+void CWallet::UpdateBalances() const
 {
-    int64_t nTotal = 0;
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
+
+    // A longer chain changes the depth of the volatile transactions; after
+    // a reorganization any transaction may have lost its block
+    if (pindexBalance != pindexBest)
     {
-        LOCK2(cs_main, cs_wallet);
+        if (pindexBalance && pindexBalance->IsInMainChain())
+            setBalanceDirty.insert(setBalanceVolatile.begin(), setBalanceVolatile.end());
+        else
+            fBalanceFullUpdate = true;
+        pindexBalance = pindexBest;
+    }
+
+    if (fBalanceFullUpdate)
+    {
+        balanceTotal.SetNull();
+        mapBalanceContribution.clear();
+        setBalanceVolatile.clear();
+        setBalanceDirty.clear();
+        setAvailableTx.clear();
+        fBalanceFullUpdate = false;
         for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx& pcoin = (*it).second;
-            if (pcoin.IsCoinBase() && pcoin.GetBlocksToMaturity() > 0 && pcoin.IsInMainChain())
-                nTotal += GetCredit(pcoin);
-        }
+            UpdateBalance(it->first, &it->second);
+        return;
     }
-    return nTotal;
+
+    set<uint256> setDirty;
+    setDirty.swap(setBalanceDirty);
+    BOOST_FOREACH(const uint256& hash, setDirty)
+    {
+        map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(hash);
+        UpdateBalance(hash, mi == mapWallet.end() ? NULL : &mi->second);
+    }
+}
+
+int64_t CWallet::GetBalance() const
+{
+    LOCK2(cs_main, cs_wallet);
+    UpdateBalances();
+    return balanceTotal.nTrusted;
+}
+
+int64_t CWallet::GetUnconfirmedBalance() const
+{
+    LOCK2(cs_main, cs_wallet);
+    UpdateBalances();
+    return balanceTotal.nUnconfirmed;
+}
+
+int64_t CWallet::GetImmatureBalance() const
+{
+    LOCK2(cs_main, cs_wallet);
+    UpdateBalances();
+    return balanceTotal.nImmature;
 }
 
 // populate vCoins with vector of spendable COutputs
@@ -1101,8 +1453,10 @@ void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const
 
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        UpdateBalances();
+        BOOST_FOREACH(const uint256& hash, setAvailableTx)
         {
+            map<uint256, CWalletTx>::const_iterator it = mapWallet.find(hash);
             const CWalletTx* pcoin = &(*it).second;
 
             if (!IsFinalTx(*pcoin))
@@ -1136,9 +1490,10 @@ void CWallet::AvailableCoinsForStaking(vector<COutput>& vCoins, unsigned int nSp
 
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        UpdateBalances();
+        BOOST_FOREACH(const uint256& hash, setAvailableTx)
         {
-            const CWalletTx* pcoin = &(*it).second;
+            const CWalletTx* pcoin = &mapWallet.find(hash)->second;
 
             // Filtering by tx timestamp instead of block timestamp may give false positives but never false negatives
             if (pcoin->nTime + nStakeMinAge > nSpendTime)
@@ -1207,28 +1562,16 @@ static void ApproximateBestSubset(vector<pair<int64_t, pair<const CWalletTx*,uns
 // ppcoin: total coins staked (non-spendable until maturity)
 int64_t CWallet::GetStake() const
 {
-    int64_t nTotal = 0;
     LOCK2(cs_main, cs_wallet);
-    for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-    {
-        const CWalletTx* pcoin = &(*it).second;
-        if (pcoin->IsCoinStake() && pcoin->GetBlocksToMaturity() > 0 && pcoin->GetDepthInMainChain() > 0)
-            nTotal += CWallet::GetCredit(*pcoin);
-    }
-    return nTotal;
+    UpdateBalances();
+    return balanceTotal.nStake;
 }
 
 int64_t CWallet::GetNewMint() const
 {
-    int64_t nTotal = 0;
     LOCK2(cs_main, cs_wallet);
-    for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-    {
-        const CWalletTx* pcoin = &(*it).second;
-        if (pcoin->IsCoinBase() && pcoin->GetBlocksToMaturity() > 0 && pcoin->GetDepthInMainChain() > 0)
-            nTotal += CWallet::GetCredit(*pcoin);
-    }
-    return nTotal;
+    UpdateBalances();
+    return balanceTotal.nNewMint;
 }
 
 struct LargerOrEqualThanThreshold
@@ -1863,83 +2206,101 @@ bool CWallet::CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int
     if (setCoins.empty())
         return false;
 
+    // Table of stake candidates in coin order. Kernel data is read from disk
+    // only the first time a coin is tried and cached in mapStakeCandidates.
+    vector<pair<const CWalletTx*, unsigned int> > vCandidateCoins;
+    vector<CStakeKernelCandidate> vCandidates;
+    vCandidateCoins.reserve(setCoins.size());
+    vCandidates.reserve(setCoins.size());
+    {
+        CTxDB txdb("r");
+        LOCK(cs_wallet);
+        BOOST_FOREACH(PAIRTYPE(const CWalletTx*, unsigned int) pcoin, setCoins)
+        {
+            COutPoint prevoutStake(pcoin.first->GetHash(), pcoin.second);
+            map<COutPoint, CStakeKernelCandidate>::iterator mi = mapStakeCandidates.find(prevoutStake);
+            if (mi == mapStakeCandidates.end())
+            {
+                CStakeKernelCandidate candidate;
+                if (!GetStakeKernelCandidate(txdb, prevoutStake, candidate))
+                    continue;
+                mi = mapStakeCandidates.insert(make_pair(prevoutStake, candidate)).first;
+            }
+            vCandidateCoins.push_back(pcoin);
+            vCandidates.push_back(mi->second);
+        }
+    }
+
     int64_t nCredit = 0;
     CScript scriptPubKeyKernel;
-    CTxDB txdb("r");
-    BOOST_FOREACH(PAIRTYPE(const CWalletTx*, unsigned int) pcoin, setCoins)
+    uint64_t nStakeModifier = pindexPrev->nStakeModifier;
+    for (unsigned int i = 0; i < vCandidates.size() && pindexPrev == pindexBest; i++)
     {
         static int nMaxStakeSearchInterval = 60;
-        bool fKernelFound = false;
-        for (unsigned int n=0; n<min(nSearchInterval,(int64_t)nMaxStakeSearchInterval) && !fKernelFound && pindexPrev == pindexBest; n++)
-        {
-            boost::this_thread::interruption_point();
-            // Search backward in time from the given txNew timestamp
-            // Search nSearchInterval seconds back up to nMaxStakeSearchInterval
-            COutPoint prevoutStake = COutPoint(pcoin.first->GetHash(), pcoin.second);
-            int64_t nBlockTime;
-            if (CheckKernel(pindexPrev, nBits, txNew.nTime - n, prevoutStake, &nBlockTime))
-            {
-                // Found a kernel
-                LogPrint("coinstake", "CreateCoinStake : kernel found\n");
-                vector<valtype> vSolutions;
-                txnouttype whichType;
-                CScript scriptPubKeyOut;
-                scriptPubKeyKernel = pcoin.first->vout[pcoin.second].scriptPubKey;
-                if (!Solver(scriptPubKeyKernel, whichType, vSolutions))
-                {
-                    LogPrint("coinstake", "CreateCoinStake : failed to parse kernel\n");
-                    break;
-                }
-                LogPrint("coinstake", "CreateCoinStake : parsed kernel type=%d\n", whichType);
-                if (whichType != TX_PUBKEY && whichType != TX_PUBKEYHASH)
-                {
-                    LogPrint("coinstake", "CreateCoinStake : no support for kernel type=%d\n", whichType);
-                    break;  // only support pay to public key and pay to address
-                }
-                if (whichType == TX_PUBKEYHASH) // pay to address type
-                {
-                    // convert to pay to public key type
-                    if (!keystore.GetKey(uint160(vSolutions[0]), key))
-                    {
-                        LogPrint("coinstake", "CreateCoinStake : failed to get key for kernel type=%d\n", whichType);
-                        break;  // unable to find corresponding public key
-                    }
-                    scriptPubKeyOut << key.GetPubKey() << OP_CHECKSIG;
-                }
-                if (whichType == TX_PUBKEY)
-                {
-                    valtype& vchPubKey = vSolutions[0];
-                    if (!keystore.GetKey(Hash160(vchPubKey), key))
-                    {
-                        LogPrint("coinstake", "CreateCoinStake : failed to get key for kernel type=%d\n", whichType);
-                        break;  // unable to find corresponding public key
-                    }
-
-                    if (key.GetPubKey() != vchPubKey)
-                    {
-                        LogPrint("coinstake", "CreateCoinStake : invalid key for kernel type=%d\n", whichType);
-                        break; // keys mismatch
-                    }
-
-                    scriptPubKeyOut = scriptPubKeyKernel;
-                }
+        boost::this_thread::interruption_point();
+        // Search backward in time from the given txNew timestamp
+        // Search nSearchInterval seconds back up to nMaxStakeSearchInterval
+        unsigned int nTimeKernel;
+        if (!FindStakeKernel(nStakeModifier, nBits, vCandidates[i], txNew.nTime, min(nSearchInterval,(int64_t)nMaxStakeSearchInterval), nTimeKernel))
+            continue;
 
-                txNew.nTime -= n;
-                txNew.vin.push_back(CTxIn(pcoin.first->GetHash(), pcoin.second));
-                nCredit += pcoin.first->vout[pcoin.second].nValue;
-                vwtxPrev.push_back(pcoin.first);
-                txNew.vout.push_back(CTxOut(0, scriptPubKeyOut));
+        // Found a kernel
+        const PAIRTYPE(const CWalletTx*, unsigned int)& pcoin = vCandidateCoins[i];
+        int64_t nBlockTime = vCandidates[i].nTimeBlockFrom;
+        LogPrint("coinstake", "CreateCoinStake : kernel found\n");
+        vector<valtype> vSolutions;
+        txnouttype whichType;
+        CScript scriptPubKeyOut;
+        scriptPubKeyKernel = pcoin.first->vout[pcoin.second].scriptPubKey;
+        if (!Solver(scriptPubKeyKernel, whichType, vSolutions))
+        {
+            LogPrint("coinstake", "CreateCoinStake : failed to parse kernel\n");
+            continue;
+        }
+        LogPrint("coinstake", "CreateCoinStake : parsed kernel type=%d\n", whichType);
+        if (whichType != TX_PUBKEY && whichType != TX_PUBKEYHASH)
+        {
+            LogPrint("coinstake", "CreateCoinStake : no support for kernel type=%d\n", whichType);
+            continue;  // only support pay to public key and pay to address
+        }
+        if (whichType == TX_PUBKEYHASH) // pay to address type
+        {
+            // convert to pay to public key type
+            if (!keystore.GetKey(uint160(vSolutions[0]), key))
+            {
+                LogPrint("coinstake", "CreateCoinStake : failed to get key for kernel type=%d\n", whichType);
+                continue;  // unable to find corresponding public key
+            }
+            scriptPubKeyOut << key.GetPubKey() << OP_CHECKSIG;
+        }
+        if (whichType == TX_PUBKEY)
+        {
+            valtype& vchPubKey = vSolutions[0];
+            if (!keystore.GetKey(Hash160(vchPubKey), key))
+            {
+                LogPrint("coinstake", "CreateCoinStake : failed to get key for kernel type=%d\n", whichType);
+                continue;  // unable to find corresponding public key
+            }
 
-                if (GetWeight(nBlockTime, (int64_t)txNew.nTime) < GetStakeSplitAge())
-                    txNew.vout.push_back(CTxOut(0, scriptPubKeyOut)); //split stake
-                LogPrint("coinstake", "CreateCoinStake : added kernel type=%d\n", whichType);
-                fKernelFound = true;
-                break;
+            if (key.GetPubKey() != vchPubKey)
+            {
+                LogPrint("coinstake", "CreateCoinStake : invalid key for kernel type=%d\n", whichType);
+                continue; // keys mismatch
             }
+
+            scriptPubKeyOut = scriptPubKeyKernel;
         }
 
-        if (fKernelFound)
-            break; // if kernel is found stop searching
+        txNew.nTime = nTimeKernel;
+        txNew.vin.push_back(CTxIn(pcoin.first->GetHash(), pcoin.second));
+        nCredit += pcoin.first->vout[pcoin.second].nValue;
+        vwtxPrev.push_back(pcoin.first);
+        txNew.vout.push_back(CTxOut(0, scriptPubKeyOut));
+
+        if (GetWeight(nBlockTime, (int64_t)txNew.nTime) < GetStakeSplitAge())
+            txNew.vout.push_back(CTxOut(0, scriptPubKeyOut)); //split stake
+        LogPrint("coinstake", "CreateCoinStake : added kernel type=%d\n", whichType);
+        break; // if kernel is found stop searching
     }
 
     if (nCredit == 0 || nCredit > nBalance - nReserveBalance)
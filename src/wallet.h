@@ -13,6 +13,7 @@
 #include <stdlib.h>
 
 #include "crypter.h"
+#include "kernel.h"
 #include "main.h"
 #include "key.h"
 #include "keystore.h"
@@ -27,6 +28,11 @@ extern int64_t nMinimumInputValue;
 extern bool fWalletUnlockStakingOnly;
 extern bool fConfChange;
 
+/** Maximum number of threads reading blocks during a wallet rescan */
+static const int MAX_RESCAN_THREADS = 8;
+/** Number of blocks a rescan reads ahead of the one being committed */
+static const size_t RESCAN_QUEUE_BLOCKS = 256;
+
 class CAccountingEntry;
 class CCoinControl;
 class CWalletTx;
@@ -72,6 +78,82 @@ public:
     )
 };
 
+/** What a wallet transaction adds to each of the wallet's balances */
+class CWalletBalance
+{
+public:
+    int64_t nTrusted;      // GetBalance
+    int64_t nUnconfirmed;  // GetUnconfirmedBalance
+    int64_t nImmature;     // GetImmatureBalance
+    int64_t nStake;        // GetStake
+    int64_t nNewMint;      // GetNewMint
+
+    CWalletBalance()
+    {
+        SetNull();
+    }
+
+    void SetNull()
+    {
+        nTrusted = nUnconfirmed = nImmature = nStake = nNewMint = 0;
+    }
+
+    bool IsNull() const
+    {
+        return !nTrusted && !nUnconfirmed && !nImmature && !nStake && !nNewMint;
+    }
+
+    CWalletBalance& operator+=(const CWalletBalance& b)
+    {
+        nTrusted += b.nTrusted;
+        nUnconfirmed += b.nUnconfirmed;
+        nImmature += b.nImmature;
+        nStake += b.nStake;
+        nNewMint += b.nNewMint;
+        return *this;
+    }
+
+    CWalletBalance& operator-=(const CWalletBalance& b)
+    {
+        nTrusted -= b.nTrusted;
+        nUnconfirmed -= b.nUnconfirmed;
+        nImmature -= b.nImmature;
+        nStake -= b.nStake;
+        nNewMint -= b.nNewMint;
+        return *this;
+    }
+};
+
+/** Output scripts a rescan looks for: pay to key hash and pay to public key for
+ * every key, and pay to script hash for every redeem script. Most outputs are
+ * rejected by a bit table before the set is consulted.
+ */
+class CWalletScanFilter
+{
+private:
+    std::set<CScript> setScripts;
+    std::vector<uint64_t> vBits;
+    int nShift;
+
+    uint64_t Slot(const CScript& script) const;
+    static bool IsIrregular(const CScript& script);
+
+public:
+    CWalletScanFilter() : nShift(64) {}
+
+    void Insert(const CScript& script)
+    {
+        setScripts.insert(script);
+    }
+
+    // Build the bit table, once all scripts are in
+    void Finish();
+
+    // True for every script in the set, and for any script IsMine() might
+    // accept that has a form the set can't hold
+    bool Match(const CScript& script) const;
+};
+
 /** A CWallet is an extension of a keystore, which also maintains a set of transactions and balances,
  * and provides the ability to create new transactions.
  */
@@ -89,6 +171,20 @@ private:
     // the maximum wallet format version: memory-only variable that specifies to what version this wallet may be upgraded
     int nWalletMaxVersion;
 
+    // The balances are sums of per transaction contributions, which only
+    // change when the transaction does, or, for transactions that are
+    // unconfirmed or immature, when the best chain moves on
+    mutable CWalletBalance balanceTotal;
+    mutable std::map<uint256, CWalletBalance> mapBalanceContribution; // nonzero ones only
+    mutable std::set<uint256> setBalanceVolatile;  // contribution depends on the chain tip
+    mutable std::set<uint256> setBalanceDirty;     // changed since the last UpdateBalances
+    mutable std::set<uint256> setAvailableTx;      // have unspent outputs of ours
+    mutable bool fBalanceFullUpdate;
+    mutable const CBlockIndex* pindexBalance;      // best block when the balances were updated
+
+    void UpdateBalance(const uint256& hash, const CWalletTx* pwtx) const;
+    void UpdateBalances() const;
+
 public:
     /// Main wallet lock.
     /// This lock protects all the fields added by CWallet
@@ -128,12 +224,18 @@ public:
         pwalletdbEncryption = NULL;
         nOrderPosNext = 0;
         nTimeFirstKey = 0;
+        fBalanceFullUpdate = true;
+        pindexBalance = NULL;
     }
 
     std::map<uint256, CWalletTx> mapWallet;
     int64_t nOrderPosNext;
     std::map<uint256, int> mapRequestCount;
 
+    // Kernel data of outputs we tried to stake, kept until they are spent
+    // or their transaction is disconnected
+    std::map<COutPoint, CStakeKernelCandidate> mapStakeCandidates;
+
     std::map<CTxDestination, std::string> mapAddressBook;
 
     CPubKey vchDefaultKey;
@@ -188,6 +290,7 @@ public:
     TxItems OrderedTxItems(std::list<CAccountingEntry>& acentries, std::string strAccount = "");
 
     void MarkDirty();
+    void MarkBalanceDirty(const uint256& hash) const;
     bool AddToWallet(const CWalletTx& wtxIn);
     void SyncTransaction(const CTransaction& tx, const CBlock* pblock, bool fConnect = true);
     bool AddToWalletIfInvolvingMe(const CTransaction& tx, const CBlock* pblock, bool fUpdate);
@@ -532,6 +635,8 @@ public:
                 fAvailableCreditCached = false;
             }
         }
+        if (fReturn && pwallet)
+            pwallet->MarkBalanceDirty(GetHash());
         return fReturn;
     }
 
@@ -542,6 +647,8 @@ public:
         fAvailableCreditCached = false;
         fDebitCached = false;
         fChangeCached = false;
+        if (pwallet)
+            pwallet->MarkBalanceDirty(GetHash());
     }
 
     void BindWallet(CWallet *pwalletIn)
@@ -559,6 +666,8 @@ public:
         {
             vfSpent[nOut] = true;
             fAvailableCreditCached = false;
+            if (pwallet)
+                pwallet->MarkBalanceDirty(GetHash());
         }
     }
 
@@ -571,6 +680,8 @@ public:
         {
             vfSpent[nOut] = false;
             fAvailableCreditCached = false;
+            if (pwallet)
+                pwallet->MarkBalanceDirty(GetHash());
         }
     }
 